@@ -11,111 +11,470 @@
 #include "lua.h"
 #include "can.h"
 #include "core.h"
+#include "dispatch.h"
+#include "monitor.h"
+#include "pcapng.h"
 #include "printf.h"
+#include "ring_buffer.h"
+#include "stats.h"
 #include "table.h"
+#include "trace.h"
 
-#ifdef _WIN32
-#include <windows.h>
+#define RX_RING_SIZE           16384 // Must be a power of two.
+#define RX_WAIT_TIMEOUT_IN_MS  100
+#define RX_NOTIFY_INTERVAL     32
+#define RX_BATCH_SIZE          64
+#define MONITOR_INTERVAL_IN_MS 1000
+#define MONITOR_RETRY_IN_MS    500
+#define TX_QUEUE_SIZE          256 // Per priority class, must be a power of two.
+#define TX_BATCH_SIZE          16
+#define TX_TIMEOUT_IN_MS       100
+#define TX_BURST_IN_MS         10
+#define TX_RETRY_IN_MS         1
+#define TX_ID_COUNT            0x800 // 11-bit identifiers
+#define DETECT_QUIET_IN_MS     1000
+#define DETECT_LISTEN_IN_MS    250
+#define DETECT_WAIT_IN_MS      10
+#define DETECT_FRAME_COUNT     4
+
+static const can_driver_t* const drivers[] =
+{
+    &pcan_driver,
+#ifdef __linux__
+    &socketcan_driver,
 #endif
-#include "PCANBasic.h"
+    &virtual_driver
+};
+
+#define DRIVER_COUNT (sizeof(drivers) / sizeof(drivers[0]))
+
+// Indexed by the commands of the b and f commands.
+static const Uint32 bit_rates[14]     = { 1000000, 800000, 500000, 250000, 125000, 100000, 95238, 83333, 50000, 47619, 33333, 20000, 10000, 5000 };
+static const Uint32 data_bit_rates[6] = { 0, 1000000, 2000000, 4000000, 5000000, 8000000 };
+
+// Order in which can_detect_baud_rate() tries the bit rates, most common first.
+static const Uint8 detect_order[14] = { 3, 2, 4, 0, 1, 5, 8, 11, 12, 6, 7, 9, 10, 13 };
+
+/* Every channel is served by its own worker: a monitor thread which
+ * (re-)opens the driver and watches its state, a receive thread which
+ * feeds the channel's receive ring and a transmit thread which drains
+ * the channel's transmit queues.  Channels do not share any locks, so
+ * a slow or removed interface does not stall the others.
+ */
+typedef struct can_worker
+{
+    core_t*             core;
+    Uint8               channel;
+    const can_driver_t* driver;
+    void*               handle;
+    SDL_mutex*          mutex;
+    SDL_cond*           monitor_cond;
+    ring_buffer_t       rx_ring;
+    SDL_Thread*         rx_thread;
+    SDL_atomic_t        rx_running;
+    SDL_atomic_t        rx_count;
+    SDL_atomic_t        rx_driver_overrun_count;
+    SDL_mutex*          rx_mutex;
+    SDL_cond*           rx_cond;
+    SDL_atomic_t        rx_waiters;
+    SDL_atomic_t        rx_readers;
+    SDL_bool            is_lua_reader; // Registered by can_read() of a script
+    Uint32              filter_id[CAN_FILTER_MAX];
+    int                 filter_count;
+    int                 filter_holds;
+    ring_buffer_t       tx_queue[CAN_PRIORITY_COUNT];
+    SDL_Thread*         tx_thread;
+    SDL_atomic_t        tx_running;
+    SDL_mutex*          tx_mutex;
+    SDL_cond*           tx_cond;
+    SDL_cond*           tx_space_cond;
+    Uint32              tx_budget;
+    Uint64              tx_tokens;
+    Uint64              tx_refill_us;
+    Uint32              tx_status;
+    Uint32              tx_sent[CAN_PRIORITY_COUNT];
+    Uint32              tx_dropped[CAN_PRIORITY_COUNT];
+    Uint64              tx_latency_sum_us[CAN_PRIORITY_COUNT];
+    Uint32              tx_latency_max_us[CAN_PRIORITY_COUNT];
+    SDL_atomic_t        tx_done_us[TX_ID_COUNT]; // Low 32 bits, see can_get_tx_time_us()
+    SDL_bool            is_detecting;
+
+} can_worker_t;
 
-static int can_monitor(void *core);
+static can_worker_t worker[CAN_CHANNEL_MAX];
+
+static int            can_monitor(void *worker);
+static int            can_receive(void *worker);
+static int            can_transmit(void *worker);
+static Uint32         enqueue(can_worker_t* w, can_message_t* messages, int count, Uint32 timeout_ms, int* queued);
+static int            dequeue(can_worker_t* w, can_message_t* messages, can_priority_t* priority);
+static void           transmit(can_worker_t* w, can_priority_t priority, can_message_t* messages, int count);
+static void           stop_transmit(can_worker_t* w);
+static can_priority_t get_priority(Uint32 can_id);
+static Uint64         get_tx_burst(Uint32 frames_per_s);
+static int            listen_at_baud_rate(const can_driver_t* driver, void* handle, Uint32 timeout_ms);
+static SDL_bool       is_bus_error(Uint32 can_status);
+static void           notify_readers(can_worker_t* w);
+static void           close_driver(can_worker_t* w);
+static void           apply_filter(can_worker_t* w);
+static void           start_worker(can_worker_t* w);
+static can_worker_t*  get_worker(Uint8 channel);
 
 void can_init(core_t* core)
 {
+    Uint8 channel;
+
     if (NULL == core)
     {
         return;
     }
 
-    core->can_monitor_th = SDL_CreateThread(can_monitor, "CAN monitor thread", (void *)core);
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_worker_t*  w            = &worker[channel];
+        can_channel_t* can_channel = &core->can_channel[channel];
+
+        w->core         = core;
+        w->channel      = channel;
+        w->mutex        = SDL_CreateMutex();
+        w->monitor_cond = SDL_CreateCond();
+        w->rx_mutex     = SDL_CreateMutex();
+        w->rx_cond       = SDL_CreateCond();
+        w->tx_mutex      = SDL_CreateMutex();
+        w->tx_cond       = SDL_CreateCond();
+        w->tx_space_cond = SDL_CreateCond();
+        w->filter_count  = -1;
+
+        if ((NULL == w->mutex) || (NULL == w->monitor_cond) || (NULL == w->rx_mutex) || (NULL == w->rx_cond) ||
+            (NULL == w->tx_mutex) || (NULL == w->tx_cond) || (NULL == w->tx_space_cond))
+        {
+            c_log(LOG_ERROR, "Could not create CAN synchronisation objects: %s", SDL_GetError());
+            return;
+        }
+
+        can_channel->baud_rate = 3;
+        SDL_strlcpy(can_channel->interface, drivers[can_channel->driver]->default_interface, sizeof(can_channel->interface));
+    }
+
+    // Only the first channel is opened by default.
+    start_worker(&worker[0]);
 }
 
-void can_deinit(core_t* core)
+void can_deinit(Uint8 channel, core_t* core)
 {
-    if (NULL == core)
+    can_worker_t* w = get_worker(channel);
+
+    if ((NULL == core) || (NULL == w))
     {
         return;
     }
 
-    core->can_status         = 0;
-    core->is_can_initialised = SDL_FALSE;
-
-    CAN_Uninitialize(PCAN_USBBUS1);
+    SDL_LockMutex(w->mutex);
+    close_driver(w);
+    SDL_CondSignal(w->monitor_cond);
+    SDL_UnlockMutex(w->mutex);
 }
 
 void can_quit(core_t* core)
 {
+    Uint8 channel;
+
     if (NULL == core)
     {
         return;
     }
 
-    if (SDL_TRUE == is_can_initialised(core))
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_worker_t* w = &worker[channel];
+        int           priority;
+
+        if (NULL == core->can_channel[channel].monitor_th)
+        {
+            continue;
+        }
+
+        // The monitor thread leaves its loop as soon as is_running is
+        // cleared, the channel is closed here.
+        SDL_LockMutex(w->mutex);
+        close_driver(w);
+        SDL_CondSignal(w->monitor_cond);
+        SDL_UnlockMutex(w->mutex);
+
+        SDL_WaitThread(core->can_channel[channel].monitor_th, NULL);
+        core->can_channel[channel].monitor_th = NULL;
+
+        ring_buffer_deinit(&w->rx_ring);
+        for (priority = 0; priority < CAN_PRIORITY_COUNT; priority += 1)
+        {
+            ring_buffer_deinit(&w->tx_queue[priority]);
+        }
+    }
+}
+
+Uint32 can_write(Uint8 channel, can_message_t* message)
+{
+    return can_write_timeout(channel, message, TX_TIMEOUT_IN_MS);
+}
+
+/* Frames are queued per priority class and sent by the transmit thread
+ * of the channel.  If the queue of the frame's class is full, the
+ * caller waits up to timeout_ms for space; a timeout of 0 does not
+ * block at all.  Frames which do not fit are dropped and counted.
+ */
+Uint32 can_write_timeout(Uint8 channel, can_message_t* message, Uint32 timeout_ms)
+{
+    can_worker_t* w = get_worker(channel);
+    int           queued;
+
+    if (NULL == w)
     {
-        can_deinit(core);
+        return CAN_ERROR_ILLPARAMVAL;
     }
 
-    SDL_DetachThread(core->can_monitor_th);
+    return enqueue(w, message, 1, timeout_ms, &queued);
 }
 
-Uint32 can_write(can_message_t* message)
+/* Frames are received by a dedicated thread per channel and queued in
+ * a single-producer/single-consumer ring while a reader is registered,
+ * see can_register_reader().  can_read() is the consumer side and must
+ * therefore only be called from one thread at a time per channel.
+ */
+Uint32 can_read(Uint8 channel, can_message_t* message)
 {
-    int      index;
-    TPCANMsg pcan_message = { 0 };
+    can_worker_t* w = get_worker(channel);
 
-    pcan_message.ID      = message->id;
-    pcan_message.MSGTYPE = PCAN_MESSAGE_STANDARD;
-    pcan_message.LEN     = message->length;
+    if (NULL == w)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
 
-    for (index = 0; index < 8; index += 1)
+    if (SDL_TRUE == ring_buffer_pop(&w->rx_ring, message))
+    {
+        return CAN_OK;
+    }
+    else if (NULL == w->driver)
     {
-        pcan_message.DATA[index] = message->data[index];
+        return CAN_ERROR_INITIALIZE;
     }
 
-    return (Uint32)CAN_Write(PCAN_USBBUS1, &pcan_message);
+    return CAN_ERROR_QRCVEMPTY;
 }
 
-Uint32 can_read(can_message_t* message)
+Uint32 can_write_batch(Uint8 channel, can_message_t* messages, int count, int* written)
 {
-    int      index;
-    Uint32   can_status;
-    TPCANMsg pcan_message = { 0 };
+    // Never blocks, it is called from timer callbacks.
+    return can_write_batch_timeout(channel, messages, count, 0, written);
+}
+
+/* Queues the frames in order under a single acquisition of the
+ * transmit lock, waiting up to timeout_ms for space like
+ * can_write_timeout().  written tells how many frames were queued.
+ */
+Uint32 can_write_batch_timeout(Uint8 channel, can_message_t* messages, int count, Uint32 timeout_ms, int* written)
+{
+    can_worker_t* w      = get_worker(channel);
+    Uint32        can_status;
+    int           frames = 0;
 
-    can_status = CAN_Read(PCAN_USBBUS1, &pcan_message, NULL);
+    if (NULL == w)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
 
-    message->id     = pcan_message.ID;
-    message->length = pcan_message.LEN;
+    can_status = enqueue(w, messages, count, timeout_ms, &frames);
 
-    for (index = 0; index < 8; index += 1)
+    if (NULL != written)
     {
-        message->data[index] = pcan_message.DATA[index];
+        *written = frames;
     }
 
     return can_status;
 }
 
-void can_set_baud_rate(Uint8 command, core_t* core)
+Uint32 can_read_batch(Uint8 channel, can_message_t* messages, int count, int* read)
 {
-    if (NULL == core)
+    can_worker_t* w      = get_worker(channel);
+    int           frames = 0;
+
+    if (NULL == w)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
+
+    while ((frames < count) && (SDL_TRUE == ring_buffer_pop(&w->rx_ring, &messages[frames])))
+    {
+        frames += 1;
+    }
+
+    if (NULL != read)
+    {
+        *read = frames;
+    }
+
+    if (frames > 0)
+    {
+        return CAN_OK;
+    }
+    else if (NULL == w->driver)
+    {
+        return CAN_ERROR_INITIALIZE;
+    }
+
+    return CAN_ERROR_QRCVEMPTY;
+}
+
+Uint32 can_read_timeout(Uint8 channel, can_message_t* message, Uint32 timeout_ms)
+{
+    can_worker_t* w        = get_worker(channel);
+    Uint64        deadline = SDL_GetTicks64() + timeout_ms;
+    Uint32        can_status;
+
+    if (NULL == w)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
+
+    while (1)
+    {
+        Uint64 now;
+
+        can_status = can_read(channel, message);
+        if (CAN_ERROR_QRCVEMPTY != can_status)
+        {
+            return can_status;
+        }
+
+        now = SDL_GetTicks64();
+        if (now >= deadline)
+        {
+            return CAN_ERROR_QRCVEMPTY;
+        }
+
+        SDL_LockMutex(w->rx_mutex);
+        SDL_AtomicAdd(&w->rx_waiters, 1);
+        if (0 == ring_buffer_count(&w->rx_ring))
+        {
+            SDL_CondWaitTimeout(w->rx_cond, w->rx_mutex, (Uint32)(deadline - now));
+        }
+        SDL_AtomicAdd(&w->rx_waiters, -1);
+        SDL_UnlockMutex(w->rx_mutex);
+    }
+}
+
+void can_set_baud_rate(Uint8 channel, Uint8 command, core_t* core)
+{
+    if ((NULL == core) || (channel >= CAN_CHANNEL_MAX))
+    {
+        return;
+    }
+
+    core->can_channel[channel].baud_rate = command;
+
+    if (SDL_TRUE == is_can_initialised(channel, core))
+    {
+        can_deinit(channel, core);
+    }
+}
+
+void can_set_data_baud_rate(Uint8 channel, Uint8 command, core_t* core)
+{
+    if ((NULL == core) || (channel >= CAN_CHANNEL_MAX))
     {
         return;
     }
 
-    core->baud_rate = command;
+    core->can_channel[channel].data_baud_rate = command;
 
-    if (SDL_TRUE == is_can_initialised(core))
+    if (SDL_TRUE == is_can_initialised(channel, core))
     {
-        can_deinit(core);
+        can_deinit(channel, core);
     }
 }
 
+/* The channel is opened in listen-only mode at one bit rate after the
+ * other, so that a wrong guess does not disturb the bus by sending
+ * error frames.  A bit rate is rejected as soon as an error frame or a
+ * bus error is seen and accepted once a few frames were received
+ * without any error.  If the bus is quiet at the first bit rate, the
+ * search is aborted, as there is nothing to synchronise to.
+ */
+SDL_bool can_detect_baud_rate(Uint8 channel, core_t* core)
+{
+    can_worker_t*       w           = get_worker(channel);
+    const can_driver_t* driver;
+    can_channel_t*      can_channel;
+    SDL_bool            is_detected = SDL_FALSE;
+    int                 index;
+
+    if ((NULL == core) || (NULL == w))
+    {
+        return SDL_FALSE;
+    }
+
+    can_channel = &core->can_channel[channel];
+    driver      = drivers[can_channel->driver];
+
+    SDL_LockMutex(w->mutex);
+    close_driver(w);
+    w->is_detecting = SDL_TRUE;
+    SDL_UnlockMutex(w->mutex);
+
+    c_log(LOG_INFO, "Detecting baud rate of CAN channel %u (%s, %s)", channel, driver->name, can_channel->interface);
+
+    for (index = 0; index < (int)SDL_arraysize(detect_order); index += 1)
+    {
+        Uint8  baud_rate = detect_order[index];
+        void*  handle    = NULL;
+        Uint32 can_status;
+        int    result;
+
+        can_status = driver->open(can_channel->interface, baud_rate, 0, SDL_TRUE, &handle);
+        if (CAN_OK != can_status)
+        {
+            can_print_error_message(channel, "Could not open channel in listen-only mode", can_status);
+            break;
+        }
+
+        result = listen_at_baud_rate(driver, handle, (0 == index) ? DETECT_QUIET_IN_MS : DETECT_LISTEN_IN_MS);
+        driver->close(handle);
+
+        if (result > 0)
+        {
+            can_channel->baud_rate = baud_rate;
+            is_detected            = SDL_TRUE;
+            c_log(LOG_SUCCESS, "Detected baud rate of CAN channel %u: %u bit/s (b %u)", channel, bit_rates[baud_rate], baud_rate);
+            break;
+        }
+        else if ((0 == result) && (0 == index))
+        {
+            c_log(LOG_WARNING, "No traffic on CAN channel %u, baud rate detection aborted", channel);
+            break;
+        }
+        else if (index == (int)SDL_arraysize(detect_order) - 1)
+        {
+            c_log(LOG_WARNING, "Could not detect baud rate of CAN channel %u", channel);
+        }
+    }
+
+    SDL_LockMutex(w->mutex);
+    w->is_detecting = SDL_FALSE;
+    SDL_CondSignal(w->monitor_cond);
+    SDL_UnlockMutex(w->mutex);
+
+    return is_detected;
+}
+
+/* Lua functions take the channel as an optional last argument, which
+ * defaults to the first channel.
+ */
 int lua_can_write(lua_State* L)
 {
     int    can_id         = luaL_checkinteger(L, 1);
     int    length         = luaL_checkinteger(L, 2);
     Uint32 data_d0_d3     = luaL_checkinteger(L, 3);
     Uint32 data_d4_d7     = luaL_checkinteger(L, 4);
+    Uint8  channel        = (Uint8)luaL_optinteger(L, 5, 0);
     can_message_t message = { 0 };
 
     message.id      = can_id;
@@ -130,7 +489,7 @@ int lua_can_write(lua_State* L)
     message.data[5] = ((data_d4_d7 >> 16) & 0xff);
     message.data[4] = ((data_d4_d7 >> 24) & 0xff);
 
-    if (0 != can_write(&message))
+    if (0 != can_write(channel, &message))
     {
         return 0;
     }
@@ -140,181 +499,1348 @@ int lua_can_write(lua_State* L)
     }
 }
 
-void lua_register_can_commands(core_t* core)
+int lua_can_write_fd(lua_State* L)
 {
-    lua_pushcfunction(core->L, lua_can_write);
-    lua_setglobal(core->L, "can_write");
-}
+    int           can_id  = luaL_checkinteger(L, 1);
+    Uint8         channel = (Uint8)luaL_optinteger(L, 3, 0);
+    lua_Integer   length;
+    lua_Integer   index;
+    can_message_t message = { 0 };
 
-void can_print_error_message(const char* context, Uint32 can_status)
-{
-    if (PCAN_ERROR_OK != can_status)
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    length = (lua_Integer)lua_rawlen(L, 2);
+    if (length > CANFD_MAX_DATA_LENGTH)
     {
-        char err_message[100] = { 0 };
+        return 0;
+    }
 
-        CAN_GetErrorText(can_status, 0x09, err_message);
-        if (NULL == context)
-        {
-            c_log(LOG_WARNING, "%s", err_message);
-        }
-        else
-        {
-            c_log(LOG_WARNING, "%s: %s", context, err_message);
-        }
+    for (index = 0; index < length; index += 1)
+    {
+        lua_rawgeti(L, 2, index + 1);
+        message.data[index] = (Uint8)(lua_tointeger(L, -1) & 0xff);
+        lua_pop(L, 1);
+    }
+
+    message.id     = can_id;
+    message.length = can_get_fd_length((Uint8)length);
+    message.flags  = CAN_FLAG_FD | CAN_FLAG_BRS;
+
+    if (0 != can_write(channel, &message))
+    {
+        return 0;
+    }
+    else
+    {
+        return 1;
     }
 }
 
-void can_print_baud_rate_help(core_t* core)
+int lua_can_read(lua_State* L)
 {
-    table_t      table         = { DARK_CYAN, DARK_WHITE, 3, 13, 6 };
-    char         status[14][7] = { 0 };
-    unsigned int status_index  = core->baud_rate;
-    unsigned int index;
+    Uint32        timeout_ms = (Uint32)luaL_optinteger(L, 1, 0);
+    Uint8         channel    = (Uint8)luaL_optinteger(L, 2, 0);
+    Uint32        data_d0_d3;
+    Uint32        data_d4_d7;
+    int           index;
+    can_message_t message    = { 0 };
+    can_worker_t* w          = get_worker(channel);
 
-    if (status_index > 13)
+    // Frames are only kept for scripts which read them.
+    if ((NULL != w) && (NULL != w->mutex) && (SDL_FALSE == w->is_lua_reader))
     {
-        status_index = 13;
+        w->is_lua_reader = SDL_TRUE;
+        can_register_reader(channel, SDL_TRUE);
     }
 
-    for (index = 0; index < 14; index += 1)
+    if (CAN_OK != can_read_timeout(channel, &message, timeout_ms))
     {
-        if (status_index == index)
-        {
-            SDL_snprintf(status[index], 7, "Active");
-        }
-        else
-        {
-            SDL_snprintf(status[index], 2, " ");
-        }
+        lua_pushnil(L);
+        return 1;
     }
 
-    table_print_header(&table);
-    table_print_row("CMD", "Description", "Status", &table);
-    table_print_divider(&table);
-    table_print_row("  0", "1 MBit/s",      status[0],  &table);
-    table_print_row("  1", "800 kBit/s",    status[1],  &table);
-    table_print_row("  2", "500 kBit/s",    status[2],  &table);
-    table_print_row("  3", "250 kBit/s",    status[3],  &table);
-    table_print_row("  4", "125 kBit/s",    status[4],  &table);
-    table_print_row("  5", "100 kBit/s",    status[5],  &table);
-    table_print_row("  6", "95,238 kBit/s", status[6],  &table);
-    table_print_row("  7", "83,333 kBit/s", status[7],  &table);
-    table_print_row("  8", "50 kBit/s",     status[8],  &table);
-    table_print_row("  9", "47,619 kBit/s", status[9],  &table);
-    table_print_row(" 10", "33,333 kBit/s", status[10], &table);
-    table_print_row(" 11", "20 kBit/s",     status[11], &table);
-    table_print_row(" 12", "10 kBit/s",     status[12], &table);
-    table_print_row(" 13", "5 kBit/s",      status[13], &table);
-    table_print_footer(&table);
+    data_d0_d3 = ((Uint32)message.data[0] << 24) | ((Uint32)message.data[1] << 16) | ((Uint32)message.data[2] << 8) | (Uint32)message.data[3];
+    data_d4_d7 = ((Uint32)message.data[4] << 24) | ((Uint32)message.data[5] << 16) | ((Uint32)message.data[6] << 8) | (Uint32)message.data[7];
+
+    lua_pushinteger(L, message.id);
+    lua_pushinteger(L, message.length);
+    lua_pushinteger(L, data_d0_d3);
+    lua_pushinteger(L, data_d4_d7);
+    lua_pushinteger(L, (lua_Integer)message.timestamp_us);
+
+    // All data bytes, which is the only way to access CAN FD payloads.
+    lua_createtable(L, message.length, 0);
+    for (index = 0; index < message.length; index += 1)
+    {
+        lua_pushinteger(L, message.data[index]);
+        lua_rawseti(L, -2, index + 1);
+    }
+
+    return 6;
 }
 
-SDL_bool is_can_initialised(core_t* core)
+int lua_can_detect_baud_rate(lua_State* L)
 {
-    if (NULL == core)
+    Uint8         channel = (Uint8)luaL_optinteger(L, 1, 0);
+    can_worker_t* w       = get_worker(channel);
+
+    if ((NULL != w) && (SDL_TRUE == can_detect_baud_rate(channel, w->core)))
     {
-        return SDL_FALSE;
+        lua_pushinteger(L, w->core->can_channel[channel].baud_rate);
+    }
+    else
+    {
+        lua_pushnil(L);
     }
 
-    return core->is_can_initialised;
+    return 1;
 }
 
-static int can_monitor(void *core_pt)
+int lua_can_set_tx_budget(lua_State* L)
 {
-    char    err_message[100] = { 0 };
-    core_t* core             = core_pt;
+    Uint32 frames_per_s = (Uint32)luaL_checkinteger(L, 1);
+    Uint8  channel      = (Uint8)luaL_optinteger(L, 2, 0);
 
-    if (NULL == core)
+    can_set_tx_budget(channel, frames_per_s);
+
+    return 1;
+}
+
+void lua_register_can_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_can_write);
+    lua_setglobal(core->L, "can_write");
+    lua_pushcfunction(core->L, lua_can_write_fd);
+    lua_setglobal(core->L, "can_write_fd");
+    lua_pushcfunction(core->L, lua_can_read);
+    lua_setglobal(core->L, "can_read");
+    lua_pushcfunction(core->L, lua_can_set_tx_budget);
+    lua_setglobal(core->L, "can_set_tx_budget");
+    lua_pushcfunction(core->L, lua_can_detect_baud_rate);
+    lua_setglobal(core->L, "can_detect_baud_rate");
+}
+
+void can_set_driver(Uint8 channel, const char* name, const char* interface, core_t* core)
+{
+    can_worker_t* w = get_worker(channel);
+    unsigned int  index;
+
+    if ((NULL == core) || (NULL == w))
     {
-        return 1;
+        return;
     }
 
-    core->baud_rate = 3;
-
-    while (SDL_TRUE == core->is_running)
+    for (index = 0; index < DRIVER_COUNT; index += 1)
     {
-        while (SDL_FALSE == is_can_initialised(core))
+        if (0 == SDL_strcmp(name, drivers[index]->name))
         {
-            TPCANBaudrate baud_rate;
+            break;
+        }
+    }
 
-            switch (core->baud_rate)
-            {
-                case 0:
-                    baud_rate = PCAN_BAUD_1M;
-                    break;
-                case 1:
-                    baud_rate = PCAN_BAUD_800K;
-                    break;
-                case 2:
-                    baud_rate = PCAN_BAUD_500K;
-                    break;
-                case 3:
-                default:
-                    baud_rate = PCAN_BAUD_250K;
-                    break;
-                case 4:
-                    baud_rate = PCAN_BAUD_125K;
-                    break;
-                case 5:
-                    baud_rate = PCAN_BAUD_100K;
-                    break;
-                case 6:
-                    baud_rate = PCAN_BAUD_95K;
-                    break;
-                case 7:
-                    baud_rate = PCAN_BAUD_83K;
-                    break;
-                case 8:
-                    baud_rate = PCAN_BAUD_50K;
-                    break;
-                case 9:
-                    baud_rate = PCAN_BAUD_47K;
-                    break;
-                case 10:
-                    baud_rate = PCAN_BAUD_33K;
-                    break;
-                case 11:
-                    baud_rate = PCAN_BAUD_20K;
-                    break;
-                case 12:
-                    baud_rate = PCAN_BAUD_10K;
-                    break;
-                case 13:
-                    baud_rate = PCAN_BAUD_5K;
-                    break;
-            }
+    if (DRIVER_COUNT == index)
+    {
+        can_print_driver_help(core);
+        return;
+    }
 
-            core->can_status = CAN_Initialize(
-                PCAN_USBBUS1,
-                baud_rate,
-                PCAN_USB,
-                0, 0);
+    if (NULL == interface)
+    {
+        interface = drivers[index]->default_interface;
+    }
 
-            CAN_GetErrorText(core->can_status, 0x09, err_message);
+    SDL_LockMutex(w->mutex);
+    close_driver(w);
+    core->can_channel[channel].driver = (Uint8)index;
+    SDL_strlcpy(core->can_channel[channel].interface, interface, sizeof(core->can_channel[channel].interface));
+    SDL_CondSignal(w->monitor_cond);
+    SDL_UnlockMutex(w->mutex);
 
-            if ((core->can_status & PCAN_ERROR_OK) == core->can_status)
-            {
-                c_log(LOG_SUCCESS, "CAN successfully initialised");
-                core->is_can_initialised = SDL_TRUE;
-                c_print_prompt();
-            }
+    start_worker(w);
+}
 
-            SDL_Delay(10);
-            continue;
-        }
+void can_set_channel(Uint8 channel, core_t* core)
+{
+    if (NULL == core)
+    {
+        return;
+    }
+
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        can_print_channel_help(core);
+        return;
+    }
 
-        core->can_status = CAN_GetStatus(PCAN_USBBUS1);
+    core->channel = channel;
+}
 
-        if (PCAN_ERROR_ILLHW == core->can_status)
-        {
-            core->can_status         = 0;
-            core->is_can_initialised = SDL_FALSE;
+/* Called whenever the set of subscribed identifiers changes.  The
+ * filter is re-read from the dispatch table under the worker's lock,
+ * so concurrent updates cannot apply an outdated filter.
+ */
+void can_update_filter(Uint8 channel)
+{
+    can_worker_t* w = get_worker(channel);
 
-            CAN_Uninitialize(PCAN_USBBUS1);
-            c_log(LOG_WARNING, "CAN de-initialised: USB-dongle removed?");
-            c_print_prompt();
-        }
-        SDL_Delay(10);
+    if ((NULL == w) || (NULL == w->mutex))
+    {
+        return;
     }
 
-    return 0;
+    SDL_LockMutex(w->mutex);
+    if (w->filter_holds > 0)
+    {
+        w->filter_count = -1;
+    }
+    else
+    {
+        w->filter_count = dispatch_get_filter(channel, w->filter_id, CAN_FILTER_MAX);
+    }
+    apply_filter(w);
+    SDL_UnlockMutex(w->mutex);
+}
+
+/* Receivers of all frames, such as the trace recorder, keep the
+ * acceptance filter open regardless of the subscriptions.  Holds are
+ * counted, the filter is programmed again when the last one is
+ * released.
+ */
+void can_hold_filter_open(Uint8 channel, SDL_bool is_held)
+{
+    can_worker_t* w = get_worker(channel);
+
+    if ((NULL == w) || (NULL == w->mutex))
+    {
+        return;
+    }
+
+    SDL_LockMutex(w->mutex);
+    if (SDL_TRUE == is_held)
+    {
+        w->filter_holds += 1;
+    }
+    else if (w->filter_holds > 0)
+    {
+        w->filter_holds -= 1;
+    }
+    SDL_UnlockMutex(w->mutex);
+
+    can_update_filter(channel);
+}
+
+// Releases the channels can_read() registered while a script ran.
+void can_clear_lua_readers(void)
+{
+    Uint8 channel;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        if (SDL_TRUE == worker[channel].is_lua_reader)
+        {
+            worker[channel].is_lua_reader = SDL_FALSE;
+            can_register_reader(channel, SDL_FALSE);
+        }
+    }
+}
+
+/* Returns the low 32 bits of can_get_time_us() at which the last frame
+ * with the 11-bit identifier was handed to the controller, so a
+ * round-trip time can be measured without the time spent queueing.
+ * The value wraps around after about 71 minutes and is 0 until a frame
+ * was sent.
+ */
+Uint32 can_get_tx_time_us(Uint8 channel, Uint32 can_id)
+{
+    can_worker_t* w = get_worker(channel);
+
+    if ((NULL == w) || (0 != (can_id & CAN_ID_EXTENDED)))
+    {
+        return 0;
+    }
+
+    return (Uint32)SDL_AtomicGet(&w->tx_done_us[can_id & (TX_ID_COUNT - 1)]);
+}
+
+/* Tells whether the acceptance filter currently drops frames, so that
+ * everything derived from the received frames is incomplete.
+ */
+SDL_bool can_is_filtered(Uint8 channel)
+{
+    can_worker_t* w           = get_worker(channel);
+    SDL_bool      is_filtered = SDL_FALSE;
+
+    if ((NULL == w) || (NULL == w->mutex))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_LockMutex(w->mutex);
+    if ((w->filter_count >= 0) && (NULL != w->driver) && (NULL != w->driver->set_filter))
+    {
+        is_filtered = SDL_TRUE;
+    }
+    SDL_UnlockMutex(w->mutex);
+
+    return is_filtered;
+}
+
+// Tells whether frames with the identifier pass the acceptance filter.
+SDL_bool can_is_received(Uint8 channel, Uint32 can_id)
+{
+    can_worker_t* w           = get_worker(channel);
+    SDL_bool      is_received = SDL_TRUE;
+    int           index;
+
+    if ((NULL == w) || (NULL == w->mutex) || (SDL_FALSE == can_is_filtered(channel)))
+    {
+        return SDL_TRUE;
+    }
+
+    SDL_LockMutex(w->mutex);
+    if (w->filter_count >= 0)
+    {
+        is_received = SDL_FALSE;
+        for (index = 0; index < w->filter_count; index += 1)
+        {
+            if (can_id == w->filter_id[index])
+            {
+                is_received = SDL_TRUE;
+                break;
+            }
+        }
+    }
+    SDL_UnlockMutex(w->mutex);
+
+    return is_received;
+}
+
+/* The receive ring is only fed while a reader is registered, e.g. once
+ * a script called can_read(), so it neither fills up nor holds stale frames when
+ * nobody reads it.  A reader expects every frame, so the acceptance
+ * filter is held open meanwhile.
+ */
+void can_register_reader(Uint8 channel, SDL_bool is_registered)
+{
+    can_worker_t* w = get_worker(channel);
+    can_message_t message;
+
+    if ((NULL == w) || (NULL == w->mutex))
+    {
+        return;
+    }
+
+    if (SDL_TRUE == is_registered)
+    {
+        // Discard what was left over by the previous reader.
+        if (0 == SDL_AtomicGet(&w->rx_readers))
+        {
+            while (SDL_TRUE == ring_buffer_pop(&w->rx_ring, &message));
+        }
+        SDL_AtomicAdd(&w->rx_readers, 1);
+    }
+    else if (SDL_AtomicGet(&w->rx_readers) > 0)
+    {
+        SDL_AtomicAdd(&w->rx_readers, -1);
+    }
+    else
+    {
+        return;
+    }
+
+    can_hold_filter_open(channel, is_registered);
+}
+
+/* Limits the transmit rate of a channel, 0 removes the limit.  Bursts
+ * of up to TX_BURST_IN_MS worth of frames are sent without delay.
+ */
+void can_set_tx_budget(Uint8 channel, Uint32 frames_per_s)
+{
+    can_worker_t* w = get_worker(channel);
+
+    if ((NULL == w) || (NULL == w->tx_mutex))
+    {
+        return;
+    }
+
+    SDL_LockMutex(w->tx_mutex);
+    w->tx_budget    = frames_per_s;
+    w->tx_tokens    = get_tx_burst(frames_per_s);
+    w->tx_refill_us = can_get_time_us();
+    SDL_CondSignal(w->tx_cond);
+    SDL_UnlockMutex(w->tx_mutex);
+}
+
+void can_get_error_text(Uint8 channel, Uint32 can_status, char* text, size_t size)
+{
+    can_worker_t* w = get_worker(channel);
+    const char*   description;
+
+    if ((NULL != w) && (NULL != w->core))
+    {
+        const can_driver_t* driver = drivers[w->core->can_channel[channel].driver];
+
+        if (NULL != driver->get_error_text)
+        {
+            driver->get_error_text(can_status, text, size);
+            return;
+        }
+    }
+
+    switch (can_status)
+    {
+        case CAN_OK:
+            description = "No error";
+            break;
+        case CAN_ERROR_XMTFULL:
+            description = "Transmit buffer in CAN controller is full";
+            break;
+        case CAN_ERROR_OVERRUN:
+            description = "CAN controller was read too late";
+            break;
+        case CAN_ERROR_BUSLIGHT:
+            description = "Bus error: an error counter reached the 'light' limit";
+            break;
+        case CAN_ERROR_BUSHEAVY:
+            description = "Bus error: an error counter reached the 'heavy' limit";
+            break;
+        case CAN_ERROR_BUSPASSIVE:
+            description = "Bus error: the CAN controller is error passive";
+            break;
+        case CAN_ERROR_BUSOFF:
+            description = "Bus error: the CAN controller is in bus-off state";
+            break;
+        case CAN_ERROR_QRCVEMPTY:
+            description = "Receive queue is empty";
+            break;
+        case CAN_ERROR_QOVERRUN:
+            description = "Receive queue was read too late";
+            break;
+        case CAN_ERROR_QXMTFULL:
+            description = "Transmit queue is full";
+            break;
+        case CAN_ERROR_NODRIVER:
+            description = "Driver not loaded";
+            break;
+        case CAN_ERROR_ILLHW:
+            description = "Invalid hardware handle";
+            break;
+        case CAN_ERROR_RESOURCE:
+            description = "Resource could not be created";
+            break;
+        case CAN_ERROR_ILLPARAMVAL:
+            description = "Invalid parameter value";
+            break;
+        case CAN_ERROR_INITIALIZE:
+            description = "Channel is not initialized";
+            break;
+        case CAN_ERROR_ILLOPERATION:
+            description = "Invalid operation";
+            break;
+        case CAN_ERROR_UNKNOWN:
+        default:
+            description = "Unknown error";
+            break;
+    }
+
+    SDL_strlcpy(text, description, size);
+}
+
+void can_print_error_message(Uint8 channel, const char* context, Uint32 can_status)
+{
+    if (CAN_OK != can_status)
+    {
+        char err_message[256] = { 0 };
+
+        can_get_error_text(channel, can_status, err_message, sizeof(err_message));
+        if (NULL == context)
+        {
+            c_log(LOG_WARNING, "%s", err_message);
+        }
+        else
+        {
+            c_log(LOG_WARNING, "%s: %s", context, err_message);
+        }
+    }
+}
+
+void can_print_baud_rate_help(core_t* core)
+{
+    table_t      table         = { DARK_CYAN, DARK_WHITE, 3, 13, 6 };
+    char         status[14][7] = { 0 };
+    unsigned int status_index  = core->can_channel[core->channel].baud_rate;
+    unsigned int index;
+
+    if (status_index > 13)
+    {
+        status_index = 13;
+    }
+
+    for (index = 0; index < 14; index += 1)
+    {
+        if (status_index == index)
+        {
+            SDL_snprintf(status[index], 7, "Active");
+        }
+        else
+        {
+            SDL_snprintf(status[index], 2, " ");
+        }
+    }
+
+    table_print_header(&table);
+    table_print_row("CMD", "Description", "Status", &table);
+    table_print_divider(&table);
+    table_print_row("  0", "1 MBit/s",      status[0],  &table);
+    table_print_row("  1", "800 kBit/s",    status[1],  &table);
+    table_print_row("  2", "500 kBit/s",    status[2],  &table);
+    table_print_row("  3", "250 kBit/s",    status[3],  &table);
+    table_print_row("  4", "125 kBit/s",    status[4],  &table);
+    table_print_row("  5", "100 kBit/s",    status[5],  &table);
+    table_print_row("  6", "95,238 kBit/s", status[6],  &table);
+    table_print_row("  7", "83,333 kBit/s", status[7],  &table);
+    table_print_row("  8", "50 kBit/s",     status[8],  &table);
+    table_print_row("  9", "47,619 kBit/s", status[9],  &table);
+    table_print_row(" 10", "33,333 kBit/s", status[10], &table);
+    table_print_row(" 11", "20 kBit/s",     status[11], &table);
+    table_print_row(" 12", "10 kBit/s",     status[12], &table);
+    table_print_row(" 13", "5 kBit/s",      status[13], &table);
+    table_print_row("  a", "Auto-detect",   " ",        &table);
+    table_print_footer(&table);
+}
+
+void can_print_data_baud_rate_help(core_t* core)
+{
+    table_t      table        = { DARK_CYAN, DARK_WHITE, 3, 13, 6 };
+    char         status[6][7] = { 0 };
+    unsigned int status_index = core->can_channel[core->channel].data_baud_rate;
+    unsigned int index;
+
+    if (status_index > 5)
+    {
+        status_index = 0;
+    }
+
+    for (index = 0; index < 6; index += 1)
+    {
+        if (status_index == index)
+        {
+            SDL_snprintf(status[index], 7, "Active");
+        }
+        else
+        {
+            SDL_snprintf(status[index], 2, " ");
+        }
+    }
+
+    table_print_header(&table);
+    table_print_row("CMD", "Description", "Status", &table);
+    table_print_divider(&table);
+    table_print_row("  0", "Classic CAN", status[0], &table);
+    table_print_row("  1", "1 MBit/s",    status[1], &table);
+    table_print_row("  2", "2 MBit/s",    status[2], &table);
+    table_print_row("  3", "4 MBit/s",    status[3], &table);
+    table_print_row("  4", "5 MBit/s",    status[4], &table);
+    table_print_row("  5", "8 MBit/s",    status[5], &table);
+    table_print_footer(&table);
+}
+
+/* CAN FD frames only carry 0-8, 12, 16, 20, 24, 32, 48 or 64 bytes,
+ * other lengths are rounded up and padded with zeros.
+ */
+Uint8 can_get_fd_length(Uint8 length)
+{
+    if (length <= 8)
+    {
+        return length;
+    }
+    else if (length <= 24)
+    {
+        return (Uint8)((length + 3) & ~3);
+    }
+    else if (length <= 32)
+    {
+        return 32;
+    }
+    else if (length <= 48)
+    {
+        return 48;
+    }
+
+    return 64;
+}
+
+void can_print_driver_help(core_t* core)
+{
+    table_t      table = { DARK_CYAN, DARK_WHITE, 9, 17, 6 };
+    unsigned int index;
+
+    table_print_header(&table);
+    table_print_row("Driver", "Default interface", "Status", &table);
+    table_print_divider(&table);
+
+    for (index = 0; index < DRIVER_COUNT; index += 1)
+    {
+        const char* status = " ";
+
+        if (core->can_channel[core->channel].driver == index)
+        {
+            status = "Active";
+        }
+
+        table_print_row(drivers[index]->name, drivers[index]->default_interface, status, &table);
+    }
+    table_print_footer(&table);
+}
+
+void can_print_channel_help(core_t* core)
+{
+    table_t table = { DARK_CYAN, DARK_WHITE, 3, 26, 8 };
+    Uint8   channel;
+
+    table_print_header(&table);
+    table_print_row("CH", "Driver / interface", "Status", &table);
+    table_print_divider(&table);
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_channel_t* can_channel = &core->can_channel[channel];
+        const char*    status      = "Unused";
+        char           number[4];
+        char           description[27];
+
+        if (SDL_TRUE == can_channel->is_initialised)
+        {
+            status = "Online";
+        }
+        else if (NULL != can_channel->monitor_th)
+        {
+            status = "Offline";
+        }
+
+        SDL_snprintf(number, sizeof(number), "%c%u", (core->channel == channel) ? '*' : ' ', channel);
+        SDL_snprintf(description, sizeof(description), "%s %s", drivers[can_channel->driver]->name, can_channel->interface);
+
+        table_print_row(number, description, status, &table);
+    }
+    table_print_footer(&table);
+}
+
+void can_print_status(core_t* core)
+{
+    table_t       table                          = { DARK_CYAN, DARK_WHITE, 16, 10, 7 };
+    table_t       tx_table                       = { DARK_CYAN, DARK_WHITE, 9, 21, 21 };
+    const char*   class_name[CAN_PRIORITY_COUNT] = { "NMT/SYNC", "PDO", "SDO", "Bulk" };
+    const char*   status                         = "Offline";
+    char          value[11];
+    int           priority;
+    can_worker_t* w;
+
+    if (NULL == core)
+    {
+        return;
+    }
+
+    w = &worker[core->channel];
+
+    if (SDL_TRUE == is_can_initialised(core->channel, core))
+    {
+        status = "Online";
+    }
+
+    table_print_header(&table);
+    table_print_row("Driver", "Interface", "Status", &table);
+    table_print_divider(&table);
+    table_print_row(drivers[core->can_channel[core->channel].driver]->name, core->can_channel[core->channel].interface, status, &table);
+    table_print_divider(&table);
+
+    SDL_snprintf(value, sizeof(value), "%u", core->channel);
+    table_print_row("Channel", value, " ", &table);
+
+    SDL_snprintf(value, sizeof(value), "%u", (Uint32)SDL_AtomicGet(&w->rx_count));
+    table_print_row("Received", value, "frames", &table);
+
+    SDL_snprintf(value, sizeof(value), "%u", ring_buffer_count(&w->rx_ring));
+    table_print_row("Queued", value, "frames", &table);
+
+    SDL_snprintf(value, sizeof(value), "%u", (Uint32)SDL_AtomicGet(&w->rx_ring.high_water_mark));
+    table_print_row("Queue high-water", value, "frames", &table);
+
+    SDL_snprintf(value, sizeof(value), "%u", (Uint32)SDL_AtomicGet(&w->rx_ring.overrun_count));
+    table_print_row("Queue overruns", value, "frames", &table);
+
+    SDL_snprintf(value, sizeof(value), "%u", (Uint32)SDL_AtomicGet(&w->rx_driver_overrun_count));
+    table_print_row("Driver overruns", value, "events", &table);
+    table_print_divider(&table);
+
+    SDL_LockMutex(w->tx_mutex);
+
+    if (0 == w->tx_budget)
+    {
+        table_print_row("TX budget", "none", " ", &table);
+    }
+    else
+    {
+        SDL_snprintf(value, sizeof(value), "%u", w->tx_budget);
+        table_print_row("TX budget", value, "fps", &table);
+    }
+    table_print_footer(&table);
+
+    table_print_header(&tx_table);
+    table_print_row("TX class", "Sent / dropped", "Latency avg/max", &tx_table);
+    table_print_divider(&tx_table);
+
+    for (priority = 0; priority < CAN_PRIORITY_COUNT; priority += 1)
+    {
+        char   frames[22];
+        char   latency[22];
+        Uint32 latency_avg_us = 0;
+
+        if (0 != w->tx_sent[priority])
+        {
+            latency_avg_us = (Uint32)(w->tx_latency_sum_us[priority] / w->tx_sent[priority]);
+        }
+
+        SDL_snprintf(frames,  sizeof(frames),  "%u / %u",    w->tx_sent[priority], w->tx_dropped[priority]);
+        SDL_snprintf(latency, sizeof(latency), "%u / %u us", latency_avg_us, w->tx_latency_max_us[priority]);
+        table_print_row(class_name[priority], frames, latency, &tx_table);
+    }
+
+    SDL_UnlockMutex(w->tx_mutex);
+
+    table_print_footer(&tx_table);
+}
+
+Uint64 can_get_time_us(void)
+{
+    Uint64 counter   = SDL_GetPerformanceCounter();
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+
+    return ((counter / frequency) * 1000000) + (((counter % frequency) * 1000000) / frequency);
+}
+
+SDL_bool is_can_initialised(Uint8 channel, core_t* core)
+{
+    if ((NULL == core) || (channel >= CAN_CHANNEL_MAX))
+    {
+        return SDL_FALSE;
+    }
+
+    return core->can_channel[channel].is_initialised;
+}
+
+/* The monitor thread (re-)opens the channel and watches its state.  It
+ * sleeps on a condition variable and is woken up whenever the
+ * configuration changes or the receive thread reports a removed
+ * device.
+ */
+static int can_monitor(void *worker_pt)
+{
+    can_worker_t*  w           = worker_pt;
+    core_t*        core        = w->core;
+    can_channel_t* can_channel = &core->can_channel[w->channel];
+
+    SDL_LockMutex(w->mutex);
+    while (SDL_TRUE == core->is_running)
+    {
+        Uint32 timeout_ms = MONITOR_INTERVAL_IN_MS;
+
+        // The interface is left to can_detect_baud_rate() while it is running.
+        if ((SDL_FALSE == can_channel->is_initialised) && (SDL_FALSE == w->is_detecting))
+        {
+            const can_driver_t* driver = drivers[can_channel->driver];
+
+            can_channel->can_status = driver->open(can_channel->interface, can_channel->baud_rate, can_channel->data_baud_rate, SDL_FALSE, &w->handle);
+
+            if (CAN_OK == can_channel->can_status)
+            {
+                w->driver                   = driver;
+                can_channel->is_initialised = SDL_TRUE;
+                apply_filter(w);
+
+                stats_set_bit_rate(
+                    w->channel,
+                    bit_rates[SDL_min(can_channel->baud_rate, 13)],
+                    data_bit_rates[SDL_min(can_channel->data_baud_rate, 5)]);
+
+                SDL_AtomicSet(&w->rx_running, 1);
+                w->rx_thread = SDL_CreateThread(can_receive, "CAN receive thread", w);
+
+                SDL_AtomicSet(&w->tx_running, 1);
+                w->tx_thread = SDL_CreateThread(can_transmit, "CAN transmit thread", w);
+
+                c_log(LOG_SUCCESS, "CAN channel %u successfully initialised (%s, %s)", w->channel, driver->name, can_channel->interface);
+                c_print_prompt();
+            }
+            else
+            {
+                timeout_ms = MONITOR_RETRY_IN_MS;
+            }
+        }
+        else if (NULL != w->driver)
+        {
+            can_channel->can_status = w->driver->get_status(w->handle);
+
+            if ((CAN_ERROR_ILLHW == can_channel->can_status) || (0 == SDL_AtomicGet(&w->rx_running)))
+            {
+                close_driver(w);
+                c_log(LOG_WARNING, "CAN channel %u de-initialised: USB-dongle removed?", w->channel);
+                c_print_prompt();
+                timeout_ms = MONITOR_RETRY_IN_MS;
+            }
+        }
+
+        SDL_CondWaitTimeout(w->monitor_cond, w->mutex, timeout_ms);
+    }
+    SDL_UnlockMutex(w->mutex);
+
+    return 0;
+}
+
+/* The receive thread blocks on the driver's receive event and drains
+ * all pending frames into the receive ring before waiting again.
+ * Readers waiting in can_read_timeout() are woken up through a
+ * condition variable.
+ */
+static int can_receive(void *worker_pt)
+{
+    can_worker_t* w       = worker_pt;
+    unsigned int  pending = 0;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+
+    while (0 != SDL_AtomicGet(&w->rx_running))
+    {
+        can_message_t messages[RX_BATCH_SIZE];
+        Uint32        can_status;
+        int           count;
+
+        can_status = w->driver->read_batch(w->handle, messages, RX_BATCH_SIZE, &count);
+
+        if (CAN_OK == can_status)
+        {
+            Uint64   timestamp_us = can_get_time_us();
+            SDL_bool is_read      = (SDL_AtomicGet(&w->rx_readers) > 0) ? SDL_TRUE : SDL_FALSE;
+            int      frames       = 0;
+            int      index;
+
+            stats_record(w->channel, STATS_RX, messages, count);
+            trace_record(w->channel, messages, count);
+            pcapng_record(w->channel, messages, count);
+            monitor_record(w->channel, messages, count);
+
+            for (index = 0; index < count; index += 1)
+            {
+                // Error frames are only counted by the statistics.
+                if (0 != (messages[index].flags & CAN_FLAG_ERROR))
+                {
+                    continue;
+                }
+
+                if (frames != index)
+                {
+                    messages[frames] = messages[index];
+                }
+
+                // Fall back to the host clock if the driver did not
+                // provide a timestamp.
+                if (0 == messages[frames].timestamp_us)
+                {
+                    messages[frames].timestamp_us = timestamp_us;
+                }
+
+                if ((SDL_TRUE == is_read) && (SDL_TRUE == ring_buffer_push(&w->rx_ring, &messages[frames])))
+                {
+                    pending += 1;
+                }
+                frames += 1;
+            }
+            SDL_AtomicAdd(&w->rx_count, frames);
+
+            dispatch_frames(w->channel, messages, frames);
+
+            if (pending >= RX_NOTIFY_INTERVAL)
+            {
+                notify_readers(w);
+                pending = 0;
+            }
+            continue;
+        }
+
+        if (pending > 0)
+        {
+            notify_readers(w);
+            pending = 0;
+        }
+
+        if (CAN_ERROR_ILLHW == can_status)
+        {
+            // Hand over to the monitor thread, which closes the channel.
+            SDL_AtomicSet(&w->rx_running, 0);
+            SDL_CondSignal(w->monitor_cond);
+            break;
+        }
+        else if (0 != (can_status & (CAN_ERROR_OVERRUN | CAN_ERROR_QOVERRUN)))
+        {
+            SDL_AtomicAdd(&w->rx_driver_overrun_count, 1);
+            continue;
+        }
+
+        if (NULL != w->driver->wait)
+        {
+            w->driver->wait(w->handle, RX_WAIT_TIMEOUT_IN_MS);
+        }
+        else
+        {
+            SDL_Delay(1);
+        }
+    }
+
+    return 0;
+}
+
+/* The transmit thread always sends the frames of the highest priority
+ * class first.  While a budget is set, a token bucket limits the
+ * number of frames per second.
+ */
+static int can_transmit(void *worker_pt)
+{
+    can_worker_t* w = worker_pt;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+
+    SDL_LockMutex(w->tx_mutex);
+    while (0 != SDL_AtomicGet(&w->tx_running))
+    {
+        can_message_t  messages[TX_BATCH_SIZE];
+        can_priority_t priority;
+        int            count;
+
+        count = dequeue(w, messages, &priority);
+        if (0 == count)
+        {
+            continue;
+        }
+
+        SDL_CondBroadcast(w->tx_space_cond);
+        SDL_UnlockMutex(w->tx_mutex);
+
+        transmit(w, priority, messages, count);
+
+        SDL_LockMutex(w->tx_mutex);
+    }
+    SDL_UnlockMutex(w->tx_mutex);
+
+    return 0;
+}
+
+static Uint32 enqueue(can_worker_t* w, can_message_t* messages, int count, Uint32 timeout_ms, int* queued)
+{
+    Uint64 deadline     = SDL_GetTicks64() + timeout_ms;
+    Uint64 timestamp_us = can_get_time_us();
+    Uint32 can_status   = CAN_OK;
+
+    *queued = 0;
+
+    SDL_LockMutex(w->tx_mutex);
+    while (*queued < count)
+    {
+        ring_buffer_t* queue = &w->tx_queue[get_priority(messages[*queued].id)];
+        Uint64         now;
+
+        if (0 == SDL_AtomicGet(&w->tx_running))
+        {
+            can_status = CAN_ERROR_INITIALIZE;
+            break;
+        }
+
+        if (ring_buffer_count(queue) < TX_QUEUE_SIZE)
+        {
+            can_message_t message = messages[*queued];
+
+            // The time of queueing is kept for the latency statistics.
+            message.timestamp_us = timestamp_us;
+            ring_buffer_push(queue, &message);
+            *queued += 1;
+            continue;
+        }
+
+        now = SDL_GetTicks64();
+        if (now >= deadline)
+        {
+            can_status = CAN_ERROR_QXMTFULL;
+            break;
+        }
+
+        SDL_CondWaitTimeout(w->tx_space_cond, w->tx_mutex, (Uint32)(deadline - now));
+    }
+
+    if (CAN_ERROR_QXMTFULL == can_status)
+    {
+        int index;
+
+        for (index = *queued; index < count; index += 1)
+        {
+            w->tx_dropped[get_priority(messages[index].id)] += 1;
+        }
+    }
+
+    if (*queued > 0)
+    {
+        SDL_CondSignal(w->tx_cond);
+    }
+    SDL_UnlockMutex(w->tx_mutex);
+
+    return can_status;
+}
+
+/* Takes up to TX_BATCH_SIZE frames of the highest non-empty priority
+ * class.  Must be called with the transmit lock held, waits and
+ * returns 0 if no frame may be sent at the moment.
+ */
+static int dequeue(can_worker_t* w, can_message_t* messages, can_priority_t* priority)
+{
+    int limit = TX_BATCH_SIZE;
+    int count = 0;
+    int index;
+
+    for (index = 0; index < CAN_PRIORITY_COUNT; index += 1)
+    {
+        if (0 != ring_buffer_count(&w->tx_queue[index]))
+        {
+            break;
+        }
+    }
+
+    if (CAN_PRIORITY_COUNT == index)
+    {
+        SDL_CondWait(w->tx_cond, w->tx_mutex);
+        return 0;
+    }
+
+    *priority = (can_priority_t)index;
+
+    // Tokens are counted in millionths of a frame.
+    if (0 != w->tx_budget)
+    {
+        Uint64 now_us = can_get_time_us();
+
+        w->tx_tokens   += (now_us - w->tx_refill_us) * w->tx_budget;
+        w->tx_refill_us = now_us;
+
+        if (w->tx_tokens > get_tx_burst(w->tx_budget))
+        {
+            w->tx_tokens = get_tx_burst(w->tx_budget);
+        }
+
+        if (w->tx_tokens < 1000000)
+        {
+            Uint32 wait_ms = (Uint32)(((1000000 - w->tx_tokens) / w->tx_budget) / 1000) + 1;
+
+            SDL_CondWaitTimeout(w->tx_cond, w->tx_mutex, wait_ms);
+            return 0;
+        }
+
+        limit = (int)SDL_min(w->tx_tokens / 1000000, (Uint64)TX_BATCH_SIZE);
+    }
+
+    while ((count < limit) && (SDL_TRUE == ring_buffer_pop(&w->tx_queue[*priority], &messages[count])))
+    {
+        count += 1;
+    }
+
+    if (0 != w->tx_budget)
+    {
+        w->tx_tokens -= (Uint64)count * 1000000;
+    }
+
+    return count;
+}
+
+/* Frames the controller cannot take at the moment are retried, any
+ * other error drops the rest of the batch.  Errors are only reported
+ * when they change, so a flooding script does not flood the log.
+ */
+static void transmit(can_worker_t* w, can_priority_t priority, can_message_t* messages, int count)
+{
+    Uint64 latency_sum_us = 0;
+    Uint32 latency_max_us = 0;
+    Uint32 can_status     = CAN_OK;
+    int    sent           = 0;
+
+    while ((sent < count) && (0 != SDL_AtomicGet(&w->tx_running)))
+    {
+        Uint64 now_us;
+        int    written = 0;
+        int    index;
+
+        can_status = w->driver->write_batch(w->handle, &messages[sent], count - sent, &written);
+
+        now_us = can_get_time_us();
+        for (index = sent; index < (sent + written); index += 1)
+        {
+            Uint32 latency_us = (Uint32)(now_us - messages[index].timestamp_us);
+
+            if (0 == (messages[index].id & CAN_ID_EXTENDED))
+            {
+                SDL_AtomicSet(&w->tx_done_us[messages[index].id & (TX_ID_COUNT - 1)], (int)(Uint32)now_us);
+            }
+
+            latency_sum_us += latency_us;
+            if (latency_us > latency_max_us)
+            {
+                latency_max_us = latency_us;
+            }
+        }
+
+        stats_record(w->channel, STATS_TX, &messages[sent], written);
+        sent += written;
+
+        if (0 != (can_status & (CAN_ERROR_XMTFULL | CAN_ERROR_QXMTFULL)))
+        {
+            SDL_Delay(TX_RETRY_IN_MS);
+        }
+        else if (CAN_OK != can_status)
+        {
+            break;
+        }
+    }
+
+    // Only written by the transmit thread.
+    if ((CAN_OK != can_status) && (w->tx_status != can_status))
+    {
+        can_print_error_message(w->channel, "Transmit failed", can_status);
+    }
+
+    SDL_LockMutex(w->tx_mutex);
+
+    w->tx_status                    = can_status;
+    w->tx_sent[priority]           += (Uint32)sent;
+    w->tx_dropped[priority]        += (Uint32)(count - sent);
+    w->tx_latency_sum_us[priority] += latency_sum_us;
+    if (latency_max_us > w->tx_latency_max_us[priority])
+    {
+        w->tx_latency_max_us[priority] = latency_max_us;
+    }
+
+    SDL_UnlockMutex(w->tx_mutex);
+}
+
+// Frames which are still queued when the channel is closed are dropped.
+static void stop_transmit(can_worker_t* w)
+{
+    can_message_t message;
+    int           priority;
+
+    SDL_LockMutex(w->tx_mutex);
+    SDL_AtomicSet(&w->tx_running, 0);
+    SDL_CondBroadcast(w->tx_cond);
+    SDL_CondBroadcast(w->tx_space_cond);
+    SDL_UnlockMutex(w->tx_mutex);
+
+    if (NULL != w->tx_thread)
+    {
+        SDL_WaitThread(w->tx_thread, NULL);
+        w->tx_thread = NULL;
+    }
+
+    SDL_LockMutex(w->tx_mutex);
+    for (priority = 0; priority < CAN_PRIORITY_COUNT; priority += 1)
+    {
+        while (SDL_TRUE == ring_buffer_pop(&w->tx_queue[priority], &message))
+        {
+            w->tx_dropped[priority] += 1;
+        }
+    }
+    SDL_UnlockMutex(w->tx_mutex);
+}
+
+static void notify_readers(can_worker_t* w)
+{
+    if (0 != SDL_AtomicGet(&w->rx_waiters))
+    {
+        SDL_LockMutex(w->rx_mutex);
+        SDL_CondBroadcast(w->rx_cond);
+        SDL_UnlockMutex(w->rx_mutex);
+    }
+}
+
+static void close_driver(can_worker_t* w)
+{
+    can_channel_t* can_channel = &w->core->can_channel[w->channel];
+
+    SDL_AtomicSet(&w->rx_running, 0);
+
+    if (NULL != w->rx_thread)
+    {
+        SDL_WaitThread(w->rx_thread, NULL);
+        w->rx_thread = NULL;
+    }
+
+    stop_transmit(w);
+
+    if (NULL != w->driver)
+    {
+        w->driver->close(w->handle);
+    }
+
+    w->driver                   = NULL;
+    w->handle                   = NULL;
+    can_channel->can_status     = 0;
+    can_channel->is_initialised = SDL_FALSE;
+}
+
+// Must be called with the worker's lock held.
+static void apply_filter(can_worker_t* w)
+{
+    Uint32 can_status;
+
+    if ((NULL == w->driver) || (NULL == w->driver->set_filter))
+    {
+        return;
+    }
+
+    can_status = w->driver->set_filter(w->handle, w->filter_id, w->filter_count);
+    if (CAN_OK != can_status)
+    {
+        can_print_error_message(w->channel, "Could not set acceptance filter", can_status);
+    }
+}
+
+static void start_worker(can_worker_t* w)
+{
+    can_channel_t* can_channel = &w->core->can_channel[w->channel];
+    int            priority;
+
+    if (NULL != can_channel->monitor_th)
+    {
+        return;
+    }
+
+    if (SDL_FALSE == ring_buffer_init(&w->rx_ring, RX_RING_SIZE))
+    {
+        c_log(LOG_ERROR, "Could not allocate CAN receive buffer");
+        return;
+    }
+
+    for (priority = 0; priority < CAN_PRIORITY_COUNT; priority += 1)
+    {
+        if (SDL_FALSE == ring_buffer_init(&w->tx_queue[priority], TX_QUEUE_SIZE))
+        {
+            c_log(LOG_ERROR, "Could not allocate CAN transmit buffer");
+            return;
+        }
+    }
+
+    can_channel->monitor_th = SDL_CreateThread(can_monitor, "CAN monitor thread", w);
+}
+
+/* The priority class follows the CANopen function code of 11-bit
+ * identifiers.  The node-ID range is treated as PDOs, as it can be
+ * used for them.
+ */
+static can_priority_t get_priority(Uint32 can_id)
+{
+    if (0 != (can_id & CAN_ID_EXTENDED))
+    {
+        return CAN_PRIORITY_BULK;
+    }
+    else if ((0x000 == can_id) || ((can_id >= 0x080) && (can_id <= 0x100)) || ((can_id >= 0x700) && (can_id <= 0x77f)))
+    {
+        return CAN_PRIORITY_NMT;
+    }
+    else if ((can_id <= 0x07f) || ((can_id >= 0x180) && (can_id <= 0x57f)))
+    {
+        return CAN_PRIORITY_PDO;
+    }
+    else if ((can_id >= 0x580) && (can_id <= 0x67f))
+    {
+        return CAN_PRIORITY_SDO;
+    }
+
+    return CAN_PRIORITY_BULK;
+}
+
+// The bucket size in millionths of a frame.
+static Uint64 get_tx_burst(Uint32 frames_per_s)
+{
+    Uint64 frames = ((Uint64)frames_per_s * TX_BURST_IN_MS) / 1000;
+
+    if (0 == frames)
+    {
+        frames = 1;
+    }
+
+    return frames * 1000000;
+}
+
+/* Returns 1 if frames were received without any error, -1 on error
+ * frames or bus errors and 0 if the bus stayed quiet.
+ */
+static int listen_at_baud_rate(const can_driver_t* driver, void* handle, Uint32 timeout_ms)
+{
+    Uint64 deadline = SDL_GetTicks64() + timeout_ms;
+    int    frames   = 0;
+
+    while (SDL_GetTicks64() < deadline)
+    {
+        can_message_t messages[RX_BATCH_SIZE];
+        Uint32        can_status;
+        int           count = 0;
+        int           index;
+
+        can_status = driver->read_batch(handle, messages, RX_BATCH_SIZE, &count);
+
+        for (index = 0; index < count; index += 1)
+        {
+            if (0 != (messages[index].flags & CAN_FLAG_ERROR))
+            {
+                return -1;
+            }
+        }
+        frames += count;
+
+        if ((SDL_TRUE == is_bus_error(can_status)) || (SDL_TRUE == is_bus_error(driver->get_status(handle))))
+        {
+            return -1;
+        }
+        else if (frames >= DETECT_FRAME_COUNT)
+        {
+            return 1;
+        }
+
+        if (0 == count)
+        {
+            if (NULL != driver->wait)
+            {
+                driver->wait(handle, DETECT_WAIT_IN_MS);
+            }
+            else
+            {
+                SDL_Delay(1);
+            }
+        }
+    }
+
+    return (frames > 0) ? 1 : 0;
+}
+
+static SDL_bool is_bus_error(Uint32 can_status)
+{
+    if (0 != (can_status & (CAN_ERROR_BUSLIGHT | CAN_ERROR_BUSHEAVY | CAN_ERROR_BUSPASSIVE | CAN_ERROR_BUSOFF)))
+    {
+        return SDL_TRUE;
+    }
+
+    return SDL_FALSE;
+}
+
+static can_worker_t* get_worker(Uint8 channel)
+{
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return NULL;
+    }
+
+    return &worker[channel];
 }
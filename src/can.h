@@ -10,28 +10,150 @@
 #ifndef CAN_H
 #define CAN_H
 
+#include <stddef.h>
 #include "SDL.h"
 #include "lua.h"
 #include "core.h"
 
+/* The status codes share their values with PCAN-Basic's TPCANStatus,
+ * which allows the PCAN driver to pass them through unchanged.  All
+ * other drivers translate their errors into this set.
+ */
+typedef enum can_status
+{
+    CAN_OK                 = 0x00000,
+    CAN_ERROR_XMTFULL      = 0x00001,
+    CAN_ERROR_OVERRUN      = 0x00002,
+    CAN_ERROR_BUSLIGHT     = 0x00004,
+    CAN_ERROR_BUSHEAVY     = 0x00008,
+    CAN_ERROR_BUSOFF       = 0x00010,
+    CAN_ERROR_QRCVEMPTY    = 0x00020,
+    CAN_ERROR_QOVERRUN     = 0x00040,
+    CAN_ERROR_QXMTFULL     = 0x00080,
+    CAN_ERROR_NODRIVER     = 0x00200,
+    CAN_ERROR_ILLHW        = 0x01400,
+    CAN_ERROR_RESOURCE     = 0x02000,
+    CAN_ERROR_ILLPARAMVAL  = 0x08000,
+    CAN_ERROR_BUSPASSIVE   = 0x40000,
+    CAN_ERROR_UNKNOWN      = 0x10000,
+    CAN_ERROR_INITIALIZE   = 0x4000000,
+    CAN_ERROR_ILLOPERATION = 0x8000000
+
+} can_status_t;
+
+#define CAN_MAX_DATA_LENGTH   8
+#define CANFD_MAX_DATA_LENGTH 64
+
+#define CAN_ID_EXTENDED 0x80000000 // Set for 29-bit identifiers
+#define CAN_ID_MASK     0x1fffffff
+
+#define CAN_FILTER_MAX 512 // Larger filters leave the channel open
+
+typedef enum can_flag
+{
+    CAN_FLAG_FD    = 0x01, // CAN FD frame
+    CAN_FLAG_BRS   = 0x02, // Bit rate switch, data phase at data bit rate
+    CAN_FLAG_ESI   = 0x04, // Error state indicator of the transmitter
+    CAN_FLAG_ERROR = 0x08  // Error frame, only counted by the statistics
+
+} can_flag_t;
+
+/* Frames are sent in the order of their priority class, which is
+ * derived from the CANopen function code of the identifier.
+ */
+typedef enum can_priority
+{
+    CAN_PRIORITY_NMT = 0, // NMT, SYNC, EMCY, TIME and error control
+    CAN_PRIORITY_PDO,
+    CAN_PRIORITY_SDO,
+    CAN_PRIORITY_BULK,    // Everything else, e.g. 29-bit identifiers
+    CAN_PRIORITY_COUNT
+
+} can_priority_t;
+
+/* The receive timestamp is taken by the CAN controller or the kernel
+ * where possible, and by the host when the frame is received otherwise.
+ * It is only comparable between frames of the same driver.
+ */
 typedef struct can_message
 {
-    Uint16 id;
+    Uint64 timestamp_us;
+    Uint32 id;
     Uint8  length;
-    Uint8  data[8];
+    Uint8  flags;
+    Uint8  data[CANFD_MAX_DATA_LENGTH];
 
 } can_message_t;
 
+/* A channel opened listen-only neither sends frames nor acknowledges
+ * or disturbs the frames of others.
+ *
+ * set_filter() programs the acceptance filter of the interface: only
+ * frames with one of the given identifiers are received.  A negative
+ * count opens the filter for all frames.  Drivers without hardware or
+ * kernel filtering leave it NULL.
+ */
+typedef struct can_driver
+{
+    const char* name;
+    const char* default_interface;
+    Uint32    (*open)(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle);
+    void      (*close)(void* handle);
+    Uint32    (*write)(void* handle, can_message_t* message);
+    Uint32    (*read)(void* handle, can_message_t* message);
+    Uint32    (*write_batch)(void* handle, can_message_t* messages, int count, int* written);
+    Uint32    (*read_batch)(void* handle, can_message_t* messages, int count, int* read);
+    Uint32    (*wait)(void* handle, Uint32 timeout_ms);
+    Uint32    (*get_status)(void* handle);
+    Uint32    (*set_filter)(void* handle, const Uint32* ids, int count);
+    void      (*get_error_text)(Uint32 can_status, char* text, size_t size);
+
+} can_driver_t;
+
+extern const can_driver_t pcan_driver;
+#ifdef __linux__
+extern const can_driver_t socketcan_driver;
+#endif
+extern const can_driver_t virtual_driver;
+
 void     can_init(core_t* core_t);
-void     can_deinit(core_t* core);
+void     can_deinit(Uint8 channel, core_t* core);
 void     can_quit(core_t* core);
-Uint32   can_write(can_message_t* message);
-Uint32   can_read(can_message_t* message);
-void     can_set_baud_rate(Uint8 command, core_t* core);
+Uint32   can_write(Uint8 channel, can_message_t* message);
+Uint32   can_write_timeout(Uint8 channel, can_message_t* message, Uint32 timeout_ms);
+Uint32   can_read(Uint8 channel, can_message_t* message);
+Uint32   can_read_timeout(Uint8 channel, can_message_t* message, Uint32 timeout_ms);
+Uint32   can_write_batch(Uint8 channel, can_message_t* messages, int count, int* written);
+Uint32   can_write_batch_timeout(Uint8 channel, can_message_t* messages, int count, Uint32 timeout_ms, int* written);
+Uint32   can_read_batch(Uint8 channel, can_message_t* messages, int count, int* read);
+void     can_set_baud_rate(Uint8 channel, Uint8 command, core_t* core);
+void     can_set_data_baud_rate(Uint8 channel, Uint8 command, core_t* core);
+SDL_bool can_detect_baud_rate(Uint8 channel, core_t* core);
+void     can_set_driver(Uint8 channel, const char* name, const char* interface, core_t* core);
+void     can_set_channel(Uint8 channel, core_t* core);
+void     can_update_filter(Uint8 channel);
+void     can_hold_filter_open(Uint8 channel, SDL_bool is_held);
+void     can_register_reader(Uint8 channel, SDL_bool is_registered);
+void     can_clear_lua_readers(void);
+SDL_bool can_is_filtered(Uint8 channel);
+SDL_bool can_is_received(Uint8 channel, Uint32 can_id);
+void     can_set_tx_budget(Uint8 channel, Uint32 frames_per_s);
 int      lua_can_write(lua_State* L);
+int      lua_can_write_fd(lua_State* L);
+int      lua_can_read(lua_State* L);
+int      lua_can_set_tx_budget(lua_State* L);
+int      lua_can_detect_baud_rate(lua_State* L);
 void     lua_register_can_commands(core_t* core);
-void     can_print_error_message(const char* context, Uint32 can_status);
+void     can_get_error_text(Uint8 channel, Uint32 can_status, char* text, size_t size);
+void     can_print_error_message(Uint8 channel, const char* context, Uint32 can_status);
 void     can_print_baud_rate_help(core_t* core);
-SDL_bool is_can_initialised(core_t* core);
+void     can_print_data_baud_rate_help(core_t* core);
+Uint8    can_get_fd_length(Uint8 length);
+void     can_print_driver_help(core_t* core);
+void     can_print_channel_help(core_t* core);
+void     can_print_status(core_t* core);
+Uint64   can_get_time_us(void);
+Uint32   can_get_tx_time_us(Uint8 channel, Uint32 can_id);
+SDL_bool is_can_initialised(Uint8 channel, core_t* core);
 
 #endif /* CAN_H */
@@ -0,0 +1,554 @@
+/** @file can_pcan.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "can.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <poll.h>
+#endif
+#include "PCANBasic.h"
+
+#define PCAN_FD_CLOCK_MHZ 80
+
+typedef struct pcan
+{
+    TPCANHandle channel;
+    SDL_bool    is_fd;
+#ifdef _WIN32
+    HANDLE      receive_event;
+#else
+    int         receive_fd;
+#endif
+
+} pcan_t;
+
+static Uint32        pcan_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle);
+static void          pcan_close(void* handle);
+static Uint32        pcan_write(void* handle, can_message_t* message);
+static Uint32        pcan_read(void* handle, can_message_t* message);
+static Uint32        pcan_write_batch(void* handle, can_message_t* messages, int count, int* written);
+static Uint32        pcan_read_batch(void* handle, can_message_t* messages, int count, int* read);
+static Uint32        pcan_wait(void* handle, Uint32 timeout_ms);
+static Uint32        pcan_get_status(void* handle);
+static Uint32        pcan_set_filter(void* handle, const Uint32* ids, int count);
+static void          pcan_get_error_text(Uint32 can_status, char* text, size_t size);
+static Uint32        pcan_write_fd(pcan_t* pcan, can_message_t* message);
+static Uint32        pcan_read_fd(pcan_t* pcan, can_message_t* message);
+static Uint64        convert_timestamp(const TPCANTimestamp* timestamp);
+static Uint8         convert_length_to_dlc(Uint8 length);
+static Uint8         convert_dlc_to_length(Uint8 dlc);
+static void          get_bit_rate_fd(Uint8 baud_rate, Uint8 data_baud_rate, char* bit_rate, size_t size);
+static TPCANHandle   get_channel(const char* interface);
+static TPCANBaudrate get_baud_rate(Uint8 baud_rate);
+
+const can_driver_t pcan_driver =
+{
+    "pcan",
+    "usb1",
+    pcan_open,
+    pcan_close,
+    pcan_write,
+    pcan_read,
+    pcan_write_batch,
+    pcan_read_batch,
+    pcan_wait,
+    pcan_get_status,
+    pcan_set_filter,
+    pcan_get_error_text
+};
+
+static Uint32 pcan_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle)
+{
+    TPCANHandle channel = get_channel(interface);
+    TPCANStatus can_status;
+    BYTE        parameter;
+    pcan_t*     pcan;
+
+    if (PCAN_NONEBUS == channel)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
+
+    // Set before the channel is initialised, so not a single frame is
+    // acknowledged or disturbed at a possibly wrong bit rate.
+    parameter  = (SDL_TRUE == is_listen_only) ? PCAN_PARAMETER_ON : PCAN_PARAMETER_OFF;
+    can_status = CAN_SetValue(channel, PCAN_LISTEN_ONLY, &parameter, sizeof(parameter));
+    if ((PCAN_ERROR_OK != can_status) && (SDL_TRUE == is_listen_only))
+    {
+        return (Uint32)can_status;
+    }
+
+    if (0 == data_baud_rate)
+    {
+        can_status = CAN_Initialize(channel, get_baud_rate(baud_rate), PCAN_USB, 0, 0);
+    }
+    else
+    {
+        char bit_rate[256] = { 0 };
+
+        get_bit_rate_fd(baud_rate, data_baud_rate, bit_rate, sizeof(bit_rate));
+        can_status = CAN_InitializeFD(channel, bit_rate);
+    }
+
+    if (PCAN_ERROR_OK != can_status)
+    {
+        return (Uint32)can_status;
+    }
+
+    pcan = (pcan_t*)SDL_calloc(1, sizeof(pcan_t));
+    if (NULL == pcan)
+    {
+        CAN_Uninitialize(channel);
+        return CAN_ERROR_RESOURCE;
+    }
+
+    pcan->channel = channel;
+    pcan->is_fd   = (0 == data_baud_rate) ? SDL_FALSE : SDL_TRUE;
+
+    // Error frames are counted by the statistics and used by the bit
+    // rate detection, not all devices support reporting them.
+    parameter = PCAN_PARAMETER_ON;
+    CAN_SetValue(channel, PCAN_ALLOW_ERROR_FRAMES, &parameter, sizeof(parameter));
+
+#ifdef _WIN32
+    pcan->receive_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (NULL != pcan->receive_event)
+    {
+        if (PCAN_ERROR_OK != CAN_SetValue(channel, PCAN_RECEIVE_EVENT, &pcan->receive_event, sizeof(pcan->receive_event)))
+        {
+            CloseHandle(pcan->receive_event);
+            pcan->receive_event = NULL;
+        }
+    }
+#else
+    if (PCAN_ERROR_OK != CAN_GetValue(channel, PCAN_RECEIVE_EVENT, &pcan->receive_fd, sizeof(pcan->receive_fd)))
+    {
+        pcan->receive_fd = -1;
+    }
+#endif
+
+    *handle = pcan;
+
+    return CAN_OK;
+}
+
+static void pcan_close(void* handle)
+{
+    pcan_t* pcan = handle;
+
+    if (NULL == pcan)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    if (NULL != pcan->receive_event)
+    {
+        HANDLE no_event = NULL;
+
+        CAN_SetValue(pcan->channel, PCAN_RECEIVE_EVENT, &no_event, sizeof(no_event));
+        CloseHandle(pcan->receive_event);
+    }
+#endif
+
+    CAN_Uninitialize(pcan->channel);
+    SDL_free(pcan);
+}
+
+static Uint32 pcan_write(void* handle, can_message_t* message)
+{
+    pcan_t*  pcan         = handle;
+    TPCANMsg pcan_message = { 0 };
+
+    if (SDL_TRUE == pcan->is_fd)
+    {
+        return pcan_write_fd(pcan, message);
+    }
+    else if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        return CAN_ERROR_ILLOPERATION;
+    }
+
+    pcan_message.ID      = message->id & CAN_ID_MASK;
+    pcan_message.MSGTYPE = (0 != (message->id & CAN_ID_EXTENDED)) ? PCAN_MESSAGE_EXTENDED : PCAN_MESSAGE_STANDARD;
+    pcan_message.LEN     = SDL_min(message->length, CAN_MAX_DATA_LENGTH);
+
+    SDL_memcpy(pcan_message.DATA, message->data, sizeof(pcan_message.DATA));
+
+    return (Uint32)CAN_Write(pcan->channel, &pcan_message);
+}
+
+static Uint32 pcan_read(void* handle, can_message_t* message)
+{
+    pcan_t*        pcan         = handle;
+    Uint32         can_status;
+    TPCANMsg       pcan_message = { 0 };
+    TPCANTimestamp timestamp    = { 0 };
+
+    if (SDL_TRUE == pcan->is_fd)
+    {
+        return pcan_read_fd(pcan, message);
+    }
+
+    can_status = CAN_Read(pcan->channel, &pcan_message, &timestamp);
+
+    message->id           = pcan_message.ID;
+    message->length       = pcan_message.LEN;
+    message->flags        = 0;
+    message->timestamp_us = convert_timestamp(&timestamp);
+
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_EXTENDED))
+    {
+        message->id |= CAN_ID_EXTENDED;
+    }
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_ERRFRAME))
+    {
+        message->flags |= CAN_FLAG_ERROR;
+    }
+
+    SDL_memcpy(message->data, pcan_message.DATA, sizeof(pcan_message.DATA));
+
+    return can_status;
+}
+
+/* PCAN-Basic has no vectored I/O, so the batch functions call
+ * CAN_Write() and CAN_Read() once per frame.  No lock is taken: a
+ * channel is only written by its transmit thread and only read by its
+ * receive thread.
+ */
+static Uint32 pcan_write_batch(void* handle, can_message_t* messages, int count, int* written)
+{
+    Uint32 can_status = CAN_OK;
+
+    for (*written = 0; *written < count; *written += 1)
+    {
+        can_status = pcan_write(handle, &messages[*written]);
+        if (CAN_OK != can_status)
+        {
+            break;
+        }
+    }
+
+    return can_status;
+}
+
+static Uint32 pcan_read_batch(void* handle, can_message_t* messages, int count, int* read)
+{
+    Uint32 can_status = CAN_OK;
+
+    for (*read = 0; *read < count; *read += 1)
+    {
+        can_status = pcan_read(handle, &messages[*read]);
+        if (CAN_OK != can_status)
+        {
+            break;
+        }
+    }
+
+    if (*read > 0)
+    {
+        return CAN_OK;
+    }
+
+    return can_status;
+}
+
+static Uint32 pcan_wait(void* handle, Uint32 timeout_ms)
+{
+    pcan_t* pcan = handle;
+
+#ifdef _WIN32
+    if (NULL == pcan->receive_event)
+    {
+        SDL_Delay(1);
+        return CAN_OK;
+    }
+
+    if (WAIT_OBJECT_0 == WaitForSingleObject(pcan->receive_event, timeout_ms))
+    {
+        return CAN_OK;
+    }
+#else
+    struct pollfd fds;
+
+    if (pcan->receive_fd < 0)
+    {
+        SDL_Delay(1);
+        return CAN_OK;
+    }
+
+    fds.fd      = pcan->receive_fd;
+    fds.events  = POLLIN;
+    fds.revents = 0;
+
+    if (poll(&fds, 1, (int)timeout_ms) > 0)
+    {
+        return CAN_OK;
+    }
+#endif
+
+    return CAN_ERROR_QRCVEMPTY;
+}
+
+static Uint32 pcan_get_status(void* handle)
+{
+    pcan_t* pcan = handle;
+
+    return (Uint32)CAN_GetStatus(pcan->channel);
+}
+
+/* The PCAN filter is a set of identifier ranges.  It is closed first
+ * and then extended by one range per run of consecutive identifiers.
+ */
+static Uint32 pcan_set_filter(void* handle, const Uint32* ids, int count)
+{
+    pcan_t*     pcan   = handle;
+    BYTE        filter = (count < 0) ? PCAN_FILTER_OPEN : PCAN_FILTER_CLOSE;
+    TPCANStatus can_status;
+    int         index  = 0;
+
+    can_status = CAN_SetValue(pcan->channel, PCAN_MESSAGE_FILTER, &filter, sizeof(filter));
+
+    while ((PCAN_ERROR_OK == can_status) && (index < count))
+    {
+        Uint32    from = ids[index];
+        Uint32    to   = from;
+        TPCANMode mode = (0 != (from & CAN_ID_EXTENDED)) ? PCAN_MODE_EXTENDED : PCAN_MODE_STANDARD;
+
+        while (((index + 1) < count) && ((to + 1) == ids[index + 1]))
+        {
+            index += 1;
+            to    += 1;
+        }
+
+        can_status = CAN_FilterMessages(pcan->channel, from & CAN_ID_MASK, to & CAN_ID_MASK, mode);
+        index     += 1;
+    }
+
+    return (Uint32)can_status;
+}
+
+static void pcan_get_error_text(Uint32 can_status, char* text, size_t size)
+{
+    char err_message[256] = { 0 };
+
+    CAN_GetErrorText(can_status, 0x09, err_message);
+    SDL_strlcpy(text, err_message, size);
+}
+
+static Uint32 pcan_write_fd(pcan_t* pcan, can_message_t* message)
+{
+    TPCANMsgFD pcan_message = { 0 };
+    Uint8      length       = can_get_fd_length(SDL_min(message->length, CANFD_MAX_DATA_LENGTH));
+
+    pcan_message.ID      = message->id & CAN_ID_MASK;
+    pcan_message.MSGTYPE = (0 != (message->id & CAN_ID_EXTENDED)) ? PCAN_MESSAGE_EXTENDED : PCAN_MESSAGE_STANDARD;
+    pcan_message.DLC     = convert_length_to_dlc(length);
+
+    if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        pcan_message.MSGTYPE |= PCAN_MESSAGE_FD;
+
+        if (0 != (message->flags & CAN_FLAG_BRS))
+        {
+            pcan_message.MSGTYPE |= PCAN_MESSAGE_BRS;
+        }
+    }
+    else if (length > CAN_MAX_DATA_LENGTH)
+    {
+        return CAN_ERROR_ILLPARAMVAL;
+    }
+
+    SDL_memcpy(pcan_message.DATA, message->data, length);
+
+    return (Uint32)CAN_WriteFD(pcan->channel, &pcan_message);
+}
+
+static Uint32 pcan_read_fd(pcan_t* pcan, can_message_t* message)
+{
+    Uint32           can_status;
+    TPCANMsgFD       pcan_message = { 0 };
+    TPCANTimestampFD timestamp    = 0;
+
+    can_status = CAN_ReadFD(pcan->channel, &pcan_message, &timestamp);
+
+    message->id           = pcan_message.ID;
+    message->length       = convert_dlc_to_length(pcan_message.DLC);
+    message->flags        = 0;
+    message->timestamp_us = (Uint64)timestamp;
+
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_EXTENDED))
+    {
+        message->id |= CAN_ID_EXTENDED;
+    }
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_FD))
+    {
+        message->flags |= CAN_FLAG_FD;
+    }
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_BRS))
+    {
+        message->flags |= CAN_FLAG_BRS;
+    }
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_ESI))
+    {
+        message->flags |= CAN_FLAG_ESI;
+    }
+    if (0 != (pcan_message.MSGTYPE & PCAN_MESSAGE_ERRFRAME))
+    {
+        message->flags |= CAN_FLAG_ERROR;
+    }
+
+    SDL_memcpy(message->data, pcan_message.DATA, message->length);
+
+    return can_status;
+}
+
+/* The hardware timestamp is split into a 32-bit millisecond counter,
+ * its overflow count and the microseconds within the current
+ * millisecond.
+ */
+static Uint64 convert_timestamp(const TPCANTimestamp* timestamp)
+{
+    Uint64 millis = ((Uint64)timestamp->millis_overflow << 32) | (Uint64)timestamp->millis;
+
+    return (millis * 1000) + (Uint64)timestamp->micros;
+}
+
+static Uint8 convert_length_to_dlc(Uint8 length)
+{
+    switch (length)
+    {
+        case 12:
+            return 9;
+        case 16:
+            return 10;
+        case 20:
+            return 11;
+        case 24:
+            return 12;
+        case 32:
+            return 13;
+        case 48:
+            return 14;
+        case 64:
+            return 15;
+        default:
+            return SDL_min(length, 8);
+    }
+}
+
+static Uint8 convert_dlc_to_length(Uint8 dlc)
+{
+    static const Uint8 length[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+
+    return length[dlc & 0x0f];
+}
+
+/* CAN FD bit rates are given as a timing string.  All timings are
+ * based on an 80 MHz clock with a sample point of 80% in the
+ * arbitration phase and 75% in the data phase.
+ */
+static void get_bit_rate_fd(Uint8 baud_rate, Uint8 data_baud_rate, char* bit_rate, size_t size)
+{
+    // Prescaler and time quanta per bit, indexed by the baud rate command.
+    static const int nom_brp[14]  = { 1,  1,   1,   2,   4,   5,   6,   6,   10,  12,  15,  25,  50,  100 };
+    static const int nom_tq[14]   = { 80, 100, 160, 160, 160, 160, 140, 160, 160, 140, 160, 160, 160, 160 };
+    static const int data_brp[6]  = { 1,  2,  1,  1,  1,  1  };
+    static const int data_tq[6]   = { 40, 40, 40, 20, 16, 10 };
+    int              nom_tseg2;
+    int              data_tseg2;
+
+    if (baud_rate > 13)
+    {
+        baud_rate = 3;
+    }
+
+    if (data_baud_rate > 5)
+    {
+        data_baud_rate = 2;
+    }
+
+    nom_tseg2  = nom_tq[baud_rate] / 5;
+    data_tseg2 = data_tq[data_baud_rate] / 4;
+
+    SDL_snprintf(bit_rate, size,
+                 "f_clock_mhz=%d, nom_brp=%d, nom_tseg1=%d, nom_tseg2=%d, nom_sjw=%d, "
+                 "data_brp=%d, data_tseg1=%d, data_tseg2=%d, data_sjw=%d",
+                 PCAN_FD_CLOCK_MHZ,
+                 nom_brp[baud_rate],
+                 nom_tq[baud_rate] - nom_tseg2 - 1,
+                 nom_tseg2,
+                 nom_tseg2,
+                 data_brp[data_baud_rate],
+                 data_tq[data_baud_rate] - data_tseg2 - 1,
+                 data_tseg2,
+                 data_tseg2);
+}
+
+static TPCANHandle get_channel(const char* interface)
+{
+    long index;
+
+    if (0 != SDL_strncmp(interface, "usb", 3))
+    {
+        return PCAN_NONEBUS;
+    }
+
+    index = SDL_strtol(&interface[3], NULL, 10);
+
+    if ((index >= 1) && (index <= 8))
+    {
+        return (TPCANHandle)(PCAN_USBBUS1 + (index - 1));
+    }
+    else if ((index >= 9) && (index <= 16))
+    {
+        return (TPCANHandle)(0x509 + (index - 9));
+    }
+
+    return PCAN_NONEBUS;
+}
+
+static TPCANBaudrate get_baud_rate(Uint8 baud_rate)
+{
+    switch (baud_rate)
+    {
+        case 0:
+            return PCAN_BAUD_1M;
+        case 1:
+            return PCAN_BAUD_800K;
+        case 2:
+            return PCAN_BAUD_500K;
+        case 3:
+        default:
+            return PCAN_BAUD_250K;
+        case 4:
+            return PCAN_BAUD_125K;
+        case 5:
+            return PCAN_BAUD_100K;
+        case 6:
+            return PCAN_BAUD_95K;
+        case 7:
+            return PCAN_BAUD_83K;
+        case 8:
+            return PCAN_BAUD_50K;
+        case 9:
+            return PCAN_BAUD_47K;
+        case 10:
+            return PCAN_BAUD_33K;
+        case 11:
+            return PCAN_BAUD_20K;
+        case 12:
+            return PCAN_BAUD_10K;
+        case 13:
+            return PCAN_BAUD_5K;
+    }
+}
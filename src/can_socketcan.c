@@ -0,0 +1,492 @@
+/** @file can_socketcan.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg() and recvmmsg()
+#endif
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include "SDL.h"
+#include "can.h"
+
+#define SOCKETCAN_BATCH_SIZE   64
+#define SOCKETCAN_CONTROL_SIZE CMSG_SPACE(sizeof(struct scm_timestamping))
+
+typedef struct socketcan
+{
+    int  fd;
+    char interface[IFNAMSIZ];
+
+} socketcan_t;
+
+static Uint32 socketcan_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle);
+static void   socketcan_close(void* handle);
+static Uint32 socketcan_write(void* handle, can_message_t* message);
+static Uint32 socketcan_read(void* handle, can_message_t* message);
+static Uint32 socketcan_write_batch(void* handle, can_message_t* messages, int count, int* written);
+static Uint32 socketcan_read_batch(void* handle, can_message_t* messages, int count, int* read);
+static Uint32 socketcan_wait(void* handle, Uint32 timeout_ms);
+static Uint32 socketcan_get_status(void* handle);
+static Uint32 socketcan_set_filter(void* handle, const Uint32* ids, int count);
+static size_t convert_to_frame(const can_message_t* message, struct canfd_frame* frame);
+static void   convert_from_frame(const struct canfd_frame* frame, size_t size, can_message_t* message);
+static void   enable_timestamping(int fd);
+static Uint64 get_timestamp(struct msghdr* msg_hdr);
+static Uint32 convert_errno(int error);
+
+/* The bit rates of a SocketCAN interface are configured by the system,
+ * e.g. via 'ip link set can0 type can bitrate 250000 dbitrate 2000000
+ * fd on', the baud rate settings are therefore ignored.
+ */
+const can_driver_t socketcan_driver =
+{
+    "socketcan",
+    "can0",
+    socketcan_open,
+    socketcan_close,
+    socketcan_write,
+    socketcan_read,
+    socketcan_write_batch,
+    socketcan_read_batch,
+    socketcan_wait,
+    socketcan_get_status,
+    socketcan_set_filter,
+    NULL
+};
+
+static Uint32 socketcan_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle)
+{
+    struct sockaddr_can addr      = { 0 };
+    struct ifreq        ifr       = { 0 };
+    int                 fd_frames = 1;
+    can_err_mask_t      err_mask  = CAN_ERR_PROT | CAN_ERR_ACK | CAN_ERR_BUSERROR;
+    socketcan_t*        socketcan;
+    int                 fd;
+
+    (void)baud_rate;
+    (void)data_baud_rate;
+
+    // Listen-only is a property of the interface, e.g. 'ip link set
+    // can0 type can bitrate 250000 listen-only on'.
+    if (SDL_TRUE == is_listen_only)
+    {
+        return CAN_ERROR_ILLOPERATION;
+    }
+
+    fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0)
+    {
+        return CAN_ERROR_NODRIVER;
+    }
+
+    SDL_strlcpy(ifr.ifr_name, interface, IFNAMSIZ);
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0)
+    {
+        close(fd);
+        return CAN_ERROR_ILLHW;
+    }
+
+    if (0 == (ifr.ifr_flags & IFF_UP))
+    {
+        close(fd);
+        return CAN_ERROR_ILLHW;
+    }
+
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+        close(fd);
+        return CAN_ERROR_ILLHW;
+    }
+
+    enable_timestamping(fd);
+
+    // Fails on interfaces without CAN FD support, which then only
+    // transmit and receive classic frames.
+    setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &fd_frames, sizeof(fd_frames));
+
+    // Error frames are counted by the statistics.  Bus errors are only
+    // reported with 'ip link set can0 type can berr-reporting on'.
+    setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+
+    addr.can_family  = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return convert_errno(errno);
+    }
+
+    socketcan = (socketcan_t*)SDL_calloc(1, sizeof(socketcan_t));
+    if (NULL == socketcan)
+    {
+        close(fd);
+        return CAN_ERROR_RESOURCE;
+    }
+
+    socketcan->fd = fd;
+    SDL_strlcpy(socketcan->interface, interface, IFNAMSIZ);
+    *handle = socketcan;
+
+    return CAN_OK;
+}
+
+static void socketcan_close(void* handle)
+{
+    socketcan_t* socketcan = handle;
+
+    if (NULL == socketcan)
+    {
+        return;
+    }
+
+    close(socketcan->fd);
+    SDL_free(socketcan);
+}
+
+static Uint32 socketcan_write(void* handle, can_message_t* message)
+{
+    int written;
+
+    return socketcan_write_batch(handle, message, 1, &written);
+}
+
+static Uint32 socketcan_read(void* handle, can_message_t* message)
+{
+    int read;
+
+    return socketcan_read_batch(handle, message, 1, &read);
+}
+
+static Uint32 socketcan_write_batch(void* handle, can_message_t* messages, int count, int* written)
+{
+    socketcan_t*       socketcan = handle;
+    struct canfd_frame frame[SOCKETCAN_BATCH_SIZE];
+    struct iovec       iov[SOCKETCAN_BATCH_SIZE];
+    struct mmsghdr     msg[SOCKETCAN_BATCH_SIZE];
+
+    *written = 0;
+
+    while (*written < count)
+    {
+        int chunk = SDL_min(count - *written, SOCKETCAN_BATCH_SIZE);
+        int index;
+        int sent;
+
+        SDL_memset(msg, 0, sizeof(struct mmsghdr) * chunk);
+
+        for (index = 0; index < chunk; index += 1)
+        {
+            iov[index].iov_base            = &frame[index];
+            iov[index].iov_len             = convert_to_frame(&messages[*written + index], &frame[index]);
+            msg[index].msg_hdr.msg_iov    = &iov[index];
+            msg[index].msg_hdr.msg_iovlen = 1;
+        }
+
+        sent = sendmmsg(socketcan->fd, msg, chunk, MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (EAGAIN == errno)
+            {
+                return CAN_ERROR_QXMTFULL;
+            }
+            return convert_errno(errno);
+        }
+
+        *written += sent;
+
+        if (sent < chunk)
+        {
+            return CAN_ERROR_QXMTFULL;
+        }
+    }
+
+    return CAN_OK;
+}
+
+static Uint32 socketcan_read_batch(void* handle, can_message_t* messages, int count, int* read)
+{
+    socketcan_t*       socketcan = handle;
+    struct canfd_frame frame[SOCKETCAN_BATCH_SIZE];
+    struct iovec       iov[SOCKETCAN_BATCH_SIZE];
+    struct mmsghdr     msg[SOCKETCAN_BATCH_SIZE];
+    char               control[SOCKETCAN_BATCH_SIZE][SOCKETCAN_CONTROL_SIZE];
+    int                chunk     = SDL_min(count, SOCKETCAN_BATCH_SIZE);
+    int                received;
+    int                index;
+
+    *read = 0;
+
+    SDL_memset(msg, 0, sizeof(struct mmsghdr) * chunk);
+
+    for (index = 0; index < chunk; index += 1)
+    {
+        iov[index].iov_base                = &frame[index];
+        iov[index].iov_len                 = CANFD_MTU;
+        msg[index].msg_hdr.msg_iov        = &iov[index];
+        msg[index].msg_hdr.msg_iovlen     = 1;
+        msg[index].msg_hdr.msg_control    = control[index];
+        msg[index].msg_hdr.msg_controllen = SOCKETCAN_CONTROL_SIZE;
+    }
+
+    received = recvmmsg(socketcan->fd, msg, chunk, MSG_DONTWAIT, NULL);
+    if (received < 0)
+    {
+        return convert_errno(errno);
+    }
+
+    for (index = 0; index < received; index += 1)
+    {
+        if ((CAN_MTU != msg[index].msg_len) && (CANFD_MTU != msg[index].msg_len))
+        {
+            continue;
+        }
+
+        // Only data and error frames are passed on.
+        if (0 != (frame[index].can_id & CAN_RTR_FLAG))
+        {
+            continue;
+        }
+
+        convert_from_frame(&frame[index], msg[index].msg_len, &messages[*read]);
+        messages[*read].timestamp_us = get_timestamp(&msg[index].msg_hdr);
+
+        if (0 != (frame[index].can_id & CAN_ERR_FLAG))
+        {
+            messages[*read].id     = frame[index].can_id & CAN_ERR_MASK;
+            messages[*read].flags |= CAN_FLAG_ERROR;
+        }
+        *read += 1;
+    }
+
+    if (0 == *read)
+    {
+        return CAN_ERROR_QRCVEMPTY;
+    }
+
+    return CAN_OK;
+}
+
+static Uint32 socketcan_wait(void* handle, Uint32 timeout_ms)
+{
+    socketcan_t*  socketcan = handle;
+    struct pollfd fds;
+
+    fds.fd      = socketcan->fd;
+    fds.events  = POLLIN;
+    fds.revents = 0;
+
+    if (poll(&fds, 1, (int)timeout_ms) > 0)
+    {
+        return CAN_OK;
+    }
+
+    return CAN_ERROR_QRCVEMPTY;
+}
+
+static Uint32 socketcan_get_status(void* handle)
+{
+    socketcan_t* socketcan = handle;
+    struct ifreq ifr       = { 0 };
+
+    SDL_strlcpy(ifr.ifr_name, socketcan->interface, IFNAMSIZ);
+    if (ioctl(socketcan->fd, SIOCGIFFLAGS, &ifr) < 0)
+    {
+        return CAN_ERROR_ILLHW;
+    }
+
+    if (0 == (ifr.ifr_flags & IFF_UP))
+    {
+        return CAN_ERROR_ILLHW;
+    }
+
+    return CAN_OK;
+}
+
+/* The kernel matches every frame against the filter list of the
+ * socket, frames which do not match are not copied to user space.
+ * Remote frames never match, they are dropped by the driver anyway.
+ */
+static Uint32 socketcan_set_filter(void* handle, const Uint32* ids, int count)
+{
+    socketcan_t*      socketcan = handle;
+    struct can_filter filter[CAN_FILTER_MAX] = { { 0 } };
+    int               index;
+
+    if (count < 0)
+    {
+        // A single filter with an empty mask accepts all frames.
+        count = 1;
+    }
+    else
+    {
+        for (index = 0; index < count; index += 1)
+        {
+            if (0 != (ids[index] & CAN_ID_EXTENDED))
+            {
+                filter[index].can_id   = (ids[index] & CAN_EFF_MASK) | CAN_EFF_FLAG;
+                filter[index].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+            }
+            else
+            {
+                filter[index].can_id   = ids[index] & CAN_SFF_MASK;
+                filter[index].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+            }
+        }
+    }
+
+    if (setsockopt(socketcan->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filter, (socklen_t)(count * sizeof(struct can_filter))) < 0)
+    {
+        return convert_errno(errno);
+    }
+
+    return CAN_OK;
+}
+
+/* Classic frames share the layout of the first CAN_MTU bytes of a
+ * CAN FD frame, the size passed to the socket tells them apart.
+ */
+static size_t convert_to_frame(const can_message_t* message, struct canfd_frame* frame)
+{
+    SDL_zerop(frame);
+
+    if (0 != (message->id & CAN_ID_EXTENDED))
+    {
+        frame->can_id = (message->id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    }
+    else
+    {
+        frame->can_id = message->id & CAN_SFF_MASK;
+    }
+
+    if (0 == (message->flags & CAN_FLAG_FD))
+    {
+        frame->len = SDL_min(message->length, CAN_MAX_DLEN);
+        SDL_memcpy(frame->data, message->data, CAN_MAX_DLEN);
+
+        return CAN_MTU;
+    }
+
+    frame->len = can_get_fd_length(SDL_min(message->length, CANFD_MAX_DLEN));
+    if (0 != (message->flags & CAN_FLAG_BRS))
+    {
+        frame->flags |= CANFD_BRS;
+    }
+    SDL_memcpy(frame->data, message->data, frame->len);
+
+    return CANFD_MTU;
+}
+
+static void convert_from_frame(const struct canfd_frame* frame, size_t size, can_message_t* message)
+{
+    if (0 != (frame->can_id & CAN_EFF_FLAG))
+    {
+        message->id = (frame->can_id & CAN_EFF_MASK) | CAN_ID_EXTENDED;
+    }
+    else
+    {
+        message->id = frame->can_id & CAN_SFF_MASK;
+    }
+
+    message->length = SDL_min(frame->len, CANFD_MAX_DLEN);
+    message->flags  = 0;
+
+    if (CANFD_MTU == size)
+    {
+        message->flags |= CAN_FLAG_FD;
+
+        if (0 != (frame->flags & CANFD_BRS))
+        {
+            message->flags |= CAN_FLAG_BRS;
+        }
+        if (0 != (frame->flags & CANFD_ESI))
+        {
+            message->flags |= CAN_FLAG_ESI;
+        }
+    }
+
+    SDL_memcpy(message->data, frame->data, message->length);
+}
+
+/* Hardware timestamps are preferred, if the controller does not
+ * provide them the kernel stamps the frame on arrival.  A timestamp of
+ * zero lets the caller fall back to the host clock.
+ */
+static void enable_timestamping(int fd)
+{
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+static Uint64 get_timestamp(struct msghdr* msg_hdr)
+{
+    struct cmsghdr* cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg_hdr); NULL != cmsg; cmsg = CMSG_NXTHDR(msg_hdr, cmsg))
+    {
+        struct scm_timestamping timestamping;
+        struct timespec*        ts;
+
+        if ((SOL_SOCKET != cmsg->cmsg_level) || (SCM_TIMESTAMPING != cmsg->cmsg_type))
+        {
+            continue;
+        }
+
+        SDL_memcpy(&timestamping, CMSG_DATA(cmsg), sizeof(timestamping));
+
+        // ts[2] holds the raw hardware timestamp, ts[0] the software one.
+        ts = &timestamping.ts[2];
+        if ((0 == ts->tv_sec) && (0 == ts->tv_nsec))
+        {
+            ts = &timestamping.ts[0];
+        }
+
+        return ((Uint64)ts->tv_sec * 1000000) + ((Uint64)ts->tv_nsec / 1000);
+    }
+
+    return 0;
+}
+
+static Uint32 convert_errno(int error)
+{
+    switch (error)
+    {
+        case EAGAIN:
+            return CAN_ERROR_QRCVEMPTY;
+        case ENOBUFS:
+            return CAN_ERROR_QXMTFULL;
+        case ENETDOWN:
+        case ENODEV:
+        case ENXIO:
+            return CAN_ERROR_ILLHW;
+        case ENOMEM:
+            return CAN_ERROR_RESOURCE;
+        case EINVAL:
+            return CAN_ERROR_ILLPARAMVAL;
+        default:
+            return CAN_ERROR_UNKNOWN;
+    }
+}
+
+#endif /* __linux__ */
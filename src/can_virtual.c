@@ -0,0 +1,389 @@
+/** @file can_virtual.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "can.h"
+
+#define VIRTUAL_BUS_MAX      8
+#define VIRTUAL_ENDPOINT_MAX 8
+#define VIRTUAL_QUEUE_SIZE   1024 // Must be a power of two.
+
+struct virtual_bus;
+
+typedef struct virtual_endpoint
+{
+    struct virtual_bus* bus;
+    can_message_t       queue[VIRTUAL_QUEUE_SIZE];
+    Uint32              head;
+    Uint32              tail;
+    Uint32              can_status;
+    Uint8               baud_rate;
+    SDL_bool            is_fd;
+    SDL_bool            is_listen_only;
+    SDL_bool            is_filtered;
+    Uint8               filter_standard[2048 / 8];
+    Uint32              filter_extended[CAN_FILTER_MAX];
+    int                 filter_extended_count;
+    SDL_sem*            receive_event;
+
+} virtual_endpoint_t;
+
+typedef struct virtual_bus
+{
+    char                name[16];
+    virtual_endpoint_t* endpoint[VIRTUAL_ENDPOINT_MAX];
+    int                 endpoint_count;
+
+} virtual_bus_t;
+
+static virtual_bus_t bus[VIRTUAL_BUS_MAX];
+static SDL_SpinLock  bus_lock;
+
+static Uint32 virtual_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle);
+static void   virtual_close(void* handle);
+static Uint32 virtual_write(void* handle, can_message_t* message);
+static Uint32 virtual_read(void* handle, can_message_t* message);
+static Uint32 virtual_write_batch(void* handle, can_message_t* messages, int count, int* written);
+static Uint32 virtual_read_batch(void* handle, can_message_t* messages, int count, int* read);
+static Uint32 virtual_wait(void* handle, Uint32 timeout_ms);
+static Uint32 virtual_get_status(void* handle);
+static Uint32 virtual_set_filter(void* handle, const Uint32* ids, int count);
+static SDL_bool is_accepted(const virtual_endpoint_t* endpoint, Uint32 can_id);
+static void     push_message(virtual_endpoint_t* receiver, const can_message_t* message, Uint64 timestamp_us);
+
+/* Every endpoint opened on the same interface name is attached to the
+ * same in-process bus.  Frames written by one endpoint are delivered
+ * to all other endpoints of that bus.  Endpoints opened with another
+ * baud rate than the sender receive an error frame instead, which
+ * allows testing the bit rate detection.
+ */
+const can_driver_t virtual_driver =
+{
+    "virtual",
+    "vcan0",
+    virtual_open,
+    virtual_close,
+    virtual_write,
+    virtual_read,
+    virtual_write_batch,
+    virtual_read_batch,
+    virtual_wait,
+    virtual_get_status,
+    virtual_set_filter,
+    NULL
+};
+
+static Uint32 virtual_open(const char* interface, Uint8 baud_rate, Uint8 data_baud_rate, SDL_bool is_listen_only, void** handle)
+{
+    virtual_bus_t*      vbus = NULL;
+    virtual_endpoint_t* endpoint;
+    int                 index;
+
+    endpoint = (virtual_endpoint_t*)SDL_calloc(1, sizeof(virtual_endpoint_t));
+    if (NULL == endpoint)
+    {
+        return CAN_ERROR_RESOURCE;
+    }
+
+    endpoint->receive_event = SDL_CreateSemaphore(0);
+    if (NULL == endpoint->receive_event)
+    {
+        SDL_free(endpoint);
+        return CAN_ERROR_RESOURCE;
+    }
+
+    endpoint->baud_rate      = baud_rate;
+    endpoint->is_fd          = (0 == data_baud_rate) ? SDL_FALSE : SDL_TRUE;
+    endpoint->is_listen_only = is_listen_only;
+
+    SDL_AtomicLock(&bus_lock);
+
+    for (index = 0; index < VIRTUAL_BUS_MAX; index += 1)
+    {
+        if ((bus[index].endpoint_count > 0) && (0 == SDL_strcmp(bus[index].name, interface)))
+        {
+            vbus = &bus[index];
+            break;
+        }
+    }
+
+    if (NULL == vbus)
+    {
+        for (index = 0; index < VIRTUAL_BUS_MAX; index += 1)
+        {
+            if (0 == bus[index].endpoint_count)
+            {
+                vbus = &bus[index];
+                SDL_strlcpy(vbus->name, interface, sizeof(vbus->name));
+                break;
+            }
+        }
+    }
+
+    if ((NULL == vbus) || (VIRTUAL_ENDPOINT_MAX == vbus->endpoint_count))
+    {
+        SDL_AtomicUnlock(&bus_lock);
+        SDL_DestroySemaphore(endpoint->receive_event);
+        SDL_free(endpoint);
+        return CAN_ERROR_RESOURCE;
+    }
+
+    endpoint->bus = vbus;
+    vbus->endpoint[vbus->endpoint_count] = endpoint;
+    vbus->endpoint_count += 1;
+
+    SDL_AtomicUnlock(&bus_lock);
+
+    *handle = endpoint;
+    return CAN_OK;
+}
+
+static void virtual_close(void* handle)
+{
+    virtual_endpoint_t* endpoint = handle;
+    virtual_bus_t*      vbus;
+    int                 index;
+
+    if (NULL == endpoint)
+    {
+        return;
+    }
+
+    SDL_AtomicLock(&bus_lock);
+
+    vbus = endpoint->bus;
+    for (index = 0; index < vbus->endpoint_count; index += 1)
+    {
+        if (endpoint == vbus->endpoint[index])
+        {
+            vbus->endpoint_count -= 1;
+            vbus->endpoint[index] = vbus->endpoint[vbus->endpoint_count];
+            vbus->endpoint[vbus->endpoint_count] = NULL;
+            break;
+        }
+    }
+
+    SDL_AtomicUnlock(&bus_lock);
+    SDL_DestroySemaphore(endpoint->receive_event);
+    SDL_free(endpoint);
+}
+
+static Uint32 virtual_write(void* handle, can_message_t* message)
+{
+    int written;
+
+    return virtual_write_batch(handle, message, 1, &written);
+}
+
+static Uint32 virtual_read(void* handle, can_message_t* message)
+{
+    int read;
+
+    return virtual_read_batch(handle, message, 1, &read);
+}
+
+static Uint32 virtual_write_batch(void* handle, can_message_t* messages, int count, int* written)
+{
+    virtual_endpoint_t* endpoint     = handle;
+    virtual_bus_t*      vbus         = endpoint->bus;
+    Uint64              timestamp_us = can_get_time_us();
+    int                 index;
+
+    if (SDL_TRUE == endpoint->is_listen_only)
+    {
+        *written = 0;
+        return CAN_ERROR_ILLOPERATION;
+    }
+
+    // Only endpoints opened with a data bit rate may send CAN FD frames.
+    if (SDL_FALSE == endpoint->is_fd)
+    {
+        for (index = 0; index < count; index += 1)
+        {
+            if (0 != (messages[index].flags & CAN_FLAG_FD))
+            {
+                *written = 0;
+                return CAN_ERROR_ILLOPERATION;
+            }
+        }
+    }
+
+    SDL_AtomicLock(&bus_lock);
+
+    for (index = 0; index < vbus->endpoint_count; index += 1)
+    {
+        virtual_endpoint_t* receiver = vbus->endpoint[index];
+        SDL_bool            is_empty;
+        int                 message_index;
+
+        if (endpoint == receiver)
+        {
+            continue;
+        }
+
+        is_empty = (receiver->head == receiver->tail) ? SDL_TRUE : SDL_FALSE;
+
+        if (receiver->baud_rate != endpoint->baud_rate)
+        {
+            can_message_t error_frame = { 0 };
+
+            error_frame.flags = CAN_FLAG_ERROR;
+            push_message(receiver, &error_frame, timestamp_us);
+        }
+        else
+        {
+            for (message_index = 0; message_index < count; message_index += 1)
+            {
+                if (SDL_TRUE == is_accepted(receiver, messages[message_index].id))
+                {
+                    push_message(receiver, &messages[message_index], timestamp_us);
+                }
+            }
+        }
+
+        // Only signal the transition from empty to non-empty, the
+        // receiver drains its queue completely before waiting again.
+        if ((SDL_TRUE == is_empty) && (receiver->head != receiver->tail))
+        {
+            SDL_SemPost(receiver->receive_event);
+        }
+    }
+
+    SDL_AtomicUnlock(&bus_lock);
+
+    *written = count;
+    return CAN_OK;
+}
+
+static Uint32 virtual_read_batch(void* handle, can_message_t* messages, int count, int* read)
+{
+    virtual_endpoint_t* endpoint = handle;
+
+    SDL_AtomicLock(&bus_lock);
+
+    for (*read = 0; *read < count; *read += 1)
+    {
+        if (endpoint->head == endpoint->tail)
+        {
+            break;
+        }
+
+        messages[*read] = endpoint->queue[endpoint->tail & (VIRTUAL_QUEUE_SIZE - 1)];
+        endpoint->tail += 1;
+    }
+
+    SDL_AtomicUnlock(&bus_lock);
+
+    if (0 == *read)
+    {
+        return CAN_ERROR_QRCVEMPTY;
+    }
+
+    return CAN_OK;
+}
+
+static Uint32 virtual_wait(void* handle, Uint32 timeout_ms)
+{
+    virtual_endpoint_t* endpoint = handle;
+
+    if (0 == SDL_SemWaitTimeout(endpoint->receive_event, timeout_ms))
+    {
+        return CAN_OK;
+    }
+
+    return CAN_ERROR_QRCVEMPTY;
+}
+
+static Uint32 virtual_get_status(void* handle)
+{
+    virtual_endpoint_t* endpoint = handle;
+    Uint32              can_status;
+
+    SDL_AtomicLock(&bus_lock);
+    can_status           = endpoint->can_status;
+    endpoint->can_status = CAN_OK;
+    SDL_AtomicUnlock(&bus_lock);
+
+    return can_status;
+}
+
+static Uint32 virtual_set_filter(void* handle, const Uint32* ids, int count)
+{
+    virtual_endpoint_t* endpoint = handle;
+    int                 index;
+
+    SDL_AtomicLock(&bus_lock);
+
+    SDL_zeroa(endpoint->filter_standard);
+    endpoint->filter_extended_count = 0;
+    endpoint->is_filtered           = (count < 0) ? SDL_FALSE : SDL_TRUE;
+
+    for (index = 0; index < count; index += 1)
+    {
+        Uint32 can_id = ids[index];
+
+        if (0 != (can_id & CAN_ID_EXTENDED))
+        {
+            if (endpoint->filter_extended_count < CAN_FILTER_MAX)
+            {
+                endpoint->filter_extended[endpoint->filter_extended_count] = can_id;
+                endpoint->filter_extended_count += 1;
+            }
+        }
+        else if (can_id < 2048)
+        {
+            endpoint->filter_standard[can_id / 8] |= (Uint8)(1 << (can_id % 8));
+        }
+    }
+
+    SDL_AtomicUnlock(&bus_lock);
+
+    return CAN_OK;
+}
+
+// Must be called with the bus lock held.
+static void push_message(virtual_endpoint_t* receiver, const can_message_t* message, Uint64 timestamp_us)
+{
+    if ((receiver->head - receiver->tail) >= VIRTUAL_QUEUE_SIZE)
+    {
+        receiver->can_status |= CAN_ERROR_QOVERRUN;
+        return;
+    }
+
+    // The frame is on the bus the moment it is written.
+    receiver->queue[receiver->head & (VIRTUAL_QUEUE_SIZE - 1)]              = *message;
+    receiver->queue[receiver->head & (VIRTUAL_QUEUE_SIZE - 1)].timestamp_us = timestamp_us;
+    receiver->head += 1;
+}
+
+// Must be called with the bus lock held.
+static SDL_bool is_accepted(const virtual_endpoint_t* endpoint, Uint32 can_id)
+{
+    int index;
+
+    if (SDL_FALSE == endpoint->is_filtered)
+    {
+        return SDL_TRUE;
+    }
+
+    if (0 == (can_id & CAN_ID_EXTENDED))
+    {
+        return (0 != (endpoint->filter_standard[(can_id & 0x7ff) / 8] & (1 << (can_id % 8)))) ? SDL_TRUE : SDL_FALSE;
+    }
+
+    for (index = 0; index < endpoint->filter_extended_count; index += 1)
+    {
+        if (can_id == endpoint->filter_extended[index])
+        {
+            return SDL_TRUE;
+        }
+    }
+
+    return SDL_FALSE;
+}
@@ -13,12 +13,18 @@
 #include "core.h"
 #include "command.h"
 #include "gui.h"
+#include "monitor.h"
 #include "nmt_client.h"
+#include "pcapng.h"
 #include "pdo.h"
 #include "printf.h"
+#include "replay.h"
 #include "scripts.h"
 #include "sdo_client.h"
+#include "stats.h"
 #include "table.h"
+#include "trace.h"
+#include "trace_convert.h"
 
 #ifdef _WIN32
 #  define CLEAR_CMD "cls"
@@ -46,6 +52,78 @@ void parse_command(char* input, core_t* core)
     {
         return;
     }
+    else if (0 == SDL_strncmp(token, "bl", 2))
+    {
+        Uint32 value[3];
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            sdo_print_block_settings();
+        }
+        else if (0 == SDL_strncmp(token, "size", 4))
+        {
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL == token)
+            {
+                print_usage_information(SDL_TRUE);
+                return;
+            }
+
+            convert_token_to_uint(token, &value[0]);
+            sdo_set_block_size((Uint8)SDL_min(value[0], 0xff));
+            sdo_print_block_settings();
+        }
+        else if (0 == SDL_strncmp(token, "threshold", 9))
+        {
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL == token)
+            {
+                print_usage_information(SDL_TRUE);
+                return;
+            }
+
+            convert_token_to_uint(token, &value[0]);
+            sdo_set_block_threshold((Uint8)SDL_min(value[0], 0xff));
+            sdo_print_block_settings();
+        }
+        else if ((0 == SDL_strncmp(token, "up", 2)) || (0 == SDL_strncmp(token, "down", 4)))
+        {
+            SDL_bool is_upload = ('u' == token[0]) ? SDL_TRUE : SDL_FALSE;
+
+            // Node-ID, index and sub-index, then the file name.
+            for (index = 0; index < 3; index += 1)
+            {
+                token = SDL_strtokr(input_savptr, delim, &input_savptr);
+                if (NULL == token)
+                {
+                    print_usage_information(SDL_TRUE);
+                    return;
+                }
+                convert_token_to_uint(token, &value[index]);
+            }
+
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL == token)
+            {
+                print_usage_information(SDL_TRUE);
+                return;
+            }
+
+            if (SDL_TRUE == is_upload)
+            {
+                sdo_block_upload_file(core->channel, (Uint8)value[0], (Uint16)value[1], (Uint8)value[2], token);
+            }
+            else
+            {
+                sdo_block_download_file(core->channel, (Uint8)value[0], (Uint16)value[1], (Uint8)value[2], token);
+            }
+        }
+        else
+        {
+            print_usage_information(SDL_TRUE);
+        }
+    }
     else if (0 == SDL_strncmp(token, "b", 1))
     {
         Uint32 command;
@@ -56,6 +134,11 @@ void parse_command(char* input, core_t* core)
             can_print_baud_rate_help(core);
             return;
         }
+        else if (0 == SDL_strncmp(token, "a", 1))
+        {
+            can_detect_baud_rate(core->channel, core);
+            return;
+        }
         else
         {
             convert_token_to_uint(token, &command);
@@ -68,9 +151,41 @@ void parse_command(char* input, core_t* core)
         }
         else
         {
-            can_set_baud_rate(command, core);
+            can_set_baud_rate(core->channel, command, core);
         }
     }
+    else if (0 == SDL_strncmp(token, "ch", 2))
+    {
+        Uint32 channel;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            can_print_channel_help(core);
+            return;
+        }
+        else
+        {
+            convert_token_to_uint(token, &channel);
+        }
+
+        can_set_channel((Uint8)channel, core);
+    }
+    else if (0 == SDL_strncmp(token, "cv", 2))
+    {
+        char* input_name;
+        char* output_name;
+
+        input_name  = SDL_strtokr(input_savptr, delim, &input_savptr);
+        output_name = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if ((NULL == input_name) || (NULL == output_name))
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
+
+        trace_convert(input_name, output_name);
+    }
     else if (0 == SDL_strncmp(token, "c", 1))
     {
         if (0 != system(CLEAR_CMD))
@@ -78,6 +193,49 @@ void parse_command(char* input, core_t* core)
             c_log(LOG_WARNING, "Could not clear screen");
         }
     }
+    else if (0 == SDL_strncmp(token, "d", 1))
+    {
+        char* driver;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            can_print_driver_help(core);
+            return;
+        }
+        else
+        {
+            driver = token;
+        }
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        can_set_driver(core->channel, driver, token, core);
+    }
+    else if (0 == SDL_strncmp(token, "f", 1))
+    {
+        Uint32 command;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            can_print_data_baud_rate_help(core);
+            return;
+        }
+        else
+        {
+            convert_token_to_uint(token, &command);
+        }
+
+        if (command > 5)
+        {
+            can_print_data_baud_rate_help(core);
+            return;
+        }
+        else
+        {
+            can_set_data_baud_rate(core->channel, command, core);
+        }
+    }
     else if (0 == SDL_strncmp(token, "q", 1))
     {
         core->is_running = SDL_FALSE;
@@ -137,12 +295,99 @@ void parse_command(char* input, core_t* core)
                 convert_token_to_uint(token, &command);
             }
         }
-        nmt_send_command((Uint16)node_id, (Uint8)command);
+        nmt_send_command(core->channel, (Uint8)node_id, (Uint8)command);
+    }
+    else if (0 == SDL_strncmp(token, "i", 1))
+    {
+        can_print_status(core);
+    }
+    else if (0 == SDL_strncmp(token, "lg", 2))
+    {
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            c_log_print_status();
+        }
+        else if (0 == SDL_strncmp(token, "level", 5))
+        {
+            log_level_t level;
+
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (SDL_FALSE == c_log_parse_level(token, &level))
+            {
+                print_usage_information(SDL_FALSE);
+                return;
+            }
+            c_log_set_level(level);
+        }
+        else if (0 == SDL_strncmp(token, "open", 4))
+        {
+            char*  file_name;
+            Uint32 size_kib = LOG_FILE_SIZE_IN_KIB;
+            Uint32 count    = LOG_FILE_COUNT;
+
+            file_name = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL == file_name)
+            {
+                print_usage_information(SDL_FALSE);
+                return;
+            }
+
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL != token)
+            {
+                convert_token_to_uint(token, &size_kib);
+
+                token = SDL_strtokr(input_savptr, delim, &input_savptr);
+                if (NULL != token)
+                {
+                    convert_token_to_uint(token, &count);
+                }
+            }
+
+            c_log_open(file_name, size_kib, (int)count, LOG_INFO);
+        }
+        else if (0 == SDL_strncmp(token, "close", 5))
+        {
+            c_log_close();
+        }
+        else
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
     }
     else if (0 == SDL_strncmp(token, "l", 1))
     {
         list_scripts();
     }
+    else if (0 == SDL_strncmp(token, "m", 1))
+    {
+        monitor_run(core);
+    }
+    else if (0 == SDL_strncmp(token, "pc", 2))
+    {
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            pcapng_print_status();
+        }
+        else if (0 == SDL_strncmp(token, "start", 5))
+        {
+            // The file name is optional.
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            pcapng_start(token);
+        }
+        else if (0 == SDL_strncmp(token, "stop", 4))
+        {
+            pcapng_stop();
+        }
+        else
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
+    }
     else if (0 == SDL_strncmp(token, "p", 1))
     {
         Uint32 can_id;
@@ -209,14 +454,14 @@ void parse_command(char* input, core_t* core)
                 return;
             }
 
-            if (SDL_FALSE == is_can_initialised(core))
+            if (SDL_FALSE == is_can_initialised(core->channel, core))
             {
                 c_log(LOG_WARNING, "Could not add PDO: CAN not initialised");
                 return;
             }
             else
             {
-                pdo_add((Uint16)can_id, event_time_ms, length, data);
+                pdo_add(core->channel, (Uint16)can_id, event_time_ms, length, data);
             }
         }
         else if (0 == SDL_strncmp(token, "del", 3))
@@ -238,14 +483,14 @@ void parse_command(char* input, core_t* core)
                 return;
             }
 
-            if (SDL_FALSE == is_can_initialised(core))
+            if (SDL_FALSE == is_can_initialised(core->channel, core))
             {
                 c_log(LOG_WARNING, "Could not delete PDO: CAN not initialised");
                 return;
             }
             else
             {
-                pdo_del((Uint16)can_id);
+                pdo_del(core->channel, (Uint16)can_id);
             }
         }
         else
@@ -254,12 +499,85 @@ void parse_command(char* input, core_t* core)
             return;
         }
     }
+    else if (0 == SDL_strncmp(token, "rp", 2))
+    {
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            replay_print_status();
+        }
+        else if (0 == SDL_strncmp(token, "start", 5))
+        {
+            char*    file_name;
+            float    speed     = 1.0f;
+            SDL_bool is_looped = SDL_FALSE;
+            double   from_s    = 0.0;
+
+            file_name = SDL_strtokr(input_savptr, delim, &input_savptr);
+            if (NULL == file_name)
+            {
+                print_usage_information(SDL_FALSE);
+                return;
+            }
+
+            // Speed, loop and start time are optional.
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            while (NULL != token)
+            {
+                if (0 == SDL_strncmp(token, "loop", 4))
+                {
+                    is_looped = SDL_TRUE;
+                }
+                else if (0 == SDL_strncmp(token, "from", 4))
+                {
+                    token = SDL_strtokr(input_savptr, delim, &input_savptr);
+                    if (NULL != token)
+                    {
+                        from_s = SDL_max(SDL_strtod(token, NULL), 0.0);
+                    }
+                }
+                else
+                {
+                    speed = (float)SDL_strtod(token, NULL);
+                }
+                token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            }
+
+            replay_start(file_name, core->channel, speed, is_looped, (Uint64)(from_s * 1000000.0));
+        }
+        else if (0 == SDL_strncmp(token, "stop", 4))
+        {
+            replay_stop();
+        }
+        else if (0 == SDL_strncmp(token, "filter", 6))
+        {
+            Uint32 can_id[REPLAY_FILTER_MAX];
+            int    count = 0;
+
+            // Without COB-IDs, the filter is removed.
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            while ((NULL != token) && (count < REPLAY_FILTER_MAX))
+            {
+                convert_token_to_uint(token, &can_id[count]);
+                count += 1;
+                token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            }
+
+            replay_set_filter(can_id, count);
+        }
+        else
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
+    }
     else if (0 == SDL_strncmp(token, "r", 1))
     {
-        can_message_t sdo_response = { 0 };
-        Uint32        node_id;
-        Uint32        sdo_index;
-        Uint32        sub_index;
+        Uint32 node_id;
+        Uint32 last_node_id;
+        Uint32 sdo_index;
+        Uint32 sub_index;
+        char*  range;
 
         token = SDL_strtokr(input_savptr, delim, &input_savptr);
         if (NULL == token)
@@ -270,6 +588,14 @@ void parse_command(char* input, core_t* core)
         else
         {
             convert_token_to_uint(token, &node_id);
+            last_node_id = node_id;
+
+            // E.g. 1-60 reads the object from all nodes at once.
+            range = SDL_strchr(token, '-');
+            if (NULL != range)
+            {
+                convert_token_to_uint(range + 1, &last_node_id);
+            }
         }
 
         token = SDL_strtokr(input_savptr, delim, &input_savptr);
@@ -293,7 +619,24 @@ void parse_command(char* input, core_t* core)
             convert_token_to_uint(token, &sub_index);
         }
 
-        sdo_read(&sdo_response, SDL_TRUE, node_id, sdo_index, sub_index);
+        if (last_node_id != node_id)
+        {
+            sdo_read_nodes(core->channel, (Uint8)node_id, (Uint8)last_node_id, (Uint16)sdo_index, (Uint8)sub_index);
+        }
+        else
+        {
+            Uint8* buffer = SDL_malloc(SDO_BUFFER_SIZE);
+            Uint32 size;
+
+            if (NULL == buffer)
+            {
+                c_log(LOG_ERROR, "Could not allocate SDO buffer");
+                return;
+            }
+
+            sdo_upload(core->channel, SDL_TRUE, (Uint8)node_id, (Uint16)sdo_index, (Uint8)sub_index, buffer, SDO_BUFFER_SIZE, &size);
+            SDL_free(buffer);
+        }
     }
     else if (0 == SDL_strncmp(token, "w", 1))
     {
@@ -337,6 +680,27 @@ void parse_command(char* input, core_t* core)
             convert_token_to_uint(token, &sub_index);
         }
 
+        // A quoted string is written as is, of any length.
+        while (' ' == *input_savptr)
+        {
+            input_savptr += 1;
+        }
+
+        if ('"' == *input_savptr)
+        {
+            char* string = input_savptr + 1;
+            char* end    = SDL_strrchr(string, '"');
+
+            if (NULL == end)
+            {
+                print_usage_information(SDL_FALSE);
+                return;
+            }
+
+            sdo_download(core->channel, SDL_TRUE, (Uint8)node_id, (Uint16)sdo_index, (Uint8)sub_index, (const Uint8*)string, (Uint32)(end - string));
+            return;
+        }
+
         token = SDL_strtokr(input_savptr, delim, &input_savptr);
         if (NULL == token)
         {
@@ -358,7 +722,94 @@ void parse_command(char* input, core_t* core)
             convert_token_to_uint(token, &sdo_data);
         }
 
-        sdo_write(&sdo_response, SDL_TRUE, node_id, sdo_index, sub_index, sdo_data_length, sdo_data);
+        sdo_write(core->channel, &sdo_response, SDL_TRUE, node_id, sdo_index, sub_index, sdo_data_length, sdo_data);
+    }
+    else if (0 == SDL_strncmp(token, "to", 2))
+    {
+        Uint32 node_id;
+        Uint32 timeout_ms;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            sdo_print_timeouts(core->channel);
+            return;
+        }
+        convert_token_to_uint(token, &node_id);
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            print_usage_information(SDL_TRUE);
+            return;
+        }
+        else if (0 == SDL_strncmp(token, "auto", 4))
+        {
+            timeout_ms = 0;
+        }
+        else
+        {
+            convert_token_to_uint(token, &timeout_ms);
+        }
+
+        sdo_set_timeout(core->channel, (Uint8)SDL_min(node_id, 0xff), timeout_ms);
+        sdo_print_timeouts(core->channel);
+    }
+    else if (0 == SDL_strncmp(token, "tr", 2))
+    {
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            trace_print_status();
+        }
+        else if (0 == SDL_strncmp(token, "start", 5))
+        {
+            // The file name is optional.
+            token = SDL_strtokr(input_savptr, delim, &input_savptr);
+            trace_start(token);
+        }
+        else if (0 == SDL_strncmp(token, "stop", 4))
+        {
+            trace_stop();
+        }
+        else
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
+    }
+    else if (0 == SDL_strncmp(token, "t", 1))
+    {
+        Uint32 frames_per_s;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            print_usage_information(SDL_FALSE);
+            return;
+        }
+        else
+        {
+            convert_token_to_uint(token, &frames_per_s);
+        }
+
+        can_set_tx_budget(core->channel, frames_per_s);
+    }
+    else if (0 == SDL_strncmp(token, "st", 2))
+    {
+        Uint32 window_s;
+
+        token = SDL_strtokr(input_savptr, delim, &input_savptr);
+        if (NULL == token)
+        {
+            window_s = 10;
+        }
+        else
+        {
+            convert_token_to_uint(token, &window_s);
+        }
+
+        stats_print(core->channel, window_s);
     }
     else if (0 == SDL_strncmp(token, "s", 1))
     {
@@ -414,16 +865,35 @@ static void print_usage_information(SDL_bool show_all)
 
     if (SDL_TRUE == show_all)
     {
-        table_print_row(" b ", "(command)",                                 "Set baud rate",  &table);
+        table_print_row(" b ", "(command or auto)",                         "Set baud rate",  &table);
+        table_print_row(" bl", "up [node_id] [index] [sub_index] [file]",   "Block upload",   &table);
+        table_print_row(" bl", "down [node_id] [index] [sub_index] [file]", "Block download", &table);
+        table_print_row(" bl", "size [segments] or threshold [bytes]",      "Block settings", &table);
         table_print_row(" c ", " ",                                         "Clear output",   &table);
+        table_print_row(" ch", "(channel)",                                 "Select channel", &table);
+        table_print_row(" cv", "[input] [output]",                          "Convert trace",  &table);
+        table_print_row(" d ", "(driver) (interface)",                      "Set CAN driver", &table);
+        table_print_row(" f ", "(command)",                                 "Set FD rate",    &table);
         table_print_row(" g ", " ",                                         "Activate GUI",   &table);
+        table_print_row(" i ", " ",                                         "CAN status",     &table);
         table_print_row(" l ", " ",                                         "List scripts",   &table);
+        table_print_row(" lg", "level [info, success, warning or error]",   "Log level",      &table);
+        table_print_row(" lg", "open [file] (size_kib) (count) or close",   "Log to file",    &table);
+        table_print_row(" m ", " ",                                         "Monitor bus",    &table);
+        table_print_row(" pc", "(start (file_name) or stop)",               "Capture pcapng", &table);
+        table_print_row(" rp", "start [file] (speed) (loop) (from [s])",    "Replay trace",   &table);
+        table_print_row(" rp", "filter (can_id ...) or stop",               "Replay control", &table);
         table_print_row(" s ", "[script_name]",                             "Run script",     &table);
+        table_print_row(" st", "(window_s)",                                "Bus statistics", &table);
+        table_print_row(" t ", "[frames_per_s]",                            "Set TX budget",  &table);
+        table_print_row(" to", "([node_id] [timeout_ms or auto])",          "SDO timeouts",   &table);
+        table_print_row(" tr", "(start (file_name) or stop)",               "Trace frames",   &table);
     }
 
     table_print_row(" n ", "[node_id] [command or alias]",                  "NMT command",    &table);
-    table_print_row(" r ", "[node_id] [index] (sub_index)",                 "Read SDO",       &table);
+    table_print_row(" r ", "[node_id(-last_node_id)] [index] (sub_index)",  "Read SDO",       &table);
     table_print_row(" w ", "[node_id] [index] [sub_index] [length] (data)", "Write SDO",      &table);
+    table_print_row(" w ", "[node_id] [index] [sub_index] \"[string]\"",    "Write string",   &table);
     table_print_row(" p ", "add [can_id] [event_time_ms] [length] [data]",  "Add TPDO",       &table);
     table_print_row(" p ", "del [can_id]",                                  "Remove TPDO",    &table);
     table_print_row(" q ", " ",                                             "Quit",           &table);
@@ -15,12 +15,19 @@
 #include "can.h"
 #include "command.h"
 #include "core.h"
+#include "dispatch.h"
 #include "gui.h"
+#include "monitor.h"
 #include "nmt_client.h"
+#include "pcapng.h"
 #include "pdo.h"
 #include "printf.h"
+#include "replay.h"
 #include "sdo_client.h"
 #include "scripts.h"
+#include "stats.h"
+#include "trace.h"
+#include "trace_convert.h"
 #include "version.h"
 
 status_t core_init(core_t **core)
@@ -35,6 +42,8 @@ status_t core_init(core_t **core)
     SetConsoleOutputCP(65001);
 #endif
 
+    c_log_init();
+
     c_printf(DARK_WHITE, "CANopenTerm %u.%u.%u\r\n",
              VERSION_MAJOR,
              VERSION_MINOR,
@@ -60,9 +69,16 @@ status_t core_init(core_t **core)
     if (NULL != (*core)->L)
     {
         lua_register_can_commands((*core));
+        lua_register_dispatch_commands((*core));
+        lua_register_log_commands((*core));
         lua_register_nmt_command((*core));
+        lua_register_pcapng_commands((*core));
         lua_register_pdo_commands((*core));
+        lua_register_replay_commands((*core));
         lua_register_sdo_commands((*core));
+        lua_register_stats_commands((*core));
+        lua_register_trace_commands((*core));
+        lua_register_trace_convert_commands((*core));
     }
 
     // Initialise CAN.
@@ -114,8 +130,14 @@ void core_deinit(core_t *core)
         gui_deinit(core);
     }
 
+    replay_deinit();
     can_quit(core);
+    sdo_deinit();
+    trace_deinit();
+    pcapng_deinit();
+    monitor_deinit();
     scripts_deinit(core);
+    c_log_deinit();
     SDL_Quit();
     free(core);
 }
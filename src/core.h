@@ -13,6 +13,8 @@
 #include "SDL.h"
 #include "lua.h"
 
+#define CAN_CHANNEL_MAX 8
+
 typedef enum status
 {
     COT_OK = 0,
@@ -22,17 +24,27 @@ typedef enum status
 
 } status_t;
 
+typedef struct can_channel
+{
+    SDL_Thread *monitor_th;
+    char        interface[16];
+    Uint8       driver;
+    Uint8       baud_rate;
+    Uint8       data_baud_rate;
+    Uint32      can_status;
+    SDL_bool    is_initialised;
+
+} can_channel_t;
+
 typedef struct core
 {
     SDL_Window        *window;
     SDL_Renderer      *renderer;
-    SDL_Thread        *can_monitor_th;
     lua_State         *L;
     struct nk_context *ctx;
-    Uint8              baud_rate;
-    Uint32             can_status;
+    can_channel_t      can_channel[CAN_CHANNEL_MAX];
+    Uint8              channel;
     Uint8              node_id;
-    SDL_bool           is_can_initialised;
     SDL_bool           is_running;
     SDL_bool           is_gui_active;
     SDL_bool           is_script_running;
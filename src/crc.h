@@ -0,0 +1,21 @@
+/** @file crc.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef CRC_H
+#define CRC_H
+
+#include "SDL.h"
+
+/* CRC-16/CCITT as used by SDO block transfers: polynomial 0x1021,
+ * initial value 0, neither reflected nor inverted.  Pass the result of
+ * the previous call to continue over further data.
+ */
+Uint16 crc16_ccitt(Uint16 crc, const Uint8* data, size_t size);
+
+#endif /* CRC_H */
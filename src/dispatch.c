@@ -0,0 +1,484 @@
+/** @file dispatch.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "can.h"
+#include "core.h"
+#include "dispatch.h"
+#include "printf.h"
+
+#define DISPATCH_STANDARD_SIZE 2048
+#define DISPATCH_HASH_SIZE     256  // Must be a power of two.
+#define LUA_QUEUE_SIZE         1024 // Must be a power of two.
+#define LUA_SUBSCRIPTION_MAX   64
+
+typedef struct subscriber
+{
+    Uint32             can_id;
+    dispatch_handler_t handler;
+    void*              user_data;
+    struct subscriber* next;
+
+} subscriber_t;
+
+/* Standard identifiers index the table directly, 29-bit identifiers
+ * are spread over a small hash table.  Each slot holds the list of
+ * subscribers of that identifier.
+ */
+typedef struct dispatch_table
+{
+    SDL_SpinLock  lock;
+    subscriber_t* standard[DISPATCH_STANDARD_SIZE];
+    subscriber_t* extended[DISPATCH_HASH_SIZE];
+    int           id_count;
+
+} dispatch_table_t;
+
+typedef struct lua_subscription
+{
+    SDL_bool is_used;
+    Uint8    channel;
+    Uint32   can_id;
+    int      ref;
+
+} lua_subscription_t;
+
+typedef struct lua_callback
+{
+    int           subscription;
+    int           ref;
+    Uint8         channel;
+    can_message_t message;
+
+} lua_callback_t;
+
+static dispatch_table_t   table[CAN_CHANNEL_MAX];
+static lua_subscription_t lua_subscription[LUA_SUBSCRIPTION_MAX];
+static lua_callback_t     lua_queue[LUA_QUEUE_SIZE];
+static Uint32             lua_queue_head;
+static Uint32             lua_queue_tail;
+static SDL_SpinLock       lua_queue_lock;
+static SDL_sem*           lua_queue_event;
+
+static subscriber_t** get_slot(dispatch_table_t* t, Uint32 can_id);
+static SDL_bool       is_subscribed(subscriber_t* subscriber, Uint32 can_id);
+static void           queue_lua_callback(Uint8 channel, const can_message_t* message, void* user_data);
+static void           run_lua_callback(lua_State* L, lua_callback_t* callback);
+static void           remove_lua_subscription(lua_State* L, int index);
+
+/* Subscriptions also define the acceptance filter of the channel: as
+ * long as there is at least one, only the subscribed identifiers are
+ * received.  Receivers of all frames, such as the trace recorder or a
+ * script reading through can_read(), hold the filter open instead.
+ */
+SDL_bool dispatch_subscribe(Uint8 channel, Uint32 can_id, dispatch_handler_t handler, void* user_data)
+{
+    dispatch_table_t* t;
+    subscriber_t*     subscriber;
+    subscriber_t**    slot;
+    SDL_bool          is_new_id;
+
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return SDL_FALSE;
+    }
+
+    if ((0 == (can_id & CAN_ID_EXTENDED)) && (can_id >= DISPATCH_STANDARD_SIZE))
+    {
+        return SDL_FALSE;
+    }
+
+    subscriber = (subscriber_t*)SDL_calloc(1, sizeof(subscriber_t));
+    if (NULL == subscriber)
+    {
+        return SDL_FALSE;
+    }
+
+    subscriber->can_id    = can_id;
+    subscriber->handler   = handler;
+    subscriber->user_data = user_data;
+
+    t = &table[channel];
+
+    SDL_AtomicLock(&t->lock);
+
+    // Append, so handlers are called in the order of subscription.
+    slot      = get_slot(t, can_id);
+    is_new_id = (SDL_FALSE == is_subscribed(*slot, can_id)) ? SDL_TRUE : SDL_FALSE;
+    while (NULL != *slot)
+    {
+        slot = &(*slot)->next;
+    }
+    *slot = subscriber;
+
+    if (SDL_TRUE == is_new_id)
+    {
+        t->id_count += 1;
+    }
+
+    SDL_AtomicUnlock(&t->lock);
+
+    if (SDL_TRUE == is_new_id)
+    {
+        can_update_filter(channel);
+    }
+
+    return SDL_TRUE;
+}
+
+void dispatch_unsubscribe(Uint8 channel, Uint32 can_id, dispatch_handler_t handler, void* user_data)
+{
+    dispatch_table_t* t;
+    subscriber_t*     subscriber = NULL;
+    subscriber_t**    slot;
+    SDL_bool          is_last_id = SDL_FALSE;
+
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return;
+    }
+
+    if ((0 == (can_id & CAN_ID_EXTENDED)) && (can_id >= DISPATCH_STANDARD_SIZE))
+    {
+        return;
+    }
+
+    t = &table[channel];
+
+    SDL_AtomicLock(&t->lock);
+
+    for (slot = get_slot(t, can_id); NULL != *slot; slot = &(*slot)->next)
+    {
+        if ((can_id == (*slot)->can_id) && (handler == (*slot)->handler) && (user_data == (*slot)->user_data))
+        {
+            subscriber = *slot;
+            *slot      = subscriber->next;
+            break;
+        }
+    }
+
+    if ((NULL != subscriber) && (SDL_FALSE == is_subscribed(*get_slot(t, can_id), can_id)))
+    {
+        is_last_id   = SDL_TRUE;
+        t->id_count -= 1;
+    }
+
+    SDL_AtomicUnlock(&t->lock);
+
+    SDL_free(subscriber);
+
+    if (SDL_TRUE == is_last_id)
+    {
+        can_update_filter(channel);
+    }
+}
+
+/* Collects the subscribed identifiers of a channel.  Returns -1 if the
+ * filter has to stay open, i.e. if there are no subscriptions at all
+ * or more identifiers than fit into the filter.
+ */
+int dispatch_get_filter(Uint8 channel, Uint32* ids, int max)
+{
+    dispatch_table_t* t     = &table[channel];
+    int               count = 0;
+    int               standard_count;
+    int               index;
+
+    SDL_AtomicLock(&t->lock);
+
+    if ((0 == t->id_count) || (t->id_count > max))
+    {
+        SDL_AtomicUnlock(&t->lock);
+        return -1;
+    }
+
+    for (index = 0; index < DISPATCH_STANDARD_SIZE; index += 1)
+    {
+        if (NULL != t->standard[index])
+        {
+            ids[count] = (Uint32)index;
+            count     += 1;
+        }
+    }
+
+    standard_count = count;
+
+    for (index = 0; index < DISPATCH_HASH_SIZE; index += 1)
+    {
+        subscriber_t* subscriber;
+
+        for (subscriber = t->extended[index]; NULL != subscriber; subscriber = subscriber->next)
+        {
+            int id_index;
+
+            // Several subscribers may share an identifier.
+            for (id_index = standard_count; id_index < count; id_index += 1)
+            {
+                if (subscriber->can_id == ids[id_index])
+                {
+                    break;
+                }
+            }
+
+            if (id_index == count)
+            {
+                ids[count] = subscriber->can_id;
+                count     += 1;
+            }
+        }
+    }
+
+    SDL_AtomicUnlock(&t->lock);
+
+    return count;
+}
+
+/* Called by the receive thread for every batch of received frames.
+ * The lock is taken once per batch, it is only contended while a
+ * subscription is added or removed.
+ */
+void dispatch_frames(Uint8 channel, const can_message_t* messages, int count)
+{
+    dispatch_table_t* t = &table[channel];
+    int               index;
+
+    SDL_AtomicLock(&t->lock);
+
+    for (index = 0; index < count; index += 1)
+    {
+        const can_message_t* message = &messages[index];
+        subscriber_t*        subscriber;
+
+        for (subscriber = *get_slot(t, message->id); NULL != subscriber; subscriber = subscriber->next)
+        {
+            if ((message->id == subscriber->can_id) && (NULL != subscriber->handler))
+            {
+                subscriber->handler(channel, message, subscriber->user_data);
+            }
+        }
+    }
+
+    SDL_AtomicUnlock(&t->lock);
+}
+
+/* The Lua state must only be used from the main thread.  Frames for
+ * Lua subscribers are therefore queued by the receive threads and the
+ * callbacks run here, e.g. while a script waits in delay_ms().
+ */
+void dispatch_run_lua_callbacks(lua_State* L, Uint32 timeout_ms)
+{
+    if (NULL == lua_queue_event)
+    {
+        return;
+    }
+
+    if (lua_queue_head == lua_queue_tail)
+    {
+        SDL_SemWaitTimeout(lua_queue_event, timeout_ms);
+    }
+
+    while (1)
+    {
+        lua_callback_t callback;
+
+        SDL_AtomicLock(&lua_queue_lock);
+        if (lua_queue_head == lua_queue_tail)
+        {
+            SDL_AtomicUnlock(&lua_queue_lock);
+            break;
+        }
+        callback        = lua_queue[lua_queue_tail & (LUA_QUEUE_SIZE - 1)];
+        lua_queue_tail += 1;
+        SDL_AtomicUnlock(&lua_queue_lock);
+
+        run_lua_callback(L, &callback);
+    }
+}
+
+void dispatch_clear_lua_subscriptions(lua_State* L)
+{
+    int index;
+
+    for (index = 0; index < LUA_SUBSCRIPTION_MAX; index += 1)
+    {
+        if (SDL_TRUE == lua_subscription[index].is_used)
+        {
+            remove_lua_subscription(L, index);
+        }
+    }
+}
+
+int lua_can_subscribe(lua_State* L)
+{
+    Uint32 can_id  = (Uint32)luaL_checkinteger(L, 1);
+    Uint8  channel = (Uint8)luaL_optinteger(L, 3, 0);
+    int    index;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    for (index = 0; index < LUA_SUBSCRIPTION_MAX; index += 1)
+    {
+        if (SDL_FALSE == lua_subscription[index].is_used)
+        {
+            break;
+        }
+    }
+
+    if (LUA_SUBSCRIPTION_MAX == index)
+    {
+        c_log(LOG_WARNING, "No free Lua subscription slot available");
+        return 0;
+    }
+
+    lua_pushvalue(L, 2);
+    lua_subscription[index].ref     = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_subscription[index].channel = channel;
+    lua_subscription[index].can_id  = can_id;
+    lua_subscription[index].is_used = SDL_TRUE;
+
+    if (SDL_FALSE == dispatch_subscribe(channel, can_id, queue_lua_callback, &lua_subscription[index]))
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, lua_subscription[index].ref);
+        lua_subscription[index].is_used = SDL_FALSE;
+        return 0;
+    }
+
+    return 1;
+}
+
+int lua_can_unsubscribe(lua_State* L)
+{
+    Uint32 can_id  = (Uint32)luaL_checkinteger(L, 1);
+    Uint8  channel = (Uint8)luaL_optinteger(L, 2, 0);
+    int    index;
+
+    for (index = 0; index < LUA_SUBSCRIPTION_MAX; index += 1)
+    {
+        lua_subscription_t* subscription = &lua_subscription[index];
+
+        if ((SDL_TRUE == subscription->is_used) && (channel == subscription->channel) && (can_id == subscription->can_id))
+        {
+            remove_lua_subscription(L, index);
+        }
+    }
+
+    return 1;
+}
+
+void lua_register_dispatch_commands(core_t* core)
+{
+    lua_queue_event = SDL_CreateSemaphore(0);
+    if (NULL == lua_queue_event)
+    {
+        c_log(LOG_ERROR, "Could not create Lua callback queue: %s", SDL_GetError());
+    }
+
+    lua_pushcfunction(core->L, lua_can_subscribe);
+    lua_setglobal(core->L, "can_subscribe");
+
+    lua_pushcfunction(core->L, lua_can_unsubscribe);
+    lua_setglobal(core->L, "can_unsubscribe");
+}
+
+static subscriber_t** get_slot(dispatch_table_t* t, Uint32 can_id)
+{
+    if (0 == (can_id & CAN_ID_EXTENDED))
+    {
+        return &t->standard[can_id & (DISPATCH_STANDARD_SIZE - 1)];
+    }
+
+    return &t->extended[(can_id ^ (can_id >> 8) ^ (can_id >> 16)) & (DISPATCH_HASH_SIZE - 1)];
+}
+
+static SDL_bool is_subscribed(subscriber_t* subscriber, Uint32 can_id)
+{
+    for (; NULL != subscriber; subscriber = subscriber->next)
+    {
+        if (can_id == subscriber->can_id)
+        {
+            return SDL_TRUE;
+        }
+    }
+
+    return SDL_FALSE;
+}
+
+static void queue_lua_callback(Uint8 channel, const can_message_t* message, void* user_data)
+{
+    lua_subscription_t* subscription = user_data;
+    SDL_bool            was_empty;
+
+    SDL_AtomicLock(&lua_queue_lock);
+
+    // Frames are dropped while the script does not keep up.
+    if ((lua_queue_head - lua_queue_tail) >= LUA_QUEUE_SIZE)
+    {
+        SDL_AtomicUnlock(&lua_queue_lock);
+        return;
+    }
+
+    was_empty = (lua_queue_head == lua_queue_tail) ? SDL_TRUE : SDL_FALSE;
+
+    lua_queue[lua_queue_head & (LUA_QUEUE_SIZE - 1)].subscription = (int)(subscription - lua_subscription);
+    lua_queue[lua_queue_head & (LUA_QUEUE_SIZE - 1)].ref          = subscription->ref;
+    lua_queue[lua_queue_head & (LUA_QUEUE_SIZE - 1)].channel      = channel;
+    lua_queue[lua_queue_head & (LUA_QUEUE_SIZE - 1)].message      = *message;
+    lua_queue_head += 1;
+
+    SDL_AtomicUnlock(&lua_queue_lock);
+
+    if (SDL_TRUE == was_empty)
+    {
+        SDL_SemPost(lua_queue_event);
+    }
+}
+
+static void run_lua_callback(lua_State* L, lua_callback_t* callback)
+{
+    lua_subscription_t* subscription = &lua_subscription[callback->subscription];
+    int                 index;
+
+    // Skip frames queued before the subscription was removed.
+    if ((SDL_FALSE == subscription->is_used) || (callback->ref != subscription->ref))
+    {
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, callback->ref);
+    lua_pushinteger(L, callback->message.id);
+    lua_pushinteger(L, callback->message.length);
+
+    lua_createtable(L, callback->message.length, 0);
+    for (index = 0; index < callback->message.length; index += 1)
+    {
+        lua_pushinteger(L, callback->message.data[index]);
+        lua_rawseti(L, -2, index + 1);
+    }
+
+    lua_pushinteger(L, (lua_Integer)callback->message.timestamp_us);
+    lua_pushinteger(L, callback->channel);
+
+    if (LUA_OK != lua_pcall(L, 5, 0, 0))
+    {
+        c_log(LOG_WARNING, "Lua callback failed: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static void remove_lua_subscription(lua_State* L, int index)
+{
+    lua_subscription_t* subscription = &lua_subscription[index];
+
+    dispatch_unsubscribe(subscription->channel, subscription->can_id, queue_lua_callback, subscription);
+    luaL_unref(L, LUA_REGISTRYINDEX, subscription->ref);
+
+    subscription->is_used = SDL_FALSE;
+}
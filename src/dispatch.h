@@ -0,0 +1,33 @@
+/** @file dispatch.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "can.h"
+#include "core.h"
+
+/* Handlers are called from the receive thread of the channel and must
+ * therefore return quickly.  They must not subscribe or unsubscribe.
+ */
+typedef void (*dispatch_handler_t)(Uint8 channel, const can_message_t* message, void* user_data);
+
+SDL_bool dispatch_subscribe(Uint8 channel, Uint32 can_id, dispatch_handler_t handler, void* user_data);
+void     dispatch_unsubscribe(Uint8 channel, Uint32 can_id, dispatch_handler_t handler, void* user_data);
+int      dispatch_get_filter(Uint8 channel, Uint32* ids, int max);
+void     dispatch_frames(Uint8 channel, const can_message_t* messages, int count);
+void     dispatch_run_lua_callbacks(lua_State* L, Uint32 timeout_ms);
+void     dispatch_clear_lua_subscriptions(lua_State* L);
+int      lua_can_subscribe(lua_State* L);
+int      lua_can_unsubscribe(lua_State* L);
+void     lua_register_dispatch_commands(core_t* core);
+
+#endif /* DISPATCH_H */
@@ -12,9 +12,12 @@
 #include "menu_bar.h"
 #include "nmt_client.h"
 #include "printf.h"
+#include "sdo_client.h"
+#include "stats.h"
 
-#define WINDOW_WIDTH  800
-#define WINDOW_HEIGHT 600
+#define WINDOW_WIDTH      800
+#define WINDOW_HEIGHT     600
+#define GUI_REFRESH_IN_MS 1000 // The bus statistics change without input
 
 #define NK_INCLUDE_FIXED_TYPES
 #define NK_INCLUDE_STANDARD_IO
@@ -79,8 +82,11 @@ status_t gui_init(core_t* core)
 
 status_t gui_update(core_t* core)
 {
+    static Uint64 last_update_ms = 0;
+
     SDL_Event event;
     SDL_bool  update_gui = SDL_FALSE;
+    Uint64    now_ms;
 
     // Handle events.
     nk_input_begin(core->ctx);
@@ -98,11 +104,23 @@ status_t gui_update(core_t* core)
     }
     nk_input_end(core->ctx);
 
+    // Transfers submitted from the GUI complete without blocking it.
+    sdo_poll(0);
+
+    now_ms = SDL_GetTicks64();
+    if ((now_ms - last_update_ms) >= GUI_REFRESH_IN_MS)
+    {
+        update_gui = SDL_TRUE;
+    }
+
     if (SDL_TRUE == update_gui)
     {
+        last_update_ms = now_ms;
+
         // Add widgets.
         menu_bar_widget(core);
         nmt_client_widget(core);
+        stats_widget(core);
 
         // Update window.
         SDL_SetRenderDrawColor(core->renderer, 0xf6, 0xf8, 0xfa, 0xff);
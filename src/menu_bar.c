@@ -58,7 +58,7 @@ void menu_bar_widget(core_t* core)
             }
 
             nk_layout_row_dynamic(core->ctx, 20, 1);
-            if (SDL_TRUE == is_can_initialised(core))
+            if (SDL_TRUE == is_can_initialised(core->channel, core))
             {
                 nk_text_colored(core->ctx, "Connected", 9, NK_TEXT_LEFT, nk_rgba(0x00, 0xcc, 0x00, 0xff));
             }
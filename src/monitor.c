@@ -0,0 +1,399 @@
+/** @file monitor.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <conio.h>
+#else
+#include <sys/select.h>
+#include <unistd.h>
+#endif
+
+#include "SDL.h"
+#include "can.h"
+#include "core.h"
+#include "monitor.h"
+#include "printf.h"
+#include "ring_buffer.h"
+#include "table.h"
+
+#define MONITOR_RING_SIZE           16384 // Must be a power of two.
+#define MONITOR_POLL_IN_MS          10
+#define MONITOR_RATE_INTERVAL_IN_MS 1000
+#define MONITOR_DATA_BYTES          8     // Further bytes of CAN FD frames are only counted.
+
+typedef struct monitor_row
+{
+    Uint32 id;
+    Uint8  data[CANFD_MAX_DATA_LENGTH];
+    Uint8  length;
+    Uint32 changed_ms[CANFD_MAX_DATA_LENGTH];
+    Uint64 count;
+    Uint64 rate_count;
+    Uint64 last_us;
+    Uint64 cycle_us;
+    float  frames_per_s;
+
+} monitor_row_t;
+
+/* Frames are passed from the receive thread of the monitored channel
+ * through a lock-free ring and aggregated by the command-line thread,
+ * which redraws the table every MONITOR_REFRESH_IN_MS.  So the console
+ * output does not depend on the bus load.
+ */
+typedef struct monitor
+{
+    SDL_atomic_t  channel; // Monitored channel + 1, 0 if none
+    ring_buffer_t ring;
+    int           overrun_count;
+    monitor_row_t row[MONITOR_ROW_MAX];
+    int           row_count;
+    int           standard_row[2048];
+    Uint64        error_frames;
+    Uint64        unlisted_frames;
+
+} monitor_t;
+
+static monitor_t monitor;
+
+static void          update_row(const can_message_t* message, Uint32 now_ms);
+static monitor_row_t* get_row(Uint32 can_id);
+static void          update_rates(Uint32 elapsed_ms);
+static void          render(Uint8 channel, Uint32 now_ms);
+static int           compare_rows(const void* a, const void* b);
+static SDL_bool      is_key_pressed(void);
+
+/* Shows one row per COB-ID of the selected channel until Enter is
+ * pressed.  Bytes which changed during the last MONITOR_HIGHLIGHT_IN_MS
+ * are highlighted.
+ */
+void monitor_run(core_t* core)
+{
+    Uint8         channel = core->channel;
+    can_message_t message;
+    Uint32        refresh_ms;
+    Uint32        rate_ms;
+    int           id;
+
+    if (SDL_FALSE == is_can_initialised(channel, core))
+    {
+        c_log(LOG_WARNING, "Could not start monitor: CAN not initialised");
+        return;
+    }
+
+    if (NULL == monitor.ring.buffer)
+    {
+        if (SDL_FALSE == ring_buffer_init(&monitor.ring, MONITOR_RING_SIZE))
+        {
+            c_log(LOG_ERROR, "Could not allocate monitor buffer");
+            return;
+        }
+    }
+
+    // Discard frames received after the previous monitor was stopped.
+    while (SDL_TRUE == ring_buffer_pop(&monitor.ring, &message));
+
+    monitor.overrun_count   = SDL_AtomicGet(&monitor.ring.overrun_count);
+    monitor.row_count       = 0;
+    monitor.error_frames    = 0;
+    monitor.unlisted_frames = 0;
+    for (id = 0; id < 2048; id += 1)
+    {
+        monitor.standard_row[id] = -1;
+    }
+
+    // All COB-IDs are shown, not only the subscribed ones.
+    can_hold_filter_open(channel, SDL_TRUE);
+    SDL_AtomicSet(&monitor.channel, channel + 1);
+
+    refresh_ms = SDL_GetTicks();
+    rate_ms    = refresh_ms;
+    render(channel, refresh_ms);
+
+    while (SDL_FALSE == is_key_pressed())
+    {
+        Uint32 now_ms = SDL_GetTicks();
+
+        while (SDL_TRUE == ring_buffer_pop(&monitor.ring, &message))
+        {
+            update_row(&message, now_ms);
+        }
+
+        if ((now_ms - rate_ms) >= MONITOR_RATE_INTERVAL_IN_MS)
+        {
+            update_rates(now_ms - rate_ms);
+            rate_ms = now_ms;
+        }
+
+        if ((now_ms - refresh_ms) >= MONITOR_REFRESH_IN_MS)
+        {
+            render(channel, now_ms);
+            refresh_ms = now_ms;
+        }
+
+        SDL_Delay(MONITOR_POLL_IN_MS);
+    }
+
+    SDL_AtomicSet(&monitor.channel, 0);
+    can_hold_filter_open(channel, SDL_FALSE);
+
+    c_log(LOG_INFO, "Monitor stopped");
+}
+
+// Called by the receive thread of the channel, see trace_record().
+void monitor_record(Uint8 channel, const can_message_t* messages, int count)
+{
+    int index;
+
+    if ((channel + 1) != SDL_AtomicGet(&monitor.channel))
+    {
+        return;
+    }
+
+    for (index = 0; index < count; index += 1)
+    {
+        ring_buffer_push(&monitor.ring, &messages[index]);
+    }
+}
+
+// Must be called after the CAN channels were closed.
+void monitor_deinit(void)
+{
+    ring_buffer_deinit(&monitor.ring);
+}
+
+static void update_row(const can_message_t* message, Uint32 now_ms)
+{
+    monitor_row_t* row;
+    Uint8          length = SDL_min(message->length, CANFD_MAX_DATA_LENGTH);
+    int            index;
+
+    if (0 != (message->flags & CAN_FLAG_ERROR))
+    {
+        monitor.error_frames += 1;
+        return;
+    }
+
+    row = get_row(message->id);
+    if (NULL == row)
+    {
+        monitor.unlisted_frames += 1;
+        return;
+    }
+
+    if (row->count > 0)
+    {
+        Uint64 cycle_us = (message->timestamp_us > row->last_us) ? (message->timestamp_us - row->last_us) : 0;
+
+        // Smoothed, so that jitter does not make it unreadable.
+        row->cycle_us = (1 == row->count) ? cycle_us : (((row->cycle_us * 7) + cycle_us) / 8);
+    }
+
+    for (index = 0; index < length; index += 1)
+    {
+        if ((0 == row->count) || (index >= row->length) || (row->data[index] != message->data[index]))
+        {
+            row->changed_ms[index] = now_ms;
+        }
+    }
+
+    SDL_memcpy(row->data, message->data, length);
+    row->length   = length;
+    row->last_us  = message->timestamp_us;
+    row->count   += 1;
+}
+
+// Returns NULL if there is no row left for a new COB-ID.
+static monitor_row_t* get_row(Uint32 can_id)
+{
+    monitor_row_t* row;
+    int            index;
+
+    if (0 == (can_id & CAN_ID_EXTENDED))
+    {
+        index = monitor.standard_row[can_id & 0x7ff];
+        if (index >= 0)
+        {
+            return &monitor.row[index];
+        }
+    }
+    else
+    {
+        for (index = 0; index < monitor.row_count; index += 1)
+        {
+            if (can_id == monitor.row[index].id)
+            {
+                return &monitor.row[index];
+            }
+        }
+    }
+
+    if (monitor.row_count >= MONITOR_ROW_MAX)
+    {
+        return NULL;
+    }
+
+    row = &monitor.row[monitor.row_count];
+    SDL_zerop(row);
+    row->id = can_id;
+
+    if (0 == (can_id & CAN_ID_EXTENDED))
+    {
+        monitor.standard_row[can_id & 0x7ff] = monitor.row_count;
+    }
+    monitor.row_count += 1;
+
+    return row;
+}
+
+static void update_rates(Uint32 elapsed_ms)
+{
+    int index;
+
+    for (index = 0; index < monitor.row_count; index += 1)
+    {
+        monitor_row_t* row = &monitor.row[index];
+
+        row->frames_per_s = (float)(row->count - row->rate_count) * 1000.0f / (float)elapsed_ms;
+        row->rate_count   = row->count;
+    }
+}
+
+static void render(Uint8 channel, Uint32 now_ms)
+{
+    table_t  table = { DARK_CYAN, DARK_WHITE, 10, 27, 29 };
+    int      order[MONITOR_ROW_MAX];
+    char     statistics[30];
+    Uint32   dropped;
+    int      index;
+
+    for (index = 0; index < monitor.row_count; index += 1)
+    {
+        order[index] = index;
+    }
+    SDL_qsort(order, (size_t)monitor.row_count, sizeof(int), compare_rows);
+
+    dropped = (Uint32)(SDL_AtomicGet(&monitor.ring.overrun_count) - monitor.overrun_count);
+
+    c_clear_screen();
+    c_printf(LIGHT_WHITE, " Channel %u, %d COB-IDs, %llu error frames, %u dropped, press Enter to stop\r\n",
+             channel,
+             monitor.row_count,
+             (unsigned long long)monitor.error_frames,
+             dropped);
+
+    SDL_snprintf(statistics, sizeof(statistics), "%10s %8s %9s", "Count", "Frames/s", "Cycle ms");
+
+    table_print_header(&table);
+    table_print_row("COB-ID", "Data", statistics, &table);
+    table_print_divider(&table);
+
+    for (index = 0; index < monitor.row_count; index += 1)
+    {
+        monitor_row_t* row = &monitor.row[order[index]];
+        char           id[11];
+        char           data[28];
+        SDL_bool       is_marked[28];
+        int            byte;
+        int            shown = SDL_min(row->length, MONITOR_DATA_BYTES);
+
+        if (0 != (row->id & CAN_ID_EXTENDED))
+        {
+            SDL_snprintf(id, sizeof(id), "0x%08x", row->id & CAN_ID_MASK);
+        }
+        else
+        {
+            SDL_snprintf(id, sizeof(id), "0x%03x", row->id & 0x7ff);
+        }
+
+        SDL_zeroa(is_marked);
+        data[0] = '\0';
+        for (byte = 0; byte < shown; byte += 1)
+        {
+            SDL_bool is_changed = ((now_ms - row->changed_ms[byte]) < MONITOR_HIGHLIGHT_IN_MS) ? SDL_TRUE : SDL_FALSE;
+
+            SDL_snprintf(&data[byte * 3], sizeof(data) - (size_t)(byte * 3), "%02x ", row->data[byte]);
+            is_marked[(byte * 3)]     = is_changed;
+            is_marked[(byte * 3) + 1] = is_changed;
+        }
+        if (shown > 0)
+        {
+            data[(shown * 3) - 1] = '\0';
+        }
+
+        if (row->length > shown)
+        {
+            size_t length = SDL_strlen(data);
+
+            SDL_snprintf(&data[length], sizeof(data) - length, " +%u", row->length - shown);
+        }
+
+        if (row->count > 1)
+        {
+            SDL_snprintf(statistics, sizeof(statistics), "%10llu %8.1f %9.2f",
+                         (unsigned long long)row->count,
+                         row->frames_per_s,
+                         (double)row->cycle_us / 1000.0);
+        }
+        else
+        {
+            SDL_snprintf(statistics, sizeof(statistics), "%10llu %8.1f %9s", (unsigned long long)row->count, row->frames_per_s, "-");
+        }
+
+        table_print_row_marked(id, data, statistics, is_marked, LIGHT_RED, &table);
+    }
+
+    table_print_footer(&table);
+
+    if (monitor.unlisted_frames > 0)
+    {
+        c_printf(DARK_YELLOW, " %llu frames of further COB-IDs not shown\r\n", (unsigned long long)monitor.unlisted_frames);
+    }
+}
+
+// Standard COB-IDs first, each in ascending order.
+static int compare_rows(const void* a, const void* b)
+{
+    Uint32 id_a = monitor.row[*(const int*)a].id;
+    Uint32 id_b = monitor.row[*(const int*)b].id;
+
+    return (id_a < id_b) ? -1 : ((id_a > id_b) ? 1 : 0);
+}
+
+// Only returns once a complete line was entered, which is consumed.
+static SDL_bool is_key_pressed(void)
+{
+#ifdef _WIN32
+    if (0 != _kbhit())
+    {
+        (void)_getch();
+        return SDL_TRUE;
+    }
+    return SDL_FALSE;
+#else
+    fd_set         fds;
+    struct timeval timeout = { 0, 0 };
+
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+
+    if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &timeout) > 0)
+    {
+        char line[64];
+
+        if (NULL == fgets(line, sizeof(line), stdin))
+        {
+            clearerr(stdin);
+        }
+        return SDL_TRUE;
+    }
+
+    return SDL_FALSE;
+#endif
+}
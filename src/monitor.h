@@ -0,0 +1,25 @@
+/** @file monitor.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include "SDL.h"
+#include "can.h"
+#include "core.h"
+
+#define MONITOR_ROW_MAX           512
+#define MONITOR_REFRESH_IN_MS     100
+#define MONITOR_HIGHLIGHT_IN_MS   1000
+
+void monitor_run(core_t* core);
+void monitor_record(Uint8 channel, const can_message_t* messages, int count);
+void monitor_deinit(void);
+
+#endif /* MONITOR_H */
@@ -16,7 +16,7 @@
 #include "printf.h"
 #include "table.h"
 
-Uint32 nmt_send_command(Uint8 node_id, nmt_command_t command)
+Uint32 nmt_send_command(Uint8 channel, Uint8 node_id, nmt_command_t command)
 {
     Uint32        can_status  = 0;
     can_message_t can_message = { 0 };
@@ -44,10 +44,10 @@ Uint32 nmt_send_command(Uint8 node_id, nmt_command_t command)
             return can_status;
     }
 
-    can_status = can_write(&can_message);
+    can_status = can_write(channel, &can_message);
     if (0 != can_status)
     {
-        can_print_error_message(NULL, can_status);
+        can_print_error_message(channel, NULL, can_status);
     }
 
     return can_status;
@@ -57,6 +57,7 @@ int lua_nmt_send_command(lua_State* L)
 {
     int node_id = luaL_checkinteger(L, 1);
     int command = luaL_checkinteger(L, 2);
+    int channel = luaL_optinteger(L, 3, 0);
 
     switch (command)
     {
@@ -75,7 +76,7 @@ int lua_nmt_send_command(lua_State* L)
         node_id = 0x00 + (node_id % 0x7f);
     }
 
-    if (0 != nmt_send_command(node_id, command))
+    if (0 != nmt_send_command(channel, node_id, command))
     {
         return 0;
     }
@@ -121,27 +122,27 @@ void nmt_client_widget(core_t* core)
         nk_layout_row_push(core->ctx, 195);
         if (0 != nk_button_text(core->ctx, "0x01 Enter Operational    ", 26))
         {
-            core->can_status = nmt_send_command(core->node_id, NMT_OPERATIONAL);
+            core->can_channel[core->channel].can_status = nmt_send_command(core->channel, core->node_id, NMT_OPERATIONAL);
         }
         nk_layout_row_push(core->ctx, 195);
         if (0 != nk_button_text(core->ctx, "0x02 Enter Stop           ", 26))
         {
-            core->can_status = nmt_send_command(core->node_id, NMT_STOP);
+            core->can_channel[core->channel].can_status = nmt_send_command(core->channel, core->node_id, NMT_STOP);
         }
         nk_layout_row_push(core->ctx, 195);
         if (0 != nk_button_text(core->ctx, "0x80 Enter Pre-operational", 26))
         {
-            core->can_status = nmt_send_command(core->node_id, NMT_PRE_OPERATIONAL);
+            core->can_channel[core->channel].can_status = nmt_send_command(core->channel, core->node_id, NMT_PRE_OPERATIONAL);
         }
         nk_layout_row_push(core->ctx, 195);
         if (0 != nk_button_text(core->ctx, "0x81 Reset node           ", 26))
         {
-            core->can_status = nmt_send_command(core->node_id, NMT_RESET_NODE);
+            core->can_channel[core->channel].can_status = nmt_send_command(core->channel, core->node_id, NMT_RESET_NODE);
         }
         nk_layout_row_push(core->ctx, 195);
         if (0 != nk_button_text(core->ctx, "0x82 Reset communication  ", 26))
         {
-            core->can_status = nmt_send_command(core->node_id, NMT_RESET_COMM);
+            core->can_channel[core->channel].can_status = nmt_send_command(core->channel, core->node_id, NMT_RESET_COMM);
         }
         nk_layout_row_end(core->ctx);
     }
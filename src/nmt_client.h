@@ -24,7 +24,7 @@ typedef enum
 
 } nmt_command_t;
 
-Uint32 nmt_send_command(Uint8 node_id, nmt_command_t command);
+Uint32 nmt_send_command(Uint8 channel, Uint8 node_id, nmt_command_t command);
 int    lua_send_nmt_command(lua_State *L);
 void   lua_register_nmt_command(core_t* core);
 void   nmt_client_widget(core_t* core);
@@ -0,0 +1,618 @@
+/** @file pcapng.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include <time.h>
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "can.h"
+#include "core.h"
+#include "pcapng.h"
+#include "printf.h"
+#include "ring_buffer.h"
+
+#define PCAPNG_BUFFER_SIZE          (1024 * 1024)
+#define PCAPNG_RING_SIZE            16384 // Per channel, must be a power of two.
+#define PCAPNG_FLUSH_INTERVAL_IN_MS 10
+#define PCAPNG_SYNC_INTERVAL_IN_MS  1000
+#define PCAPNG_BLOCK_SIZE_MAX       128
+#define PCAPNG_SECTION_HEADER       0x0a0d0d0a
+#define PCAPNG_INTERFACE            0x00000001
+#define PCAPNG_ENHANCED_PACKET      0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC     0x1a2b3c4d
+#define PCAPNG_OPTION_END           0
+#define PCAPNG_OPTION_NAME          2
+#define PCAPNG_OPTION_USER_APPL     4
+#define PCAPNG_OPTION_TSRESOL       9
+#define SOCKETCAN_EFF_FLAG          0x80000000
+#define SOCKETCAN_ERR_FLAG          0x20000000
+#define SOCKETCAN_FD_BRS            0x01
+#define SOCKETCAN_FD_ESI            0x02
+#define SOCKETCAN_FD_FDF            0x04
+#define SOCKETCAN_HEADER_SIZE       8
+#define SOCKETCAN_CAN_SIZE          (SOCKETCAN_HEADER_SIZE + 8)
+#define SOCKETCAN_CANFD_SIZE        (SOCKETCAN_HEADER_SIZE + CANFD_MAX_DATA_LENGTH)
+
+/* The live tap works like the trace recorder: the receive threads push
+ * into a lock-free ring per channel, a flush thread drains the rings
+ * into a large buffer, which is written whenever it is full.
+ */
+typedef struct pcapng_tap
+{
+    SDL_atomic_t    is_active;
+    SDL_Thread*     flush_thread;
+    SDL_mutex*      mutex;
+    SDL_cond*       cond;
+    ring_buffer_t   ring[CAN_CHANNEL_MAX];
+    int             overrun_count[CAN_CHANNEL_MAX];
+    char            file_name[256];
+    pcapng_writer_t writer;
+    Uint64          wall_start_us;
+    Uint64          clock_start_us;
+    Uint64          offset_us[CAN_CHANNEL_MAX];
+    SDL_bool        is_synced[CAN_CHANNEL_MAX];
+
+} pcapng_tap_t;
+
+static pcapng_tap_t tap;
+
+static int      pcapng_flush_thread(void* unused);
+static SDL_bool drain(void);
+static Uint32   get_dropped_frames(void);
+static void     append(pcapng_writer_t* writer, const Uint8* block, size_t size);
+static size_t   put_option(Uint8* buffer, Uint16 code, const void* value, Uint16 length);
+static void     put_uint16(Uint8* buffer, Uint16 value);
+static void     put_uint32(Uint8* buffer, Uint32 value);
+static void     put_uint64(Uint8* buffer, Uint64 value);
+
+/* Writes the section header and one interface per CAN channel.  The
+ * blocks are buffered until the buffer is full or pcapng_flush() is
+ * called.
+ */
+SDL_bool pcapng_create(pcapng_writer_t* writer, const char* file_name)
+{
+    Uint8 block[PCAPNG_BLOCK_SIZE_MAX];
+    int   channel;
+
+    if ((NULL == writer) || (NULL == file_name))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zerop(writer);
+
+    writer->buffer = (Uint8*)SDL_malloc(PCAPNG_BUFFER_SIZE);
+    if (NULL == writer->buffer)
+    {
+        c_log(LOG_ERROR, "Could not allocate capture buffer");
+        return SDL_FALSE;
+    }
+
+    writer->file = SDL_RWFromFile(file_name, "wb");
+    if (NULL == writer->file)
+    {
+        c_log(LOG_ERROR, "Could not create capture file %s", file_name);
+        SDL_free(writer->buffer);
+        writer->buffer = NULL;
+        return SDL_FALSE;
+    }
+
+    {
+        size_t size = 24;
+
+        put_uint32(&block[0],  PCAPNG_SECTION_HEADER);
+        put_uint32(&block[8],  PCAPNG_BYTE_ORDER_MAGIC);
+        put_uint16(&block[12], 1);
+        put_uint16(&block[14], 0);
+        put_uint64(&block[16], 0xffffffffffffffffULL); // Section length unknown
+        size += put_option(&block[size], PCAPNG_OPTION_USER_APPL, "CANopenTerm", 11);
+        size += put_option(&block[size], PCAPNG_OPTION_END, NULL, 0);
+        put_uint32(&block[4], (Uint32)(size + 4));
+        put_uint32(&block[size], (Uint32)(size + 4));
+        append(writer, block, size + 4);
+    }
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        char   name[8];
+        Uint8  resolution = 6; // Microseconds
+        size_t size       = 16;
+
+        SDL_snprintf(name, sizeof(name), "can%d", channel);
+
+        put_uint32(&block[0],  PCAPNG_INTERFACE);
+        put_uint16(&block[8],  PCAPNG_LINKTYPE_CAN_SOCKETCAN);
+        put_uint16(&block[10], 0);
+        put_uint32(&block[12], 0); // No snapshot length limit
+        size += put_option(&block[size], PCAPNG_OPTION_NAME, name, (Uint16)SDL_strlen(name));
+        size += put_option(&block[size], PCAPNG_OPTION_TSRESOL, &resolution, 1);
+        size += put_option(&block[size], PCAPNG_OPTION_END, NULL, 0);
+        put_uint32(&block[4], (Uint32)(size + 4));
+        put_uint32(&block[size], (Uint32)(size + 4));
+        append(writer, block, size + 4);
+    }
+
+    return (SDL_TRUE == writer->is_failed) ? SDL_FALSE : SDL_TRUE;
+}
+
+SDL_bool pcapng_write(pcapng_writer_t* writer, Uint8 channel, Uint64 time_us, const can_message_t* message)
+{
+    Uint8  block[PCAPNG_BLOCK_SIZE_MAX];
+    Uint8* packet = &block[28];
+    Uint32 can_id;
+    Uint8  length = SDL_min(message->length, CANFD_MAX_DATA_LENGTH);
+    size_t packet_size;
+    size_t size;
+
+    if ((NULL == writer->file) || (SDL_TRUE == writer->is_failed))
+    {
+        return SDL_FALSE;
+    }
+
+    // Wireshark tells CAN FD frames from classic ones by their size.
+    packet_size = (0 != (message->flags & CAN_FLAG_FD)) ? SOCKETCAN_CANFD_SIZE : SOCKETCAN_CAN_SIZE;
+    length      = (Uint8)SDL_min(length, packet_size - SOCKETCAN_HEADER_SIZE);
+    size        = 28 + packet_size + 4;
+
+    if (0 != (message->flags & CAN_FLAG_ERROR))
+    {
+        can_id = (message->id & CAN_ID_MASK) | SOCKETCAN_ERR_FLAG;
+    }
+    else if (0 != (message->id & CAN_ID_EXTENDED))
+    {
+        can_id = (message->id & CAN_ID_MASK) | SOCKETCAN_EFF_FLAG;
+    }
+    else
+    {
+        can_id = message->id & 0x7ff;
+    }
+
+    put_uint32(&block[0],  PCAPNG_ENHANCED_PACKET);
+    put_uint32(&block[4],  (Uint32)size);
+    put_uint32(&block[8],  channel);
+    put_uint32(&block[12], (Uint32)(time_us >> 32));
+    put_uint32(&block[16], (Uint32)(time_us & 0xffffffff));
+    put_uint32(&block[20], (Uint32)packet_size);
+    put_uint32(&block[24], (Uint32)packet_size);
+
+    // The CAN-ID of the SocketCAN layout is in network byte order.
+    can_id = SDL_SwapBE32(can_id);
+    SDL_memcpy(&packet[0], &can_id, sizeof(can_id));
+    packet[4] = length;
+    packet[5] = 0;
+    packet[6] = 0;
+    packet[7] = 0;
+
+    if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        packet[5] = SOCKETCAN_FD_FDF;
+        packet[5] |= (0 != (message->flags & CAN_FLAG_BRS)) ? SOCKETCAN_FD_BRS : 0;
+        packet[5] |= (0 != (message->flags & CAN_FLAG_ESI)) ? SOCKETCAN_FD_ESI : 0;
+    }
+
+    SDL_memset(&packet[SOCKETCAN_HEADER_SIZE], 0, packet_size - SOCKETCAN_HEADER_SIZE);
+    SDL_memcpy(&packet[SOCKETCAN_HEADER_SIZE], message->data, length);
+    put_uint32(&block[size - 4], (Uint32)size);
+
+    append(writer, block, size);
+    writer->frames += 1;
+
+    return (SDL_TRUE == writer->is_failed) ? SDL_FALSE : SDL_TRUE;
+}
+
+SDL_bool pcapng_flush(pcapng_writer_t* writer)
+{
+    if (NULL == writer->file)
+    {
+        return SDL_FALSE;
+    }
+
+    if ((SDL_FALSE == writer->is_failed) && (writer->used > 0))
+    {
+        if (1 != SDL_RWwrite(writer->file, writer->buffer, writer->used, 1))
+        {
+            writer->is_failed = SDL_TRUE;
+        }
+    }
+    writer->used = 0;
+
+    return (SDL_TRUE == writer->is_failed) ? SDL_FALSE : SDL_TRUE;
+}
+
+// Returns SDL_FALSE if any block could not be written.
+SDL_bool pcapng_finish(pcapng_writer_t* writer)
+{
+    SDL_bool is_ok;
+
+    if (NULL == writer->file)
+    {
+        return SDL_FALSE;
+    }
+
+    is_ok = pcapng_flush(writer);
+    if (0 != SDL_RWclose(writer->file))
+    {
+        is_ok = SDL_FALSE;
+    }
+
+    writer->file = NULL;
+    SDL_free(writer->buffer);
+    writer->buffer = NULL;
+
+    return is_ok;
+}
+
+SDL_bool pcapng_start(const char* file_name)
+{
+    char default_name[64];
+    int  channel;
+
+    if (SDL_TRUE == pcapng_is_active())
+    {
+        c_log(LOG_WARNING, "Capture already running: %s", tap.file_name);
+        return SDL_FALSE;
+    }
+    else if (NULL != tap.flush_thread)
+    {
+        // The previous capture was stopped by an error.
+        pcapng_stop();
+    }
+
+    if (NULL == tap.mutex)
+    {
+        tap.mutex = SDL_CreateMutex();
+        tap.cond  = SDL_CreateCond();
+
+        if ((NULL == tap.mutex) || (NULL == tap.cond))
+        {
+            c_log(LOG_ERROR, "Could not create capture synchronisation objects: %s", SDL_GetError());
+            return SDL_FALSE;
+        }
+    }
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        ring_buffer_t* ring = &tap.ring[channel];
+        can_message_t  message;
+
+        if (NULL == ring->buffer)
+        {
+            if (SDL_FALSE == ring_buffer_init(ring, PCAPNG_RING_SIZE))
+            {
+                c_log(LOG_ERROR, "Could not allocate capture buffer");
+                return SDL_FALSE;
+            }
+        }
+
+        // Discard frames received after the previous capture was stopped.
+        while (SDL_TRUE == ring_buffer_pop(ring, &message));
+
+        tap.overrun_count[channel] = SDL_AtomicGet(&ring->overrun_count);
+        tap.is_synced[channel]     = SDL_FALSE;
+    }
+
+    if (NULL == file_name)
+    {
+        time_t    now = time(NULL);
+        struct tm local_time;
+
+#ifdef _WIN32
+        localtime_s(&local_time, &now);
+#else
+        localtime_r(&now, &local_time);
+#endif
+        strftime(default_name, sizeof(default_name), "capture_%Y%m%d_%H%M%S.pcapng", &local_time);
+        file_name = default_name;
+    }
+
+    if (SDL_FALSE == pcapng_create(&tap.writer, file_name))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_strlcpy(tap.file_name, file_name, sizeof(tap.file_name));
+    tap.wall_start_us  = (Uint64)time(NULL) * 1000000;
+    tap.clock_start_us = can_get_time_us();
+
+    SDL_AtomicSet(&tap.is_active, 1);
+
+    tap.flush_thread = SDL_CreateThread(pcapng_flush_thread, "Capture flush thread", NULL);
+    if (NULL == tap.flush_thread)
+    {
+        SDL_AtomicSet(&tap.is_active, 0);
+        pcapng_finish(&tap.writer);
+        c_log(LOG_ERROR, "Could not create capture flush thread: %s", SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    // The capture contains all frames, not only the subscribed ones.
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_hold_filter_open((Uint8)channel, SDL_TRUE);
+    }
+
+    c_log(LOG_SUCCESS, "Capture started: %s", tap.file_name);
+    return SDL_TRUE;
+}
+
+void pcapng_stop(void)
+{
+    Uint32 dropped;
+    int    channel;
+
+    if (NULL == tap.flush_thread)
+    {
+        c_log(LOG_WARNING, "No capture running");
+        return;
+    }
+
+    SDL_LockMutex(tap.mutex);
+    SDL_AtomicSet(&tap.is_active, 0);
+    SDL_CondSignal(tap.cond);
+    SDL_UnlockMutex(tap.mutex);
+
+    SDL_WaitThread(tap.flush_thread, NULL);
+    tap.flush_thread = NULL;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_hold_filter_open((Uint8)channel, SDL_FALSE);
+    }
+
+    c_log(LOG_SUCCESS, "Capture stopped: %s, %llu frames, %llu bytes",
+          tap.file_name,
+          (unsigned long long)tap.writer.frames,
+          (unsigned long long)tap.writer.size);
+
+    dropped = get_dropped_frames();
+    if (dropped > 0)
+    {
+        c_log(LOG_WARNING, "%u frames could not be captured in time", dropped);
+    }
+}
+
+SDL_bool pcapng_is_active(void)
+{
+    return (0 != SDL_AtomicGet(&tap.is_active)) ? SDL_TRUE : SDL_FALSE;
+}
+
+// Called by the receive thread of the channel, see trace_record().
+void pcapng_record(Uint8 channel, const can_message_t* messages, int count)
+{
+    ring_buffer_t* ring;
+    int            index;
+
+    if ((0 == SDL_AtomicGet(&tap.is_active)) || (channel >= CAN_CHANNEL_MAX))
+    {
+        return;
+    }
+
+    ring = &tap.ring[channel];
+
+    for (index = 0; index < count; index += 1)
+    {
+        if (0 != messages[index].timestamp_us)
+        {
+            ring_buffer_push(ring, &messages[index]);
+        }
+        else
+        {
+            can_message_t message = messages[index];
+
+            message.timestamp_us = can_get_time_us();
+            ring_buffer_push(ring, &message);
+        }
+    }
+}
+
+void pcapng_print_status(void)
+{
+    if (NULL == tap.flush_thread)
+    {
+        c_log(LOG_INFO, "No capture running");
+        return;
+    }
+
+    SDL_LockMutex(tap.mutex);
+    c_log(LOG_INFO, "Capture running: %s, %llu frames, %llu bytes, %u dropped",
+          tap.file_name,
+          (unsigned long long)tap.writer.frames,
+          (unsigned long long)tap.writer.size,
+          get_dropped_frames());
+    SDL_UnlockMutex(tap.mutex);
+}
+
+// Must be called after the CAN channels were closed.
+void pcapng_deinit(void)
+{
+    int channel;
+
+    if (NULL != tap.flush_thread)
+    {
+        pcapng_stop();
+    }
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        ring_buffer_deinit(&tap.ring[channel]);
+    }
+
+    if (NULL != tap.cond)
+    {
+        SDL_DestroyCond(tap.cond);
+        tap.cond = NULL;
+    }
+
+    if (NULL != tap.mutex)
+    {
+        SDL_DestroyMutex(tap.mutex);
+        tap.mutex = NULL;
+    }
+}
+
+int lua_pcapng_start(lua_State* L)
+{
+    const char* file_name = luaL_optstring(L, 1, NULL);
+
+    lua_pushboolean(L, pcapng_start(file_name));
+
+    return 1;
+}
+
+int lua_pcapng_stop(lua_State* L)
+{
+    (void)L;
+
+    pcapng_stop();
+
+    return 0;
+}
+
+void lua_register_pcapng_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_pcapng_start);
+    lua_setglobal(core->L, "pcapng_start");
+
+    lua_pushcfunction(core->L, lua_pcapng_stop);
+    lua_setglobal(core->L, "pcapng_stop");
+}
+
+static int pcapng_flush_thread(void* unused)
+{
+    Uint64   sync_ms = SDL_GetTicks64();
+    SDL_bool is_ok   = SDL_TRUE;
+
+    (void)unused;
+
+    SDL_LockMutex(tap.mutex);
+    while ((1 == SDL_AtomicGet(&tap.is_active)) && (SDL_TRUE == is_ok))
+    {
+        SDL_CondWaitTimeout(tap.cond, tap.mutex, PCAPNG_FLUSH_INTERVAL_IN_MS);
+
+        is_ok = drain();
+
+        // Keeps the file readable while the capture is running.
+        if ((SDL_TRUE == is_ok) && ((SDL_GetTicks64() - sync_ms) >= PCAPNG_SYNC_INTERVAL_IN_MS))
+        {
+            is_ok   = pcapng_flush(&tap.writer);
+            sync_ms = SDL_GetTicks64();
+        }
+    }
+
+    // Capture the frames received until the capture was stopped.
+    if (SDL_TRUE == is_ok)
+    {
+        is_ok = drain();
+    }
+
+    if (SDL_FALSE == pcapng_finish(&tap.writer))
+    {
+        is_ok = SDL_FALSE;
+    }
+
+    if (SDL_FALSE == is_ok)
+    {
+        SDL_AtomicSet(&tap.is_active, 0);
+        c_log(LOG_ERROR, "Could not write capture file %s, capture stopped", tap.file_name);
+    }
+
+    SDL_UnlockMutex(tap.mutex);
+
+    return 0;
+}
+
+/* Driver timestamps have no common epoch, so each channel's clock is
+ * related to the wall clock by its first frame.  Intervals keep the
+ * driver's resolution.
+ */
+static SDL_bool drain(void)
+{
+    int channel;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_message_t message;
+
+        while (SDL_TRUE == ring_buffer_pop(&tap.ring[channel], &message))
+        {
+            if (SDL_FALSE == tap.is_synced[channel])
+            {
+                tap.offset_us[channel] = tap.wall_start_us + (can_get_time_us() - tap.clock_start_us) - message.timestamp_us;
+                tap.is_synced[channel] = SDL_TRUE;
+            }
+
+            if (SDL_FALSE == pcapng_write(&tap.writer, (Uint8)channel, message.timestamp_us + tap.offset_us[channel], &message))
+            {
+                return SDL_FALSE;
+            }
+        }
+    }
+
+    return SDL_TRUE;
+}
+
+static Uint32 get_dropped_frames(void)
+{
+    Uint32 dropped = 0;
+    int    channel;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        dropped += (Uint32)(SDL_AtomicGet(&tap.ring[channel].overrun_count) - tap.overrun_count[channel]);
+    }
+
+    return dropped;
+}
+
+static void append(pcapng_writer_t* writer, const Uint8* block, size_t size)
+{
+    if ((writer->used + size) > PCAPNG_BUFFER_SIZE)
+    {
+        pcapng_flush(writer);
+    }
+
+    SDL_memcpy(&writer->buffer[writer->used], block, size);
+    writer->used += size;
+    writer->size += size;
+}
+
+// Options are padded to 32 bits.
+static size_t put_option(Uint8* buffer, Uint16 code, const void* value, Uint16 length)
+{
+    size_t padded = ((size_t)length + 3) & ~(size_t)3;
+
+    put_uint16(&buffer[0], code);
+    put_uint16(&buffer[2], length);
+    SDL_memset(&buffer[4], 0, padded);
+    if (length > 0)
+    {
+        SDL_memcpy(&buffer[4], value, length);
+    }
+
+    return 4 + padded;
+}
+
+static void put_uint16(Uint8* buffer, Uint16 value)
+{
+    value = SDL_SwapLE16(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
+
+static void put_uint32(Uint8* buffer, Uint32 value)
+{
+    value = SDL_SwapLE32(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
+
+static void put_uint64(Uint8* buffer, Uint64 value)
+{
+    value = SDL_SwapLE64(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
@@ -0,0 +1,51 @@
+/** @file pcapng.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef PCAPNG_H
+#define PCAPNG_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "can.h"
+#include "core.h"
+
+/* Captures are written in the pcapng format with one interface per
+ * CAN channel, named can0 to can7.  Every frame is stored in the
+ * SocketCAN layout (LINKTYPE_CAN_SOCKETCAN) with a timestamp in
+ * microseconds since the Unix epoch, so that Wireshark decodes it with
+ * its CANopen dissector.
+ */
+#define PCAPNG_LINKTYPE_CAN_SOCKETCAN 227
+
+typedef struct pcapng_writer
+{
+    SDL_RWops* file;
+    Uint8*     buffer;
+    size_t     used;
+    Uint64     frames;
+    Uint64     size;
+    SDL_bool   is_failed;
+
+} pcapng_writer_t;
+
+SDL_bool pcapng_create(pcapng_writer_t* writer, const char* file_name);
+SDL_bool pcapng_write(pcapng_writer_t* writer, Uint8 channel, Uint64 time_us, const can_message_t* message);
+SDL_bool pcapng_flush(pcapng_writer_t* writer);
+SDL_bool pcapng_finish(pcapng_writer_t* writer);
+SDL_bool pcapng_start(const char* file_name);
+void     pcapng_stop(void);
+SDL_bool pcapng_is_active(void);
+void     pcapng_record(Uint8 channel, const can_message_t* messages, int count);
+void     pcapng_print_status(void);
+void     pcapng_deinit(void);
+int      lua_pcapng_start(lua_State* L);
+int      lua_pcapng_stop(lua_State* L);
+void     lua_register_pcapng_commands(core_t* core);
+
+#endif /* PCAPNG_H */
@@ -14,14 +14,24 @@
 #include "printf.h"
 #include "table.h"
 
-static pdo_t pdo[PDO_MAX];
+static pdo_t         pdo[CAN_CHANNEL_MAX][PDO_MAX];
+static can_message_t pdo_batch[PDO_MAX];
+static SDL_SpinLock  pdo_lock;
+static SDL_TimerID   scheduler_id;
 
 static Uint32 pdo_send_callback(Uint32 interval, void *param);
+static void   restart_scheduler(void);
 
-void pdo_add(Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data)
+void pdo_add(Uint8 channel, Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data)
 {
     int index;
 
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        c_log(LOG_WARNING, "Invalid CAN channel");
+        return;
+    }
+
     // Check CAN-ID.
     if (SDL_FALSE == pdo_is_id_valid(can_id))
     {
@@ -35,17 +45,27 @@ void pdo_add(Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data)
     }
 
     // Delete PDO to avoid duplicate entries.
-    pdo_del(can_id);
+    pdo_del(channel, can_id);
+
+    if (0 == event_time_ms)
+    {
+        event_time_ms = 1;
+    }
 
     // Find empty slot.
     for (index = 0; index < PDO_MAX; index += 1)
     {
-        if (0 == pdo[index].can_id)
+        if (0 == pdo[channel][index].can_id)
         {
-            pdo[index].can_id = can_id;
-            pdo[index].length = length;
-            pdo[index].data   = data;
-            pdo[index].id     = SDL_AddTimer(event_time_ms, pdo_send_callback, &pdo[index]);
+            SDL_AtomicLock(&pdo_lock);
+            pdo[channel][index].can_id        = can_id;
+            pdo[channel][index].length        = length;
+            pdo[channel][index].data          = data;
+            pdo[channel][index].event_time_ms = event_time_ms;
+            pdo[channel][index].next_due_ms   = SDL_GetTicks64() + event_time_ms;
+            SDL_AtomicUnlock(&pdo_lock);
+
+            restart_scheduler();
             return;
         }
     }
@@ -53,10 +73,16 @@ void pdo_add(Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data)
     c_log(LOG_WARNING, "No empty PDO slot available");
 }
 
-void pdo_del(Uint16 can_id)
+void pdo_del(Uint8 channel, Uint16 can_id)
 {
     int index;
 
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        c_log(LOG_WARNING, "Invalid CAN channel");
+        return;
+    }
+
     // Check CAN-ID.
     if (SDL_FALSE == pdo_is_id_valid(can_id))
     {
@@ -66,13 +92,13 @@ void pdo_del(Uint16 can_id)
 
     for (index = 0; index < PDO_MAX; index += 1)
     {
-        if (can_id == pdo[index].can_id)
+        if (can_id == pdo[channel][index].can_id)
         {
-            pdo[index].can_id = 0;
-            pdo[index].length = 0;
-            pdo[index].data   = 0;
-
-            SDL_RemoveTimer(pdo[index].id);
+            SDL_AtomicLock(&pdo_lock);
+            pdo[channel][index].can_id = 0;
+            pdo[channel][index].length = 0;
+            pdo[channel][index].data   = 0;
+            SDL_AtomicUnlock(&pdo_lock);
             return;
         }
     }
@@ -86,17 +112,19 @@ int lua_pdo_add(lua_State* L)
     Uint32 data_d0_d3    = luaL_checkinteger(L, 4);
     Uint32 data_d4_d7    = luaL_checkinteger(L, 5);
     Uint64 data          = ((Uint64)data_d0_d3 << 32) | data_d4_d7;
+    int    channel       = luaL_optinteger(L, 6, 0);
 
-    pdo_add(can_id, event_time_ms, length, data);
+    pdo_add(channel, can_id, event_time_ms, length, data);
 
     return 1;
 }
 
 int lua_pdo_del(lua_State* L)
 {
-    int can_id = luaL_checkinteger(L, 1);
+    int can_id  = luaL_checkinteger(L, 1);
+    int channel = luaL_optinteger(L, 2, 0);
 
-    pdo_del(can_id);
+    pdo_del(channel, can_id);
 
     return 1;
 }
@@ -110,25 +138,93 @@ void lua_register_pdo_commands(core_t* core)
     lua_setglobal(core->L, "pdo_del");
 }
 
-static Uint32 pdo_send_callback(Uint32 interval, void *pdo_pt)
+/* A single scheduler timer serves all PDOs.  Every time it fires, all
+ * PDOs that are due are sent in one batch per channel, and the timer
+ * is re-armed for the next due PDO.
+ */
+static Uint32 pdo_send_callback(Uint32 interval, void *unused)
 {
-    int           index;
-    int           offset  = 0;
-    pdo_t*        pdo     = pdo_pt;
-    can_message_t message = { 0 };
+    Uint64 now         = SDL_GetTicks64();
+    Uint64 next_due_ms = 0;
+    Uint8  channel;
+
+    (void)interval;
+    (void)unused;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        int count = 0;
+        int index;
+
+        SDL_AtomicLock(&pdo_lock);
+        for (index = 0; index < PDO_MAX; index += 1)
+        {
+            pdo_t* entry = &pdo[channel][index];
 
-    message.id     = pdo->can_id;
-    message.length = pdo->length;
+            if (0 == entry->can_id)
+            {
+                continue;
+            }
 
-    for (index = (pdo->length - 1); index >= 0; index -= 1)
+            if (entry->next_due_ms <= now)
+            {
+                can_message_t* message = &pdo_batch[count];
+                int            offset  = 0;
+                int            data_index;
+
+                message->id     = entry->can_id;
+                message->length = entry->length;
+
+                for (data_index = (entry->length - 1); data_index >= 0; data_index -= 1)
+                {
+                    message->data[data_index] = ((entry->data >> offset) & 0xFF);
+                    offset += 8;
+                }
+                count += 1;
+
+                entry->next_due_ms += entry->event_time_ms;
+                if (entry->next_due_ms <= now)
+                {
+                    // Do not try to catch up on missed cycles.
+                    entry->next_due_ms = now + entry->event_time_ms;
+                }
+            }
+
+            if ((0 == next_due_ms) || (entry->next_due_ms < next_due_ms))
+            {
+                next_due_ms = entry->next_due_ms;
+            }
+        }
+        SDL_AtomicUnlock(&pdo_lock);
+
+        if (count > 0)
+        {
+            can_write_batch(channel, pdo_batch, count, NULL);
+        }
+    }
+
+    if (0 == next_due_ms)
     {
-        message.data[index] = ((pdo->data >> offset) & 0xFF);
-        offset += 8;
+        return 0;
     }
 
-    can_write(&message);
+    now = SDL_GetTicks64();
+    if (next_due_ms <= now)
+    {
+        return 1;
+    }
+
+    return (Uint32)(next_due_ms - now);
+}
+
+static void restart_scheduler(void)
+{
+    if (0 != scheduler_id)
+    {
+        SDL_RemoveTimer(scheduler_id);
+    }
 
-    return interval;
+    scheduler_id = SDL_AddTimer(1, pdo_send_callback, NULL);
 }
 
 void pdo_print_help(void)
@@ -17,15 +17,16 @@
 
 typedef struct pdo
 {
-    SDL_TimerID id;
-    Uint16      can_id;
-    Uint8       length;
-    Uint64      data;
+    Uint64 next_due_ms;
+    Uint32 event_time_ms;
+    Uint16 can_id;
+    Uint8  length;
+    Uint64 data;
 
 } pdo_t;
 
-void     pdo_add(Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data);
-void     pdo_del(Uint16 can_id);
+void     pdo_add(Uint8 channel, Uint16 can_id, Uint32 event_time_ms, Uint8 length, Uint64 data);
+void     pdo_del(Uint8 channel, Uint16 can_id);
 int      lua_pdo_add(lua_State* L);
 int      lua_pdo_del(lua_State* L);
 void     lua_register_pdo_commands(core_t* core);
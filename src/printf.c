@@ -9,6 +9,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 #ifdef _WIN32
 #include <windows.h>
 static HANDLE console = NULL;
@@ -16,8 +17,109 @@ static WORD   default_attr;
 #endif /* _WIN32 */
 
 #include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "core.h"
 #include "printf.h"
 
+#define LOG_QUEUE_SIZE    256 // Must be a power of two.
+#define LOG_OUTPUT_SIZE   8192
+#define LOG_WAIT_IN_MS    100
+#define LOG_BLOCK_IN_MS   100
+#define LOG_REPEAT_IN_MS  5000
+#define COLOR_MARK        '\x01' // Followed by COLOR_OFFSET + color_t.
+#define COLOR_OFFSET      0x10
+
+typedef enum log_entry_type
+{
+    LOG_ENTRY_TEXT = 0,
+    LOG_ENTRY_PROMPT,
+    LOG_ENTRY_CLEAR
+
+} log_entry_type_t;
+
+typedef struct log_entry
+{
+    SDL_atomic_t     sequence;
+    log_entry_type_t type;
+    log_level_t      level;
+    SDL_bool         is_shown; // On the console, at the time of the call
+    size_t           length;
+    char             text[C_BUFFER_SIZE];
+
+} log_entry_t;
+
+typedef struct log_sink
+{
+    char        file_name[256];
+    SDL_RWops*  file;
+    Uint64      size;
+    Uint64      size_max;
+    int         count;
+    log_level_t level;
+
+} log_sink_t;
+
+/* Messages of all threads are passed through a lock-free bounded queue
+ * (multiple producers, one consumer) to the console writer thread,
+ * which merges consecutive runs of the same colour and writes all
+ * pending messages at once.  Until the thread is started and after it
+ * was stopped, the producers write the queue out themselves.
+ *
+ * The sequence of every entry is stored relative to its index, so that
+ * the zero-initialised queue is valid before c_log_init() was called.
+ */
+typedef struct log_pipeline
+{
+    log_entry_t  entry[LOG_QUEUE_SIZE];
+    SDL_atomic_t head;
+    Uint32       tail;
+    SDL_SpinLock consumer_lock;
+    SDL_sem*     event;
+    SDL_Thread*  thread;
+    SDL_atomic_t is_running;
+    SDL_atomic_t level;        // Of the console
+    SDL_atomic_t format_level; // Lowest level of the console and all sinks
+    SDL_atomic_t dropped;
+    int          dropped_reported;
+    SDL_mutex*   sink_mutex;
+    log_sink_t   sink[LOG_SINK_MAX];
+
+    // Only used by the consumer.
+    char         output[LOG_OUTPUT_SIZE];
+    size_t       output_used;
+    color_t      color;
+    SDL_bool     is_colored;
+    char         repeat_text[C_BUFFER_SIZE];
+    size_t       repeat_length;
+    log_level_t  repeat_level;
+    SDL_bool     is_repeat_shown;
+    Uint32       repeat_count;
+    Uint32       repeat_ms;
+
+} log_pipeline_t;
+
+static log_pipeline_t pipeline;
+
+static const char* level_name[] = { "", "", "info", "success", "warning", "error" };
+
+static void     format_log(c_buffer_t* b, const log_level_t level, const char* message);
+static void     submit(const log_entry_type_t type, const log_level_t level, const char* text, size_t length);
+static void     drain(void);
+static void     process_entry(const log_entry_t* entry);
+static void     emit(const char* text, size_t length, const log_level_t level, SDL_bool is_shown);
+static void     report_repeats(void);
+static void     report_dropped(void);
+static void     render(const char* text, size_t length);
+static void     set_color(const color_t color);
+static void     clear_console(void);
+static void     flush_output(SDL_bool is_reset);
+static void     write_sink(log_sink_t* sink, const char* text, size_t length, const log_level_t level);
+static void     rotate_sink(log_sink_t* sink);
+static void     close_sink(log_sink_t* sink);
+static void     update_format_level(void);
+static int      log_writer(void* unused);
+
 #ifdef _WIN32
 static int printf_init(void)
 {
@@ -43,29 +145,11 @@ static int printf_init(void)
     default_attr = info.wAttributes;
     return 0;
 }
-#endif /* _WIN32 */
 
-void c_printf(const color_t color, const char* format, ...)
+static WORD get_attribute(const color_t color)
 {
-    char    buffer[1024];
-    va_list varg;
-
-#ifdef _WIN32
     WORD attr = 0;
 
-    if (INVALID_HANDLE_VALUE == console)
-    {
-        console = NULL;
-    }
-
-    if (NULL == console)
-    {
-        if (0 != printf_init())
-        {
-            return;
-        }
-    }
-
     switch(color)
     {
         default:
@@ -109,116 +193,891 @@ void c_printf(const color_t color, const char* format, ...)
         attr |= FOREGROUND_INTENSITY;
     }
 
+    return attr;
+}
+
 #elif defined __linux__
-    switch(color)
+static const char* get_sequence(const color_t color)
+{
+    // In the order of color_t.
+    static const char* sequence[] =
     {
-        default:
-            break;
-        case DARK_BLACK:
-            printf("\e[0;30m");
-            break;
-        case DARK_BLUE:
-            printf("\e[0;34m");
-            break;
-        case DARK_GREEN:
-            printf("\e[0;32m");
-            break;
-        case DARK_CYAN:
-            printf("\e[0;36m");
-            break;
-        case DARK_RED:
-            printf("\e[0;31m");
-            break;
-        case DARK_MAGENTA:
-            printf("\e[0;35m");
-            break;
-        case DARK_YELLOW:
-            printf("\e[0;33m");
-            break;
-        case DARK_WHITE:
-            printf("\e[0;37m");
-            break;
-        case LIGHT_BLACK:
-            printf("\e[0;90m");
-            break;
-        case LIGHT_BLUE:
-            printf("\e[0;94m");
-            break;
-        case LIGHT_GREEN:
-            printf("\e[0;92m");
-            break;
-        case LIGHT_CYAN:
-            printf("\e[0;96m");
-            break;
-        case LIGHT_RED:
-            printf("\e[0;91m");
-            break;
-        case LIGHT_MAGENTA:
-            printf("\e[0;95m");
-            break;
-        case LIGHT_YELLOW:
-            printf("\e[0;93m");
-            break;
-        case LIGHT_WHITE:
-            printf("\e[0;97m");
-            break;
+        "\e[0;30m", "\e[0;34m", "\e[0;32m", "\e[0;36m",
+        "\e[0;31m", "\e[0;35m", "\e[0;33m", "\e[0;37m",
+        "\e[0;90m", "\e[0;94m", "\e[0;92m", "\e[0;96m",
+        "\e[0;91m", "\e[0;95m", "\e[0;93m", "\e[0;97m"
+    };
+
+    if ((color < DARK_BLACK) || (color > LIGHT_WHITE))
+    {
+        return "";
     }
 
+    return sequence[color];
+}
 #endif /* _WIN32 */
 
-   va_start(varg, format);
-   SDL_vsnprintf(buffer, 1024, format, varg);
-   va_end(varg);
-
-#ifdef _WIN32
-   SetConsoleTextAttribute(console, attr);
-#endif
+void c_printf(const color_t color, const char* format, ...)
+{
+    char       buffer[1024];
+    c_buffer_t b;
+    va_list    varg;
 
-   printf("%s", buffer);
+    va_start(varg, format);
+    SDL_vsnprintf(buffer, 1024, format, varg);
+    va_end(varg);
 
-#ifdef _WIN32
-   SetConsoleTextAttribute(console, default_attr);
-#elif defined __linux__
-   printf("\e[0m");
-#endif
+    c_buffer_init(&b);
+    c_buffer_append(&b, color, buffer, SDL_strlen(buffer));
+    c_buffer_flush(&b);
 }
 
 void c_print_prompt(void)
 {
-    c_printf(LIGHT_WHITE, "\r: ");
+    c_buffer_t b;
+
+    c_buffer_init(&b);
+    c_buffer_append(&b, LIGHT_WHITE, "\r: ", 3);
+    submit(LOG_ENTRY_PROMPT, LOG_DEFAULT, b.text, b.used);
+}
+
+// Moves the cursor home and clears the console without scrolling.
+void c_clear_screen(void)
+{
+    submit(LOG_ENTRY_CLEAR, LOG_DEFAULT, NULL, 0);
 }
 
+/* Messages of disabled levels are dropped before they are formatted.
+ * Repeated warnings and errors are collapsed by the console writer.
+ */
 void c_log(const log_level_t level, const char* format, ...)
 {
-    char    buffer[1024];
-    va_list varg;
+    char       buffer[1024];
+    c_buffer_t b;
+    va_list    varg;
 
     if (LOG_SUPPRESS == level)
     {
         return;
     }
 
+    if ((level >= LOG_INFO) && ((int)level < SDL_AtomicGet(&pipeline.format_level)))
+    {
+        return;
+    }
+
     va_start(varg, format);
     SDL_vsnprintf(buffer, 1024, format, varg);
     va_end(varg);
 
+    c_buffer_init(&b);
+    format_log(&b, level, buffer);
+    submit(LOG_ENTRY_TEXT, level, b.text, b.used);
+}
+
+void c_buffer_init(c_buffer_t* b)
+{
+    b->used       = 0;
+    b->color      = DARK_WHITE;
+    b->is_colored = SDL_FALSE;
+}
+
+void c_buffer_append(c_buffer_t* b, const color_t color, const char* text, size_t length)
+{
+    while (length > 0)
+    {
+        size_t chunk;
+
+        // The colour of blanks is not visible, so they continue the run.
+        if ((SDL_FALSE == b->is_colored) || ((color != b->color) && (' ' != *text)))
+        {
+            if ((b->used + 2) > sizeof(b->text))
+            {
+                c_buffer_flush(b);
+            }
+
+            b->text[b->used]     = COLOR_MARK;
+            b->text[b->used + 1] = (char)(COLOR_OFFSET + color);
+            b->used             += 2;
+            b->color             = color;
+            b->is_colored        = SDL_TRUE;
+        }
+
+        if (color == b->color)
+        {
+            chunk = length;
+        }
+        else
+        {
+            for (chunk = 0; (chunk < length) && (' ' == text[chunk]); chunk += 1);
+        }
+        chunk = SDL_min(chunk, sizeof(b->text) - b->used);
+
+        if (0 == chunk)
+        {
+            c_buffer_flush(b);
+            continue;
+        }
+
+        SDL_memcpy(&b->text[b->used], text, chunk);
+        b->used += chunk;
+        text    += chunk;
+        length  -= chunk;
+    }
+}
+
+void c_buffer_flush(c_buffer_t* b)
+{
+    if (b->used > 0)
+    {
+        submit(LOG_ENTRY_TEXT, LOG_DEFAULT, b->text, b->used);
+    }
+
+    b->used       = 0;
+    b->is_colored = SDL_FALSE;
+}
+
+SDL_bool c_log_init(void)
+{
+#ifdef _WIN32
+    if (0 != printf_init())
+    {
+        console = NULL;
+    }
+#endif
+
+    pipeline.sink_mutex = SDL_CreateMutex();
+    pipeline.event      = SDL_CreateSemaphore(0);
+
+    if ((NULL == pipeline.sink_mutex) || (NULL == pipeline.event))
+    {
+        c_log(LOG_ERROR, "Could not initialise console writer: %s", SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    SDL_AtomicSet(&pipeline.is_running, 1);
+    pipeline.thread = SDL_CreateThread(log_writer, "Console writer thread", NULL);
+    if (NULL == pipeline.thread)
+    {
+        SDL_AtomicSet(&pipeline.is_running, 0);
+        c_log(LOG_WARNING, "Could not create console writer thread: %s", SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+// Writes all pending messages, which are written directly afterwards.
+void c_log_deinit(void)
+{
+    if (NULL != pipeline.thread)
+    {
+        SDL_AtomicSet(&pipeline.is_running, 0);
+        SDL_SemPost(pipeline.event);
+        SDL_WaitThread(pipeline.thread, NULL);
+        pipeline.thread = NULL;
+    }
+
+    drain();
+    c_log_close();
+
+    if (NULL != pipeline.event)
+    {
+        SDL_DestroySemaphore(pipeline.event);
+        pipeline.event = NULL;
+    }
+
+    if (NULL != pipeline.sink_mutex)
+    {
+        SDL_DestroyMutex(pipeline.sink_mutex);
+        pipeline.sink_mutex = NULL;
+    }
+}
+
+SDL_bool c_log_parse_level(const char* name, log_level_t* level)
+{
+    int index;
+
+    if (NULL == name)
+    {
+        return SDL_FALSE;
+    }
+
+    for (index = LOG_INFO; index <= LOG_ERROR; index += 1)
+    {
+        if (0 == SDL_strcasecmp(name, level_name[index]))
+        {
+            *level = (log_level_t)index;
+            return SDL_TRUE;
+        }
+    }
+
+    return SDL_FALSE;
+}
+
+// Messages below the level are no longer shown on the console.
+void c_log_set_level(const log_level_t level)
+{
+    SDL_AtomicSet(&pipeline.level, (int)level);
+    update_format_level();
+}
+
+/* The file is rotated once it exceeds size_kib: file_name becomes
+ * file_name.1 and so on, up to count old files are kept.  Every message
+ * of at least the given level is written, together with all other
+ * output.
+ */
+SDL_bool c_log_open(const char* file_name, Uint32 size_kib, int count, const log_level_t level)
+{
+    log_sink_t* sink = NULL;
+    int         index;
+
+    if (NULL == pipeline.sink_mutex)
+    {
+        c_log(LOG_WARNING, "Could not open log file: console writer not initialised");
+        return SDL_FALSE;
+    }
+
+    SDL_LockMutex(pipeline.sink_mutex);
+    for (index = 0; index < LOG_SINK_MAX; index += 1)
+    {
+        if ((NULL != pipeline.sink[index].file) && (0 == SDL_strcmp(pipeline.sink[index].file_name, file_name)))
+        {
+            SDL_UnlockMutex(pipeline.sink_mutex);
+            c_log(LOG_WARNING, "Log file %s already open", file_name);
+            return SDL_FALSE;
+        }
+
+        if ((NULL == sink) && (NULL == pipeline.sink[index].file))
+        {
+            sink = &pipeline.sink[index];
+        }
+    }
+
+    if (NULL == sink)
+    {
+        SDL_UnlockMutex(pipeline.sink_mutex);
+        c_log(LOG_WARNING, "Could not open log file: all %d log files in use", LOG_SINK_MAX);
+        return SDL_FALSE;
+    }
+
+    sink->file = SDL_RWFromFile(file_name, "ab");
+    if (NULL == sink->file)
+    {
+        SDL_UnlockMutex(pipeline.sink_mutex);
+        c_log(LOG_ERROR, "Could not open log file %s: %s", file_name, SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    SDL_strlcpy(sink->file_name, file_name, sizeof(sink->file_name));
+    sink->size     = (Uint64)SDL_max(SDL_RWsize(sink->file), 0);
+    sink->size_max = (Uint64)size_kib * 1024;
+    sink->count    = SDL_max(count, 0);
+    sink->level    = level;
+    SDL_UnlockMutex(pipeline.sink_mutex);
+
+    update_format_level();
+
+    c_log(LOG_SUCCESS, "Logging to %s", file_name);
+    return SDL_TRUE;
+}
+
+void c_log_close(void)
+{
+    int index;
+
+    if (NULL == pipeline.sink_mutex)
+    {
+        return;
+    }
+
+    SDL_LockMutex(pipeline.sink_mutex);
+    for (index = 0; index < LOG_SINK_MAX; index += 1)
+    {
+        close_sink(&pipeline.sink[index]);
+    }
+    SDL_UnlockMutex(pipeline.sink_mutex);
+
+    update_format_level();
+}
+
+void c_log_print_status(void)
+{
+    log_sink_t sink[LOG_SINK_MAX];
+    int        level = SDL_AtomicGet(&pipeline.level);
+    int        index;
+
+    c_log(LOG_INFO, "Console level %s, %d messages dropped",
+          level_name[SDL_max(level, LOG_INFO)],
+          SDL_AtomicGet(&pipeline.dropped));
+
+    if (NULL == pipeline.sink_mutex)
+    {
+        return;
+    }
+
+    // Copied, since c_log() may write the queue out itself.
+    SDL_LockMutex(pipeline.sink_mutex);
+    SDL_memcpy(sink, pipeline.sink, sizeof(sink));
+    SDL_UnlockMutex(pipeline.sink_mutex);
+
+    for (index = 0; index < LOG_SINK_MAX; index += 1)
+    {
+        if (NULL != sink[index].file)
+        {
+            c_log(LOG_INFO, "Log file %s, level %s, %llu of %llu bytes, %d old files kept",
+                  sink[index].file_name,
+                  level_name[sink[index].level],
+                  (unsigned long long)sink[index].size,
+                  (unsigned long long)sink[index].size_max,
+                  sink[index].count);
+        }
+    }
+}
+
+int lua_log_level(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    log_level_t level;
+
+    if (SDL_FALSE == c_log_parse_level(name, &level))
+    {
+        c_log(LOG_WARNING, "Unknown log level: %s", name);
+        return 0;
+    }
+
+    c_log_set_level(level);
+
+    return 0;
+}
+
+int lua_log_open(lua_State* L)
+{
+    const char* file_name = luaL_checkstring(L, 1);
+    Uint32      size_kib  = (Uint32)luaL_optinteger(L, 2, LOG_FILE_SIZE_IN_KIB);
+    int         count     = (int)luaL_optinteger(L, 3, LOG_FILE_COUNT);
+    const char* name      = luaL_optstring(L, 4, "info");
+    log_level_t level;
+
+    if (SDL_FALSE == c_log_parse_level(name, &level))
+    {
+        c_log(LOG_WARNING, "Unknown log level: %s", name);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    lua_pushboolean(L, c_log_open(file_name, size_kib, count, level));
+
+    return 1;
+}
+
+int lua_log_close(lua_State* L)
+{
+    (void)L;
+
+    c_log_close();
+
+    return 0;
+}
+
+void lua_register_log_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_log_level);
+    lua_setglobal(core->L, "log_level");
+
+    lua_pushcfunction(core->L, lua_log_open);
+    lua_setglobal(core->L, "log_open");
+
+    lua_pushcfunction(core->L, lua_log_close);
+    lua_setglobal(core->L, "log_close");
+}
+
+static void format_log(c_buffer_t* b, const log_level_t level, const char* message)
+{
     switch(level)
     {
         default:
         case LOG_DEFAULT:
             break;
         case LOG_INFO:
-            c_printf(DARK_WHITE,  "[INFO]    ");
+            c_buffer_append(b, DARK_WHITE,  "[INFO]    ", 10);
             break;
         case LOG_SUCCESS:
-            c_printf(LIGHT_GREEN, "[SUCCESS] ");
+            c_buffer_append(b, LIGHT_GREEN, "[SUCCESS] ", 10);
             break;
         case LOG_WARNING:
-            c_printf(DARK_YELLOW, "[WARNING] ");
+            c_buffer_append(b, DARK_YELLOW, "[WARNING] ", 10);
             break;
         case LOG_ERROR:
-            c_printf(LIGHT_RED,   "[ERROR]   ");
+            c_buffer_append(b, LIGHT_RED,   "[ERROR]   ", 10);
             break;
     }
-    c_printf(DARK_WHITE, "%s\r\n", buffer);
+    c_buffer_append(b, DARK_WHITE, message, SDL_strlen(message));
+    c_buffer_append(b, DARK_WHITE, "\r\n", 2);
+}
+
+/* Blocks for up to LOG_BLOCK_IN_MS if the queue is full, e.g. on a
+ * slow serial console, before the message is dropped.
+ */
+static void submit(const log_entry_type_t type, const log_level_t level, const char* text, size_t length)
+{
+    log_entry_t* entry;
+    Uint32       position;
+    Uint32       wait_ms    = 0;
+    SDL_bool     is_waiting = SDL_FALSE;
+
+    while (1)
+    {
+        int difference;
+
+        position   = (Uint32)SDL_AtomicGet(&pipeline.head);
+        entry      = &pipeline.entry[position & (LOG_QUEUE_SIZE - 1)];
+        difference = (int)((Uint32)SDL_AtomicGet(&entry->sequence) + (position & (LOG_QUEUE_SIZE - 1)) - position);
+
+        if (0 == difference)
+        {
+            if (SDL_TRUE == SDL_AtomicCAS(&pipeline.head, (int)position, (int)(position + 1)))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            if (0 == SDL_AtomicGet(&pipeline.is_running))
+            {
+                drain();
+            }
+            else if (SDL_FALSE == is_waiting)
+            {
+                is_waiting = SDL_TRUE;
+                wait_ms    = SDL_GetTicks();
+            }
+            else if ((SDL_GetTicks() - wait_ms) >= LOG_BLOCK_IN_MS)
+            {
+                SDL_AtomicIncRef(&pipeline.dropped);
+                return;
+            }
+            else
+            {
+                SDL_SemPost(pipeline.event);
+                SDL_Delay(1);
+            }
+        }
+    }
+
+    entry->type     = type;
+    entry->level    = level;
+    entry->is_shown = ((level < LOG_INFO) || ((int)level >= SDL_AtomicGet(&pipeline.level))) ? SDL_TRUE : SDL_FALSE;
+    entry->length   = SDL_min(length, sizeof(entry->text));
+    if (entry->length > 0)
+    {
+        SDL_memcpy(entry->text, text, entry->length);
+    }
+    SDL_AtomicSet(&entry->sequence, (int)(position + 1 - (position & (LOG_QUEUE_SIZE - 1))));
+
+    if (0 != SDL_AtomicGet(&pipeline.is_running))
+    {
+        SDL_SemPost(pipeline.event);
+    }
+    else
+    {
+        drain();
+    }
+}
+
+// Writes all queued messages, only one thread at a time.
+static void drain(void)
+{
+    SDL_AtomicLock(&pipeline.consumer_lock);
+
+    if (NULL != pipeline.sink_mutex)
+    {
+        SDL_LockMutex(pipeline.sink_mutex);
+    }
+
+    while (1)
+    {
+        Uint32       index = pipeline.tail & (LOG_QUEUE_SIZE - 1);
+        log_entry_t* entry = &pipeline.entry[index];
+
+        if ((Uint32)SDL_AtomicGet(&entry->sequence) + index != (pipeline.tail + 1))
+        {
+            break;
+        }
+
+        process_entry(entry);
+
+        SDL_AtomicSet(&entry->sequence, (int)(pipeline.tail + LOG_QUEUE_SIZE - index));
+        pipeline.tail += 1;
+    }
+
+    if ((pipeline.repeat_count > 0) && ((SDL_GetTicks() - pipeline.repeat_ms) >= LOG_REPEAT_IN_MS))
+    {
+        report_repeats();
+    }
+    report_dropped();
+
+    flush_output(SDL_TRUE);
+
+    if (NULL != pipeline.sink_mutex)
+    {
+        SDL_UnlockMutex(pipeline.sink_mutex);
+    }
+
+    SDL_AtomicUnlock(&pipeline.consumer_lock);
+}
+
+static void process_entry(const log_entry_t* entry)
+{
+    switch (entry->type)
+    {
+        case LOG_ENTRY_PROMPT:
+            render(entry->text, entry->length);
+            return;
+        case LOG_ENTRY_CLEAR:
+            clear_console();
+            return;
+        default:
+        case LOG_ENTRY_TEXT:
+            break;
+    }
+
+    if (entry->level < LOG_WARNING)
+    {
+        emit(entry->text, entry->length, entry->level, entry->is_shown);
+        return;
+    }
+
+    // Only repeats within LOG_REPEAT_IN_MS of the shown message are
+    // merged, a later one is shown again.
+    if ((entry->length == pipeline.repeat_length) &&
+        (0 == SDL_memcmp(entry->text, pipeline.repeat_text, entry->length)) &&
+        ((SDL_GetTicks() - pipeline.repeat_ms) < LOG_REPEAT_IN_MS))
+    {
+        pipeline.repeat_count += 1;
+        return;
+    }
+
+    report_repeats();
+    SDL_memcpy(pipeline.repeat_text, entry->text, entry->length);
+    pipeline.repeat_length = entry->length;
+    pipeline.repeat_level    = entry->level;
+    pipeline.is_repeat_shown = entry->is_shown;
+    pipeline.repeat_ms       = SDL_GetTicks();
+
+    emit(entry->text, entry->length, entry->level, entry->is_shown);
+}
+
+static void emit(const char* text, size_t length, const log_level_t level, SDL_bool is_shown)
+{
+    int index;
+
+    if (SDL_TRUE == is_shown)
+    {
+        render(text, length);
+    }
+
+    for (index = 0; index < LOG_SINK_MAX; index += 1)
+    {
+        log_sink_t* sink = &pipeline.sink[index];
+
+        if ((NULL != sink->file) && ((level < LOG_INFO) || (level >= sink->level)))
+        {
+            write_sink(sink, text, length, level);
+        }
+    }
+}
+
+static void report_repeats(void)
+{
+    char       message[64];
+    c_buffer_t b;
+
+    if (0 == pipeline.repeat_count)
+    {
+        return;
+    }
+
+    SDL_snprintf(message, sizeof(message), "Last message repeated %u times", pipeline.repeat_count);
+    c_buffer_init(&b);
+    format_log(&b, pipeline.repeat_level, message);
+    emit(b.text, b.used, pipeline.repeat_level, pipeline.is_repeat_shown);
+
+    // The next occurrence is shown verbatim.
+    pipeline.repeat_count  = 0;
+    pipeline.repeat_length = 0;
+}
+
+static void report_dropped(void)
+{
+    char       message[64];
+    c_buffer_t b;
+    int        dropped = SDL_AtomicGet(&pipeline.dropped);
+
+    if (dropped == pipeline.dropped_reported)
+    {
+        return;
+    }
+
+    SDL_snprintf(message, sizeof(message), "%d messages dropped", dropped - pipeline.dropped_reported);
+    c_buffer_init(&b);
+    format_log(&b, LOG_WARNING, message);
+    emit(b.text, b.used, LOG_WARNING, SDL_TRUE);
+
+    pipeline.dropped_reported = dropped;
+}
+
+// Translates the colour marks of the text for the console.
+static void render(const char* text, size_t length)
+{
+    size_t index = 0;
+
+    while (index < length)
+    {
+        size_t start = index;
+
+        if ((COLOR_MARK == text[index]) && ((index + 1) < length))
+        {
+            set_color((color_t)(text[index + 1] - COLOR_OFFSET));
+            index += 2;
+            continue;
+        }
+
+        while ((index < length) && (COLOR_MARK != text[index]))
+        {
+            index += 1;
+        }
+
+        while (start < index)
+        {
+            size_t chunk = SDL_min(index - start, sizeof(pipeline.output) - pipeline.output_used);
+
+            if (0 == chunk)
+            {
+                flush_output(SDL_FALSE);
+                continue;
+            }
+
+            SDL_memcpy(&pipeline.output[pipeline.output_used], &text[start], chunk);
+            pipeline.output_used += chunk;
+            start                += chunk;
+        }
+    }
+}
+
+static void set_color(const color_t color)
+{
+    if ((SDL_TRUE == pipeline.is_colored) && (color == pipeline.color))
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    flush_output(SDL_FALSE);
+    if (NULL != console)
+    {
+        SetConsoleTextAttribute(console, get_attribute(color));
+    }
+#elif defined __linux__
+    {
+        const char* sequence = get_sequence(color);
+        size_t      length   = SDL_strlen(sequence);
+
+        if ((pipeline.output_used + length) > sizeof(pipeline.output))
+        {
+            flush_output(SDL_FALSE);
+        }
+        SDL_memcpy(&pipeline.output[pipeline.output_used], sequence, length);
+        pipeline.output_used += length;
+    }
+#endif
+
+    pipeline.color      = color;
+    pipeline.is_colored = SDL_TRUE;
+}
+
+static void clear_console(void)
+{
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    COORD                      home = { 0, 0 };
+    DWORD                      written;
+
+    flush_output(SDL_FALSE);
+    if ((NULL != console) && (0 != GetConsoleScreenBufferInfo(console, &info)))
+    {
+        FillConsoleOutputCharacterA(console, ' ', (DWORD)(info.dwSize.X * info.dwSize.Y), home, &written);
+        FillConsoleOutputAttribute(console, default_attr, (DWORD)(info.dwSize.X * info.dwSize.Y), home, &written);
+        SetConsoleCursorPosition(console, home);
+    }
+#else
+    render("\e[H\e[J", 6);
+#endif
+}
+
+// The default colour is restored once all pending messages are written.
+static void flush_output(SDL_bool is_reset)
+{
+#ifdef __linux__
+    if ((SDL_TRUE == is_reset) && (SDL_TRUE == pipeline.is_colored))
+    {
+        if ((pipeline.output_used + 4) > sizeof(pipeline.output))
+        {
+            flush_output(SDL_FALSE);
+        }
+        SDL_memcpy(&pipeline.output[pipeline.output_used], "\e[0m", 4);
+        pipeline.output_used += 4;
+    }
+#endif
+
+    if (pipeline.output_used > 0)
+    {
+        fwrite(pipeline.output, 1, pipeline.output_used, stdout);
+        fflush(stdout);
+        pipeline.output_used = 0;
+    }
+
+#ifdef _WIN32
+    if ((SDL_TRUE == is_reset) && (SDL_TRUE == pipeline.is_colored) && (NULL != console))
+    {
+        SetConsoleTextAttribute(console, default_attr);
+    }
+#endif
+
+    if (SDL_TRUE == is_reset)
+    {
+        pipeline.is_colored = SDL_FALSE;
+    }
+}
+
+// Log files get plain text, messages with a level also the local time.
+static void write_sink(log_sink_t* sink, const char* text, size_t length, const log_level_t level)
+{
+    char   line[C_BUFFER_SIZE + 32];
+    size_t used = 0;
+    size_t index;
+
+    if (level >= LOG_INFO)
+    {
+        time_t     now = time(NULL);
+        struct tm* local_time = localtime(&now);
+
+        if (NULL != local_time)
+        {
+            used = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S ", local_time);
+        }
+    }
+
+    for (index = 0; (index < length) && (used < sizeof(line)); index += 1)
+    {
+        if (COLOR_MARK == text[index])
+        {
+            index += 1;
+        }
+        else if ('\r' != text[index])
+        {
+            line[used] = text[index];
+            used      += 1;
+        }
+    }
+
+    if (SDL_RWwrite(sink->file, line, 1, used) != used)
+    {
+        char message[320];
+
+        SDL_snprintf(message, sizeof(message), "Could not write log file %s, closed", sink->file_name);
+        close_sink(sink);
+        update_format_level();
+        render(message, SDL_strlen(message));
+        render("\r\n", 2);
+        return;
+    }
+
+    sink->size += used;
+    if ((sink->size_max > 0) && (sink->size >= sink->size_max))
+    {
+        rotate_sink(sink);
+    }
+}
+
+static void rotate_sink(log_sink_t* sink)
+{
+    char old_name[270];
+    char new_name[270];
+    int  index;
+
+    SDL_RWclose(sink->file);
+    sink->file = NULL;
+
+    for (index = sink->count; index > 0; index -= 1)
+    {
+        SDL_snprintf(new_name, sizeof(new_name), "%s.%d", sink->file_name, index);
+        if (index > 1)
+        {
+            SDL_snprintf(old_name, sizeof(old_name), "%s.%d", sink->file_name, index - 1);
+        }
+        else
+        {
+            SDL_strlcpy(old_name, sink->file_name, sizeof(old_name));
+        }
+
+        // Windows does not replace existing files.
+        remove(new_name);
+        rename(old_name, new_name);
+    }
+
+    sink->file = SDL_RWFromFile(sink->file_name, "wb");
+    sink->size = 0;
+    if (NULL == sink->file)
+    {
+        update_format_level();
+    }
+}
+
+static void close_sink(log_sink_t* sink)
+{
+    if (NULL != sink->file)
+    {
+        SDL_RWclose(sink->file);
+        sink->file = NULL;
+    }
+}
+
+static void update_format_level(void)
+{
+    int level = SDL_max(SDL_AtomicGet(&pipeline.level), LOG_INFO);
+    int index;
+
+    if (NULL != pipeline.sink_mutex)
+    {
+        SDL_LockMutex(pipeline.sink_mutex);
+    }
+
+    for (index = 0; index < LOG_SINK_MAX; index += 1)
+    {
+        if (NULL != pipeline.sink[index].file)
+        {
+            level = SDL_min(level, (int)pipeline.sink[index].level);
+        }
+    }
+
+    if (NULL != pipeline.sink_mutex)
+    {
+        SDL_UnlockMutex(pipeline.sink_mutex);
+    }
+
+    SDL_AtomicSet(&pipeline.format_level, level);
+}
+
+static int log_writer(void* unused)
+{
+    (void)unused;
+
+    while (0 != SDL_AtomicGet(&pipeline.is_running))
+    {
+        SDL_SemWaitTimeout(pipeline.event, LOG_WAIT_IN_MS);
+        drain();
+    }
+
+    return 0;
 }
@@ -11,6 +11,9 @@
 #define PRINTF_H
 
 #include <stdarg.h>
+#include "SDL.h"
+#include "lua.h"
+#include "core.h"
 
 typedef enum color
 {
@@ -44,8 +47,41 @@ typedef enum log_level
 
 } log_level_t;
 
+#define C_BUFFER_SIZE         1024
+#define LOG_SINK_MAX          4
+#define LOG_FILE_SIZE_IN_KIB  10240
+#define LOG_FILE_COUNT        5
+
+/* Collects coloured text so that it is passed to the console writer as
+ * one message.  Consecutive text of the same colour is one run.
+ */
+typedef struct c_buffer
+{
+    char     text[C_BUFFER_SIZE];
+    size_t   used;
+    color_t  color;
+    SDL_bool is_colored;
+
+} c_buffer_t;
+
 void c_printf(const color_t color, const char* format, ...);
 void c_print_prompt(void);
+void c_clear_screen(void);
 void c_log(const log_level_t level, const char* format, ...);
+void c_buffer_init(c_buffer_t* b);
+void c_buffer_append(c_buffer_t* b, const color_t color, const char* text, size_t length);
+void c_buffer_flush(c_buffer_t* b);
+
+SDL_bool c_log_init(void);
+void     c_log_deinit(void);
+SDL_bool c_log_parse_level(const char* name, log_level_t* level);
+void     c_log_set_level(const log_level_t level);
+SDL_bool c_log_open(const char* file_name, Uint32 size_kib, int count, const log_level_t level);
+void     c_log_close(void);
+void     c_log_print_status(void);
+int      lua_log_level(lua_State* L);
+int      lua_log_open(lua_State* L);
+int      lua_log_close(lua_State* L);
+void     lua_register_log_commands(core_t* core);
 
 #endif /* PRINTF_H */
@@ -0,0 +1,460 @@
+/** @file replay.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "can.h"
+#include "core.h"
+#include "printf.h"
+#include "replay.h"
+#include "trace.h"
+
+#define REPLAY_SPIN_IN_US      2000
+#define REPLAY_SLEEP_MAX_IN_MS 100
+#define REPLAY_TIMEOUT_IN_MS   1000
+#define REPLAY_LATE_IN_US      1000
+#define REPLAY_BATCH_SIZE      64
+
+typedef struct replay
+{
+    SDL_atomic_t   is_active;
+    SDL_atomic_t   frames;
+    SDL_Thread*    thread;
+    trace_reader_t reader;
+    char           file_name[256];
+    Uint8          channel;
+    float          speed;
+    SDL_bool       is_looped;
+    Uint64         from_us;
+    Uint32         filter_id[REPLAY_FILTER_MAX];
+    int            filter_count;
+    Uint32         loops;
+    Uint32         failed_frames;
+    Uint32         late_frames;
+    Uint64         error_sum_us;
+    Uint64         error_max_us;
+
+} replay_t;
+
+static replay_t replay;
+
+static int      replay_run(void* unused);
+static SDL_bool send_batch(can_message_t* batch, int count);
+static SDL_bool seek_start(void);
+static SDL_bool wait_until(Uint64 deadline_us);
+
+/* A speed of 0 sends the frames as fast as the transmit queue accepts
+ * them, any other speed between REPLAY_SPEED_MIN and REPLAY_SPEED_MAX
+ * scales the original timing.  The replay starts from_us after the
+ * first frame of the trace.
+ */
+SDL_bool replay_start(const char* file_name, Uint8 channel, float speed, SDL_bool is_looped, Uint64 from_us)
+{
+    if (SDL_TRUE == replay_is_active())
+    {
+        c_log(LOG_WARNING, "Replay already running: %s", replay.file_name);
+        return SDL_FALSE;
+    }
+    else if (NULL != replay.thread)
+    {
+        SDL_WaitThread(replay.thread, NULL);
+        replay.thread = NULL;
+    }
+
+    if ((NULL == file_name) || (channel >= CAN_CHANNEL_MAX))
+    {
+        return SDL_FALSE;
+    }
+
+    if ((speed != 0.0f) && ((speed < REPLAY_SPEED_MIN) || (speed > REPLAY_SPEED_MAX)))
+    {
+        c_log(LOG_WARNING, "Replay speed must be 0 or between %.1f and %.1f", REPLAY_SPEED_MIN, REPLAY_SPEED_MAX);
+        return SDL_FALSE;
+    }
+
+    if (SDL_FALSE == trace_open(&replay.reader, file_name))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_strlcpy(replay.file_name, file_name, sizeof(replay.file_name));
+    replay.channel       = channel;
+    replay.speed         = speed;
+    replay.is_looped     = is_looped;
+    replay.from_us       = from_us;
+    replay.loops         = 0;
+    replay.failed_frames = 0;
+    replay.late_frames   = 0;
+    replay.error_sum_us  = 0;
+    replay.error_max_us  = 0;
+    SDL_AtomicSet(&replay.frames, 0);
+    SDL_AtomicSet(&replay.is_active, 1);
+
+    replay.thread = SDL_CreateThread(replay_run, "Replay thread", NULL);
+    if (NULL == replay.thread)
+    {
+        SDL_AtomicSet(&replay.is_active, 0);
+        trace_close(&replay.reader);
+        c_log(LOG_ERROR, "Could not create replay thread: %s", SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    c_log(LOG_SUCCESS, "Replaying %s on CAN channel %u", replay.file_name, channel);
+    return SDL_TRUE;
+}
+
+void replay_stop(void)
+{
+    if (NULL == replay.thread)
+    {
+        c_log(LOG_WARNING, "No replay running");
+        return;
+    }
+
+    SDL_AtomicSet(&replay.is_active, 0);
+    SDL_WaitThread(replay.thread, NULL);
+    replay.thread = NULL;
+}
+
+SDL_bool replay_is_active(void)
+{
+    return (0 != SDL_AtomicGet(&replay.is_active)) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Only frames with one of the given COB-IDs are replayed, a count of 0
+ * replays all frames.  The filter applies to the next replay.
+ */
+void replay_set_filter(const Uint32* can_id, int count)
+{
+    if (SDL_TRUE == replay_is_active())
+    {
+        c_log(LOG_WARNING, "Replay filter can not be changed while replaying");
+        return;
+    }
+
+    if ((NULL == can_id) || (count < 0))
+    {
+        count = 0;
+    }
+    else if (count > REPLAY_FILTER_MAX)
+    {
+        c_log(LOG_WARNING, "Replay filter limited to %u COB-IDs", REPLAY_FILTER_MAX);
+        count = REPLAY_FILTER_MAX;
+    }
+
+    if (count > 0)
+    {
+        SDL_memcpy(replay.filter_id, can_id, (size_t)count * sizeof(Uint32));
+    }
+    replay.filter_count = count;
+}
+
+void replay_print_status(void)
+{
+    if (SDL_FALSE == replay_is_active())
+    {
+        c_log(LOG_INFO, "No replay running");
+        return;
+    }
+
+    c_log(LOG_INFO, "Replaying %s on CAN channel %u: %d frames sent",
+          replay.file_name,
+          replay.channel,
+          SDL_AtomicGet(&replay.frames));
+}
+
+// Must be called before the CAN channels are closed.
+void replay_deinit(void)
+{
+    if (NULL != replay.thread)
+    {
+        SDL_AtomicSet(&replay.is_active, 0);
+        SDL_WaitThread(replay.thread, NULL);
+        replay.thread = NULL;
+    }
+}
+
+int lua_replay_start(lua_State* L)
+{
+    const char* file_name = luaL_checkstring(L, 1);
+    float       speed     = (float)luaL_optnumber(L, 2, 1.0);
+    SDL_bool    is_looped = lua_toboolean(L, 3) ? SDL_TRUE : SDL_FALSE;
+    double      from_s    = luaL_optnumber(L, 4, 0.0);
+    Uint8       channel   = (Uint8)luaL_optinteger(L, 5, 0);
+
+    lua_pushboolean(L, replay_start(file_name, channel, speed, is_looped, (Uint64)(SDL_max(from_s, 0.0) * 1000000.0)));
+
+    return 1;
+}
+
+int lua_replay_stop(lua_State* L)
+{
+    (void)L;
+
+    replay_stop();
+
+    return 0;
+}
+
+int lua_replay_is_active(lua_State* L)
+{
+    lua_pushboolean(L, replay_is_active());
+
+    return 1;
+}
+
+int lua_replay_set_filter(lua_State* L)
+{
+    Uint32 can_id[REPLAY_FILTER_MAX];
+    int    count = 0;
+
+    if (lua_istable(L, 1))
+    {
+        int length = (int)luaL_len(L, 1);
+        int index;
+
+        for (index = 1; (index <= length) && (count < REPLAY_FILTER_MAX); index += 1)
+        {
+            lua_rawgeti(L, 1, index);
+            can_id[count] = (Uint32)luaL_checkinteger(L, -1);
+            lua_pop(L, 1);
+            count += 1;
+        }
+    }
+
+    replay_set_filter(can_id, count);
+
+    return 0;
+}
+
+void lua_register_replay_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_replay_start);
+    lua_setglobal(core->L, "replay_start");
+
+    lua_pushcfunction(core->L, lua_replay_stop);
+    lua_setglobal(core->L, "replay_stop");
+
+    lua_pushcfunction(core->L, lua_replay_is_active);
+    lua_setglobal(core->L, "replay_is_active");
+
+    lua_pushcfunction(core->L, lua_replay_set_filter);
+    lua_setglobal(core->L, "replay_set_filter");
+}
+
+/* Every frame is due at an absolute deadline derived from the time
+ * that passed in the trace since its first frame.  As the deadlines do
+ * not depend on when the previous frame was actually sent, delays do
+ * not add up over the course of a long replay.
+ *
+ * At a speed of 0, frames are queued in batches through
+ * can_write_batch_timeout().  Timed frames are queued the moment they
+ * are due, as reading the next one may take a seek through the trace.
+ * Their timing error is measured when they are queued, the latency of
+ * the transmit queue is not included.
+ */
+static int replay_run(void* unused)
+{
+    can_message_t message;
+    can_message_t batch[REPLAY_BATCH_SIZE];
+    int           count       = 0;
+    Uint8         source_channel;
+    Uint64        start_us    = can_get_time_us();
+    Uint64        first_us    = 0;
+    Uint64        trace_us    = 0;
+    Uint64        pass_us     = 0;
+    SDL_bool      is_first    = SDL_TRUE;
+    Uint32        pass_frames = 0;
+    Uint32        frames;
+    SDL_bool      is_read     = seek_start();
+    SDL_bool      is_aborted  = SDL_FALSE;
+
+    (void)unused;
+
+    while ((1 == SDL_AtomicGet(&replay.is_active)) && (SDL_TRUE == is_read))
+    {
+        // Blocks of the trace without any of the COB-IDs are skipped.
+        if (replay.filter_count > 0)
+        {
+            is_read = trace_seek_id(&replay.reader, replay.filter_id, replay.filter_count);
+        }
+
+        if (SDL_TRUE == is_read)
+        {
+            is_read = trace_read(&replay.reader, &message, &source_channel);
+        }
+
+        if (SDL_FALSE == is_read)
+        {
+            if ((SDL_FALSE == replay.is_looped) || (0 == pass_frames))
+            {
+                break;
+            }
+
+            // The next pass starts where this one ended.
+            is_read     = seek_start();
+            pass_us     = trace_us;
+            is_first    = SDL_TRUE;
+            pass_frames = 0;
+            replay.loops += 1;
+            continue;
+        }
+
+        if (0 != (message.flags & CAN_FLAG_ERROR))
+        {
+            continue;
+        }
+
+        // Frames of different channels do not share a clock, so the
+        // time in the trace is never allowed to go backwards.
+        if (SDL_TRUE == is_first)
+        {
+            first_us = message.timestamp_us;
+            is_first = SDL_FALSE;
+        }
+        else if (message.timestamp_us < first_us)
+        {
+            message.timestamp_us = first_us;
+        }
+
+        if ((pass_us + (message.timestamp_us - first_us)) > trace_us)
+        {
+            trace_us = pass_us + (message.timestamp_us - first_us);
+        }
+
+        if (replay.speed > 0.0f)
+        {
+            Uint64 deadline_us = start_us + (Uint64)((double)trace_us / (double)replay.speed);
+            Uint64 error_us;
+
+            if (SDL_FALSE == wait_until(deadline_us))
+            {
+                break;
+            }
+
+            is_aborted = (SDL_FALSE == send_batch(&message, 1)) ? SDL_TRUE : SDL_FALSE;
+
+            error_us = can_get_time_us() - deadline_us;
+            replay.error_sum_us += error_us;
+            if (error_us > replay.error_max_us)
+            {
+                replay.error_max_us = error_us;
+            }
+            if (error_us > REPLAY_LATE_IN_US)
+            {
+                replay.late_frames += 1;
+            }
+
+            if (SDL_TRUE == is_aborted)
+            {
+                break;
+            }
+
+            pass_frames += 1;
+            continue;
+        }
+
+        if (REPLAY_BATCH_SIZE == count)
+        {
+            is_aborted = (SDL_FALSE == send_batch(batch, count)) ? SDL_TRUE : SDL_FALSE;
+            count      = 0;
+            if (SDL_TRUE == is_aborted)
+            {
+                break;
+            }
+        }
+
+        batch[count]  = message;
+        count        += 1;
+        pass_frames  += 1;
+    }
+
+    if ((count > 0) && (SDL_FALSE == is_aborted) && (1 == SDL_AtomicGet(&replay.is_active)))
+    {
+        (void)send_batch(batch, count);
+    }
+
+    trace_close(&replay.reader);
+    SDL_AtomicSet(&replay.is_active, 0);
+
+    frames = (Uint32)SDL_AtomicGet(&replay.frames);
+    c_log(LOG_SUCCESS, "Replay of %s finished: %u frames, %u loops", replay.file_name, frames, replay.loops);
+
+    if ((replay.speed > 0.0f) && (frames > 0))
+    {
+        c_log(LOG_INFO, "Timing error when queued: avg %llu us, max %llu us, %u frames late by more than %u us",
+              (unsigned long long)(replay.error_sum_us / frames),
+              (unsigned long long)replay.error_max_us,
+              replay.late_frames,
+              REPLAY_LATE_IN_US);
+    }
+
+    if (replay.failed_frames > 0)
+    {
+        c_log(LOG_WARNING, "%u frames could not be sent", replay.failed_frames);
+    }
+    c_print_prompt();
+
+    return 0;
+}
+
+// Returns SDL_FALSE if the replay has to be aborted.
+static SDL_bool send_batch(can_message_t* batch, int count)
+{
+    Uint32 can_status;
+    int    written = 0;
+
+    can_status = can_write_batch_timeout(replay.channel, batch, count, REPLAY_TIMEOUT_IN_MS, &written);
+
+    replay.failed_frames += (Uint32)(count - written);
+    SDL_AtomicAdd(&replay.frames, count);
+
+    if (CAN_ERROR_INITIALIZE == can_status)
+    {
+        c_log(LOG_WARNING, "Replay aborted: CAN channel %u not initialised", replay.channel);
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+static SDL_bool seek_start(void)
+{
+    if (0 == replay.from_us)
+    {
+        trace_rewind(&replay.reader);
+        return SDL_TRUE;
+    }
+
+    return trace_seek_time(&replay.reader, trace_get_first_timestamp(&replay.reader) + replay.from_us);
+}
+
+/* Sleeps until shortly before the deadline and spins for the rest, as
+ * SDL_Delay() only has a resolution of milliseconds and may oversleep.
+ * Returns SDL_FALSE if the replay was stopped meanwhile.
+ */
+static SDL_bool wait_until(Uint64 deadline_us)
+{
+    while (1 == SDL_AtomicGet(&replay.is_active))
+    {
+        Uint64 now_us = can_get_time_us();
+
+        if (now_us >= deadline_us)
+        {
+            return SDL_TRUE;
+        }
+        else if ((deadline_us - now_us) > REPLAY_SPIN_IN_US)
+        {
+            SDL_Delay((Uint32)SDL_min((deadline_us - now_us - REPLAY_SPIN_IN_US) / 1000, REPLAY_SLEEP_MAX_IN_MS));
+        }
+    }
+
+    return SDL_FALSE;
+}
@@ -0,0 +1,33 @@
+/** @file replay.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "core.h"
+
+#define REPLAY_FILTER_MAX 64
+#define REPLAY_SPEED_MIN  0.1f
+#define REPLAY_SPEED_MAX  100.0f
+
+SDL_bool replay_start(const char* file_name, Uint8 channel, float speed, SDL_bool is_looped, Uint64 from_us);
+void     replay_stop(void);
+SDL_bool replay_is_active(void);
+void     replay_set_filter(const Uint32* can_id, int count);
+void     replay_print_status(void);
+void     replay_deinit(void);
+int      lua_replay_start(lua_State* L);
+int      lua_replay_stop(lua_State* L);
+int      lua_replay_is_active(lua_State* L);
+int      lua_replay_set_filter(lua_State* L);
+void     lua_register_replay_commands(core_t* core);
+
+#endif /* REPLAY_H */
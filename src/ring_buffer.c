@@ -0,0 +1,98 @@
+/** @file ring_buffer.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "can.h"
+#include "ring_buffer.h"
+
+SDL_bool ring_buffer_init(ring_buffer_t* ring, Uint32 size)
+{
+    if (NULL == ring)
+    {
+        return SDL_FALSE;
+    }
+
+    // The size must be a power of two.
+    if ((0 == size) || (0 != (size & (size - 1))))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zerop(ring);
+
+    ring->buffer = (can_message_t*)SDL_calloc(size, sizeof(can_message_t));
+    if (NULL == ring->buffer)
+    {
+        return SDL_FALSE;
+    }
+
+    ring->size = size;
+    ring->mask = size - 1;
+
+    return SDL_TRUE;
+}
+
+void ring_buffer_deinit(ring_buffer_t* ring)
+{
+    if (NULL == ring)
+    {
+        return;
+    }
+
+    SDL_free(ring->buffer);
+    SDL_zerop(ring);
+}
+
+SDL_bool ring_buffer_push(ring_buffer_t* ring, const can_message_t* message)
+{
+    Uint32 head  = (Uint32)SDL_AtomicGet(&ring->head);
+    Uint32 tail  = (Uint32)SDL_AtomicGet(&ring->tail);
+    Uint32 count = head - tail;
+
+    if (count >= ring->size)
+    {
+        SDL_AtomicAdd(&ring->overrun_count, 1);
+        return SDL_FALSE;
+    }
+
+    ring->buffer[head & ring->mask] = *message;
+
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ring->head, (int)(head + 1));
+
+    if ((count + 1) > (Uint32)SDL_AtomicGet(&ring->high_water_mark))
+    {
+        SDL_AtomicSet(&ring->high_water_mark, (int)(count + 1));
+    }
+
+    return SDL_TRUE;
+}
+
+SDL_bool ring_buffer_pop(ring_buffer_t* ring, can_message_t* message)
+{
+    Uint32 tail = (Uint32)SDL_AtomicGet(&ring->tail);
+    Uint32 head = (Uint32)SDL_AtomicGet(&ring->head);
+
+    if (head == tail)
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_MemoryBarrierAcquire();
+    *message = ring->buffer[tail & ring->mask];
+
+    SDL_AtomicSet(&ring->tail, (int)(tail + 1));
+
+    return SDL_TRUE;
+}
+
+Uint32 ring_buffer_count(ring_buffer_t* ring)
+{
+    return (Uint32)SDL_AtomicGet(&ring->head) - (Uint32)SDL_AtomicGet(&ring->tail);
+}
@@ -0,0 +1,43 @@
+/** @file ring_buffer.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include "SDL.h"
+#include "can.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* Lock-free single-producer/single-consumer queue of CAN messages.
+ * The head is only written by the producer, the tail only by the
+ * consumer; both are kept on separate cache lines.
+ */
+typedef struct ring_buffer
+{
+    can_message_t* buffer;
+    Uint32         size;
+    Uint32         mask;
+    SDL_atomic_t   overrun_count;
+    SDL_atomic_t   high_water_mark;
+    Uint8          padding_a[CACHE_LINE_SIZE];
+    SDL_atomic_t   head;
+    Uint8          padding_b[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+    SDL_atomic_t   tail;
+    Uint8          padding_c[CACHE_LINE_SIZE - sizeof(SDL_atomic_t)];
+
+} ring_buffer_t;
+
+SDL_bool ring_buffer_init(ring_buffer_t* ring, Uint32 size);
+void     ring_buffer_deinit(ring_buffer_t* ring);
+SDL_bool ring_buffer_push(ring_buffer_t* ring, const can_message_t* message);
+SDL_bool ring_buffer_pop(ring_buffer_t* ring, can_message_t* message);
+Uint32   ring_buffer_count(ring_buffer_t* ring);
+
+#endif /* RING_BUFFER_H */
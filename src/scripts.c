@@ -16,9 +16,12 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include "dirent.h"
+#include "can.h"
 #include "core.h"
+#include "dispatch.h"
 #include "printf.h"
 #include "scripts.h"
+#include "sdo_client.h"
 
 void scripts_init(core_t* core)
 {
@@ -81,7 +84,7 @@ void list_scripts(void)
 
 void run_script(const char* name, core_t* core)
 {
-    char script_path[64] = { 0 };
+    char  script_path[64] = { 0 };
 
     if (NULL == core)
     {
@@ -97,13 +100,27 @@ void run_script(const char* name, core_t* core)
     {
         c_log(LOG_WARNING, "Could not load script '%s'", name);
     }
+
+    // Subscriptions do not outlive the script that made them.
+    dispatch_clear_lua_subscriptions(core->L);
+    sdo_clear_lua_transfers();
+    can_clear_lua_readers();
 }
 
 int lua_delay_ms(lua_State* L)
 {
     Uint32 delay_in_ms = (Uint32)luaL_checkinteger(L, 1);
+    Uint64 deadline    = SDL_GetTicks64() + delay_in_ms;
+    Uint64 now;
+
+    // Run the callbacks of subscribed frames while waiting.
+    do
+    {
+        now = SDL_GetTicks64();
+        dispatch_run_lua_callbacks(L, (now < deadline) ? (Uint32)(deadline - now) : 0);
+    }
+    while (now < deadline);
 
-    SDL_Delay(delay_in_ms);
     return 1;
 }
 
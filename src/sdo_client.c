@@ -9,22 +9,328 @@
 
 #include "SDL.h"
 #include "lua.h"
+#include "lauxlib.h"
 #include "nuklear.h"
 #include "can.h"
 #include "core.h"
+#include "crc.h"
+#include "dispatch.h"
 #include "printf.h"
 #include "sdo_client.h"
+#include "table.h"
 
-#define SDO_TIMEOUT_IN_MS 100
+#define SDO_TIMEOUT_IN_MS      100  // Until a round-trip time was measured
+#define SDO_TIMEOUT_MIN_IN_MS  50
+#define SDO_TIMEOUT_MAX_IN_MS  2000
+#define SDO_SEGMENT_TIME_IN_MS 1    // Allowance per segment of a block
+#define SDO_RETRY_MAX          2
+#define SDO_NODE_MAX           0x80
+#define SDO_LUA_TRANSFER_MAX   256
+#define SDO_BLOCK_THRESHOLD    32
 
-static Uint32 sdo_result;
+typedef enum sdo_slot_state
+{
+    SDO_SLOT_IDLE = 0,
+    SDO_SLOT_WAITING,
+    SDO_SLOT_BUSY,     // A response is handled, usually by the receive thread
+    SDO_SLOT_SENDING,  // Segments are sent by sdo_poll()
+    SDO_SLOT_ANSWERED, // A response came in while SENDING
+    SDO_SLOT_RECEIVED
+
+} sdo_slot_state_t;
+
+/* Responses are taken from the dispatcher by the receive thread and
+ * handled in the slot of the server.  The receive queue is not touched,
+ * so all other frames stay available for their consumers.  Segments are
+ * sent by the receive thread as well, the moment the previous one is
+ * confirmed.  Those which do not fit into the transmit queue are sent
+ * by sdo_poll() later.
+ *
+ * Everything else, i.e. initiating transfers, timeouts and callbacks,
+ * is done by the thread which calls sdo_poll().  A slot is subscribed
+ * while it has a transfer in flight or queued.
+ */
+typedef struct sdo_slot
+{
+    SDL_atomic_t    state;
+    SDL_atomic_t    progress; // Segments handled
+    int             seen_progress;
+    Uint8           channel;
+    Uint8           node_id;
+    SDL_bool        is_active;
+    SDL_bool        is_listed; // In active_slot
+    sdo_transfer_t* transfer; // In flight
+    sdo_transfer_t* first;    // Queued
+    sdo_transfer_t* last;
+
+    // Round-trip time, see update_rtt().
+    Uint64          sent_us;         // Of the request to be answered
+    SDL_bool        is_sample_valid; // SDL_FALSE once a request was repeated
+    SDL_atomic_t    srtt_us;
+    SDL_atomic_t    rttvar_us;
+    SDL_atomic_t    sample_count;
+    SDL_atomic_t    backoff;
+    Uint32          timeout_count;
+    Uint32          fixed_timeout_ms; // 0 if adaptive
+    Uint64          hold_until_ms;    // See complete_transfer()
+    can_message_t   answer;           // See SDO_SLOT_ANSWERED
+    Uint64          answer_us;
+
+} sdo_slot_t;
+
+static Uint32         sdo_result;
+static sdo_slot_t     sdo_slot[CAN_CHANNEL_MAX][SDO_NODE_MAX];
+static sdo_slot_t*    active_slot[CAN_CHANNEL_MAX * SDO_NODE_MAX];
+static int            active_slot_count;
+static SDL_sem*       response_event;
+static sdo_transfer_t lua_transfer[SDO_LUA_TRANSFER_MAX];
+static SDL_bool       is_lua_transfer_used[SDO_LUA_TRANSFER_MAX];
+static Uint8          block_size      = SDO_BLOCK_SIZE_MAX;
+static Uint8          block_threshold = SDO_BLOCK_THRESHOLD;
+
+static Uint32   sdo_send(Uint8 channel, sdo_type_t sdo_type, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data);
+static Uint32   run_transfer(sdo_transfer_t* transfer, SDL_bool show_output);
+static SDL_bool is_transfer_ok(sdo_transfer_t* transfer);
+static void     send_next_transfer(sdo_slot_t* slot);
+static void     send_request(sdo_slot_t* slot);
+static void     resume_sending(sdo_slot_t* slot);
+static void     build_request(const sdo_transfer_t* transfer, can_message_t* can_message);
+static void     complete_transfer(sdo_slot_t* slot, Uint32 can_status);
+static SDL_bool is_slot_due(sdo_slot_t* slot, Uint64 now, Uint64* next_deadline);
+static void     update_deadline(sdo_slot_t* slot, Uint64 now);
+static Uint64   get_deadline(sdo_slot_t* slot, Uint64 now);
+static Uint32   get_timeout_ms(sdo_slot_t* slot);
+static void     update_rtt(sdo_slot_t* slot, Uint64 rtt_us);
+static Uint64   get_rtt_us(sdo_slot_t* slot, Uint64 now_us);
+static void     store_response(Uint8 channel, const can_message_t* message, void* user_data);
+static void     process_response(sdo_slot_t* slot, const can_message_t* message, Uint64 now_us);
+static SDL_bool is_response_expected(const sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool handle_response(sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool handle_upload(sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool handle_download(sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool handle_block_upload(sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool handle_block_download(sdo_transfer_t* transfer, const can_message_t* message);
+static SDL_bool send_download_segment(sdo_transfer_t* transfer);
+static SDL_bool send_sub_block(sdo_transfer_t* transfer);
+static SDL_bool send_block_segments(sdo_transfer_t* transfer);
+static SDL_bool send_segment(sdo_transfer_t* transfer, can_message_t* message);
+static SDL_bool send_abort(sdo_transfer_t* transfer, Uint32 abort_code);
+static Uint8    get_response_length(Uint8 command_code);
+static Uint32   get_le32(const Uint8* data);
+static void     format_data(const Uint8* data, Uint32 size, char* text, size_t text_size);
+static int      submit_lua_transfer(lua_State* L, sdo_transfer_t* transfer);
+static void     print_abort_code_error(Uint32 abort_code);
+
+/* Queues the transfer and sends it right away unless the server is busy
+ * with an earlier one.  Returns SDL_FALSE if the transfer could not be
+ * queued, it is done then.
+ */
+SDL_bool sdo_submit(sdo_transfer_t* transfer)
+{
+    sdo_slot_t* slot;
+
+    transfer->is_done         = SDL_FALSE;
+    transfer->can_status      = CAN_OK;
+    transfer->abort_code      = 0;
+    transfer->next            = NULL;
+    transfer->offset          = 0;
+    transfer->toggle          = 0;
+    transfer->sequence        = 0;
+    transfer->block_offset    = 0;
+    transfer->crc             = 0;
+    transfer->is_crc_used     = SDL_FALSE;
+    transfer->retry_count     = 0;
+    transfer->phase           = SDO_PHASE_INITIATE;
+    transfer->is_send_pending = SDL_FALSE;
+    SDL_zero(transfer->response);
+
+    if ((SDO_UPLOAD == transfer->type) || (SDO_BLOCK_UPLOAD == transfer->type))
+    {
+        transfer->size = 0;
+    }
+
+    if ((0 == transfer->block_size) || (transfer->block_size > SDO_BLOCK_SIZE_MAX))
+    {
+        transfer->block_size = SDO_BLOCK_SIZE_MAX;
+    }
+
+    if (SDO_BLOCK_DOWNLOAD == transfer->type)
+    {
+        // Not worth the handshakes of a block transfer.
+        if (transfer->size <= transfer->threshold)
+        {
+            transfer->type = SDO_DOWNLOAD;
+        }
+        else
+        {
+            transfer->crc = crc16_ccitt(0, transfer->buffer, transfer->size);
+        }
+    }
+
+    if (transfer->node_id > 0x7f)
+    {
+        transfer->node_id = 0x00 + (transfer->node_id % 0x7f);
+    }
+
+    if (transfer->channel >= CAN_CHANNEL_MAX)
+    {
+        transfer->can_status = CAN_ERROR_ILLPARAMVAL;
+        transfer->is_done    = SDL_TRUE;
+        return SDL_FALSE;
+    }
+
+    if (NULL == response_event)
+    {
+        response_event = SDL_CreateSemaphore(0);
+        if (NULL == response_event)
+        {
+            c_log(LOG_ERROR, "Could not create SDO response event: %s", SDL_GetError());
+            transfer->can_status = CAN_ERROR_ILLPARAMVAL;
+            transfer->is_done    = SDL_TRUE;
+            return SDL_FALSE;
+        }
+    }
+
+    slot = &sdo_slot[transfer->channel][transfer->node_id];
+    if (SDL_FALSE == slot->is_active)
+    {
+        // Open the acceptance filter for the responses before the first
+        // request is sent.
+        if (SDL_FALSE == dispatch_subscribe(transfer->channel, 0x580 + transfer->node_id, store_response, slot))
+        {
+            transfer->can_status = CAN_ERROR_ILLPARAMVAL;
+            transfer->is_done    = SDL_TRUE;
+            return SDL_FALSE;
+        }
+
+        slot->channel   = transfer->channel;
+        slot->node_id   = transfer->node_id;
+        slot->is_active = SDL_TRUE;
+    }
+
+    if (SDL_FALSE == slot->is_listed)
+    {
+        slot->is_listed                  = SDL_TRUE;
+        active_slot[active_slot_count]   = slot;
+        active_slot_count               += 1;
+    }
+
+    if (NULL == slot->last)
+    {
+        slot->first = transfer;
+    }
+    else
+    {
+        slot->last->next = transfer;
+    }
+    slot->last = transfer;
+
+    send_next_transfer(slot);
+
+    return SDL_TRUE;
+}
+
+/* Completes the transfers which were answered or timed out and sends the
+ * next queued ones.  Waits up to timeout_ms for a response if none is
+ * due yet, 0 never blocks, e.g. once per frame of the GUI.
+ */
+void sdo_poll(Uint32 timeout_ms)
+{
+    Uint64   now           = SDL_GetTicks64();
+    Uint64   next_deadline = now + timeout_ms;
+    SDL_bool is_due        = SDL_FALSE;
+    int      index;
+
+    for (index = 0; index < active_slot_count; index += 1)
+    {
+        if (SDL_TRUE == is_slot_due(active_slot[index], now, &next_deadline))
+        {
+            is_due = SDL_TRUE;
+        }
+    }
+
+    if ((SDL_FALSE == is_due) && (active_slot_count > 0) && (next_deadline > now))
+    {
+        (void)SDL_SemWaitTimeout(response_event, (Uint32)(next_deadline - now));
+        now = SDL_GetTicks64();
+    }
+
+    index = 0;
+    while (index < active_slot_count)
+    {
+        sdo_slot_t* slot = active_slot[index];
+
+        if (NULL != slot->transfer)
+        {
+            if ((SDO_SLOT_WAITING == SDL_AtomicGet(&slot->state)) && (SDL_TRUE == slot->transfer->is_send_pending))
+            {
+                resume_sending(slot);
+            }
+
+            // Segments may have been handled while waiting.
+            update_deadline(slot, now);
+
+            if (SDO_SLOT_RECEIVED == SDL_AtomicGet(&slot->state))
+            {
+                complete_transfer(slot, slot->transfer->can_status);
+            }
+            else if ((now >= slot->transfer->deadline_ms) && (SDL_TRUE == SDL_AtomicCAS(&slot->state, SDO_SLOT_WAITING, SDO_SLOT_IDLE)))
+            {
+                slot->timeout_count += 1;
+
+                // Nothing was transferred yet, so the request can simply
+                // be sent again.  Not to nodes which never answered, they
+                // are most likely absent, e.g. while scanning a range.
+                if ((SDO_PHASE_INITIATE == slot->transfer->phase) &&
+                    (slot->transfer->retry_count < SDO_RETRY_MAX) &&
+                    (SDL_AtomicGet(&slot->sample_count) > 0))
+                {
+                    if (SDL_AtomicGet(&slot->backoff) < SDO_RETRY_MAX)
+                    {
+                        SDL_AtomicIncRef(&slot->backoff);
+                    }
+                    slot->transfer->retry_count += 1;
+                    send_request(slot);
+                }
+                else
+                {
+                    // The node may be gone, so the next transfer starts over.
+                    SDL_AtomicSet(&slot->backoff, 0);
+                    complete_transfer(slot, CAN_ERROR_QRCVEMPTY);
+                }
+            }
+        }
+
+        send_next_transfer(slot);
+
+        if (SDL_TRUE == slot->is_active)
+        {
+            index += 1;
+        }
+        else
+        {
+            slot->is_listed     = SDL_FALSE;
+            active_slot_count  -= 1;
+            active_slot[index]  = active_slot[active_slot_count];
+        }
+    }
+}
+
+// Returns the CAN status of the transfer once it is done.
+Uint32 sdo_wait(sdo_transfer_t* transfer)
+{
+    while (SDL_FALSE == transfer->is_done)
+    {
+        sdo_poll(SDO_TIMEOUT_IN_MS);
+    }
 
-static Uint32 sdo_send(sdo_type_t sdo_type, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data);
-static void   print_abort_code_error(Uint32 abort_code);
+    return transfer->can_status;
+}
 
-Uint32 sdo_read(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index)
+Uint32 sdo_read(Uint8 channel, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index)
 {
     return sdo_send(
+        channel,
         EXPEDITED_SDO_READ,
         sdo_response,
         show_output,
@@ -34,9 +340,10 @@ Uint32 sdo_read(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id
         0, 0);
 }
 
-Uint32 sdo_write(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data)
+Uint32 sdo_write(Uint8 channel, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data)
 {
     return sdo_send(
+        channel,
         EXPEDITED_SDO_WRITE,
         sdo_response,
         show_output,
@@ -47,12 +354,339 @@ Uint32 sdo_write(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_i
         data);
 }
 
+/* Reads objects of any size, e.g. strings or domains, into the buffer.
+ * Servers answer expedited or segmented on their own.
+ */
+Uint32 sdo_upload(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8* buffer, Uint32 buffer_size, Uint32* size)
+{
+    sdo_transfer_t transfer = { 0 };
+    Uint32         can_status;
+
+    transfer.channel     = channel;
+    transfer.type        = SDO_UPLOAD;
+    transfer.node_id     = node_id;
+    transfer.index       = index;
+    transfer.sub_index   = sub_index;
+    transfer.buffer      = buffer;
+    transfer.buffer_size = buffer_size;
+
+    can_status = run_transfer(&transfer, show_output);
+    *size      = transfer.size;
+
+    return can_status;
+}
+
+// Writes up to 4 bytes expedited, everything else segmented.
+Uint32 sdo_download(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, const Uint8* buffer, Uint32 size)
+{
+    sdo_transfer_t transfer = { 0 };
+
+    transfer.channel   = channel;
+    transfer.type      = SDO_DOWNLOAD;
+    transfer.node_id   = node_id;
+    transfer.index     = index;
+    transfer.sub_index = sub_index;
+    transfer.buffer    = (Uint8*)buffer;
+    transfer.size      = size;
+
+    return run_transfer(&transfer, show_output);
+}
+
+// Like sdo_upload(), but without a round trip for every segment.
+Uint32 sdo_block_upload(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8* buffer, Uint32 buffer_size, Uint32* size)
+{
+    sdo_transfer_t transfer = { 0 };
+    Uint32         can_status;
+
+    transfer.channel     = channel;
+    transfer.type        = SDO_BLOCK_UPLOAD;
+    transfer.node_id     = node_id;
+    transfer.index       = index;
+    transfer.sub_index   = sub_index;
+    transfer.buffer      = buffer;
+    transfer.buffer_size = buffer_size;
+    transfer.block_size  = block_size;
+    transfer.threshold   = block_threshold;
+
+    can_status = run_transfer(&transfer, show_output);
+    *size      = transfer.size;
+
+    return can_status;
+}
+
+Uint32 sdo_block_download(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, const Uint8* buffer, Uint32 size)
+{
+    sdo_transfer_t transfer = { 0 };
+
+    transfer.channel    = channel;
+    transfer.type       = SDO_BLOCK_DOWNLOAD;
+    transfer.node_id    = node_id;
+    transfer.index      = index;
+    transfer.sub_index  = sub_index;
+    transfer.buffer     = (Uint8*)buffer;
+    transfer.size       = size;
+    transfer.block_size = block_size;
+    transfer.threshold  = block_threshold;
+
+    return run_transfer(&transfer, show_output);
+}
+
+// Writes the object into the file, e.g. to save a firmware image.
+void sdo_block_upload_file(Uint8 channel, Uint8 node_id, Uint16 index, Uint8 sub_index, const char* file_name)
+{
+    SDL_RWops* file;
+    Uint8*     buffer = SDL_malloc(SDO_BLOCK_BUFFER_SIZE);
+    Uint32     size   = 0;
+
+    if (NULL == buffer)
+    {
+        c_log(LOG_ERROR, "Could not allocate SDO buffer");
+        return;
+    }
+
+    if (CAN_OK == sdo_block_upload(channel, SDL_TRUE, node_id, index, sub_index, buffer, SDO_BLOCK_BUFFER_SIZE, &size))
+    {
+        file = SDL_RWFromFile(file_name, "wb");
+        if (NULL == file)
+        {
+            c_log(LOG_WARNING, "Could not open '%s': %s", file_name, SDL_GetError());
+        }
+        else
+        {
+            if (size != SDL_RWwrite(file, buffer, 1, size))
+            {
+                c_log(LOG_WARNING, "Could not write '%s': %s", file_name, SDL_GetError());
+            }
+            SDL_RWclose(file);
+        }
+    }
+
+    SDL_free(buffer);
+}
+
+void sdo_block_download_file(Uint8 channel, Uint8 node_id, Uint16 index, Uint8 sub_index, const char* file_name)
+{
+    SDL_RWops* file = SDL_RWFromFile(file_name, "rb");
+    Uint8*     buffer;
+    Sint64     size;
+
+    if (NULL == file)
+    {
+        c_log(LOG_WARNING, "Could not open '%s': %s", file_name, SDL_GetError());
+        return;
+    }
+
+    size = SDL_RWsize(file);
+    if ((size < 0) || (size > SDO_BLOCK_BUFFER_SIZE))
+    {
+        c_log(LOG_WARNING, "Could not load '%s': up to %u bytes are supported", file_name, SDO_BLOCK_BUFFER_SIZE);
+        SDL_RWclose(file);
+        return;
+    }
+
+    buffer = SDL_malloc((size_t)SDL_max(size, 1));
+    if (NULL == buffer)
+    {
+        c_log(LOG_ERROR, "Could not allocate SDO buffer");
+        SDL_RWclose(file);
+        return;
+    }
+
+    if ((size_t)size != SDL_RWread(file, buffer, 1, (size_t)size))
+    {
+        c_log(LOG_WARNING, "Could not read '%s': %s", file_name, SDL_GetError());
+    }
+    else
+    {
+        (void)sdo_block_download(channel, SDL_TRUE, node_id, index, sub_index, buffer, (Uint32)size);
+    }
+
+    SDL_free(buffer);
+    SDL_RWclose(file);
+}
+
+// Segments per block requested by uploads; servers choose for downloads.
+void sdo_set_block_size(Uint8 size)
+{
+    if ((0 == size) || (size > SDO_BLOCK_SIZE_MAX))
+    {
+        c_log(LOG_WARNING, "Invalid block size: %u, 1 to %u segments", size, SDO_BLOCK_SIZE_MAX);
+        return;
+    }
+
+    block_size = size;
+}
+
+/* Objects up to this size are uploaded segmented or expedited, if the
+ * server agrees, and downloaded so in any case.  0 disables switching.
+ */
+void sdo_set_block_threshold(Uint8 threshold)
+{
+    block_threshold = threshold;
+}
+
+void sdo_print_block_settings(void)
+{
+    c_log(LOG_INFO, "Block size: %u segments, protocol switch threshold: %u bytes", block_size, block_threshold);
+}
+
+// A timeout_ms of 0 returns to the timeout derived from the round-trip time.
+void sdo_set_timeout(Uint8 channel, Uint8 node_id, Uint32 timeout_ms)
+{
+    if ((channel >= CAN_CHANNEL_MAX) || (node_id > 0x7f))
+    {
+        c_log(LOG_WARNING, "Invalid node: %u", node_id);
+        return;
+    }
+
+    sdo_slot[channel][node_id].fixed_timeout_ms = timeout_ms;
+}
+
+// Returns the timeout of the next request to the node.
+Uint32 sdo_get_timeout(Uint8 channel, Uint8 node_id)
+{
+    if ((channel >= CAN_CHANNEL_MAX) || (node_id > 0x7f))
+    {
+        return SDO_TIMEOUT_IN_MS;
+    }
+
+    return get_timeout_ms(&sdo_slot[channel][node_id]);
+}
+
+// Shows one row per node which was talked to or has a fixed timeout.
+void sdo_print_timeouts(Uint8 channel)
+{
+    table_t table = { DARK_CYAN, DARK_WHITE, 4, 37, 17 };
+    char    rtt[38];
+    int     node;
+    int     count = 0;
+
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return;
+    }
+
+    SDL_snprintf(rtt, sizeof(rtt), "%9s %9s %8s %8s", "SRTT ms", "RTTVAR ms", "Samples", "Timeouts");
+
+    for (node = 0; node < SDO_NODE_MAX; node += 1)
+    {
+        sdo_slot_t* slot    = &sdo_slot[channel][node];
+        int         samples = SDL_AtomicGet(&slot->sample_count);
+        char        node_id[5];
+        char        timeout[18];
+
+        if ((0 == samples) && (0 == slot->timeout_count) && (0 == slot->fixed_timeout_ms))
+        {
+            continue;
+        }
+
+        if (0 == count)
+        {
+            table_print_header(&table);
+            table_print_row("ID", rtt, "Timeout", &table);
+            table_print_divider(&table);
+        }
+        count += 1;
+
+        SDL_snprintf(node_id, sizeof(node_id), "0x%02x", node);
+
+        if (samples > 0)
+        {
+            SDL_snprintf(rtt, sizeof(rtt), "%9.2f %9.2f %8d %8u",
+                         (double)SDL_AtomicGet(&slot->srtt_us) / 1000.0,
+                         (double)SDL_AtomicGet(&slot->rttvar_us) / 1000.0,
+                         samples,
+                         slot->timeout_count);
+        }
+        else
+        {
+            SDL_snprintf(rtt, sizeof(rtt), "%9s %9s %8d %8u", "-", "-", samples, slot->timeout_count);
+        }
+
+        SDL_snprintf(timeout, sizeof(timeout), "%u ms (%s)", get_timeout_ms(slot), (0 != slot->fixed_timeout_ms) ? "fixed" : "auto");
+
+        table_print_row(node_id, rtt, timeout, &table);
+    }
+
+    if (0 == count)
+    {
+        c_log(LOG_INFO, "No SDO transfers on channel %u yet", channel);
+        return;
+    }
+
+    table_print_footer(&table);
+}
+
+// Reads the object from all nodes at once and shows one row per node.
+void sdo_read_nodes(Uint8 channel, Uint8 first_node_id, Uint8 last_node_id, Uint16 index, Uint8 sub_index)
+{
+    sdo_transfer_t transfer[SDO_NODE_MAX] = { 0 };
+    table_t        table                  = { DARK_CYAN, DARK_WHITE, 4, 23, 17 };
+    int            count;
+    int            node;
+
+    if ((first_node_id > last_node_id) || (last_node_id > 0x7f))
+    {
+        c_log(LOG_WARNING, "Invalid node range: %u-%u", first_node_id, last_node_id);
+        return;
+    }
+
+    count = last_node_id - first_node_id + 1;
+    for (node = 0; node < count; node += 1)
+    {
+        transfer[node].channel   = channel;
+        transfer[node].type      = EXPEDITED_SDO_READ;
+        transfer[node].node_id   = (Uint8)(first_node_id + node);
+        transfer[node].index     = index;
+        transfer[node].sub_index = sub_index;
+        (void)sdo_submit(&transfer[node]);
+    }
+
+    table_print_header(&table);
+    table_print_row("ID", "Data", "Status", &table);
+    table_print_divider(&table);
+
+    for (node = 0; node < count; node += 1)
+    {
+        char node_id[5];
+        char data[24] = " ";
+        char status[18];
+
+        (void)sdo_wait(&transfer[node]);
+
+        SDL_snprintf(node_id, sizeof(node_id), "0x%02x", transfer[node].node_id);
+
+        if (CAN_ERROR_QRCVEMPTY == transfer[node].can_status)
+        {
+            SDL_snprintf(status, sizeof(status), "Timeout");
+        }
+        else if (CAN_OK != transfer[node].can_status)
+        {
+            SDL_snprintf(status, sizeof(status), "Error 0x%x", transfer[node].can_status);
+        }
+        else if (0 != transfer[node].abort_code)
+        {
+            SDL_snprintf(status, sizeof(status), "Abort 0x%08x", transfer[node].abort_code);
+        }
+        else
+        {
+            SDL_snprintf(data, sizeof(data), "%u (0x%x)", transfer[node].data, transfer[node].data);
+            SDL_snprintf(status, sizeof(status), "%u byte(s) read", transfer[node].length);
+        }
+
+        table_print_row(node_id, data, status, &table);
+    }
+
+    table_print_footer(&table);
+}
+
 int lua_sdo_read(lua_State* L)
 {
     can_message_t sdo_response = { 0 };;
     int           node_id      = luaL_checkinteger(L, 1);
     int           index        = luaL_checkinteger(L, 2);
     int           sub_index    = luaL_checkinteger(L, 3);
+    int           channel      = luaL_optinteger(L, 4, 0);
 
     if (node_id > 0x7f)
     {
@@ -60,6 +694,7 @@ int lua_sdo_read(lua_State* L)
     }
 
     if (0 != sdo_read(
+            (Uint8)channel,
             &sdo_response,
             SDL_FALSE,
             (Uint8)node_id,
@@ -85,6 +720,7 @@ int lua_sdo_write(lua_State* L)
     int           sub_index    = luaL_checkinteger(L, 3);
     int           length       = luaL_checkinteger(L, 4);
     int           data         = luaL_checkinteger(L, 5);
+    int           channel      = luaL_optinteger(L, 6, 0);
 
     if (node_id > 0x7f)
     {
@@ -92,6 +728,7 @@ int lua_sdo_write(lua_State* L)
     }
 
     if (0 != sdo_write(
+            (Uint8)channel,
             &sdo_response,
             SDL_FALSE,
             (Uint8)node_id,
@@ -108,182 +745,1381 @@ int lua_sdo_write(lua_State* L)
     }
 }
 
-void lua_register_sdo_commands(core_t* core)
+int lua_sdo_read_string(lua_State* L)
 {
-    lua_pushcfunction(core->L, lua_sdo_read);
-    lua_setglobal(core->L, "sdo_read");
+    int    node_id   = luaL_checkinteger(L, 1);
+    int    index     = luaL_checkinteger(L, 2);
+    int    sub_index = luaL_checkinteger(L, 3);
+    int    channel   = luaL_optinteger(L, 4, 0);
+    Uint8* buffer    = SDL_malloc(SDO_BUFFER_SIZE);
+    Uint32 size      = 0;
 
-    lua_pushcfunction(core->L, lua_sdo_write);
-    lua_setglobal(core->L, "sdo_write");
-}
-
-static Uint32 sdo_send(sdo_type_t sdo_type, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data)
-{
-    can_message_t can_message       = { 0 };
-    Uint32        can_status        = 0;
-    SDL_bool      response_received = SDL_FALSE;
-    Uint64        timeout_time      = 0;
-    Uint64        time_a;
+    if (NULL == buffer)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
 
-    if (node_id > 0x7f)
+    if (CAN_OK == sdo_upload((Uint8)channel, SDL_FALSE, (Uint8)node_id, (Uint16)index, (Uint8)sub_index, buffer, SDO_BUFFER_SIZE, &size))
     {
-        node_id = 0x00 + (node_id % 0x7f);
+        lua_pushlstring(L, (const char*)buffer, size);
+    }
+    else
+    {
+        lua_pushnil(L);
     }
 
-    can_message.id      = 0x600 + node_id;
+    SDL_free(buffer);
+    return 1;
+}
 
-    can_message.data[1] = (Uint8)(index  & 0x00ff);
-    can_message.data[2] = (Uint8)((index & 0xff00) >> 8);
-    can_message.data[3] = sub_index;
+int lua_sdo_write_string(lua_State* L)
+{
+    int         node_id   = luaL_checkinteger(L, 1);
+    int         index     = luaL_checkinteger(L, 2);
+    int         sub_index = luaL_checkinteger(L, 3);
+    size_t      size      = 0;
+    const char* data      = luaL_checklstring(L, 4, &size);
+    int         channel   = luaL_optinteger(L, 5, 0);
 
-    switch (sdo_type)
+    if (CAN_OK == sdo_download((Uint8)channel, SDL_FALSE, (Uint8)node_id, (Uint16)index, (Uint8)sub_index, (const Uint8*)data, (Uint32)size))
     {
-        default:
+        lua_pushboolean(L, 1);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+int lua_sdo_block_read(lua_State* L)
+{
+    int    node_id   = luaL_checkinteger(L, 1);
+    int    index     = luaL_checkinteger(L, 2);
+    int    sub_index = luaL_checkinteger(L, 3);
+    int    channel   = luaL_optinteger(L, 4, 0);
+    Uint8* buffer    = SDL_malloc(SDO_BLOCK_BUFFER_SIZE);
+    Uint32 size      = 0;
+
+    if (NULL == buffer)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (CAN_OK == sdo_block_upload((Uint8)channel, SDL_FALSE, (Uint8)node_id, (Uint16)index, (Uint8)sub_index, buffer, SDO_BLOCK_BUFFER_SIZE, &size))
+    {
+        lua_pushlstring(L, (const char*)buffer, size);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    SDL_free(buffer);
+    return 1;
+}
+
+int lua_sdo_block_write(lua_State* L)
+{
+    int         node_id   = luaL_checkinteger(L, 1);
+    int         index     = luaL_checkinteger(L, 2);
+    int         sub_index = luaL_checkinteger(L, 3);
+    size_t      size      = 0;
+    const char* data      = luaL_checklstring(L, 4, &size);
+    int         channel   = luaL_optinteger(L, 5, 0);
+
+    if (CAN_OK == sdo_block_download((Uint8)channel, SDL_FALSE, (Uint8)node_id, (Uint16)index, (Uint8)sub_index, (const Uint8*)data, (Uint32)size))
+    {
+        lua_pushboolean(L, 1);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+
+    return 1;
+}
+
+int lua_sdo_block_settings(lua_State* L)
+{
+    int size      = luaL_checkinteger(L, 1);
+    int threshold = luaL_optinteger(L, 2, block_threshold);
+
+    sdo_set_block_size((Uint8)size);
+    sdo_set_block_threshold((Uint8)SDL_min(threshold, 0xff));
+
+    return 0;
+}
+
+// A timeout of 0 returns to the timeout derived from the round-trip time.
+int lua_sdo_timeout(lua_State* L)
+{
+    int node_id    = luaL_checkinteger(L, 1);
+    int timeout_ms = luaL_checkinteger(L, 2);
+    int channel    = luaL_optinteger(L, 3, 0);
+
+    sdo_set_timeout((Uint8)channel, (Uint8)node_id, (Uint32)SDL_max(timeout_ms, 0));
+
+    return 0;
+}
+
+int lua_sdo_get_timeout(lua_State* L)
+{
+    int node_id = luaL_checkinteger(L, 1);
+    int channel = luaL_optinteger(L, 2, 0);
+
+    lua_pushinteger(L, sdo_get_timeout((Uint8)channel, (Uint8)node_id));
+
+    return 1;
+}
+
+int lua_sdo_submit_read(lua_State* L)
+{
+    sdo_transfer_t transfer = { 0 };
+
+    transfer.node_id   = (Uint8)luaL_checkinteger(L, 1);
+    transfer.index     = (Uint16)luaL_checkinteger(L, 2);
+    transfer.sub_index = (Uint8)luaL_checkinteger(L, 3);
+    transfer.channel   = (Uint8)luaL_optinteger(L, 4, 0);
+    transfer.type      = EXPEDITED_SDO_READ;
+
+    return submit_lua_transfer(L, &transfer);
+}
+
+int lua_sdo_submit_write(lua_State* L)
+{
+    sdo_transfer_t transfer = { 0 };
+
+    transfer.node_id   = (Uint8)luaL_checkinteger(L, 1);
+    transfer.index     = (Uint16)luaL_checkinteger(L, 2);
+    transfer.sub_index = (Uint8)luaL_checkinteger(L, 3);
+    transfer.length    = (Uint8)luaL_checkinteger(L, 4);
+    transfer.data      = (Uint32)luaL_checkinteger(L, 5);
+    transfer.channel   = (Uint8)luaL_optinteger(L, 6, 0);
+    transfer.type      = EXPEDITED_SDO_WRITE;
+
+    return submit_lua_transfer(L, &transfer);
+}
+
+// Returns the read data or true once written, nil on failure.
+int lua_sdo_wait(lua_State* L)
+{
+    int             handle = luaL_checkinteger(L, 1);
+    sdo_transfer_t* transfer;
+
+    if ((handle < 1) || (handle > SDO_LUA_TRANSFER_MAX) || (SDL_FALSE == is_lua_transfer_used[handle - 1]))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    transfer = &lua_transfer[handle - 1];
+    sdo_wait(transfer);
+    is_lua_transfer_used[handle - 1] = SDL_FALSE;
+
+    if ((CAN_OK != transfer->can_status) || (0 != transfer->abort_code))
+    {
+        lua_pushnil(L);
+    }
+    else if (EXPEDITED_SDO_READ == transfer->type)
+    {
+        lua_pushinteger(L, transfer->data);
+    }
+    else
+    {
+        lua_pushboolean(L, 1);
+    }
+
+    return 1;
+}
+
+void lua_register_sdo_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_sdo_read);
+    lua_setglobal(core->L, "sdo_read");
+
+    lua_pushcfunction(core->L, lua_sdo_write);
+    lua_setglobal(core->L, "sdo_write");
+
+    lua_pushcfunction(core->L, lua_sdo_read_string);
+    lua_setglobal(core->L, "sdo_read_string");
+
+    lua_pushcfunction(core->L, lua_sdo_write_string);
+    lua_setglobal(core->L, "sdo_write_string");
+
+    lua_pushcfunction(core->L, lua_sdo_block_read);
+    lua_setglobal(core->L, "sdo_block_read");
+
+    lua_pushcfunction(core->L, lua_sdo_block_write);
+    lua_setglobal(core->L, "sdo_block_write");
+
+    lua_pushcfunction(core->L, lua_sdo_block_settings);
+    lua_setglobal(core->L, "sdo_block_settings");
+
+    lua_pushcfunction(core->L, lua_sdo_timeout);
+    lua_setglobal(core->L, "sdo_timeout");
+
+    lua_pushcfunction(core->L, lua_sdo_get_timeout);
+    lua_setglobal(core->L, "sdo_get_timeout");
+
+    lua_pushcfunction(core->L, lua_sdo_submit_read);
+    lua_setglobal(core->L, "sdo_submit_read");
+
+    lua_pushcfunction(core->L, lua_sdo_submit_write);
+    lua_setglobal(core->L, "sdo_submit_write");
+
+    lua_pushcfunction(core->L, lua_sdo_wait);
+    lua_setglobal(core->L, "sdo_wait");
+}
+
+// Transfers which a script did not wait for do not outlive it.
+void sdo_clear_lua_transfers(void)
+{
+    int index;
+
+    for (index = 0; index < SDO_LUA_TRANSFER_MAX; index += 1)
+    {
+        if (SDL_TRUE == is_lua_transfer_used[index])
+        {
+            sdo_wait(&lua_transfer[index]);
+            is_lua_transfer_used[index] = SDL_FALSE;
+        }
+    }
+}
+
+// Must be called after the CAN channels were closed.
+void sdo_deinit(void)
+{
+    SDL_zeroa(sdo_slot);
+    active_slot_count = 0;
+
+    if (NULL != response_event)
+    {
+        SDL_DestroySemaphore(response_event);
+        response_event = NULL;
+    }
+}
+
+// Waits for the transfer, the response is passed like before.
+static Uint32 sdo_send(Uint8 channel, sdo_type_t sdo_type, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data)
+{
+    sdo_transfer_t transfer = { 0 };
+    int            data_index;
+
+    transfer.channel   = channel;
+    transfer.type      = sdo_type;
+    transfer.node_id   = node_id;
+    transfer.index     = index;
+    transfer.sub_index = sub_index;
+    transfer.length    = length;
+    transfer.data      = data;
+
+    (void)sdo_submit(&transfer);
+    (void)sdo_wait(&transfer);
+
+    if (SDL_FALSE == is_transfer_ok(&transfer))
+    {
+        return transfer.can_status;
+    }
+
+    sdo_response->length = get_response_length(transfer.response.data[0]);
+    for (data_index = 0; data_index < sdo_response->length; data_index += 1)
+    {
+        sdo_response->data[4 + data_index] = transfer.response.data[4 + data_index];
+    }
+
+    if (SDL_TRUE == show_output)
+    {
+        const  char*  str_read    = "read";
+        const  char*  str_written = "written";
+        const  char** str_action  = NULL;
+        Uint32        output_data;
+
+        switch (sdo_type)
+        {
+            default:
+            case EXPEDITED_SDO_READ:
+                output_data = (Uint32)sdo_response->data[4];
+                str_action  = &str_read;
+                break;
+            case EXPEDITED_SDO_WRITE:
+                output_data = data;
+                str_action  = &str_written;
+                break;
+        }
+
+        c_log(LOG_SUCCESS, "Index %x, Sub-index %x: %u byte(s) %s: %u (0x%x)",
+              index,
+              sub_index,
+              sdo_response->length,
+              *str_action,
+              output_data,
+              output_data);
+    }
+
+    return transfer.can_status;
+}
+
+/* Waits for a transfer of a buffer.  The throughput is shown for all but
+ * expedited transfers, so the protocols can be compared.
+ */
+static Uint32 run_transfer(sdo_transfer_t* transfer, SDL_bool show_output)
+{
+    const char* protocol[] = { "expedited", "segmented", "block", "block" };
+    Uint64      start      = SDL_GetPerformanceCounter();
+    double      elapsed_s;
+    char        text[128];
+
+    (void)sdo_submit(transfer);
+    (void)sdo_wait(transfer);
+
+    if (SDL_FALSE == is_transfer_ok(transfer))
+    {
+        return (CAN_OK != transfer->can_status) ? transfer->can_status : CAN_ERROR_ILLPARAMVAL;
+    }
+
+    if (SDL_FALSE == show_output)
+    {
+        return transfer->can_status;
+    }
+
+    elapsed_s = (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+
+    format_data(transfer->buffer, transfer->size, text, sizeof(text));
+    c_log(LOG_SUCCESS, "Index %x, Sub-index %x: %u byte(s) %s: %s",
+          transfer->index,
+          transfer->sub_index,
+          transfer->size,
+          ((SDO_UPLOAD == transfer->type) || (SDO_BLOCK_UPLOAD == transfer->type)) ? "read" : "written",
+          text);
+
+    if ((SDO_PHASE_INITIATE != transfer->phase) && (elapsed_s > 0.0))
+    {
+        c_log(LOG_INFO, "%u bytes in %.1f ms, %.0f bytes/s, %s transfer",
+              transfer->size,
+              elapsed_s * 1000.0,
+              (double)transfer->size / elapsed_s,
+              protocol[transfer->phase]);
+    }
+
+    return transfer->can_status;
+}
+
+// Shows why the transfer failed, if it did.
+static SDL_bool is_transfer_ok(sdo_transfer_t* transfer)
+{
+    if (CAN_ERROR_QRCVEMPTY == transfer->can_status)
+    {
+        c_log(LOG_WARNING, "SDO timeout: USB-dongle present?");
+        return SDL_FALSE;
+    }
+    else if (CAN_OK != transfer->can_status)
+    {
+        can_print_error_message(transfer->channel, NULL, transfer->can_status);
+        return SDL_FALSE;
+    }
+    else if (0 != transfer->abort_code)
+    {
+        print_abort_code_error(transfer->abort_code);
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+// Sends the queued transfers until one is in flight or none is left.
+static void send_next_transfer(sdo_slot_t* slot)
+{
+    while ((NULL == slot->transfer) && (NULL != slot->first) && (SDL_GetTicks64() >= slot->hold_until_ms))
+    {
+        sdo_transfer_t* transfer = slot->first;
+
+        slot->first = transfer->next;
+        if (NULL == slot->first)
+        {
+            slot->last = NULL;
+        }
+
+        slot->transfer      = transfer;
+        slot->seen_progress = SDL_AtomicGet(&slot->progress);
+        send_request(slot);
+    }
+
+    if ((NULL == slot->transfer) && (NULL == slot->first) && (SDL_TRUE == slot->is_active))
+    {
+        dispatch_unsubscribe(slot->channel, 0x580 + slot->node_id, store_response, slot);
+        slot->is_active = SDL_FALSE;
+    }
+}
+
+// Sends the initiating request of the transfer in flight, again on a timeout.
+static void send_request(sdo_slot_t* slot)
+{
+    sdo_transfer_t* transfer    = slot->transfer;
+    can_message_t   can_message = { 0 };
+    Uint32          can_status;
+
+    build_request(transfer, &can_message);
+
+    // The response to a repeated request may be the one to the first.
+    slot->sent_us         = can_get_time_us();
+    slot->is_sample_valid = (0 == transfer->retry_count) ? SDL_TRUE : SDL_FALSE;
+    transfer->deadline_ms = get_deadline(slot, SDL_GetTicks64());
+    SDL_AtomicSet(&slot->state, SDO_SLOT_WAITING);
+
+    can_status = can_write(slot->channel, &can_message);
+
+    // Unless a stray response got hold of the slot first.
+    if ((CAN_OK != can_status) && (SDL_TRUE == SDL_AtomicCAS(&slot->state, SDO_SLOT_WAITING, SDO_SLOT_IDLE)))
+    {
+        complete_transfer(slot, can_status);
+    }
+}
+
+// Sends what did not fit into the transmit queue of the receive thread.
+static void resume_sending(sdo_slot_t* slot)
+{
+    sdo_transfer_t* transfer = slot->transfer;
+    Uint32          offset   = transfer->offset;
+    Uint64          now_us   = can_get_time_us();
+    SDL_bool        is_failed;
+
+    if (SDL_FALSE == SDL_AtomicCAS(&slot->state, SDO_SLOT_WAITING, SDO_SLOT_SENDING))
+    {
+        return;
+    }
+
+    transfer->is_send_pending = SDL_FALSE;
+    if ((SDO_BLOCK_DOWNLOAD == transfer->type) && (SDO_PHASE_BLOCK == transfer->phase))
+    {
+        is_failed = send_block_segments(transfer);
+    }
+    else
+    {
+        is_failed = send_segment(transfer, &transfer->pending_segment);
+    }
+
+    if (SDL_TRUE == is_failed)
+    {
+        SDL_AtomicSet(&slot->state, SDO_SLOT_RECEIVED);
+        return;
+    }
+
+    // The timeout starts over once something was sent.
+    if ((offset != transfer->offset) || (SDL_FALSE == transfer->is_send_pending))
+    {
+        slot->sent_us = now_us;
+        SDL_AtomicIncRef(&slot->progress);
+    }
+
+    // The server answered the segments before they were all sent.
+    if (SDL_FALSE == SDL_AtomicCAS(&slot->state, SDO_SLOT_SENDING, SDO_SLOT_WAITING))
+    {
+        SDL_AtomicSet(&slot->state, SDO_SLOT_BUSY);
+        process_response(slot, &slot->answer, slot->answer_us);
+    }
+}
+
+static void build_request(const sdo_transfer_t* transfer, can_message_t* can_message)
+{
+    can_message->id      = 0x600 + transfer->node_id;
+
+    can_message->data[1] = (Uint8)(transfer->index  & 0x00ff);
+    can_message->data[2] = (Uint8)((transfer->index & 0xff00) >> 8);
+    can_message->data[3] = transfer->sub_index;
+
+    switch (transfer->type)
+    {
+        default:
         case EXPEDITED_SDO_READ:
-            can_message.length  = 8;
-            can_message.data[0] = READ_DICT_OBJECT;
+        case SDO_UPLOAD:
+            can_message->length  = 8;
+            can_message->data[0] = READ_DICT_OBJECT;
+            break;
+        case SDO_DOWNLOAD:
+            // Expedited transfers carry 1 to 4 bytes, nothing is sent
+            // as a single empty segment.
+            if ((transfer->size > 4) || (0 == transfer->size))
+            {
+                // Segmented, size indicated.
+                can_message->length  = 8;
+                can_message->data[0] = DOWNLOAD_INITIATE_REQUEST | 0x01;
+                can_message->data[4] = (Uint8)(transfer->size  & 0x000000ff);
+                can_message->data[5] = (Uint8)((transfer->size & 0x0000ff00) >> 8);
+                can_message->data[6] = (Uint8)((transfer->size & 0x00ff0000) >> 16);
+                can_message->data[7] = (Uint8)((transfer->size & 0xff000000) >> 24);
+            }
+            else
+            {
+                // Expedited, size indicated.
+                can_message->length  = 4 + transfer->size;
+                can_message->data[0] = DOWNLOAD_INITIATE_REQUEST | ((4 - transfer->size) << 2) | 0x03;
+                SDL_memcpy(&can_message->data[4], transfer->buffer, transfer->size);
+            }
+            break;
+        case SDO_BLOCK_UPLOAD:
+            // CRC supported.
+            can_message->length  = 8;
+            can_message->data[0] = BLOCK_UPLOAD_REQUEST | 0x04 | BLOCK_INITIATE;
+            can_message->data[4] = transfer->block_size;
+            can_message->data[5] = transfer->threshold;
+            break;
+        case SDO_BLOCK_DOWNLOAD:
+            // CRC supported, size indicated.
+            can_message->length  = 8;
+            can_message->data[0] = BLOCK_DOWNLOAD_REQUEST | 0x04 | 0x02 | BLOCK_INITIATE;
+            can_message->data[4] = (Uint8)(transfer->size  & 0x000000ff);
+            can_message->data[5] = (Uint8)((transfer->size & 0x0000ff00) >> 8);
+            can_message->data[6] = (Uint8)((transfer->size & 0x00ff0000) >> 16);
+            can_message->data[7] = (Uint8)((transfer->size & 0xff000000) >> 24);
             break;
         case EXPEDITED_SDO_WRITE:
-            can_message.length  = 4 + length;
-            can_message.data[4] = (Uint8)(data  & 0x000000ff);
-            can_message.data[5] = (Uint8)((data & 0x0000ff00) >> 8);
-            can_message.data[6] = (Uint8)((data & 0x00ff0000) >> 16);
-            can_message.data[7] = (Uint8)((data & 0xff000000) >> 24);
-            switch(length)
+            can_message->length  = 4 + transfer->length;
+            can_message->data[4] = (Uint8)(transfer->data  & 0x000000ff);
+            can_message->data[5] = (Uint8)((transfer->data & 0x0000ff00) >> 8);
+            can_message->data[6] = (Uint8)((transfer->data & 0x00ff0000) >> 16);
+            can_message->data[7] = (Uint8)((transfer->data & 0xff000000) >> 24);
+            switch(transfer->length)
             {
                 case 1:
-                    can_message.data[0] = WRITE_DICT_1_BYTE_SENT;
+                    can_message->data[0] = WRITE_DICT_1_BYTE_SENT;
                     break;
                 case 2:
-                    can_message.data[0] = WRITE_DICT_2_BYTE_SENT;
+                    can_message->data[0] = WRITE_DICT_2_BYTE_SENT;
                     break;
                 case 3:
-                    can_message.data[0] = WRITE_DICT_3_BYTE_SENT;
+                    can_message->data[0] = WRITE_DICT_3_BYTE_SENT;
                     break;
                 case 4:
                 default:
-                    can_message.data[0] = WRITE_DICT_4_BYTE_SENT;
+                    can_message->data[0] = WRITE_DICT_4_BYTE_SENT;
                     break;
             }
             break;
     }
+}
+
+static void complete_transfer(sdo_slot_t* slot, Uint32 can_status)
+{
+    sdo_transfer_t* transfer = slot->transfer;
+
+    slot->transfer = NULL;
 
-    can_status = can_write(&can_message);
-    if (0 != can_status)
+    // SDO responses do not tell which request they answer, so the late
+    // response to a repeated request must not be taken for the next one.
+    if (transfer->retry_count > 0)
     {
-        can_print_error_message(NULL, can_status);
+        slot->hold_until_ms = SDL_GetTicks64() + get_timeout_ms(slot);
     }
 
-    time_a = SDL_GetTicks64();
-    while ((SDL_FALSE == response_received) && (timeout_time < SDO_TIMEOUT_IN_MS))
+    transfer->can_status = can_status;
+    if ((CAN_ERROR_QRCVEMPTY == can_status) && (SDO_PHASE_INITIATE != transfer->phase))
     {
-        Uint64 time_b;
-        Uint64 delta_time;
+        // Let the server know, so it does not wait for the next segment.
+        (void)send_abort(transfer, ABORT_SDO_PROTOCOL_TIMED_OUT);
+    }
+    else if ((CAN_OK == can_status) && (0 == transfer->abort_code) && (EXPEDITED_SDO_READ == transfer->type))
+    {
+        int data_index;
 
-        if ((0x580 + node_id) == can_message.id)
+        transfer->length = get_response_length(transfer->response.data[0]);
+        transfer->data   = 0;
+        for (data_index = 0; data_index < transfer->length; data_index += 1)
         {
-            if ((index  & 0x00ff) == can_message.data[1])
-            {
-                if (((index & 0xff00) >> 8) == can_message.data[2])
-                {
-                    response_received = SDL_TRUE;
-                    continue;
-                }
-            }
+            transfer->data |= (Uint32)transfer->response.data[4 + data_index] << (8 * data_index);
         }
+    }
+
+    // A late response must not be taken for the next transfer.
+    SDL_AtomicSet(&slot->state, SDO_SLOT_IDLE);
 
-        can_status = can_read(&can_message);
-        time_b     = time_a;
-        time_a     = SDL_GetTicks64();
+    // The callback may free or submit the transfer again.
+    transfer->is_done = SDL_TRUE;
+    if (NULL != transfer->callback)
+    {
+        transfer->callback(transfer, transfer->user_data);
+    }
+}
 
-        if (time_a > time_b)
+static SDL_bool is_slot_due(sdo_slot_t* slot, Uint64 now, Uint64* next_deadline)
+{
+    if (NULL == slot->transfer)
+    {
+        if (NULL == slot->first)
         {
-            delta_time = time_a - time_b;
+            return SDL_FALSE;
         }
-        else
+        else if (now >= slot->hold_until_ms)
+        {
+            return SDL_TRUE;
+        }
+
+        if (slot->hold_until_ms < *next_deadline)
         {
-            delta_time = time_b - time_a;
+            *next_deadline = slot->hold_until_ms;
         }
-        timeout_time += delta_time;
+        return SDL_FALSE;
     }
 
-    if (0 != can_status)
+    update_deadline(slot, now);
+
+    if ((SDO_SLOT_RECEIVED == SDL_AtomicGet(&slot->state)) || (now >= slot->transfer->deadline_ms))
     {
-        can_print_error_message(NULL, can_status);
+        return SDL_TRUE;
     }
-    else if (timeout_time >= SDO_TIMEOUT_IN_MS)
+
+    // The transmit queue has room again after about one frame.
+    if ((SDL_TRUE == slot->transfer->is_send_pending) && ((now + SDO_SEGMENT_TIME_IN_MS) < *next_deadline))
     {
-        c_log(LOG_WARNING, "SDO timeout: USB-dongle present?");
+        *next_deadline = now + SDO_SEGMENT_TIME_IN_MS;
     }
-    else
-    {
-        Uint32 abort_code = 0;
-        int    data_index;
-        switch (can_message.data[0])
-        {
-            case READ_DICT_4_BYTE_SENT:
-            case WRITE_DICT_4_BYTE_SENT:
-                sdo_response->length = 4;
-                break;
-            case READ_DICT_3_BYTE_SENT:
-            case WRITE_DICT_3_BYTE_SENT:
-                sdo_response->length = 3;
-                break;
-            case READ_DICT_2_BYTE_SENT:
-            case WRITE_DICT_2_BYTE_SENT:
-                sdo_response->length = 2;
-                break;
-            case READ_DICT_1_BYTE_SENT:
-            case WRITE_DICT_1_BYTE_SENT:
-                sdo_response->length = 1;
-                break;
-            case SDO_ABORT:
-                abort_code = (abort_code & 0xffffff00) | can_message.data[7];
-                abort_code = (abort_code & 0xffff00ff) | ((Uint32)can_message.data[6] << 8);
-                abort_code = (abort_code & 0xff00ffff) | ((Uint32)can_message.data[5] << 16);
-                abort_code = (abort_code & 0x00ffffff) | ((Uint32)can_message.data[4] << 24);
-                abort_code = SDL_SwapBE32(abort_code);
-
-                print_abort_code_error(abort_code);
-                return can_status;
-        }
 
-        for (data_index = 0; data_index < sdo_response->length; data_index += 1)
-        {
-            sdo_response->data[4 + data_index] = can_message.data[4 + data_index];
-        }
+    if (slot->transfer->deadline_ms < *next_deadline)
+    {
+        *next_deadline = slot->transfer->deadline_ms;
+    }
 
-        if (SDL_TRUE == show_output)
-        {
-            const  char*  str_read    = "read";
-            const  char*  str_written = "written";
-            const  char** str_action  = NULL;
-            Uint32        output_data;
+    return SDL_FALSE;
+}
 
-            switch (sdo_type)
-            {
-                default:
-                case EXPEDITED_SDO_READ:
-                    output_data = (Uint32)sdo_response->data[4];
-                    str_action  = &str_read;
-                    break;
-                case EXPEDITED_SDO_WRITE:
-                    output_data = data;
-                    str_action  = &str_written;
-                    break;
-            }
+// The timeout applies to every segment, not to the whole transfer.
+static void update_deadline(sdo_slot_t* slot, Uint64 now)
+{
+    int progress = SDL_AtomicGet(&slot->progress);
 
-            c_log(LOG_SUCCESS, "Index %x, Sub-index %x: %u byte(s) %s: %u (0x%x)",
-                  index,
-                  sub_index,
-                  sdo_response->length,
-                  *str_action,
-                  output_data,
-                  output_data);
-        }
+    if (progress != slot->seen_progress)
+    {
+        slot->seen_progress         = progress;
+        slot->transfer->deadline_ms = get_deadline(slot, now);
     }
+}
 
-    return can_status;
+static Uint64 get_deadline(sdo_slot_t* slot, Uint64 now)
+{
+    sdo_transfer_t* transfer   = slot->transfer;
+    Uint64          timeout_ms = get_timeout_ms(slot);
+
+    if (SDO_PHASE_BLOCK == transfer->phase)
+    {
+        // A whole sub-block is sent before it is confirmed.
+        timeout_ms += (Uint64)transfer->block_size * SDO_SEGMENT_TIME_IN_MS;
+    }
+
+    return now + timeout_ms;
+}
+
+static Uint32 get_timeout_ms(sdo_slot_t* slot)
+{
+    Uint32 timeout_ms;
+
+    if (0 != slot->fixed_timeout_ms)
+    {
+        return slot->fixed_timeout_ms;
+    }
+    else if (0 == SDL_AtomicGet(&slot->sample_count))
+    {
+        timeout_ms = SDO_TIMEOUT_IN_MS;
+    }
+    else
+    {
+        timeout_ms = (Uint32)(SDL_AtomicGet(&slot->srtt_us) + (4 * SDL_AtomicGet(&slot->rttvar_us)) + 999) / 1000;
+        timeout_ms = SDL_max(timeout_ms, SDO_TIMEOUT_MIN_IN_MS);
+    }
+
+    // Doubled per repeated request until a response can be measured
+    // again, as the responses to repeated requests are not.
+    timeout_ms <<= SDL_AtomicGet(&slot->backoff);
+
+    return SDL_min(timeout_ms, SDO_TIMEOUT_MAX_IN_MS);
+}
+
+/* Smoothed round-trip time and its mean deviation like the TCP
+ * retransmission timer, see RFC 6298.  The timeout is SRTT + 4 RTTVAR,
+ * so it follows slow servers as well as a loaded bus.  Only called by
+ * the thread which holds the slot, sdo_poll() reads the estimate.
+ */
+static void update_rtt(sdo_slot_t* slot, Uint64 rtt_us)
+{
+    int rtt    = (int)SDL_min(rtt_us, (Uint64)SDO_TIMEOUT_MAX_IN_MS * 1000);
+    int srtt   = SDL_AtomicGet(&slot->srtt_us);
+    int rttvar = SDL_AtomicGet(&slot->rttvar_us);
+    int delta  = (srtt > rtt) ? (srtt - rtt) : (rtt - srtt);
+
+    if (0 == SDL_AtomicGet(&slot->sample_count))
+    {
+        srtt   = rtt;
+        rttvar = rtt / 2;
+    }
+    else
+    {
+        rttvar = rttvar - (rttvar / 4) + (delta / 4);
+        srtt   = srtt - (srtt / 8) + (rtt / 8);
+    }
+
+    SDL_AtomicSet(&slot->srtt_us,   srtt);
+    SDL_AtomicSet(&slot->rttvar_us, rttvar);
+    SDL_AtomicSet(&slot->backoff,   0);
+    SDL_AtomicIncRef(&slot->sample_count);
+}
+
+/* The round trip starts when the request was handed to the controller,
+ * not when it was queued.  If the response is taken before the
+ * transmit thread noted the time, the time of queueing is used.
+ */
+static Uint64 get_rtt_us(sdo_slot_t* slot, Uint64 now_us)
+{
+    Uint32 tx_us = can_get_tx_time_us(slot->channel, 0x600 + slot->node_id);
+
+    // Only the low 32 bits are kept, so the times are compared as offsets.
+    if ((Uint32)(tx_us - (Uint32)slot->sent_us) <= (Uint32)(now_us - slot->sent_us))
+    {
+        return (Uint32)now_us - tx_us;
+    }
+
+    return now_us - slot->sent_us;
+}
+
+// Called by the receive thread, see dispatch_handler_t.
+static void store_response(Uint8 channel, const can_message_t* message, void* user_data)
+{
+    sdo_slot_t* slot   = user_data;
+    Uint64      now_us = can_get_time_us();
+
+    (void)channel;
+
+    // The slot is held while the response is handled, so the transfer
+    // can neither time out nor be completed meanwhile.
+    while (SDL_FALSE == SDL_AtomicCAS(&slot->state, SDO_SLOT_WAITING, SDO_SLOT_BUSY))
+    {
+        if (SDO_SLOT_SENDING != SDL_AtomicGet(&slot->state))
+        {
+            return;
+        }
+
+        /* The server may answer the last segments before sdo_poll() is
+         * done sending them.  The dispatcher must not be held up, so
+         * sdo_poll() handles the response then.  Only one is kept, the
+         * server does not send another before it got an answer.
+         */
+        slot->answer    = *message;
+        slot->answer_us = now_us;
+        if (SDL_TRUE == SDL_AtomicCAS(&slot->state, SDO_SLOT_SENDING, SDO_SLOT_ANSWERED))
+        {
+            return;
+        }
+    }
+
+    process_response(slot, message, now_us);
+}
+
+// Must be called with the slot held, i.e. in SDO_SLOT_BUSY.
+static void process_response(sdo_slot_t* slot, const can_message_t* message, Uint64 now_us)
+{
+    if (SDL_FALSE == is_response_expected(slot->transfer, message))
+    {
+        SDL_AtomicSet(&slot->state, SDO_SLOT_WAITING);
+        return;
+    }
+
+    // Sub-blocks are not confirmed frame by frame, so only the phases
+    // with one response per request are measured.
+    if ((SDL_TRUE == slot->is_sample_valid) &&
+        ((SDO_PHASE_INITIATE == slot->transfer->phase) || (SDO_PHASE_SEGMENT == slot->transfer->phase)))
+    {
+        update_rtt(slot, get_rtt_us(slot, now_us));
+    }
+
+    if (SDL_TRUE == handle_response(slot->transfer, message))
+    {
+        SDL_AtomicSet(&slot->state, SDO_SLOT_RECEIVED);
+        SDL_SemPost(response_event);
+    }
+    else
+    {
+        // The next request was sent by the handler.
+        slot->sent_us         = now_us;
+        slot->is_sample_valid = SDL_TRUE;
+
+        SDL_AtomicIncRef(&slot->progress);
+        SDL_AtomicSet(&slot->state, SDO_SLOT_WAITING);
+    }
+}
+
+// Responses of an earlier request to another object are ignored.
+static SDL_bool is_response_expected(const sdo_transfer_t* transfer, const can_message_t* message)
+{
+    // Segments do not carry the index.
+    if ((SDO_PHASE_INITIATE == transfer->phase) || (SDO_ABORT == message->data[0]))
+    {
+        if ((message->data[1] != (transfer->index & 0x00ff)) || (message->data[2] != ((transfer->index & 0xff00) >> 8)))
+        {
+            return SDL_FALSE;
+        }
+    }
+
+    return SDL_TRUE;
+}
+
+// Returns SDL_TRUE once the transfer is done.
+static SDL_bool handle_response(sdo_transfer_t* transfer, const can_message_t* message)
+{
+    Uint8 command = message->data[0];
+
+    transfer->response = *message;
+
+    if (SDO_ABORT == command)
+    {
+        transfer->abort_code = get_le32(&message->data[4]);
+        return SDL_TRUE;
+    }
+
+    switch (transfer->type)
+    {
+        default:
+        case EXPEDITED_SDO_READ:
+        case EXPEDITED_SDO_WRITE:
+            return SDL_TRUE;
+        case SDO_UPLOAD:
+            return handle_upload(transfer, message);
+        case SDO_DOWNLOAD:
+            return handle_download(transfer, message);
+        case SDO_BLOCK_UPLOAD:
+            return handle_block_upload(transfer, message);
+        case SDO_BLOCK_DOWNLOAD:
+            return handle_block_download(transfer, message);
+    }
+}
+
+static SDL_bool handle_upload(sdo_transfer_t* transfer, const can_message_t* message)
+{
+    can_message_t request = { 0 };
+    Uint8         command = message->data[0];
+    Uint32        length;
+
+    if (SDO_PHASE_INITIATE == transfer->phase)
+    {
+        if (UPLOAD_INITIATE_RESPONSE != (command & SDO_SPECIFIER_MASK))
+        {
+            return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+        }
+
+        // Expedited, the size is only given if indicated.
+        if (0 != (command & 0x02))
+        {
+            length = (0 != (command & 0x01)) ? (4 - ((command >> 2) & 0x03)) : 4;
+            if (length > transfer->buffer_size)
+            {
+                return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+            }
+
+            SDL_memcpy(transfer->buffer, &message->data[4], length);
+            transfer->size = length;
+            return SDL_TRUE;
+        }
+
+        if ((0 != (command & 0x01)) && (get_le32(&message->data[4]) > transfer->buffer_size))
+        {
+            return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+        }
+
+        transfer->phase = SDO_PHASE_SEGMENT;
+    }
+    else
+    {
+        if (UPLOAD_SEGMENT_RESPONSE != (command & SDO_SPECIFIER_MASK))
+        {
+            return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+        }
+
+        if (((command >> 4) & 0x01) != transfer->toggle)
+        {
+            return send_abort(transfer, ABORT_TOGGLE_BIT_NOT_ALTERED);
+        }
+
+        length = 7 - ((command >> 1) & 0x07);
+        if ((transfer->size + length) > transfer->buffer_size)
+        {
+            return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+        }
+
+        SDL_memcpy(&transfer->buffer[transfer->size], &message->data[1], length);
+        transfer->size += length;
+
+        // No more segments.
+        if (0 != (command & 0x01))
+        {
+            return SDL_TRUE;
+        }
+
+        transfer->toggle ^= 1;
+    }
+
+    request.data[0] = UPLOAD_SEGMENT_REQUEST | (Uint8)(transfer->toggle << 4);
+    return send_segment(transfer, &request);
+}
+
+static SDL_bool handle_download(sdo_transfer_t* transfer, const can_message_t* message)
+{
+    Uint8 command = message->data[0];
+
+    if (SDO_PHASE_INITIATE == transfer->phase)
+    {
+        if (DOWNLOAD_INITIATE_RESPONSE != (command & SDO_SPECIFIER_MASK))
+        {
+            return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+        }
+
+        // Expedited.
+        if ((transfer->size > 0) && (transfer->size <= 4))
+        {
+            return SDL_TRUE;
+        }
+
+        transfer->phase = SDO_PHASE_SEGMENT;
+        return send_download_segment(transfer);
+    }
+
+    if (DOWNLOAD_SEGMENT_RESPONSE != (command & SDO_SPECIFIER_MASK))
+    {
+        return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+    }
+
+    if (((command >> 4) & 0x01) != transfer->toggle)
+    {
+        return send_abort(transfer, ABORT_TOGGLE_BIT_NOT_ALTERED);
+    }
+
+    if (transfer->offset >= transfer->size)
+    {
+        return SDL_TRUE;
+    }
+
+    transfer->toggle ^= 1;
+    return send_download_segment(transfer);
+}
+
+/* Segments of a block carry their sequence number instead of a command
+ * code.  Every block is acknowledged, up to the last segment which was
+ * received in sequence; the server repeats the block from there.
+ */
+static SDL_bool handle_block_upload(sdo_transfer_t* transfer, const can_message_t* message)
+{
+    can_message_t request = { 0 };
+    Uint8         command = message->data[0];
+    Uint8         sequence;
+    Uint32        length;
+
+    switch (transfer->phase)
+    {
+        case SDO_PHASE_SEGMENT:
+            return handle_upload(transfer, message);
+
+        default:
+        case SDO_PHASE_INITIATE:
+            // The server may switch to a segmented or expedited transfer.
+            if (UPLOAD_INITIATE_RESPONSE == (command & SDO_SPECIFIER_MASK))
+            {
+                return handle_upload(transfer, message);
+            }
+
+            if ((BLOCK_UPLOAD_RESPONSE | BLOCK_INITIATE) != (command & (SDO_SPECIFIER_MASK | 0x01)))
+            {
+                return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+            }
+
+            if ((0 != (command & 0x02)) && (get_le32(&message->data[4]) > transfer->buffer_size))
+            {
+                return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+            }
+
+            transfer->is_crc_used = (0 != (command & 0x04)) ? SDL_TRUE : SDL_FALSE;
+            transfer->phase       = SDO_PHASE_BLOCK;
+            transfer->sequence    = 0;
+
+            request.data[0] = BLOCK_UPLOAD_REQUEST | BLOCK_START_UPLOAD;
+            return send_segment(transfer, &request);
+
+        case SDO_PHASE_BLOCK:
+            sequence = command & 0x7f;
+
+            if ((transfer->sequence + 1) == sequence)
+            {
+                if (0 != (command & 0x80))
+                {
+                    // Its length is only known at the end.
+                    SDL_memcpy(transfer->last_segment, &message->data[1], 7);
+                    transfer->phase = SDO_PHASE_BLOCK_END;
+                }
+                else if ((transfer->size + 7) > transfer->buffer_size)
+                {
+                    return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+                }
+                else
+                {
+                    SDL_memcpy(&transfer->buffer[transfer->size], &message->data[1], 7);
+                    transfer->crc   = crc16_ccitt(transfer->crc, &message->data[1], 7);
+                    transfer->size += 7;
+                }
+
+                transfer->sequence = sequence;
+            }
+
+            if ((sequence < transfer->block_size) && (0 == (command & 0x80)))
+            {
+                return SDL_FALSE;
+            }
+
+            request.data[0]    = BLOCK_UPLOAD_REQUEST | BLOCK_ACKNOWLEDGE;
+            request.data[1]    = transfer->sequence;
+            request.data[2]    = transfer->block_size;
+            transfer->sequence = 0;
+            return send_segment(transfer, &request);
+
+        case SDO_PHASE_BLOCK_END:
+            // Segments repeated after a lost acknowledge are ignored.
+            if ((BLOCK_UPLOAD_RESPONSE | BLOCK_END) != (command & (SDO_SPECIFIER_MASK | BLOCK_COMMAND_MASK)))
+            {
+                return SDL_FALSE;
+            }
+
+            length = 7 - ((command >> 2) & 0x07);
+            if ((transfer->size + length) > transfer->buffer_size)
+            {
+                return send_abort(transfer, ABORT_OUT_OF_MEMORY);
+            }
+
+            SDL_memcpy(&transfer->buffer[transfer->size], transfer->last_segment, length);
+            transfer->crc   = crc16_ccitt(transfer->crc, transfer->last_segment, length);
+            transfer->size += length;
+
+            if ((SDL_TRUE == transfer->is_crc_used) && (transfer->crc != (Uint16)(message->data[1] | (message->data[2] << 8))))
+            {
+                return send_abort(transfer, ABORT_CRC_ERROR);
+            }
+
+            request.data[0] = BLOCK_UPLOAD_REQUEST | BLOCK_END;
+            (void)send_segment(transfer, &request);
+            return SDL_TRUE;
+    }
+}
+
+static SDL_bool handle_block_download(sdo_transfer_t* transfer, const can_message_t* message)
+{
+    can_message_t request = { 0 };
+    Uint8         command = message->data[0];
+    Uint8         sequence;
+
+    switch (transfer->phase)
+    {
+        default:
+        case SDO_PHASE_INITIATE:
+            if ((BLOCK_DOWNLOAD_RESPONSE | BLOCK_INITIATE) != (command & (SDO_SPECIFIER_MASK | BLOCK_COMMAND_MASK)))
+            {
+                return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+            }
+
+            if ((0 == message->data[4]) || (message->data[4] > SDO_BLOCK_SIZE_MAX))
+            {
+                return send_abort(transfer, ABORT_INVALID_BLOCK_SIZE);
+            }
+
+            transfer->is_crc_used = (0 != (command & 0x04)) ? SDL_TRUE : SDL_FALSE;
+            transfer->block_size  = message->data[4];
+            transfer->phase       = SDO_PHASE_BLOCK;
+            return send_sub_block(transfer);
+
+        case SDO_PHASE_BLOCK:
+            if ((BLOCK_DOWNLOAD_RESPONSE | BLOCK_ACKNOWLEDGE) != (command & (SDO_SPECIFIER_MASK | BLOCK_COMMAND_MASK)))
+            {
+                return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+            }
+
+            sequence = message->data[1];
+            if (sequence > transfer->sequence)
+            {
+                return send_abort(transfer, ABORT_INVALID_SEQUENCE_NUMBER);
+            }
+
+            if ((0 == message->data[2]) || (message->data[2] > SDO_BLOCK_SIZE_MAX))
+            {
+                return send_abort(transfer, ABORT_INVALID_BLOCK_SIZE);
+            }
+
+            // Segments after the acknowledged one are sent again.
+            transfer->offset     = SDL_min(transfer->block_offset + (Uint32)(sequence * 7), transfer->size);
+            transfer->block_size = message->data[2];
+
+            if (transfer->offset < transfer->size)
+            {
+                return send_sub_block(transfer);
+            }
+
+            // Bytes of the last segment which do not contain data.
+            request.data[0] = BLOCK_DOWNLOAD_REQUEST | (Uint8)(((7 - (transfer->size % 7)) % 7) << 2) | BLOCK_END;
+            if (SDL_TRUE == transfer->is_crc_used)
+            {
+                request.data[1] = (Uint8)(transfer->crc & 0x00ff);
+                request.data[2] = (Uint8)((transfer->crc & 0xff00) >> 8);
+            }
+
+            transfer->phase = SDO_PHASE_BLOCK_END;
+            return send_segment(transfer, &request);
+
+        case SDO_PHASE_BLOCK_END:
+            if ((BLOCK_DOWNLOAD_RESPONSE | BLOCK_END) != (command & (SDO_SPECIFIER_MASK | BLOCK_COMMAND_MASK)))
+            {
+                return send_abort(transfer, ABORT_CMD_SPECIFIER_INVALID_UNKNOWN);
+            }
+            return SDL_TRUE;
+    }
+}
+
+static SDL_bool send_sub_block(sdo_transfer_t* transfer)
+{
+    transfer->block_offset = transfer->offset;
+    transfer->sequence     = 0;
+
+    return send_block_segments(transfer);
+}
+
+/* Queues the segments of the block which are not queued yet at once.
+ * offset and sequence only count the queued ones, so if the transmit
+ * queue is full, sdo_poll() sends the rest later.  Returns SDL_TRUE if
+ * the transfer failed.
+ */
+static SDL_bool send_block_segments(sdo_transfer_t* transfer)
+{
+    can_message_t segment[SDO_BLOCK_SIZE_MAX];
+    Uint32        offset  = transfer->offset;
+    int           count   = 0;
+    int           written = 0;
+    int           index;
+    Uint32        can_status;
+
+    while (((transfer->sequence + count) < transfer->block_size) && (offset < transfer->size))
+    {
+        Uint32 length = SDL_min(7, transfer->size - offset);
+
+        SDL_zero(segment[count]);
+        segment[count].id      = 0x600 + transfer->node_id;
+        segment[count].length  = 8;
+        segment[count].data[0] = (Uint8)(transfer->sequence + count + 1);
+        if ((offset + length) >= transfer->size)
+        {
+            segment[count].data[0] |= 0x80;
+        }
+
+        SDL_memcpy(&segment[count].data[1], &transfer->buffer[offset], length);
+        offset += length;
+        count  += 1;
+    }
+
+    can_status = can_write_batch(transfer->channel, segment, count, &written);
+
+    for (index = 0; index < written; index += 1)
+    {
+        transfer->offset   += SDL_min(7, transfer->size - transfer->offset);
+        transfer->sequence += 1;
+    }
+
+    if (CAN_ERROR_QXMTFULL == can_status)
+    {
+        transfer->is_send_pending = SDL_TRUE;
+    }
+    else if (CAN_OK != can_status)
+    {
+        transfer->can_status = can_status;
+        return SDL_TRUE;
+    }
+
+    return SDL_FALSE;
+}
+
+static SDL_bool send_download_segment(sdo_transfer_t* transfer)
+{
+    can_message_t segment = { 0 };
+    Uint32        length  = SDL_min(7, transfer->size - transfer->offset);
+
+    segment.data[0] = DOWNLOAD_SEGMENT_REQUEST | (Uint8)(transfer->toggle << 4) | (Uint8)((7 - length) << 1);
+    if ((transfer->offset + length) >= transfer->size)
+    {
+        segment.data[0] |= 0x01;
+    }
+
+    if (length > 0)
+    {
+        SDL_memcpy(&segment.data[1], &transfer->buffer[transfer->offset], length);
+        transfer->offset += length;
+    }
+
+    return send_segment(transfer, &segment);
+}
+
+/* Called by the receive thread, so it must not block.  If the transmit
+ * queue is full, sdo_poll() sends the segment later.  Returns SDL_TRUE
+ * if the transfer failed and is done therefore.
+ */
+static SDL_bool send_segment(sdo_transfer_t* transfer, can_message_t* message)
+{
+    Uint32 can_status;
+
+    message->id     = 0x600 + transfer->node_id;
+    message->length = 8;
+
+    can_status = can_write_timeout(transfer->channel, message, 0);
+    if (CAN_ERROR_QXMTFULL == can_status)
+    {
+        transfer->pending_segment = *message;
+        transfer->is_send_pending = SDL_TRUE;
+    }
+    else if (CAN_OK != can_status)
+    {
+        transfer->can_status = can_status;
+        return SDL_TRUE;
+    }
+
+    return SDL_FALSE;
+}
+
+// Always returns SDL_TRUE, the transfer is done.
+static SDL_bool send_abort(sdo_transfer_t* transfer, Uint32 abort_code)
+{
+    can_message_t abort = { 0 };
+
+    abort.id      = 0x600 + transfer->node_id;
+    abort.length  = 8;
+    abort.data[0] = SDO_ABORT;
+    abort.data[1] = (Uint8)(transfer->index  & 0x00ff);
+    abort.data[2] = (Uint8)((transfer->index & 0xff00) >> 8);
+    abort.data[3] = transfer->sub_index;
+    abort.data[4] = (Uint8)(abort_code  & 0x000000ff);
+    abort.data[5] = (Uint8)((abort_code & 0x0000ff00) >> 8);
+    abort.data[6] = (Uint8)((abort_code & 0x00ff0000) >> 16);
+    abort.data[7] = (Uint8)((abort_code & 0xff000000) >> 24);
+
+    (void)can_write_timeout(transfer->channel, &abort, 0);
+
+    transfer->abort_code = abort_code;
+    return SDL_TRUE;
+}
+
+static Uint32 get_le32(const Uint8* data)
+{
+    return (Uint32)data[0] | ((Uint32)data[1] << 8) | ((Uint32)data[2] << 16) | ((Uint32)data[3] << 24);
+}
+
+// Up to 4 bytes are shown as number, printable data as string.
+static void format_data(const Uint8* data, Uint32 size, char* text, size_t text_size)
+{
+    SDL_bool is_printable = SDL_TRUE;
+    size_t   used         = 0;
+    Uint32   index;
+
+    for (index = 0; index < size; index += 1)
+    {
+        if ((data[index] < 0x20) || (data[index] > 0x7e))
+        {
+            // Strings may be terminated.
+            if ((0 == data[index]) && (index == (size - 1)) && (index > 0))
+            {
+                break;
+            }
+            is_printable = SDL_FALSE;
+            break;
+        }
+    }
+
+    if (0 == size)
+    {
+        SDL_strlcpy(text, "\"\"", text_size);
+    }
+    else if (size <= 4)
+    {
+        Uint8  bytes[4] = { 0 };
+        Uint32 value;
+
+        SDL_memcpy(bytes, data, size);
+        value = get_le32(bytes);
+        SDL_snprintf(text, text_size, "%u (0x%x)", value, value);
+    }
+    else if (SDL_TRUE == is_printable)
+    {
+        SDL_snprintf(text, text_size, "\"%.*s\"", (int)SDL_min(index, text_size - 3), (const char*)data);
+    }
+    else
+    {
+        text[0] = '\0';
+        // Leaves room for the ellipsis.
+        for (index = 0; (index < size) && ((used + 7) <= text_size); index += 1)
+        {
+            used += (size_t)SDL_snprintf(&text[used], text_size - used, "%02x ", data[index]);
+        }
+
+        if (index < size)
+        {
+            SDL_strlcpy(&text[used], "...", text_size - used);
+        }
+        else if (used > 0)
+        {
+            text[used - 1] = '\0';
+        }
+    }
+}
+
+static Uint8 get_response_length(Uint8 command_code)
+{
+    switch (command_code)
+    {
+        case READ_DICT_4_BYTE_SENT:
+        case WRITE_DICT_4_BYTE_SENT:
+            return 4;
+        case READ_DICT_3_BYTE_SENT:
+        case WRITE_DICT_3_BYTE_SENT:
+            return 3;
+        case READ_DICT_2_BYTE_SENT:
+        case WRITE_DICT_2_BYTE_SENT:
+            return 2;
+        case READ_DICT_1_BYTE_SENT:
+        case WRITE_DICT_1_BYTE_SENT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Returns a handle for sdo_wait(), or nil if the transfer failed.
+static int submit_lua_transfer(lua_State* L, sdo_transfer_t* transfer)
+{
+    int index;
+
+    for (index = 0; index < SDO_LUA_TRANSFER_MAX; index += 1)
+    {
+        if (SDL_FALSE == is_lua_transfer_used[index])
+        {
+            break;
+        }
+    }
+
+    if (index >= SDO_LUA_TRANSFER_MAX)
+    {
+        c_log(LOG_WARNING, "Could not submit SDO transfer: %d transfers not waited for", SDO_LUA_TRANSFER_MAX);
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_transfer[index] = *transfer;
+    if (SDL_FALSE == sdo_submit(&lua_transfer[index]))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    is_lua_transfer_used[index] = SDL_TRUE;
+    lua_pushinteger(L, index + 1);
+    return 1;
 }
 
 static void print_abort_code_error(Uint32 abort_code)
@@ -15,10 +15,18 @@
 #include "can.h"
 #include "core.h"
 
+#define SDO_BUFFER_SIZE       0x10000
+#define SDO_BLOCK_BUFFER_SIZE 0x100000
+#define SDO_BLOCK_SIZE_MAX    127
+
 typedef enum
 {
     EXPEDITED_SDO_READ = 0,
-    EXPEDITED_SDO_WRITE
+    EXPEDITED_SDO_WRITE,
+    SDO_UPLOAD,        // Expedited or segmented, into the buffer
+    SDO_DOWNLOAD,      // Segmented if longer than 4 bytes
+    SDO_BLOCK_UPLOAD,  // Unless the server switches, see threshold
+    SDO_BLOCK_DOWNLOAD // Unless not longer than the threshold
 
 } sdo_type_t;
 
@@ -46,6 +54,45 @@ typedef enum
 
 } sdo_command_code_t;
 
+// Upper three bits of the command code, see CiA 301.
+typedef enum
+{
+    DOWNLOAD_SEGMENT_REQUEST   = 0x00,
+    DOWNLOAD_INITIATE_REQUEST  = 0x20,
+    UPLOAD_INITIATE_REQUEST    = 0x40,
+    UPLOAD_SEGMENT_REQUEST     = 0x60,
+    UPLOAD_SEGMENT_RESPONSE    = 0x00,
+    DOWNLOAD_SEGMENT_RESPONSE  = 0x20,
+    UPLOAD_INITIATE_RESPONSE   = 0x40,
+    DOWNLOAD_INITIATE_RESPONSE = 0x60,
+    BLOCK_UPLOAD_REQUEST       = 0xa0,
+    BLOCK_DOWNLOAD_REQUEST     = 0xc0,
+    BLOCK_DOWNLOAD_RESPONSE    = 0xa0,
+    BLOCK_UPLOAD_RESPONSE      = 0xc0,
+    SDO_SPECIFIER_MASK         = 0xe0
+
+} sdo_command_specifier_t;
+
+// Sub-commands of block transfers, lower two bits.
+typedef enum
+{
+    BLOCK_INITIATE     = 0x00,
+    BLOCK_END          = 0x01,
+    BLOCK_ACKNOWLEDGE  = 0x02,
+    BLOCK_START_UPLOAD = 0x03,
+    BLOCK_COMMAND_MASK = 0x03
+
+} sdo_block_command_t;
+
+typedef enum
+{
+    SDO_PHASE_INITIATE = 0, // Done here if expedited
+    SDO_PHASE_SEGMENT,
+    SDO_PHASE_BLOCK,
+    SDO_PHASE_BLOCK_END
+
+} sdo_phase_t;
+
 typedef enum
 {
     ABORT_TOGGLE_BIT_NOT_ALTERED             = 0x05030000,
@@ -82,10 +129,87 @@ typedef enum
 
 } sdo_abort_code_t;
 
-Uint32 sdo_read(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index);
-Uint32 sdo_write(can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data);
+typedef struct sdo_transfer sdo_transfer_t;
+typedef void (*sdo_callback_t)(sdo_transfer_t* transfer, void* user_data);
+
+/* A transfer is owned by the caller and must stay valid until it is
+ * done.  Transfers to the same SDO server are sent one after another,
+ * transfers to different servers are in flight at the same time.
+ */
+struct sdo_transfer
+{
+    // Set by the caller.
+    Uint8           channel;
+    sdo_type_t      type;
+    Uint8           node_id;
+    Uint16          index;
+    Uint8           sub_index;
+    Uint8           length;     // Written bytes, or read bytes once done
+    Uint32          data;       // Written data, or read data once done
+    Uint8*          buffer;     // Of SDO_UPLOAD and SDO_DOWNLOAD
+    Uint32          size;       // Written bytes, or read bytes once done
+    Uint32          buffer_size;
+    Uint8           block_size; // Segments per block, up to 127
+    Uint8           threshold;  // Not sent as block up to this many bytes
+    sdo_callback_t  callback;   // Optional
+    void*           user_data;
+
+    // Set once done.
+    SDL_bool        is_done;
+    Uint32          can_status; // CAN_ERROR_QRCVEMPTY on timeout
+    Uint32          abort_code;
+    can_message_t   response;
+    sdo_phase_t     phase;      // Tells the protocol which was used
+
+    // Internal.
+    Uint64          deadline_ms;
+    Uint32          offset;
+    Uint8           toggle;
+    Uint8           sequence;
+    Uint32          block_offset;
+    Uint16          crc;
+    SDL_bool        is_crc_used;
+    Uint8           retry_count;
+    Uint8           last_segment[7];
+    SDL_bool        is_send_pending; // Transmit queue was full
+    can_message_t   pending_segment;
+    sdo_transfer_t* next;
+
+};
+
+SDL_bool sdo_submit(sdo_transfer_t* transfer);
+void     sdo_poll(Uint32 timeout_ms);
+Uint32   sdo_wait(sdo_transfer_t* transfer);
+
+Uint32 sdo_read(Uint8 channel, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index);
+Uint32 sdo_write(Uint8 channel, can_message_t* sdo_response, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8 length, Uint32 data);
+Uint32 sdo_upload(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8* buffer, Uint32 buffer_size, Uint32* size);
+Uint32 sdo_download(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, const Uint8* buffer, Uint32 size);
+Uint32 sdo_block_upload(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, Uint8* buffer, Uint32 buffer_size, Uint32* size);
+Uint32 sdo_block_download(Uint8 channel, SDL_bool show_output, Uint8 node_id, Uint16 index, Uint8 sub_index, const Uint8* buffer, Uint32 size);
+void   sdo_block_upload_file(Uint8 channel, Uint8 node_id, Uint16 index, Uint8 sub_index, const char* file_name);
+void   sdo_block_download_file(Uint8 channel, Uint8 node_id, Uint16 index, Uint8 sub_index, const char* file_name);
+void   sdo_set_block_size(Uint8 size);
+void   sdo_set_block_threshold(Uint8 threshold);
+void   sdo_print_block_settings(void);
+void   sdo_set_timeout(Uint8 channel, Uint8 node_id, Uint32 timeout_ms);
+Uint32 sdo_get_timeout(Uint8 channel, Uint8 node_id);
+void   sdo_print_timeouts(Uint8 channel);
+void   sdo_read_nodes(Uint8 channel, Uint8 first_node_id, Uint8 last_node_id, Uint16 index, Uint8 sub_index);
 int    lua_sdo_read(lua_State* L);
 int    lua_sdo_write(lua_State* L);
+int    lua_sdo_read_string(lua_State* L);
+int    lua_sdo_write_string(lua_State* L);
+int    lua_sdo_block_read(lua_State* L);
+int    lua_sdo_block_write(lua_State* L);
+int    lua_sdo_block_settings(lua_State* L);
+int    lua_sdo_timeout(lua_State* L);
+int    lua_sdo_get_timeout(lua_State* L);
+int    lua_sdo_submit_read(lua_State* L);
+int    lua_sdo_submit_write(lua_State* L);
+int    lua_sdo_wait(lua_State* L);
 void   lua_register_sdo_commands(core_t* core);
+void   sdo_clear_lua_transfers(void);
+void   sdo_deinit(void);
 
 #endif /* SDO_CLIENT_H */
@@ -0,0 +1,495 @@
+/** @file stats.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "nuklear.h"
+#include "can.h"
+#include "core.h"
+#include "printf.h"
+#include "stats.h"
+#include "table.h"
+
+#define STATS_BUCKET_COUNT 64 // Must be a power of two > STATS_WINDOW_MAX.
+#define STATS_ID_COUNT     2048
+
+/* Every bucket covers one second.  The buckets are reused round-robin
+ * and cleared when a new second begins, a sliding window is the sum of
+ * the last completed seconds.
+ */
+typedef struct stats_bucket
+{
+    Uint64 second;
+    Uint32 frames[STATS_DIRECTION_COUNT];
+    Uint64 bits[STATS_DIRECTION_COUNT];
+    Uint64 busy_ns;
+    Uint32 error_frames;
+    Uint16 id_frames[STATS_ID_COUNT];
+
+} stats_bucket_t;
+
+typedef struct stats_channel
+{
+    SDL_SpinLock   lock;
+    Uint32         bit_rate;
+    Uint32         data_bit_rate;
+    stats_bucket_t bucket[STATS_BUCKET_COUNT];
+
+} stats_channel_t;
+
+static stats_channel_t stats_channel[CAN_CHANNEL_MAX];
+
+static stats_bucket_t* get_bucket(stats_channel_t* s, Uint64 second);
+static void            get_frame_bits(const can_message_t* message, Uint32* nominal_bits, Uint32* data_bits);
+static Uint32          get_window(Uint32 window_s);
+
+void stats_set_bit_rate(Uint8 channel, Uint32 bit_rate, Uint32 data_bit_rate)
+{
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return;
+    }
+
+    SDL_AtomicLock(&stats_channel[channel].lock);
+    stats_channel[channel].bit_rate      = bit_rate;
+    stats_channel[channel].data_bit_rate = data_bit_rate;
+    SDL_AtomicUnlock(&stats_channel[channel].lock);
+}
+
+/* Called by the receive thread for every batch of received frames and
+ * by can_write() for every batch of sent frames.  Error frames reported
+ * by the driver are only counted.
+ */
+void stats_record(Uint8 channel, stats_direction_t direction, const can_message_t* messages, int count)
+{
+    stats_channel_t* s;
+    stats_bucket_t*  bucket;
+    Uint64           nominal_bits = 0;
+    Uint64           data_bits    = 0;
+    int              index;
+
+    if ((channel >= CAN_CHANNEL_MAX) || (count <= 0))
+    {
+        return;
+    }
+
+    s = &stats_channel[channel];
+
+    SDL_AtomicLock(&s->lock);
+
+    bucket = get_bucket(s, SDL_GetTicks64() / 1000);
+
+    for (index = 0; index < count; index += 1)
+    {
+        const can_message_t* message = &messages[index];
+        Uint32               frame_nominal_bits;
+        Uint32               frame_data_bits;
+
+        if (0 != (message->flags & CAN_FLAG_ERROR))
+        {
+            bucket->error_frames += 1;
+            continue;
+        }
+
+        get_frame_bits(message, &frame_nominal_bits, &frame_data_bits);
+        nominal_bits += frame_nominal_bits;
+        data_bits    += frame_data_bits;
+
+        bucket->frames[direction] += 1;
+
+        if (0 == (message->id & CAN_ID_EXTENDED))
+        {
+            bucket->id_frames[message->id & (STATS_ID_COUNT - 1)] += 1;
+        }
+    }
+
+    bucket->bits[direction] += nominal_bits + data_bits;
+
+    if (0 != s->bit_rate)
+    {
+        Uint32 data_bit_rate = (0 != s->data_bit_rate) ? s->data_bit_rate : s->bit_rate;
+
+        bucket->busy_ns += (nominal_bits * 1000000000) / s->bit_rate;
+        bucket->busy_ns += (data_bits    * 1000000000) / data_bit_rate;
+    }
+
+    SDL_AtomicUnlock(&s->lock);
+}
+
+void stats_get(Uint8 channel, Uint32 window_s, stats_t* stats)
+{
+    stats_channel_t* s;
+    Uint64           now_s = SDL_GetTicks64() / 1000;
+    Uint64           frames[STATS_DIRECTION_COUNT] = { 0 };
+    Uint64           bits[STATS_DIRECTION_COUNT]   = { 0 };
+    Uint64           busy_ns                        = 0;
+    Uint32           error_frames                   = 0;
+    Uint32           offset;
+    int              direction;
+
+    SDL_zerop(stats);
+
+    if (channel >= CAN_CHANNEL_MAX)
+    {
+        return;
+    }
+
+    s        = &stats_channel[channel];
+    window_s = get_window(window_s);
+
+    SDL_AtomicLock(&s->lock);
+    for (offset = 1; (offset <= window_s) && (offset <= now_s); offset += 1)
+    {
+        stats_bucket_t* bucket = &s->bucket[(now_s - offset) & (STATS_BUCKET_COUNT - 1)];
+
+        if ((now_s - offset) != bucket->second)
+        {
+            continue;
+        }
+
+        for (direction = 0; direction < STATS_DIRECTION_COUNT; direction += 1)
+        {
+            frames[direction] += bucket->frames[direction];
+            bits[direction]   += bucket->bits[direction];
+        }
+        busy_ns      += bucket->busy_ns;
+        error_frames += bucket->error_frames;
+    }
+    SDL_AtomicUnlock(&s->lock);
+
+    stats->window_s = window_s;
+    for (direction = 0; direction < STATS_DIRECTION_COUNT; direction += 1)
+    {
+        stats->frames_per_s[direction] = (float)frames[direction] / (float)window_s;
+        stats->bits_per_s[direction]   = (float)bits[direction]   / (float)window_s;
+    }
+    stats->bus_load     = ((float)busy_ns * 100.0f) / ((float)window_s * 1000000000.0f);
+    stats->error_frames = error_frames;
+    stats->is_filtered  = can_is_filtered(channel);
+}
+
+float stats_get_id_rate(Uint8 channel, Uint16 can_id, Uint32 window_s)
+{
+    stats_channel_t* s;
+    Uint64           now_s  = SDL_GetTicks64() / 1000;
+    Uint32           frames = 0;
+    Uint32           offset;
+
+    if ((channel >= CAN_CHANNEL_MAX) || (can_id >= STATS_ID_COUNT))
+    {
+        return 0.0f;
+    }
+
+    s        = &stats_channel[channel];
+    window_s = get_window(window_s);
+
+    SDL_AtomicLock(&s->lock);
+    for (offset = 1; (offset <= window_s) && (offset <= now_s); offset += 1)
+    {
+        stats_bucket_t* bucket = &s->bucket[(now_s - offset) & (STATS_BUCKET_COUNT - 1)];
+
+        if ((now_s - offset) == bucket->second)
+        {
+            frames += bucket->id_frames[can_id];
+        }
+    }
+    SDL_AtomicUnlock(&s->lock);
+
+    return (float)frames / (float)window_s;
+}
+
+void stats_print(Uint8 channel, Uint32 window_s)
+{
+    table_t table    = { DARK_CYAN, DARK_WHITE, 16, 12, 12 };
+    table_t id_table = { DARK_CYAN, DARK_WHITE, 6, 12, 12 };
+    stats_t stats;
+    char    title[17];
+    char    rx[13];
+    char    tx[13];
+    float   frames_per_s;
+    Uint16  can_id;
+
+    stats_get(channel, window_s, &stats);
+
+    SDL_snprintf(title, sizeof(title), "Channel %u, %2u s", channel, stats.window_s);
+
+    table_print_header(&table);
+    table_print_row(title, "RX", "TX", &table);
+    table_print_divider(&table);
+
+    SDL_snprintf(rx, sizeof(rx), "%.1f", stats.frames_per_s[STATS_RX]);
+    SDL_snprintf(tx, sizeof(tx), "%.1f", stats.frames_per_s[STATS_TX]);
+    table_print_row("Frames/s", (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, tx, &table);
+
+    SDL_snprintf(rx, sizeof(rx), "%.0f", stats.bits_per_s[STATS_RX]);
+    SDL_snprintf(tx, sizeof(tx), "%.0f", stats.bits_per_s[STATS_TX]);
+    table_print_row("Bits/s", (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, tx, &table);
+
+    SDL_snprintf(rx, sizeof(rx), "%.1f %%", stats.bus_load);
+    table_print_row("Bus load", (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, " ", &table);
+
+    SDL_snprintf(rx, sizeof(rx), "%u", stats.error_frames);
+    table_print_row("Error frames", rx, " ", &table);
+    table_print_footer(&table);
+
+    // Only the subscribed COB-IDs are received, see can_update_filter().
+    if (SDL_TRUE == stats.is_filtered)
+    {
+        c_log(LOG_INFO, "Acceptance filter active: received frames and bus load not available");
+    }
+
+    frames_per_s = stats.frames_per_s[STATS_RX] + stats.frames_per_s[STATS_TX];
+    if (frames_per_s <= 0.0f)
+    {
+        return;
+    }
+
+    table_print_header(&id_table);
+    table_print_row("COB-ID", "Frames/s", "Share", &id_table);
+    table_print_divider(&id_table);
+
+    for (can_id = 0; can_id < STATS_ID_COUNT; can_id += 1)
+    {
+        float id_frames_per_s = stats_get_id_rate(channel, can_id, stats.window_s);
+        char  id[7];
+
+        if (id_frames_per_s <= 0.0f)
+        {
+            continue;
+        }
+        else if (SDL_FALSE == can_is_received(channel, can_id))
+        {
+            continue;
+        }
+
+        SDL_snprintf(id, sizeof(id), "0x%03x", can_id);
+        SDL_snprintf(rx, sizeof(rx), "%.1f", id_frames_per_s);
+        SDL_snprintf(tx, sizeof(tx), "%.1f %%", (id_frames_per_s * 100.0f) / frames_per_s);
+        table_print_row(id, rx, (SDL_TRUE == stats.is_filtered) ? "n/a" : tx, &id_table);
+    }
+    table_print_footer(&id_table);
+}
+
+void stats_widget(core_t* core)
+{
+    static int window_s = 10;
+
+    stats_t stats;
+    char    rx[16];
+    char    tx[16];
+
+    if (NULL == core)
+    {
+        return;
+    }
+
+    if (SDL_FALSE == core->is_gui_active)
+    {
+        return;
+    }
+
+    if (0 != nk_begin(
+            core->ctx,
+            "Bus statistics",
+            nk_rect(10, 40, 250, 225),
+            NK_WINDOW_BORDER  |
+            NK_WINDOW_TITLE   |
+            NK_WINDOW_MOVABLE |
+            NK_WINDOW_NO_SCROLLBAR))
+    {
+        nk_layout_row_dynamic(core->ctx, 20, 3);
+        if (0 != nk_option_label(core->ctx, "1 s", (1 == window_s)))
+        {
+            window_s = 1;
+        }
+        if (0 != nk_option_label(core->ctx, "10 s", (10 == window_s)))
+        {
+            window_s = 10;
+        }
+        if (0 != nk_option_label(core->ctx, "60 s", (60 == window_s)))
+        {
+            window_s = 60;
+        }
+
+        stats_get(core->channel, (Uint32)window_s, &stats);
+
+        nk_layout_row_dynamic(core->ctx, 20, 3);
+        nk_label(core->ctx, " ",  NK_TEXT_LEFT);
+        nk_label(core->ctx, "RX", NK_TEXT_RIGHT);
+        nk_label(core->ctx, "TX", NK_TEXT_RIGHT);
+
+        SDL_snprintf(rx, sizeof(rx), "%.1f", stats.frames_per_s[STATS_RX]);
+        SDL_snprintf(tx, sizeof(tx), "%.1f", stats.frames_per_s[STATS_TX]);
+        nk_label(core->ctx, "Frames/s", NK_TEXT_LEFT);
+        nk_label(core->ctx, (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, NK_TEXT_RIGHT);
+        nk_label(core->ctx, tx, NK_TEXT_RIGHT);
+
+        SDL_snprintf(rx, sizeof(rx), "%.0f", stats.bits_per_s[STATS_RX]);
+        SDL_snprintf(tx, sizeof(tx), "%.0f", stats.bits_per_s[STATS_TX]);
+        nk_label(core->ctx, "Bits/s", NK_TEXT_LEFT);
+        nk_label(core->ctx, (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, NK_TEXT_RIGHT);
+        nk_label(core->ctx, tx, NK_TEXT_RIGHT);
+
+        SDL_snprintf(rx, sizeof(rx), "%.1f %%", stats.bus_load);
+        nk_label(core->ctx, "Bus load", NK_TEXT_LEFT);
+        nk_label(core->ctx, (SDL_TRUE == stats.is_filtered) ? "n/a" : rx, NK_TEXT_RIGHT);
+        nk_label(core->ctx, " ", NK_TEXT_RIGHT);
+
+        SDL_snprintf(rx, sizeof(rx), "%u", stats.error_frames);
+        nk_label(core->ctx, "Error frames", NK_TEXT_LEFT);
+        nk_label(core->ctx, rx, NK_TEXT_RIGHT);
+        nk_label(core->ctx, " ", NK_TEXT_RIGHT);
+
+        if (SDL_TRUE == stats.is_filtered)
+        {
+            nk_layout_row_dynamic(core->ctx, 20, 1);
+            nk_label(core->ctx, "n/a: acceptance filter active", NK_TEXT_LEFT);
+        }
+    }
+
+    nk_end(core->ctx);
+}
+
+int lua_stats_get(lua_State* L)
+{
+    Uint32  window_s = (Uint32)luaL_optinteger(L, 1, 1);
+    Uint8   channel  = (Uint8)luaL_optinteger(L, 2, 0);
+    stats_t stats;
+
+    stats_get(channel, window_s, &stats);
+
+    lua_createtable(L, 0, 7);
+    lua_pushnumber(L, stats.frames_per_s[STATS_TX]);
+    lua_setfield(L, -2, "tx_frames_per_s");
+    lua_pushnumber(L, stats.bits_per_s[STATS_TX]);
+    lua_setfield(L, -2, "tx_bits_per_s");
+
+    // Left nil, the acceptance filter drops most of the frames.
+    if (SDL_FALSE == stats.is_filtered)
+    {
+        lua_pushnumber(L, stats.frames_per_s[STATS_RX]);
+        lua_setfield(L, -2, "rx_frames_per_s");
+        lua_pushnumber(L, stats.bits_per_s[STATS_RX]);
+        lua_setfield(L, -2, "rx_bits_per_s");
+        lua_pushnumber(L, stats.bus_load);
+        lua_setfield(L, -2, "bus_load");
+    }
+    lua_pushinteger(L, stats.error_frames);
+    lua_setfield(L, -2, "error_frames");
+    lua_pushboolean(L, stats.is_filtered);
+    lua_setfield(L, -2, "is_filtered");
+
+    return 1;
+}
+
+int lua_stats_get_id(lua_State* L)
+{
+    Uint16 can_id   = (Uint16)luaL_checkinteger(L, 1);
+    Uint32 window_s = (Uint32)luaL_optinteger(L, 2, 1);
+    Uint8  channel  = (Uint8)luaL_optinteger(L, 3, 0);
+
+    if (SDL_FALSE == can_is_received(channel, can_id))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushnumber(L, stats_get_id_rate(channel, can_id, window_s));
+
+    return 1;
+}
+
+void lua_register_stats_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_stats_get);
+    lua_setglobal(core->L, "stats_get");
+
+    lua_pushcfunction(core->L, lua_stats_get_id);
+    lua_setglobal(core->L, "stats_get_id");
+}
+
+// Must be called with the channel's lock held.
+static stats_bucket_t* get_bucket(stats_channel_t* s, Uint64 second)
+{
+    stats_bucket_t* bucket = &s->bucket[second & (STATS_BUCKET_COUNT - 1)];
+
+    if (second != bucket->second)
+    {
+        SDL_zerop(bucket);
+        bucket->second = second;
+    }
+
+    return bucket;
+}
+
+/* Worst-case frame length including all stuff bits and the interframe
+ * space, see R. I. Davis et al., "Controller Area Network (CAN)
+ * schedulability analysis: Refuted, revisited and revised".  For CAN FD
+ * frames with bit rate switch, the data phase is returned separately
+ * as it is sent at the data bit rate.
+ */
+static void get_frame_bits(const can_message_t* message, Uint32* nominal_bits, Uint32* data_bits)
+{
+    Uint32 data_field = 8 * (Uint32)message->length;
+    Uint32 arbitration;
+    Uint32 data_phase;
+    Uint32 crc;
+
+    if (0 == (message->flags & CAN_FLAG_FD))
+    {
+        if (0 == (message->id & CAN_ID_EXTENDED))
+        {
+            *nominal_bits = data_field + 47 + ((34 + data_field - 1) / 4);
+        }
+        else
+        {
+            *nominal_bits = data_field + 67 + ((54 + data_field - 1) / 4);
+        }
+        *data_bits = 0;
+        return;
+    }
+
+    // SOF to BRS, dynamically stuffed.
+    arbitration  = (0 == (message->id & CAN_ID_EXTENDED)) ? 17 : 36;
+    arbitration += (arbitration - 1) / 4;
+
+    // ESI, DLC and data, dynamically stuffed, followed by the stuff
+    // count and the CRC with a fixed stuff bit every four bits.
+    crc         = (message->length > 16) ? 21 : 17;
+    data_phase  = 5 + data_field;
+    data_phase += data_phase / 4;
+    data_phase += 4 + crc + ((4 + crc + 3) / 4);
+
+    // CRC delimiter, ACK, ACK delimiter, EOF and interframe space.
+    if (0 != (message->flags & CAN_FLAG_BRS))
+    {
+        *nominal_bits = arbitration + 13;
+        *data_bits    = data_phase;
+    }
+    else
+    {
+        *nominal_bits = arbitration + data_phase + 13;
+        *data_bits    = 0;
+    }
+}
+
+static Uint32 get_window(Uint32 window_s)
+{
+    if (0 == window_s)
+    {
+        return 1;
+    }
+    else if (window_s > STATS_WINDOW_MAX)
+    {
+        return STATS_WINDOW_MAX;
+    }
+
+    return window_s;
+}
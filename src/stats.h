@@ -0,0 +1,49 @@
+/** @file stats.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "can.h"
+#include "core.h"
+
+#define STATS_WINDOW_MAX 60 // Longest sliding window in seconds
+
+typedef enum stats_direction
+{
+    STATS_RX = 0,
+    STATS_TX,
+    STATS_DIRECTION_COUNT
+
+} stats_direction_t;
+
+typedef struct stats
+{
+    Uint32   window_s;
+    float    frames_per_s[STATS_DIRECTION_COUNT];
+    float    bits_per_s[STATS_DIRECTION_COUNT];
+    float    bus_load;
+    Uint32   error_frames;
+    SDL_bool is_filtered; // RX figures and bus load are not available
+
+} stats_t;
+
+void  stats_set_bit_rate(Uint8 channel, Uint32 bit_rate, Uint32 data_bit_rate);
+void  stats_record(Uint8 channel, stats_direction_t direction, const can_message_t* messages, int count);
+void  stats_get(Uint8 channel, Uint32 window_s, stats_t* stats);
+float stats_get_id_rate(Uint8 channel, Uint16 can_id, Uint32 window_s);
+void  stats_print(Uint8 channel, Uint32 window_s);
+void  stats_widget(core_t* core);
+int   lua_stats_get(lua_State* L);
+int   lua_stats_get_id(lua_State* L);
+void  lua_register_stats_commands(core_t* core);
+
+#endif /* STATS_H */
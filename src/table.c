@@ -12,6 +12,8 @@
 #include "printf.h"
 
 static void print_frame(const char* left, const char* center, const char* right, table_t* t);
+static void append_repeated(c_buffer_t* line, color_t color, const char* text, Uint8 count);
+static void append_column(c_buffer_t* line, const char* text, Uint8 width, const SDL_bool* is_marked, color_t mark_color, table_t* t);
 
 void table_print_header(table_t* t)
 {
@@ -30,73 +32,74 @@ void table_print_footer(table_t* t)
 
 void table_print_row(const char* column_a, const char* column_b, const char* column_c, table_t* t)
 {
-    int    index;
-    size_t column_a_len = SDL_strlen(column_a);
-    size_t column_b_len = SDL_strlen(column_b);
-    size_t column_c_len = SDL_strlen(column_c);
+    table_print_row_marked(column_a, column_b, column_c, NULL, t->text_color, t);
+}
 
-    c_printf(t->frame_color, " │ ");
+/* Like table_print_row(), but the characters of the second column for
+ * which is_marked is set are printed in the mark colour.
+ */
+void table_print_row_marked(const char* column_a, const char* column_b, const char* column_c, const SDL_bool* is_marked, color_t mark_color, table_t* t)
+{
+    c_buffer_t line;
 
-    for (index = 0; index < t->column_a_width; index += 1)
-    {
-        if (index <= (column_a_len - 1))
-        {
-            c_printf(t->text_color, "%c", column_a[index]);
-        }
-        else
-        {
-            c_printf(t->text_color, " ");
-        }
-    }
-    c_printf(t->frame_color, " ║ ");
+    c_buffer_init(&line);
+    c_buffer_append(&line, t->frame_color, " │ ", 5);
+    append_column(&line, column_a, t->column_a_width, NULL, mark_color, t);
+    c_buffer_append(&line, t->frame_color, " ║ ", 5);
+    append_column(&line, column_b, t->column_b_width, is_marked, mark_color, t);
+    c_buffer_append(&line, t->frame_color, " ║ ", 5);
+    append_column(&line, column_c, t->column_c_width, NULL, mark_color, t);
+    c_buffer_append(&line, t->frame_color, " │\r\n", 6);
+    c_buffer_flush(&line);
+}
 
-    for (index = 0; index < t->column_b_width; index += 1)
-    {
-        if (index <= (column_b_len - 1))
-        {
-            c_printf(t->text_color, "%c", column_b[index]);
-        }
-        else
-        {
-            c_printf(t->text_color, " ");
-        }
-    }
-    c_printf(t->frame_color, " ║ ");
+// Every line of a table is written at once, see c_buffer_t.
+static void print_frame(const char* left, const char* center, const char* right, table_t* t)
+{
+    c_buffer_t line;
 
-    for (index = 0; index < t->column_c_width; index += 1)
-    {
-        if (index <= (column_c_len - 1))
-        {
-            c_printf(t->text_color, "%c", column_c[index]);
-        }
-        else
-        {
-            c_printf(t->text_color, " ");
-        }
-    }
-    c_printf(t->frame_color, " │\r\n");
+    c_buffer_init(&line);
+    c_buffer_append(&line, t->frame_color, " ", 1);
+    c_buffer_append(&line, t->frame_color, left, SDL_strlen(left));
+    append_repeated(&line, t->frame_color, "─", t->column_a_width);
+    c_buffer_append(&line, t->frame_color, center, SDL_strlen(center));
+    append_repeated(&line, t->frame_color, "─", t->column_b_width);
+    c_buffer_append(&line, t->frame_color, center, SDL_strlen(center));
+    append_repeated(&line, t->frame_color, "─", t->column_c_width);
+    c_buffer_append(&line, t->frame_color, right, SDL_strlen(right));
+    c_buffer_append(&line, t->frame_color, "\r\n", 2);
+    c_buffer_flush(&line);
 }
 
-static void print_frame(const char* left, const char* center, const char* right, table_t* t)
+static void append_repeated(c_buffer_t* line, color_t color, const char* text, Uint8 count)
 {
-    int index;
+    size_t length = SDL_strlen(text);
+    int    index;
 
-    c_printf(t->frame_color, " %s", left);
-    for (index = 0; index < t->column_a_width; index += 1)
+    for (index = 0; index < count; index += 1)
     {
-        c_printf(t->frame_color, "─");
+        c_buffer_append(line, color, text, length);
     }
-    c_printf(t->frame_color, "%s", center);
+}
 
-    for (index = 0; index < t->column_b_width; index += 1)
-    {
-        c_printf(t->frame_color, "─");
-    }
-    c_printf(t->frame_color, "%s", center);
+// Text longer than the column is cut, shorter text is padded.
+static void append_column(c_buffer_t* line, const char* text, Uint8 width, const SDL_bool* is_marked, color_t mark_color, table_t* t)
+{
+    size_t length = SDL_min(SDL_strlen(text), width);
+    size_t index  = 0;
 
-    for (index = 0; index < t->column_c_width; index += 1)
+    while (index < length)
     {
-        c_printf(t->frame_color, "─");
+        SDL_bool is_run_marked = (NULL != is_marked) ? is_marked[index] : SDL_FALSE;
+        size_t   run_start     = index;
+
+        while ((index < length) && (is_run_marked == ((NULL != is_marked) ? is_marked[index] : SDL_FALSE)))
+        {
+            index += 1;
+        }
+
+        c_buffer_append(line, (SDL_TRUE == is_run_marked) ? mark_color : t->text_color, &text[run_start], index - run_start);
     }
-    c_printf(t->frame_color, "%s\r\n", right);
+
+    append_repeated(line, t->text_color, " ", (Uint8)(width - length));
 }
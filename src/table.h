@@ -27,5 +27,6 @@ void table_print_header(table_t* t);
 void table_print_divider(table_t* t);
 void table_print_footer(table_t* t);
 void table_print_row(const char* column_a, const char* column_b, const char* column_c, table_t* t);
+void table_print_row_marked(const char* column_a, const char* column_b, const char* column_c, const SDL_bool* is_marked, color_t mark_color, table_t* t);
 
 #endif /* TABLE_H */
@@ -0,0 +1,1396 @@
+/** @file trace.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "can.h"
+#include "core.h"
+#include "printf.h"
+#include "ring_buffer.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE            16384 // Per channel, must be a power of two.
+#define TRACE_CHUNK_SIZE           (64 * 1024 * 1024)
+#define TRACE_FLUSH_INTERVAL_IN_MS 10
+#define TRACE_SYNC_INTERVAL_IN_MS  1000
+#define TRACE_WRITER_BUFFER_SIZE   (256 * 1024)
+
+/* The receive threads only push frames into a lock-free ring per
+ * channel, which is drained by the flush thread.  The flush thread is
+ * the only one touching the file: it writes the records into a memory
+ * mapping of the preallocated file and grows it by TRACE_CHUNK_SIZE
+ * whenever it is full.  This way, neither file I/O nor page faults nor
+ * the growing of the file can stall the receive path.
+ */
+typedef struct trace
+{
+    SDL_atomic_t  is_active;
+    SDL_Thread*   flush_thread;
+    SDL_mutex*    mutex;
+    SDL_cond*     cond;
+    ring_buffer_t ring[CAN_CHANNEL_MAX];
+    int           overrun_count[CAN_CHANNEL_MAX];
+    char          file_name[256];
+#ifdef _WIN32
+    HANDLE        file;
+    HANDLE        mapping;
+#else
+    int           fd;
+#endif
+    Uint8*        map;
+    Uint64        map_size;
+    Uint64        offset;
+    Uint64        file_size;
+    Uint64        frames;
+    trace_index_t index;
+
+} trace_t;
+
+static trace_t        trace;
+static trace_reader_t query_reader;
+static char           query_file_name[256];
+
+static int      trace_flush(void* unused);
+static SDL_bool drain(void);
+static SDL_bool open_file(const char* file_name);
+static void     close_file(void);
+static SDL_bool map_file(Uint64 size);
+static void     unmap_file(void);
+static void     sync_file(void);
+static SDL_bool write_index(void);
+static Uint32   get_dropped_frames(void);
+static void     encode_header(Uint8* header, Uint64 start_time_us, Uint64 data_size, Uint64 index_offset, Uint32 index_count);
+static Uint8    encode_record(Uint8* record, Uint8 channel, const can_message_t* message);
+static void     encode_index_entry(Uint8* entry, const trace_block_t* block);
+static SDL_bool flush_writer(trace_writer_t* writer);
+static void     index_add(trace_index_t* index, Uint64 offset, const can_message_t* message);
+static void     index_free(trace_index_t* index);
+static SDL_bool load_index(trace_reader_t* reader, Uint64 index_offset, Uint32 count);
+static void     build_index(trace_reader_t* reader);
+static Uint32   get_next_block(trace_index_t* index, const Uint32* can_id, int count, Uint32 block);
+static SDL_bool is_in_block(const trace_block_t* block, const Uint32* can_id, int count);
+static void     update_block(trace_reader_t* reader);
+static void     seek_block(trace_reader_t* reader, Uint32 block);
+static void     seek_offset(trace_reader_t* reader, Uint64 offset);
+static void     put_uint16(Uint8* buffer, Uint16 value);
+static void     put_uint32(Uint8* buffer, Uint32 value);
+static void     put_uint64(Uint8* buffer, Uint64 value);
+static Uint16   get_uint16(const Uint8* buffer);
+static Uint32   get_uint32(const Uint8* buffer);
+static Uint64   get_uint64(const Uint8* buffer);
+
+SDL_bool trace_start(const char* file_name)
+{
+    char default_name[64];
+    int  channel;
+
+    if (SDL_TRUE == trace_is_active())
+    {
+        c_log(LOG_WARNING, "Trace already running: %s", trace.file_name);
+        return SDL_FALSE;
+    }
+    else if (NULL != trace.flush_thread)
+    {
+        // The previous trace was stopped by an error.
+        trace_stop();
+    }
+
+    if (NULL == trace.mutex)
+    {
+        trace.mutex = SDL_CreateMutex();
+        trace.cond  = SDL_CreateCond();
+
+        if ((NULL == trace.mutex) || (NULL == trace.cond))
+        {
+            c_log(LOG_ERROR, "Could not create trace synchronisation objects: %s", SDL_GetError());
+            return SDL_FALSE;
+        }
+    }
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        ring_buffer_t* ring = &trace.ring[channel];
+        can_message_t  message;
+
+        if (NULL == ring->buffer)
+        {
+            if (SDL_FALSE == ring_buffer_init(ring, TRACE_RING_SIZE))
+            {
+                c_log(LOG_ERROR, "Could not allocate trace buffer");
+                return SDL_FALSE;
+            }
+        }
+
+        // Discard frames received after the previous trace was stopped.
+        while (SDL_TRUE == ring_buffer_pop(ring, &message));
+
+        trace.overrun_count[channel] = SDL_AtomicGet(&ring->overrun_count);
+    }
+
+    if (NULL == file_name)
+    {
+        time_t    now = time(NULL);
+        struct tm local_time;
+
+#ifdef _WIN32
+        localtime_s(&local_time, &now);
+#else
+        localtime_r(&now, &local_time);
+#endif
+        strftime(default_name, sizeof(default_name), "trace_%Y%m%d_%H%M%S.trace", &local_time);
+        file_name = default_name;
+    }
+
+    if (SDL_FALSE == open_file(file_name))
+    {
+        c_log(LOG_ERROR, "Could not create trace file %s", file_name);
+        return SDL_FALSE;
+    }
+
+    SDL_AtomicSet(&trace.is_active, 1);
+
+    trace.flush_thread = SDL_CreateThread(trace_flush, "Trace flush thread", NULL);
+    if (NULL == trace.flush_thread)
+    {
+        SDL_AtomicSet(&trace.is_active, 0);
+        close_file();
+        c_log(LOG_ERROR, "Could not create trace flush thread: %s", SDL_GetError());
+        return SDL_FALSE;
+    }
+
+    // The trace contains all frames, not only the subscribed ones.
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_hold_filter_open((Uint8)channel, SDL_TRUE);
+    }
+
+    c_log(LOG_SUCCESS, "Trace started: %s", trace.file_name);
+    return SDL_TRUE;
+}
+
+void trace_stop(void)
+{
+    Uint32 dropped;
+    int    channel;
+
+    if (NULL == trace.flush_thread)
+    {
+        c_log(LOG_WARNING, "No trace running");
+        return;
+    }
+
+    SDL_LockMutex(trace.mutex);
+    SDL_AtomicSet(&trace.is_active, 0);
+    SDL_CondSignal(trace.cond);
+    SDL_UnlockMutex(trace.mutex);
+
+    SDL_WaitThread(trace.flush_thread, NULL);
+    trace.flush_thread = NULL;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_hold_filter_open((Uint8)channel, SDL_FALSE);
+    }
+
+    c_log(LOG_SUCCESS, "Trace stopped: %s, %llu frames, %llu bytes",
+          trace.file_name,
+          (unsigned long long)trace.frames,
+          (unsigned long long)trace.offset);
+
+    dropped = get_dropped_frames();
+    if (dropped > 0)
+    {
+        c_log(LOG_WARNING, "%u frames could not be recorded in time", dropped);
+    }
+}
+
+SDL_bool trace_is_active(void)
+{
+    return (0 != SDL_AtomicGet(&trace.is_active)) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Called by the receive thread of the channel.  It must neither block
+ * nor allocate: if the flush thread falls behind, the frames are
+ * dropped and counted by the ring.
+ */
+void trace_record(Uint8 channel, const can_message_t* messages, int count)
+{
+    ring_buffer_t* ring;
+    int            index;
+
+    if ((0 == SDL_AtomicGet(&trace.is_active)) || (channel >= CAN_CHANNEL_MAX))
+    {
+        return;
+    }
+
+    ring = &trace.ring[channel];
+
+    for (index = 0; index < count; index += 1)
+    {
+        if (0 != messages[index].timestamp_us)
+        {
+            ring_buffer_push(ring, &messages[index]);
+        }
+        else
+        {
+            can_message_t message = messages[index];
+
+            message.timestamp_us = can_get_time_us();
+            ring_buffer_push(ring, &message);
+        }
+    }
+}
+
+void trace_print_status(void)
+{
+    if (NULL == trace.flush_thread)
+    {
+        c_log(LOG_INFO, "No trace running");
+        return;
+    }
+
+    SDL_LockMutex(trace.mutex);
+    c_log(LOG_INFO, "Trace running: %s, %llu frames, %llu bytes, %u dropped",
+          trace.file_name,
+          (unsigned long long)trace.frames,
+          (unsigned long long)trace.offset,
+          get_dropped_frames());
+    SDL_UnlockMutex(trace.mutex);
+}
+
+// Must be called after the CAN channels were closed.
+void trace_deinit(void)
+{
+    int channel;
+
+    if (NULL != trace.flush_thread)
+    {
+        trace_stop();
+    }
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        ring_buffer_deinit(&trace.ring[channel]);
+    }
+
+    if (NULL != trace.cond)
+    {
+        SDL_DestroyCond(trace.cond);
+        trace.cond = NULL;
+    }
+
+    if (NULL != trace.mutex)
+    {
+        SDL_DestroyMutex(trace.mutex);
+        trace.mutex = NULL;
+    }
+
+    index_free(&trace.index);
+    trace_close(&query_reader);
+}
+
+SDL_bool trace_open(trace_reader_t* reader, const char* file_name)
+{
+    Uint8  header[TRACE_HEADER_SIZE];
+    Sint64 file_size;
+
+    if ((NULL == reader) || (NULL == file_name))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zerop(reader);
+
+    reader->file = SDL_RWFromFile(file_name, "rb");
+    if (NULL == reader->file)
+    {
+        c_log(LOG_ERROR, "Could not open trace file %s", file_name);
+        return SDL_FALSE;
+    }
+
+    if ((1 != SDL_RWread(reader->file, header, TRACE_HEADER_SIZE, 1)) ||
+        (0 != SDL_memcmp(header, TRACE_MAGIC, 8)) ||
+        (TRACE_VERSION != get_uint16(&header[8])) ||
+        (get_uint16(&header[10]) < TRACE_HEADER_SIZE))
+    {
+        c_log(LOG_ERROR, "%s is not a trace file", file_name);
+        trace_close(reader);
+        return SDL_FALSE;
+    }
+
+    reader->header_size   = get_uint16(&header[10]);
+    reader->start_time_us = get_uint64(&header[16]);
+    reader->data_size     = get_uint64(&header[24]);
+
+    // The size may be too large if the file was truncated.
+    file_size = SDL_RWsize(reader->file);
+    if ((file_size >= 0) && ((reader->header_size + reader->data_size) > (Uint64)file_size))
+    {
+        reader->data_size = (Uint64)file_size - reader->header_size;
+    }
+
+    index_free(&reader->index);
+    if (SDL_FALSE == load_index(reader, get_uint64(&header[32]), get_uint32(&header[40])))
+    {
+        build_index(reader);
+    }
+
+    trace_rewind(reader);
+
+    return SDL_TRUE;
+}
+
+/* Returns the next record of the trace, SDL_FALSE at the end of the
+ * trace or if the record is damaged.
+ */
+SDL_bool trace_read(trace_reader_t* reader, can_message_t* message, Uint8* channel)
+{
+    Uint8 record[TRACE_RECORD_SIZE];
+    Uint8 length;
+
+    if ((NULL == reader) || (NULL == reader->file) || ((reader->offset + TRACE_RECORD_SIZE) > reader->data_size))
+    {
+        return SDL_FALSE;
+    }
+
+    update_block(reader);
+
+    if (1 != SDL_RWread(reader->file, record, TRACE_RECORD_SIZE, 1))
+    {
+        return SDL_FALSE;
+    }
+
+    length = record[14];
+    if ((length > CANFD_MAX_DATA_LENGTH) || ((reader->offset + TRACE_RECORD_SIZE + length) > reader->data_size))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zerop(message);
+    message->timestamp_us = get_uint64(&record[0]);
+    message->id           = get_uint32(&record[8]);
+    message->flags        = record[13];
+    message->length       = length;
+    *channel              = record[12];
+
+    if ((length > 0) && (1 != SDL_RWread(reader->file, message->data, length, 1)))
+    {
+        return SDL_FALSE;
+    }
+
+    reader->offset += TRACE_RECORD_SIZE + length;
+
+    return SDL_TRUE;
+}
+
+void trace_rewind(trace_reader_t* reader)
+{
+    if ((NULL == reader) || (NULL == reader->file))
+    {
+        return;
+    }
+
+    seek_offset(reader, 0);
+    reader->block = 0;
+}
+
+/* Positions the reader at the first record at or after the given
+ * timestamp, as found by a binary search over the blocks of the index
+ * and a scan of a single block.  Returns SDL_FALSE if there is none.
+ */
+SDL_bool trace_seek_time(trace_reader_t* reader, Uint64 timestamp_us)
+{
+    trace_index_t* index = &reader->index;
+    can_message_t  message;
+    Uint8          channel;
+    Uint64         latest_us;
+    Uint32         low   = 0;
+    Uint32         high;
+
+    if ((NULL == reader->file) || (0 == index->count))
+    {
+        return SDL_FALSE;
+    }
+
+    // Last block starting at or before the timestamp.
+    high = index->count;
+    while ((high - low) > 1)
+    {
+        Uint32 middle = low + ((high - low) / 2);
+
+        if (index->block[middle].timestamp_us <= timestamp_us)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    seek_block(reader, low);
+    latest_us = index->block[low].timestamp_us;
+
+    while (SDL_TRUE)
+    {
+        Uint64 offset = reader->offset;
+
+        if (SDL_FALSE == trace_read(reader, &message, &channel))
+        {
+            return SDL_FALSE;
+        }
+
+        if (message.timestamp_us > latest_us)
+        {
+            latest_us = message.timestamp_us;
+        }
+
+        if (latest_us >= timestamp_us)
+        {
+            seek_offset(reader, offset);
+            return SDL_TRUE;
+        }
+    }
+}
+
+/* Positions the reader at the next record with one of the given
+ * CAN-IDs, starting at its current position.  Blocks which do not
+ * contain any of them are skipped.  Returns SDL_FALSE if there is none.
+ */
+SDL_bool trace_seek_id(trace_reader_t* reader, const Uint32* can_id, int count)
+{
+    trace_index_t* index = &reader->index;
+    can_message_t  message;
+    Uint8          channel;
+
+    if (NULL == reader->file)
+    {
+        return SDL_FALSE;
+    }
+
+    while (reader->offset < reader->data_size)
+    {
+        Uint32 block;
+        Uint64 block_end;
+
+        update_block(reader);
+        block     = reader->block;
+        block_end = ((block + 1) < index->count) ? index->block[block + 1].offset : reader->data_size;
+
+        if ((0 == index->count) || (SDL_TRUE == is_in_block(&index->block[block], can_id, count)))
+        {
+            while ((reader->offset < block_end) || (0 == index->count))
+            {
+                Uint64 offset = reader->offset;
+                int    id_index;
+
+                if (SDL_FALSE == trace_read(reader, &message, &channel))
+                {
+                    return SDL_FALSE;
+                }
+
+                for (id_index = 0; id_index < count; id_index += 1)
+                {
+                    if (message.id == can_id[id_index])
+                    {
+                        seek_offset(reader, offset);
+                        return SDL_TRUE;
+                    }
+                }
+            }
+        }
+
+        block = get_next_block(index, can_id, count, block);
+        if (block >= index->count)
+        {
+            seek_offset(reader, reader->data_size);
+            return SDL_FALSE;
+        }
+        seek_block(reader, block);
+    }
+
+    return SDL_FALSE;
+}
+
+Uint64 trace_get_first_timestamp(trace_reader_t* reader)
+{
+    if ((NULL == reader) || (0 == reader->index.count))
+    {
+        return 0;
+    }
+
+    return reader->index.block[0].timestamp_us;
+}
+
+void trace_close(trace_reader_t* reader)
+{
+    if ((NULL == reader) || (NULL == reader->file))
+    {
+        return;
+    }
+
+    SDL_RWclose(reader->file);
+    reader->file = NULL;
+    index_free(&reader->index);
+}
+
+SDL_bool trace_create(trace_writer_t* writer, const char* file_name, Uint64 start_time_us)
+{
+    Uint8 header[TRACE_HEADER_SIZE];
+
+    if ((NULL == writer) || (NULL == file_name))
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zerop(writer);
+    index_free(&writer->index);
+
+    writer->buffer = (Uint8*)SDL_malloc(TRACE_WRITER_BUFFER_SIZE);
+    if (NULL == writer->buffer)
+    {
+        c_log(LOG_ERROR, "Could not allocate trace buffer");
+        return SDL_FALSE;
+    }
+
+    writer->file = SDL_RWFromFile(file_name, "wb");
+    if (NULL == writer->file)
+    {
+        c_log(LOG_ERROR, "Could not create trace file %s", file_name);
+        SDL_free(writer->buffer);
+        writer->buffer = NULL;
+        return SDL_FALSE;
+    }
+
+    // Completed by trace_finish().
+    writer->start_time_us = start_time_us;
+    encode_header(header, start_time_us, 0, 0, 0);
+    if (1 != SDL_RWwrite(writer->file, header, TRACE_HEADER_SIZE, 1))
+    {
+        writer->is_failed = SDL_TRUE;
+    }
+
+    return SDL_TRUE;
+}
+
+SDL_bool trace_write(trace_writer_t* writer, Uint8 channel, const can_message_t* message)
+{
+    if ((NULL == writer->file) || (SDL_TRUE == writer->is_failed))
+    {
+        return SDL_FALSE;
+    }
+
+    if ((writer->buffer_used + TRACE_RECORD_SIZE_MAX) > TRACE_WRITER_BUFFER_SIZE)
+    {
+        if (SDL_FALSE == flush_writer(writer))
+        {
+            return SDL_FALSE;
+        }
+    }
+
+    index_add(&writer->index, writer->offset, message);
+
+    writer->buffer_used += encode_record(&writer->buffer[writer->buffer_used], channel, message);
+    writer->offset      += TRACE_RECORD_SIZE + SDL_min(message->length, CANFD_MAX_DATA_LENGTH);
+    writer->frames      += 1;
+
+    return SDL_TRUE;
+}
+
+/* Appends the index, completes the header and closes the file.
+ * Returns SDL_FALSE if any record could not be written.
+ */
+SDL_bool trace_finish(trace_writer_t* writer)
+{
+    Uint8    header[TRACE_HEADER_SIZE];
+    Uint64   index_offset = TRACE_HEADER_SIZE + writer->offset;
+    Uint32   index_count  = 0;
+    Uint32   block;
+    SDL_bool is_ok;
+
+    if (NULL == writer->file)
+    {
+        return SDL_FALSE;
+    }
+
+    flush_writer(writer);
+
+    if ((SDL_FALSE == writer->is_failed) && (SDL_FALSE == writer->index.is_failed))
+    {
+        for (block = 0; block < writer->index.count; block += 1)
+        {
+            encode_index_entry(&writer->buffer[writer->buffer_used], &writer->index.block[block]);
+            writer->buffer_used += TRACE_INDEX_ENTRY_SIZE;
+
+            if ((writer->buffer_used + TRACE_INDEX_ENTRY_SIZE) > TRACE_WRITER_BUFFER_SIZE)
+            {
+                flush_writer(writer);
+            }
+        }
+
+        if (SDL_TRUE == flush_writer(writer))
+        {
+            index_count = writer->index.count;
+        }
+    }
+
+    // Without an index, the reader rebuilds it.
+    encode_header(header, writer->start_time_us, writer->offset, (index_count > 0) ? index_offset : 0, index_count);
+    if ((SDL_RWseek(writer->file, 0, RW_SEEK_SET) < 0) || (1 != SDL_RWwrite(writer->file, header, TRACE_HEADER_SIZE, 1)))
+    {
+        writer->is_failed = SDL_TRUE;
+    }
+
+    is_ok = (0 == SDL_RWclose(writer->file)) ? SDL_TRUE : SDL_FALSE;
+    if (SDL_TRUE == writer->is_failed)
+    {
+        is_ok = SDL_FALSE;
+    }
+
+    writer->file = NULL;
+    SDL_free(writer->buffer);
+    writer->buffer = NULL;
+    index_free(&writer->index);
+
+    return is_ok;
+}
+
+int lua_trace_start(lua_State* L)
+{
+    const char* file_name = luaL_optstring(L, 1, NULL);
+
+    lua_pushboolean(L, trace_start(file_name));
+
+    return 1;
+}
+
+int lua_trace_stop(lua_State* L)
+{
+    (void)L;
+
+    trace_stop();
+
+    return 0;
+}
+
+/* Returns up to max_count records, starting at the given time in
+ * seconds since the first record and optionally restricted to one
+ * CAN-ID.  The file is kept open for further queries.
+ */
+int lua_trace_find(lua_State* L)
+{
+    const char*   file_name = luaL_checkstring(L, 1);
+    double        from_s    = luaL_optnumber(L, 2, 0.0);
+    Uint32        can_id    = (Uint32)luaL_optinteger(L, 3, 0);
+    SDL_bool      is_by_id  = lua_isnoneornil(L, 3) ? SDL_FALSE : SDL_TRUE;
+    int           max_count = (int)luaL_optinteger(L, 4, 1);
+    can_message_t message;
+    Uint8         channel;
+    int           count     = 0;
+    SDL_bool      is_found;
+
+    if ((NULL == query_reader.file) || (0 != SDL_strcmp(query_file_name, file_name)))
+    {
+        trace_close(&query_reader);
+        if (SDL_FALSE == trace_open(&query_reader, file_name))
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+        SDL_strlcpy(query_file_name, file_name, sizeof(query_file_name));
+    }
+
+    lua_newtable(L);
+
+    is_found = trace_seek_time(&query_reader, trace_get_first_timestamp(&query_reader) + (Uint64)(SDL_max(from_s, 0.0) * 1000000.0));
+    while ((SDL_TRUE == is_found) && (count < max_count))
+    {
+        int index;
+
+        if (SDL_TRUE == is_by_id)
+        {
+            if (SDL_FALSE == trace_seek_id(&query_reader, &can_id, 1))
+            {
+                break;
+            }
+        }
+
+        if (SDL_FALSE == trace_read(&query_reader, &message, &channel))
+        {
+            break;
+        }
+
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, (lua_Integer)message.timestamp_us);
+        lua_setfield(L, -2, "timestamp_us");
+        lua_pushinteger(L, message.id);
+        lua_setfield(L, -2, "can_id");
+        lua_pushinteger(L, message.length);
+        lua_setfield(L, -2, "length");
+        lua_pushinteger(L, channel);
+        lua_setfield(L, -2, "channel");
+        lua_createtable(L, message.length, 0);
+        for (index = 0; index < message.length; index += 1)
+        {
+            lua_pushinteger(L, message.data[index]);
+            lua_rawseti(L, -2, index + 1);
+        }
+        lua_setfield(L, -2, "data");
+
+        count += 1;
+        lua_rawseti(L, -2, count);
+    }
+
+    return 1;
+}
+
+void lua_register_trace_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_trace_start);
+    lua_setglobal(core->L, "trace_start");
+
+    lua_pushcfunction(core->L, lua_trace_stop);
+    lua_setglobal(core->L, "trace_stop");
+
+    lua_pushcfunction(core->L, lua_trace_find);
+    lua_setglobal(core->L, "trace_find");
+}
+
+static int trace_flush(void* unused)
+{
+    Uint64   sync_ms = SDL_GetTicks64();
+    SDL_bool is_ok   = SDL_TRUE;
+
+    (void)unused;
+
+    SDL_LockMutex(trace.mutex);
+    while ((1 == SDL_AtomicGet(&trace.is_active)) && (SDL_TRUE == is_ok))
+    {
+        SDL_CondWaitTimeout(trace.cond, trace.mutex, TRACE_FLUSH_INTERVAL_IN_MS);
+
+        is_ok = drain();
+
+        if ((SDL_GetTicks64() - sync_ms) >= TRACE_SYNC_INTERVAL_IN_MS)
+        {
+            sync_file();
+            sync_ms = SDL_GetTicks64();
+        }
+    }
+
+    // Record the frames received until the trace was stopped.
+    if (SDL_TRUE == is_ok)
+    {
+        is_ok = drain();
+    }
+
+    if (SDL_FALSE == is_ok)
+    {
+        SDL_AtomicSet(&trace.is_active, 0);
+        c_log(LOG_ERROR, "Could not grow trace file %s, trace stopped", trace.file_name);
+    }
+    else if (SDL_FALSE == write_index())
+    {
+        c_log(LOG_WARNING, "Could not write index of trace file %s", trace.file_name);
+    }
+
+    close_file();
+    SDL_UnlockMutex(trace.mutex);
+
+    return 0;
+}
+
+// Must be called by the flush thread with the trace lock held.
+static SDL_bool drain(void)
+{
+    int channel;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        can_message_t message;
+
+        while (SDL_TRUE == ring_buffer_pop(&trace.ring[channel], &message))
+        {
+            if ((trace.offset + TRACE_RECORD_SIZE_MAX) > trace.map_size)
+            {
+                if (SDL_FALSE == map_file(trace.map_size + TRACE_CHUNK_SIZE))
+                {
+                    return SDL_FALSE;
+                }
+            }
+
+            index_add(&trace.index, trace.offset - TRACE_HEADER_SIZE, &message);
+
+            trace.offset += encode_record(&trace.map[trace.offset], (Uint8)channel, &message);
+            trace.frames += 1;
+        }
+    }
+
+    put_uint64(&trace.map[24], trace.offset - TRACE_HEADER_SIZE);
+    trace.file_size = trace.offset;
+
+    return SDL_TRUE;
+}
+
+static SDL_bool open_file(const char* file_name)
+{
+#ifdef _WIN32
+    trace.file = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == trace.file)
+    {
+        return SDL_FALSE;
+    }
+#else
+    trace.fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (trace.fd < 0)
+    {
+        return SDL_FALSE;
+    }
+#endif
+
+    SDL_strlcpy(trace.file_name, file_name, sizeof(trace.file_name));
+    trace.map_size  = 0;
+    trace.offset    = 0;
+    trace.file_size = 0;
+    trace.frames    = 0;
+    index_free(&trace.index);
+
+    if (SDL_FALSE == map_file(TRACE_CHUNK_SIZE))
+    {
+        close_file();
+        return SDL_FALSE;
+    }
+
+    encode_header(trace.map, (Uint64)time(NULL) * 1000000, 0, 0, 0);
+    trace.offset    = TRACE_HEADER_SIZE;
+    trace.file_size = TRACE_HEADER_SIZE;
+
+    return SDL_TRUE;
+}
+
+// Cuts the preallocated but unused part off the file.
+static void close_file(void)
+{
+    unmap_file();
+
+#ifdef _WIN32
+    if (INVALID_HANDLE_VALUE != trace.file)
+    {
+        LARGE_INTEGER size;
+
+        size.QuadPart = (LONGLONG)trace.file_size;
+        SetFilePointerEx(trace.file, size, NULL, FILE_BEGIN);
+        SetEndOfFile(trace.file);
+        CloseHandle(trace.file);
+        trace.file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (trace.fd >= 0)
+    {
+        if (0 != ftruncate(trace.fd, (off_t)trace.file_size))
+        {
+            c_log(LOG_WARNING, "Could not truncate trace file %s", trace.file_name);
+        }
+        close(trace.fd);
+        trace.fd = -1;
+    }
+#endif
+}
+
+/* Grows the file to the given size and maps it as a whole.  The space
+ * is allocated up front where possible, so that running out of disk
+ * space is reported here and not by a fault while writing.
+ */
+static SDL_bool map_file(Uint64 size)
+{
+    unmap_file();
+
+#ifdef _WIN32
+    trace.mapping = CreateFileMappingA(trace.file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xffffffff), NULL);
+    if (NULL == trace.mapping)
+    {
+        return SDL_FALSE;
+    }
+
+    trace.map = (Uint8*)MapViewOfFile(trace.mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+    if (NULL == trace.map)
+    {
+        CloseHandle(trace.mapping);
+        trace.mapping = NULL;
+        return SDL_FALSE;
+    }
+#else
+    {
+        void* map;
+
+#ifdef __linux__
+        if ((0 != posix_fallocate(trace.fd, 0, (off_t)size)) && (0 != ftruncate(trace.fd, (off_t)size)))
+#else
+        if (0 != ftruncate(trace.fd, (off_t)size))
+#endif
+        {
+            return SDL_FALSE;
+        }
+
+        map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, trace.fd, 0);
+        if (MAP_FAILED == map)
+        {
+            return SDL_FALSE;
+        }
+        trace.map = (Uint8*)map;
+    }
+#endif
+
+    trace.map_size = size;
+
+    return SDL_TRUE;
+}
+
+static void unmap_file(void)
+{
+    if (NULL == trace.map)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(trace.map);
+    CloseHandle(trace.mapping);
+    trace.mapping = NULL;
+#else
+    munmap(trace.map, (size_t)trace.map_size);
+#endif
+
+    trace.map = NULL;
+}
+
+// Starts writing back the dirty pages without waiting for it.
+static void sync_file(void)
+{
+    if (NULL == trace.map)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    FlushViewOfFile(trace.map, 0);
+#else
+    msync(trace.map, (size_t)trace.map_size, MS_ASYNC);
+#endif
+}
+
+/* Appends the index to the records.  It is referenced by the header
+ * only once it is complete.
+ */
+static SDL_bool write_index(void)
+{
+    Uint64 size = (Uint64)trace.index.count * TRACE_INDEX_ENTRY_SIZE;
+    Uint32 block;
+
+    if ((SDL_TRUE == trace.index.is_failed) || (NULL == trace.map))
+    {
+        return SDL_FALSE;
+    }
+
+    if ((trace.offset + size) > trace.map_size)
+    {
+        if (SDL_FALSE == map_file(trace.offset + size))
+        {
+            return SDL_FALSE;
+        }
+    }
+
+    for (block = 0; block < trace.index.count; block += 1)
+    {
+        encode_index_entry(&trace.map[trace.offset + ((Uint64)block * TRACE_INDEX_ENTRY_SIZE)], &trace.index.block[block]);
+    }
+
+    put_uint64(&trace.map[32], trace.offset);
+    put_uint32(&trace.map[40], trace.index.count);
+    trace.file_size = trace.offset + size;
+
+    return SDL_TRUE;
+}
+
+static Uint32 get_dropped_frames(void)
+{
+    Uint32 dropped = 0;
+    int    channel;
+
+    for (channel = 0; channel < CAN_CHANNEL_MAX; channel += 1)
+    {
+        dropped += (Uint32)(SDL_AtomicGet(&trace.ring[channel].overrun_count) - trace.overrun_count[channel]);
+    }
+
+    return dropped;
+}
+
+static void encode_header(Uint8* header, Uint64 start_time_us, Uint64 data_size, Uint64 index_offset, Uint32 index_count)
+{
+    SDL_memcpy(&header[0], TRACE_MAGIC, 8);
+    put_uint16(&header[8],  TRACE_VERSION);
+    put_uint16(&header[10], TRACE_HEADER_SIZE);
+    put_uint32(&header[12], 0);
+    put_uint64(&header[16], start_time_us);
+    put_uint64(&header[24], data_size);
+    put_uint64(&header[32], index_offset);
+    put_uint32(&header[40], index_count);
+    put_uint32(&header[44], 0);
+}
+
+// Returns the size of the record, which is at most TRACE_RECORD_SIZE_MAX.
+static Uint8 encode_record(Uint8* record, Uint8 channel, const can_message_t* message)
+{
+    Uint8 length = SDL_min(message->length, CANFD_MAX_DATA_LENGTH);
+
+    put_uint64(&record[0], message->timestamp_us);
+    put_uint32(&record[8], message->id);
+    record[12] = channel;
+    record[13] = message->flags;
+    record[14] = length;
+    record[15] = 0;
+    SDL_memcpy(&record[TRACE_RECORD_SIZE], message->data, length);
+
+    return TRACE_RECORD_SIZE + length;
+}
+
+static void encode_index_entry(Uint8* entry, const trace_block_t* block)
+{
+    put_uint64(&entry[0],  block->offset);
+    put_uint64(&entry[8],  block->timestamp_us);
+    put_uint32(&entry[16], block->frames);
+    put_uint32(&entry[20], 0);
+    SDL_memcpy(&entry[24], block->id_bitmap, sizeof(block->id_bitmap));
+}
+
+static SDL_bool flush_writer(trace_writer_t* writer)
+{
+    if ((writer->buffer_used > 0) && (1 != SDL_RWwrite(writer->file, writer->buffer, writer->buffer_used, 1)))
+    {
+        writer->is_failed = SDL_TRUE;
+    }
+    writer->buffer_used = 0;
+
+    return (SDL_TRUE == writer->is_failed) ? SDL_FALSE : SDL_TRUE;
+}
+
+/* A new block is started every TRACE_BLOCK_FRAMES records.  If there
+ * is no memory left for the index, the trace is still recorded, its
+ * index is rebuilt when it is opened.
+ */
+static void index_add(trace_index_t* index, Uint64 offset, const can_message_t* message)
+{
+    trace_block_t* block;
+    Uint32         bit = message->id & (TRACE_ID_COUNT - 1);
+
+    if (SDL_TRUE == index->is_failed)
+    {
+        return;
+    }
+
+    if (message->timestamp_us > index->timestamp_us)
+    {
+        index->timestamp_us = message->timestamp_us;
+    }
+
+    if ((0 == index->count) || (index->block[index->count - 1].frames >= TRACE_BLOCK_FRAMES))
+    {
+        if (index->count == index->capacity)
+        {
+            Uint32         capacity = (0 == index->capacity) ? 256 : (index->capacity * 2);
+            trace_block_t* blocks   = (trace_block_t*)SDL_realloc(index->block, capacity * sizeof(trace_block_t));
+
+            if (NULL == blocks)
+            {
+                index->is_failed = SDL_TRUE;
+                return;
+            }
+
+            index->block    = blocks;
+            index->capacity = capacity;
+        }
+
+        block = &index->block[index->count];
+        SDL_zerop(block);
+        block->offset       = offset;
+        block->timestamp_us = index->timestamp_us;
+        index->count       += 1;
+    }
+
+    block = &index->block[index->count - 1];
+    block->frames            += 1;
+    block->id_bitmap[bit / 8] |= (Uint8)(1 << (bit % 8));
+}
+
+static void index_free(trace_index_t* index)
+{
+    int id;
+
+    SDL_free(index->block);
+    if (NULL != index->id_blocks)
+    {
+        for (id = 0; id < TRACE_ID_COUNT; id += 1)
+        {
+            SDL_free(index->id_blocks->block[id]);
+        }
+        SDL_free(index->id_blocks);
+    }
+
+    SDL_zerop(index);
+}
+
+static SDL_bool load_index(trace_reader_t* reader, Uint64 index_offset, Uint32 count)
+{
+    trace_index_t* index = &reader->index;
+    Uint32         block;
+
+    if ((0 == index_offset) || (0 == count) || (index_offset < (reader->header_size + reader->data_size)))
+    {
+        return SDL_FALSE;
+    }
+
+    index->block = (trace_block_t*)SDL_calloc(count, sizeof(trace_block_t));
+    if ((NULL == index->block) || (SDL_RWseek(reader->file, (Sint64)index_offset, RW_SEEK_SET) < 0))
+    {
+        index_free(index);
+        return SDL_FALSE;
+    }
+
+    for (block = 0; block < count; block += 1)
+    {
+        Uint8          entry[TRACE_INDEX_ENTRY_SIZE];
+        trace_block_t* b = &index->block[block];
+
+        if (1 != SDL_RWread(reader->file, entry, TRACE_INDEX_ENTRY_SIZE, 1))
+        {
+            index_free(index);
+            return SDL_FALSE;
+        }
+
+        b->offset       = get_uint64(&entry[0]);
+        b->timestamp_us = get_uint64(&entry[8]);
+        b->frames       = get_uint32(&entry[16]);
+        SDL_memcpy(b->id_bitmap, &entry[24], sizeof(b->id_bitmap));
+
+        // Blocks must be in order and within the records.
+        if ((b->offset >= reader->data_size) || ((block > 0) && (b->offset <= index->block[block - 1].offset)))
+        {
+            index_free(index);
+            return SDL_FALSE;
+        }
+    }
+
+    index->count    = count;
+    index->capacity = count;
+
+    return SDL_TRUE;
+}
+
+// For traces which were not stopped properly.
+static void build_index(trace_reader_t* reader)
+{
+    can_message_t message;
+    Uint8         channel;
+
+    trace_rewind(reader);
+
+    while (SDL_TRUE)
+    {
+        Uint64 offset = reader->offset;
+
+        if (SDL_FALSE == trace_read(reader, &message, &channel))
+        {
+            break;
+        }
+
+        index_add(&reader->index, offset, &message);
+    }
+}
+
+/* Returns the first block after the given one which may contain one of
+ * the CAN-IDs, or the number of blocks if there is none.  The blocks
+ * containing a COB-ID are gathered from the bitmaps on first use, so
+ * every further lookup is a binary search.
+ */
+static Uint32 get_next_block(trace_index_t* index, const Uint32* can_id, int count, Uint32 block)
+{
+    trace_id_blocks_t* id_blocks = index->id_blocks;
+    Uint32             next      = index->count;
+    int                id_index;
+
+    if (NULL == id_blocks)
+    {
+        id_blocks = (trace_id_blocks_t*)SDL_calloc(1, sizeof(trace_id_blocks_t));
+        if (NULL == id_blocks)
+        {
+            // Fall back to checking the blocks one by one.
+            return SDL_min(block + 1, index->count);
+        }
+
+        for (id_index = 0; id_index < TRACE_ID_COUNT; id_index += 1)
+        {
+            id_blocks->count[id_index] = -1;
+        }
+        index->id_blocks = id_blocks;
+    }
+
+    for (id_index = 0; id_index < count; id_index += 1)
+    {
+        Uint32 bit = can_id[id_index] & (TRACE_ID_COUNT - 1);
+        Uint32 low = 0;
+        Uint32 high;
+
+        if (id_blocks->count[bit] < 0)
+        {
+            Uint32 b;
+            int    blocks = 0;
+
+            for (b = 0; b < index->count; b += 1)
+            {
+                if (0 != (index->block[b].id_bitmap[bit / 8] & (1 << (bit % 8))))
+                {
+                    blocks += 1;
+                }
+            }
+
+            id_blocks->block[bit] = (Uint32*)SDL_malloc(((size_t)blocks + 1) * sizeof(Uint32));
+            if (NULL == id_blocks->block[bit])
+            {
+                // Fall back to checking the blocks one by one.
+                return SDL_min(block + 1, index->count);
+            }
+
+            blocks = 0;
+            for (b = 0; b < index->count; b += 1)
+            {
+                if (0 != (index->block[b].id_bitmap[bit / 8] & (1 << (bit % 8))))
+                {
+                    id_blocks->block[bit][blocks] = b;
+                    blocks += 1;
+                }
+            }
+            id_blocks->count[bit] = blocks;
+        }
+
+        // First block containing the COB-ID after the given one.
+        high = (Uint32)id_blocks->count[bit];
+        while (low < high)
+        {
+            Uint32 middle = low + ((high - low) / 2);
+
+            if (id_blocks->block[bit][middle] <= block)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        if ((low < (Uint32)id_blocks->count[bit]) && (id_blocks->block[bit][low] < next))
+        {
+            next = id_blocks->block[bit][low];
+        }
+    }
+
+    return next;
+}
+
+static SDL_bool is_in_block(const trace_block_t* block, const Uint32* can_id, int count)
+{
+    int id_index;
+
+    for (id_index = 0; id_index < count; id_index += 1)
+    {
+        Uint32 bit = can_id[id_index] & (TRACE_ID_COUNT - 1);
+
+        if (0 != (block->id_bitmap[bit / 8] & (1 << (bit % 8))))
+        {
+            return SDL_TRUE;
+        }
+    }
+
+    return SDL_FALSE;
+}
+
+// Keeps the block of the reader in line with its position.
+static void update_block(trace_reader_t* reader)
+{
+    trace_index_t* index = &reader->index;
+
+    while (((reader->block + 1) < index->count) && (reader->offset >= index->block[reader->block + 1].offset))
+    {
+        reader->block += 1;
+    }
+}
+
+static void seek_block(trace_reader_t* reader, Uint32 block)
+{
+    seek_offset(reader, reader->index.block[block].offset);
+    reader->block = block;
+}
+
+static void seek_offset(trace_reader_t* reader, Uint64 offset)
+{
+    SDL_RWseek(reader->file, (Sint64)(reader->header_size + offset), RW_SEEK_SET);
+    reader->offset = offset;
+}
+
+static void put_uint16(Uint8* buffer, Uint16 value)
+{
+    value = SDL_SwapLE16(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
+
+static void put_uint32(Uint8* buffer, Uint32 value)
+{
+    value = SDL_SwapLE32(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
+
+static void put_uint64(Uint8* buffer, Uint64 value)
+{
+    value = SDL_SwapLE64(value);
+    SDL_memcpy(buffer, &value, sizeof(value));
+}
+
+static Uint16 get_uint16(const Uint8* buffer)
+{
+    Uint16 value;
+
+    SDL_memcpy(&value, buffer, sizeof(value));
+    return SDL_SwapLE16(value);
+}
+
+static Uint32 get_uint32(const Uint8* buffer)
+{
+    Uint32 value;
+
+    SDL_memcpy(&value, buffer, sizeof(value));
+    return SDL_SwapLE32(value);
+}
+
+static Uint64 get_uint64(const Uint8* buffer)
+{
+    Uint64 value;
+
+    SDL_memcpy(&value, buffer, sizeof(value));
+    return SDL_SwapLE64(value);
+}
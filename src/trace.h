@@ -0,0 +1,151 @@
+/** @file trace.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "can.h"
+#include "core.h"
+
+/* A trace file starts with a header followed by the records of all
+ * received frames and the index.  The records of one channel are in
+ * the order they were received, records of different channels are
+ * interleaved in blocks.  All values are stored in little-endian byte
+ * order.
+ *
+ *  Header (48 bytes):
+ *   0  magic "COTTRACE"
+ *   8  Uint16 version
+ *  10  Uint16 header size
+ *  12  Uint32 reserved
+ *  16  Uint64 start time, microseconds since the Unix epoch
+ *  24  Uint64 size of all records in bytes
+ *  32  Uint64 file offset of the index, 0 if there is none
+ *  40  Uint32 number of index entries
+ *  44  Uint32 reserved
+ *
+ *  Record (16 bytes + data length):
+ *   0  Uint64 timestamp_us, as taken by the driver
+ *   8  Uint32 CAN-ID, CAN_ID_EXTENDED set for 29-bit identifiers
+ *  12  Uint8  channel
+ *  13  Uint8  flags, see can_flag_t
+ *  14  Uint8  data length in bytes
+ *  15  Uint8  reserved
+ *  16  data
+ *
+ *  Index entry (280 bytes), one per block of TRACE_BLOCK_FRAMES records:
+ *   0  Uint64 offset of the block's first record, relative to the first
+ *            record of the trace
+ *   8  Uint64 latest timestamp_us up to the block's first record
+ *  16  Uint32 number of records in the block
+ *  20  Uint32 reserved
+ *  24  Uint8  bitmap of the COB-IDs in the block[256]
+ *
+ * The size in the header is updated while recording, so a trace that
+ * was not stopped properly can be read up to the last flush.  The index
+ * is written when the trace is stopped and rebuilt when such a trace
+ * is opened.
+ */
+#define TRACE_MAGIC            "COTTRACE"
+#define TRACE_VERSION          1
+#define TRACE_HEADER_SIZE      48
+#define TRACE_RECORD_SIZE      16
+#define TRACE_RECORD_SIZE_MAX  (TRACE_RECORD_SIZE + CANFD_MAX_DATA_LENGTH)
+#define TRACE_BLOCK_FRAMES     4096
+#define TRACE_ID_COUNT         2048 // 29-bit identifiers share the bits of 11-bit ones.
+#define TRACE_INDEX_ENTRY_SIZE (24 + (TRACE_ID_COUNT / 8))
+
+typedef struct trace_block
+{
+    Uint64 offset;
+    Uint64 timestamp_us;
+    Uint32 frames;
+    Uint8  id_bitmap[TRACE_ID_COUNT / 8];
+
+} trace_block_t;
+
+// Blocks containing a COB-ID, -1 until the COB-ID is looked up.
+typedef struct trace_id_blocks
+{
+    Uint32* block[TRACE_ID_COUNT];
+    int     count[TRACE_ID_COUNT];
+
+} trace_id_blocks_t;
+
+/* The index is sparse: it only locates blocks of records.  Timestamps
+ * are found by a binary search over the blocks, COB-IDs by a binary
+ * search over the blocks containing them, which are gathered from the
+ * bitmaps the first time a COB-ID is looked up.  The lists are only
+ * allocated then, so readers and writers stay small enough for the
+ * stack.
+ */
+typedef struct trace_index
+{
+    trace_block_t*     block;
+    Uint32             count;
+    Uint32             capacity;
+    Uint64             timestamp_us;
+    SDL_bool           is_failed;
+    trace_id_blocks_t* id_blocks;
+
+} trace_index_t;
+
+typedef struct trace_reader
+{
+    SDL_RWops*    file;
+    Uint64        start_time_us;
+    Uint64        header_size;
+    Uint64        data_size;
+    Uint64        offset;
+    Uint32        block;
+    trace_index_t index;
+
+} trace_reader_t;
+
+/* Writes a trace sequentially, e.g. when converting one from another
+ * format.  The records are buffered, the header is completed and the
+ * index is appended by trace_finish().
+ */
+typedef struct trace_writer
+{
+    SDL_RWops*    file;
+    Uint64        start_time_us;
+    Uint64        offset;
+    Uint64        frames;
+    Uint8*        buffer;
+    size_t        buffer_used;
+    SDL_bool      is_failed;
+    trace_index_t index;
+
+} trace_writer_t;
+
+SDL_bool trace_start(const char* file_name);
+void     trace_stop(void);
+SDL_bool trace_is_active(void);
+void     trace_record(Uint8 channel, const can_message_t* messages, int count);
+void     trace_print_status(void);
+void     trace_deinit(void);
+SDL_bool trace_open(trace_reader_t* reader, const char* file_name);
+SDL_bool trace_read(trace_reader_t* reader, can_message_t* message, Uint8* channel);
+void     trace_rewind(trace_reader_t* reader);
+SDL_bool trace_seek_time(trace_reader_t* reader, Uint64 timestamp_us);
+SDL_bool trace_seek_id(trace_reader_t* reader, const Uint32* can_id, int count);
+Uint64   trace_get_first_timestamp(trace_reader_t* reader);
+void     trace_close(trace_reader_t* reader);
+SDL_bool trace_create(trace_writer_t* writer, const char* file_name, Uint64 start_time_us);
+SDL_bool trace_write(trace_writer_t* writer, Uint8 channel, const can_message_t* message);
+SDL_bool trace_finish(trace_writer_t* writer);
+int      lua_trace_start(lua_State* L);
+int      lua_trace_stop(lua_State* L);
+int      lua_trace_find(lua_State* L);
+void     lua_register_trace_commands(core_t* core);
+
+#endif /* TRACE_H */
@@ -0,0 +1,1662 @@
+/** @file trace_convert.c
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "SDL.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "can.h"
+#include "core.h"
+#include "pcapng.h"
+#include "printf.h"
+#include "trace.h"
+#include "trace_convert.h"
+
+#define CONVERT_BUFFER_SIZE       (64 * 1024)
+#define CONVERT_LINE_MAX          1024
+#define CONVERT_TOKEN_MAX         96
+#define CONVERT_COLUMN_MAX        16
+#define CONVERT_HEADER_LINES_MAX  1000
+#define CONVERT_CHUNK_THRESHOLD   ((Sint64)1024 * 1024 * 1024)
+#define CONVERT_THREAD_MAX        8
+#define CANDUMP_ERROR_FLAG        0x20000000
+#define ASC_FLAG_EDL              0x1000
+#define ASC_FLAG_BRS              0x2000
+#define ASC_FLAG_ESI              0x4000
+#define OLE_DATE_UNIX_EPOCH_DAYS  25569ULL // 1899-12-30 to 1970-01-01
+#define US_PER_DAY                86400000000ULL
+
+typedef enum trace_format
+{
+    TRACE_FORMAT_UNKNOWN = 0,
+    TRACE_FORMAT_NATIVE,
+    TRACE_FORMAT_CANDUMP,
+    TRACE_FORMAT_ASC,
+    TRACE_FORMAT_TRC,
+    TRACE_FORMAT_PCAPNG
+
+} trace_format_t;
+
+/* Taken from the header of the file before the frames are parsed and
+ * shared by all threads.  Only time_us is changed while parsing.
+ */
+typedef struct import_options
+{
+    trace_format_t format;
+    int            base;         // ASC: base of CAN-IDs and data
+    SDL_bool       is_relative;  // ASC: timestamps relative to the previous event
+    int            version;      // TRC: file version times 10
+    char           column[CONVERT_COLUMN_MAX + 1];
+    Uint64         start_time_us;
+    Uint64         first_us;     // candump: absolute time of the first frame
+    Uint64         time_us;      // ASC: time of the previous event
+
+} import_options_t;
+
+typedef struct line_reader
+{
+    SDL_RWops* file;
+    Sint64     remaining;
+    char*      buffer;
+    size_t     start;
+    size_t     end;
+    SDL_bool   is_eof;
+
+} line_reader_t;
+
+typedef struct text_writer
+{
+    SDL_RWops* file;
+    char*      buffer;
+    size_t     used;
+    SDL_bool   is_failed;
+
+} text_writer_t;
+
+/* Large files are split into chunks at line breaks, which are parsed
+ * into separate traces by one thread each and merged in order.
+ */
+typedef struct import_chunk
+{
+    const char*             input_name;
+    char                    part_name[280];
+    Sint64                  begin;
+    Sint64                  end;
+    const import_options_t* options;
+    Uint64                  frames;
+    SDL_bool                is_ok;
+
+} import_chunk_t;
+
+static const Uint8 dlc_to_length[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+
+static trace_format_t get_format(const char* file_name);
+static SDL_bool       import_trace(const char* input_name, const char* output_name, trace_format_t format);
+static SDL_bool       export_trace(const char* input_name, const char* output_name, trace_format_t format);
+static SDL_bool       export_pcapng(const char* input_name, const char* output_name);
+static SDL_bool       read_options(const char* input_name, import_options_t* options, Sint64* size);
+static SDL_bool       split_input(const char* input_name, Sint64 size, import_chunk_t* chunk, int count);
+static int            import_chunk(void* chunk_pointer);
+static SDL_bool       merge_parts(import_chunk_t* chunk, int count, const char* output_name, Uint64 start_time_us);
+static SDL_bool       parse_header(import_options_t* options, char** token, int count);
+static SDL_bool       parse_frame(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel);
+static SDL_bool       parse_candump(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel);
+static SDL_bool       parse_asc(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel);
+static SDL_bool       parse_trc(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel);
+static SDL_bool       parse_asc_date(char** token, int count, Uint64* time_us);
+static SDL_bool       parse_data(char** token, int count, int base, can_message_t* message);
+static SDL_bool       parse_uint(const char* token, int base, Uint32* value);
+static SDL_bool       parse_fixed(const char* token, int decimals, Uint64* value);
+static Uint8          parse_channel(const char* token);
+static int            get_hex_digit(char digit);
+static Uint8          get_dlc(Uint8 length);
+static const char*    get_trc_columns(const import_options_t* options);
+static void           write_candump(text_writer_t* writer, Uint64 time_us, Uint8 channel, const can_message_t* message);
+static void           write_asc(text_writer_t* writer, Uint64 time_us, Uint8 channel, const can_message_t* message);
+static SDL_bool       write_trc(text_writer_t* writer, Uint64 frames, Uint64 time_us, Uint8 channel, const can_message_t* message);
+static void           format_data(char* buffer, const can_message_t* message, SDL_bool is_spaced);
+static int            split_line(char* line, char** token, int max_count);
+static SDL_bool       line_reader_open(line_reader_t* reader, const char* file_name, Sint64 begin, Sint64 end);
+static char*          read_line(line_reader_t* reader);
+static char*          terminate_line(line_reader_t* reader, size_t line_end, size_t next);
+static void           line_reader_close(line_reader_t* reader);
+static SDL_bool       text_writer_open(text_writer_t* writer, const char* file_name);
+static void           write_text(text_writer_t* writer, const char* format, ...);
+static SDL_bool       text_writer_close(text_writer_t* writer);
+
+SDL_bool trace_convert(const char* input_name, const char* output_name)
+{
+    trace_format_t input_format;
+    trace_format_t output_format;
+
+    if ((NULL == input_name) || (NULL == output_name))
+    {
+        return SDL_FALSE;
+    }
+
+    input_format  = get_format(input_name);
+    output_format = get_format(output_name);
+
+    if ((TRACE_FORMAT_UNKNOWN == input_format) || (TRACE_FORMAT_UNKNOWN == output_format))
+    {
+        c_log(LOG_WARNING, "Unknown trace format, use .trace, .log (candump), .asc, .trc or .pcapng");
+        return SDL_FALSE;
+    }
+    else if (TRACE_FORMAT_PCAPNG == input_format)
+    {
+        c_log(LOG_WARNING, "pcapng captures can only be written");
+        return SDL_FALSE;
+    }
+    else if ((TRACE_FORMAT_NATIVE == input_format) && (TRACE_FORMAT_PCAPNG == output_format))
+    {
+        return export_pcapng(input_name, output_name);
+    }
+    else if ((TRACE_FORMAT_NATIVE == input_format) && (TRACE_FORMAT_NATIVE != output_format))
+    {
+        return export_trace(input_name, output_name, output_format);
+    }
+    else if ((TRACE_FORMAT_NATIVE != input_format) && (TRACE_FORMAT_NATIVE == output_format))
+    {
+        return import_trace(input_name, output_name, input_format);
+    }
+
+    c_log(LOG_WARNING, "Traces can only be converted from or to the native format (.trace)");
+    return SDL_FALSE;
+}
+
+int lua_trace_convert(lua_State* L)
+{
+    const char* input_name  = luaL_checkstring(L, 1);
+    const char* output_name = luaL_checkstring(L, 2);
+
+    lua_pushboolean(L, trace_convert(input_name, output_name));
+
+    return 1;
+}
+
+void lua_register_trace_convert_commands(core_t* core)
+{
+    lua_pushcfunction(core->L, lua_trace_convert);
+    lua_setglobal(core->L, "trace_convert");
+}
+
+static trace_format_t get_format(const char* file_name)
+{
+    const char* extension = SDL_strrchr(file_name, '.');
+
+    if (NULL == extension)
+    {
+        return TRACE_FORMAT_UNKNOWN;
+    }
+    else if (0 == SDL_strcasecmp(extension, ".trace"))
+    {
+        return TRACE_FORMAT_NATIVE;
+    }
+    else if (0 == SDL_strcasecmp(extension, ".log"))
+    {
+        return TRACE_FORMAT_CANDUMP;
+    }
+    else if (0 == SDL_strcasecmp(extension, ".asc"))
+    {
+        return TRACE_FORMAT_ASC;
+    }
+    else if (0 == SDL_strcasecmp(extension, ".trc"))
+    {
+        return TRACE_FORMAT_TRC;
+    }
+    else if (0 == SDL_strcasecmp(extension, ".pcapng"))
+    {
+        return TRACE_FORMAT_PCAPNG;
+    }
+
+    return TRACE_FORMAT_UNKNOWN;
+}
+
+static SDL_bool import_trace(const char* input_name, const char* output_name, trace_format_t format)
+{
+    import_options_t options;
+    import_chunk_t   chunk[CONVERT_THREAD_MAX];
+    SDL_Thread*      thread[CONVERT_THREAD_MAX];
+    Sint64           size;
+    Uint64           frames = 0;
+    int              count  = 1;
+    int              index;
+    SDL_bool         is_ok  = SDL_TRUE;
+
+    SDL_zero(options);
+    options.format = format;
+    options.base   = 16;
+
+    if (SDL_FALSE == read_options(input_name, &options, &size))
+    {
+        return SDL_FALSE;
+    }
+
+    // Relative timestamps depend on all previous lines.
+    if ((size > CONVERT_CHUNK_THRESHOLD) && (SDL_FALSE == options.is_relative))
+    {
+        count = SDL_max(1, SDL_min(SDL_GetCPUCount(), CONVERT_THREAD_MAX));
+    }
+
+    SDL_zeroa(chunk);
+    for (index = 0; index < count; index += 1)
+    {
+        chunk[index].input_name = input_name;
+        chunk[index].options    = &options;
+
+        if (1 == count)
+        {
+            SDL_strlcpy(chunk[index].part_name, output_name, sizeof(chunk[index].part_name));
+        }
+        else
+        {
+            SDL_snprintf(chunk[index].part_name, sizeof(chunk[index].part_name), "%s.part%d", output_name, index);
+        }
+    }
+
+    if (1 == count)
+    {
+        chunk[0].end = size;
+        import_chunk(&chunk[0]);
+        is_ok  = chunk[0].is_ok;
+        frames = chunk[0].frames;
+    }
+    else
+    {
+        if (SDL_FALSE == split_input(input_name, size, chunk, count))
+        {
+            c_log(LOG_ERROR, "Could not open %s", input_name);
+            return SDL_FALSE;
+        }
+
+        c_log(LOG_INFO, "Converting %s with %d threads", input_name, count);
+
+        for (index = 0; index < count; index += 1)
+        {
+            thread[index] = SDL_CreateThread(import_chunk, "Trace import thread", &chunk[index]);
+        }
+
+        for (index = 0; index < count; index += 1)
+        {
+            if (NULL == thread[index])
+            {
+                import_chunk(&chunk[index]);
+            }
+            else
+            {
+                SDL_WaitThread(thread[index], NULL);
+            }
+
+            frames += chunk[index].frames;
+            if (SDL_FALSE == chunk[index].is_ok)
+            {
+                is_ok = SDL_FALSE;
+            }
+        }
+
+        if (SDL_FALSE == merge_parts(chunk, count, output_name, options.start_time_us))
+        {
+            is_ok = SDL_FALSE;
+        }
+    }
+
+    if (SDL_FALSE == is_ok)
+    {
+        c_log(LOG_ERROR, "Could not convert %s to %s", input_name, output_name);
+        return SDL_FALSE;
+    }
+
+    c_log(LOG_SUCCESS, "Converted %s to %s, %llu frames", input_name, output_name, (unsigned long long)frames);
+    return SDL_TRUE;
+}
+
+static SDL_bool export_trace(const char* input_name, const char* output_name, trace_format_t format)
+{
+    trace_reader_t reader;
+    text_writer_t  writer;
+    can_message_t  message;
+    Uint8          channel;
+    Uint64         first_us;
+    Uint64         frames  = 0;
+    Uint64         skipped = 0;
+    SDL_bool       is_ok;
+
+    if (SDL_FALSE == trace_open(&reader, input_name))
+    {
+        return SDL_FALSE;
+    }
+
+    if (SDL_FALSE == text_writer_open(&writer, output_name))
+    {
+        c_log(LOG_ERROR, "Could not create %s", output_name);
+        trace_close(&reader);
+        return SDL_FALSE;
+    }
+
+    first_us = trace_get_first_timestamp(&reader);
+
+    if (TRACE_FORMAT_ASC == format)
+    {
+        time_t    start_s = (time_t)(reader.start_time_us / 1000000);
+        struct tm local_time;
+        char      date[64];
+        char      am_pm[8];
+        char      year[8];
+
+#ifdef _WIN32
+        localtime_s(&local_time, &start_s);
+#else
+        localtime_r(&start_s, &local_time);
+#endif
+        strftime(date, sizeof(date), "%a %b %d %I:%M:%S", &local_time);
+        strftime(am_pm, sizeof(am_pm), "%p", &local_time);
+        strftime(year, sizeof(year), "%Y", &local_time);
+
+        write_text(&writer, "date %s.%03u %s %s\n", date, (unsigned)((reader.start_time_us / 1000) % 1000), am_pm, year);
+        write_text(&writer, "base hex  timestamps absolute\n");
+        write_text(&writer, "internal events logged\n");
+        write_text(&writer, "Begin Triggerblock %s.%03u %s %s\n", date, (unsigned)((reader.start_time_us / 1000) % 1000), am_pm, year);
+        write_text(&writer, "   0.000000 Start of measurement\n");
+    }
+    else if (TRACE_FORMAT_TRC == format)
+    {
+        Uint64 date_us = reader.start_time_us + (OLE_DATE_UNIX_EPOCH_DAYS * US_PER_DAY);
+
+        // The start time is an OLE date: days since 1899-12-30.
+        write_text(&writer, ";$FILEVERSION=2.1\n");
+        write_text(&writer, ";$STARTTIME=%llu.%08llu\n",
+                   (unsigned long long)(date_us / US_PER_DAY),
+                   (unsigned long long)(((date_us % US_PER_DAY) * 100000000ULL) / US_PER_DAY));
+        write_text(&writer, ";$COLUMNS=N,O,T,B,I,d,R,L,D\n");
+        write_text(&writer, ";\n");
+    }
+
+    while (SDL_TRUE == trace_read(&reader, &message, &channel))
+    {
+        // Records of different channels may be slightly out of order.
+        Uint64 time_us = (message.timestamp_us > first_us) ? (message.timestamp_us - first_us) : 0;
+
+        switch (format)
+        {
+            case TRACE_FORMAT_CANDUMP:
+                write_candump(&writer, reader.start_time_us + time_us, channel, &message);
+                break;
+            case TRACE_FORMAT_ASC:
+                write_asc(&writer, time_us, channel, &message);
+                break;
+            case TRACE_FORMAT_TRC:
+            default:
+                if (SDL_FALSE == write_trc(&writer, frames - skipped + 1, time_us, channel, &message))
+                {
+                    skipped += 1;
+                }
+                break;
+        }
+
+        frames += 1;
+    }
+
+    if (TRACE_FORMAT_ASC == format)
+    {
+        write_text(&writer, "End TriggerBlock\n");
+    }
+
+    trace_close(&reader);
+    is_ok = text_writer_close(&writer);
+
+    if (SDL_FALSE == is_ok)
+    {
+        c_log(LOG_ERROR, "Could not write %s", output_name);
+        return SDL_FALSE;
+    }
+
+    c_log(LOG_SUCCESS, "Converted %s to %s, %llu frames", input_name, output_name, (unsigned long long)(frames - skipped));
+    if (skipped > 0)
+    {
+        c_log(LOG_INFO, "%llu error frames skipped", (unsigned long long)skipped);
+    }
+
+    return SDL_TRUE;
+}
+
+static SDL_bool export_pcapng(const char* input_name, const char* output_name)
+{
+    trace_reader_t  reader;
+    pcapng_writer_t writer;
+    can_message_t   message;
+    Uint8           channel;
+    Uint64          first_us;
+    SDL_bool        is_ok = SDL_TRUE;
+
+    if (SDL_FALSE == trace_open(&reader, input_name))
+    {
+        return SDL_FALSE;
+    }
+
+    if (SDL_FALSE == pcapng_create(&writer, output_name))
+    {
+        trace_close(&reader);
+        return SDL_FALSE;
+    }
+
+    first_us = trace_get_first_timestamp(&reader);
+
+    while ((SDL_TRUE == is_ok) && (SDL_TRUE == trace_read(&reader, &message, &channel)))
+    {
+        Uint64 time_us = (message.timestamp_us > first_us) ? (message.timestamp_us - first_us) : 0;
+
+        is_ok = pcapng_write(&writer, channel, reader.start_time_us + time_us, &message);
+    }
+
+    trace_close(&reader);
+    if (SDL_FALSE == pcapng_finish(&writer))
+    {
+        is_ok = SDL_FALSE;
+    }
+
+    if (SDL_FALSE == is_ok)
+    {
+        c_log(LOG_ERROR, "Could not write %s", output_name);
+        return SDL_FALSE;
+    }
+
+    c_log(LOG_SUCCESS, "Converted %s to %s, %llu frames", input_name, output_name, (unsigned long long)writer.frames);
+    return SDL_TRUE;
+}
+
+/* Reads the header of the file and, for candump logs, the time of the
+ * first frame, which all further timestamps are relative to.
+ */
+static SDL_bool read_options(const char* input_name, import_options_t* options, Sint64* size)
+{
+    line_reader_t reader;
+    char*         token[CONVERT_TOKEN_MAX];
+    char*         line;
+    int           lines = 0;
+
+    if (SDL_FALSE == line_reader_open(&reader, input_name, 0, -1))
+    {
+        c_log(LOG_ERROR, "Could not open %s", input_name);
+        return SDL_FALSE;
+    }
+
+    *size = reader.remaining;
+
+    while ((lines < CONVERT_HEADER_LINES_MAX) && (NULL != (line = read_line(&reader))))
+    {
+        import_options_t probe = *options;
+        can_message_t    message;
+        Uint8            channel;
+        int              count = split_line(line, token, CONVERT_TOKEN_MAX);
+
+        lines += 1;
+
+        if (SDL_TRUE == parse_header(options, token, count))
+        {
+            continue;
+        }
+
+        SDL_zero(message);
+        if (SDL_TRUE == parse_frame(&probe, token, count, &message, &channel))
+        {
+            if (TRACE_FORMAT_CANDUMP == options->format)
+            {
+                options->first_us      = message.timestamp_us;
+                options->start_time_us = message.timestamp_us;
+            }
+            break;
+        }
+    }
+
+    line_reader_close(&reader);
+
+    return SDL_TRUE;
+}
+
+/* Moves the beginning of every chunk but the first behind the next line
+ * break.
+ */
+static SDL_bool split_input(const char* input_name, Sint64 size, import_chunk_t* chunk, int count)
+{
+    SDL_RWops* file = SDL_RWFromFile(input_name, "rb");
+    int        index;
+
+    if (NULL == file)
+    {
+        return SDL_FALSE;
+    }
+
+    chunk[0].begin = 0;
+    for (index = 1; index < count; index += 1)
+    {
+        Sint64 offset = SDL_max((size / count) * index, chunk[index - 1].begin + 1) - 1;
+        char   buffer[256];
+        size_t read;
+        size_t position;
+
+        chunk[index].begin = size;
+
+        SDL_RWseek(file, offset, RW_SEEK_SET);
+        while ((offset < size) && (chunk[index].begin == size))
+        {
+            read = SDL_RWread(file, buffer, 1, sizeof(buffer));
+            if (0 == read)
+            {
+                break;
+            }
+
+            for (position = 0; position < read; position += 1)
+            {
+                if ('\n' == buffer[position])
+                {
+                    chunk[index].begin = offset + (Sint64)position + 1;
+                    break;
+                }
+            }
+            offset += (Sint64)read;
+        }
+
+        chunk[index - 1].end = chunk[index].begin;
+    }
+    chunk[count - 1].end = size;
+
+    SDL_RWclose(file);
+
+    return SDL_TRUE;
+}
+
+static int import_chunk(void* chunk_pointer)
+{
+    import_chunk_t*  chunk   = (import_chunk_t*)chunk_pointer;
+    import_options_t options = *chunk->options;
+    line_reader_t    reader;
+    trace_writer_t   writer;
+    char*            token[CONVERT_TOKEN_MAX];
+    char*            line;
+
+    chunk->is_ok  = SDL_FALSE;
+    chunk->frames = 0;
+
+    if (SDL_FALSE == line_reader_open(&reader, chunk->input_name, chunk->begin, chunk->end))
+    {
+        return 0;
+    }
+
+    if (SDL_FALSE == trace_create(&writer, chunk->part_name, options.start_time_us))
+    {
+        line_reader_close(&reader);
+        return 0;
+    }
+
+    while (NULL != (line = read_line(&reader)))
+    {
+        can_message_t message;
+        Uint8         channel;
+        int           count = split_line(line, token, CONVERT_TOKEN_MAX);
+
+        SDL_zero(message);
+        if (SDL_FALSE == parse_frame(&options, token, count, &message, &channel))
+        {
+            continue;
+        }
+
+        if (SDL_FALSE == trace_write(&writer, channel, &message))
+        {
+            break;
+        }
+        chunk->frames += 1;
+    }
+
+    line_reader_close(&reader);
+    chunk->is_ok = trace_finish(&writer);
+
+    return 0;
+}
+
+static SDL_bool merge_parts(import_chunk_t* chunk, int count, const char* output_name, Uint64 start_time_us)
+{
+    trace_writer_t writer;
+    trace_reader_t reader;
+    can_message_t  message;
+    Uint8          channel;
+    SDL_bool       is_ok = trace_create(&writer, output_name, start_time_us);
+    int            index;
+
+    for (index = 0; index < count; index += 1)
+    {
+        if ((SDL_TRUE == is_ok) && (SDL_TRUE == chunk[index].is_ok) && (SDL_TRUE == trace_open(&reader, chunk[index].part_name)))
+        {
+            while ((SDL_TRUE == trace_read(&reader, &message, &channel)) && (SDL_TRUE == is_ok))
+            {
+                is_ok = trace_write(&writer, channel, &message);
+            }
+            trace_close(&reader);
+        }
+        else
+        {
+            is_ok = SDL_FALSE;
+        }
+
+        remove(chunk[index].part_name);
+    }
+
+    if ((SDL_FALSE == trace_finish(&writer)) || (SDL_FALSE == is_ok))
+    {
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+// Returns SDL_TRUE for lines which only belong to the header.
+static SDL_bool parse_header(import_options_t* options, char** token, int count)
+{
+    if (0 == count)
+    {
+        return SDL_TRUE;
+    }
+
+    switch (options->format)
+    {
+        case TRACE_FORMAT_ASC:
+            if (0 == SDL_strcmp(token[0], "date"))
+            {
+                parse_asc_date(token, count, &options->start_time_us);
+                return SDL_TRUE;
+            }
+            else if (0 == SDL_strcmp(token[0], "base"))
+            {
+                if (count >= 2)
+                {
+                    options->base = (0 == SDL_strcmp(token[1], "dec")) ? 10 : 16;
+                }
+                if (count >= 4)
+                {
+                    options->is_relative = (0 == SDL_strcmp(token[3], "relative")) ? SDL_TRUE : SDL_FALSE;
+                }
+                return SDL_TRUE;
+            }
+            break;
+        case TRACE_FORMAT_TRC:
+            if (';' != token[0][0])
+            {
+                break;
+            }
+            else if (0 == SDL_strncmp(token[0], ";$FILEVERSION=", 14))
+            {
+                const char* minor = SDL_strchr(token[0], '.');
+
+                options->version = (SDL_atoi(&token[0][14]) * 10) + ((NULL != minor) ? SDL_atoi(&minor[1]) : 0);
+            }
+            else if (0 == SDL_strncmp(token[0], ";$STARTTIME=", 12))
+            {
+                Uint64 days;
+
+                // An OLE date, i.e. days since 1899-12-30.
+                if ((SDL_TRUE == parse_fixed(&token[0][12], 8, &days)) && (days >= (OLE_DATE_UNIX_EPOCH_DAYS * 100000000ULL)))
+                {
+                    options->start_time_us = (days * (US_PER_DAY / 100000000ULL)) - (OLE_DATE_UNIX_EPOCH_DAYS * US_PER_DAY);
+                }
+            }
+            else if (0 == SDL_strncmp(token[0], ";$COLUMNS=", 10))
+            {
+                const char* column = &token[0][10];
+                int         length = 0;
+
+                for (; ('\0' != *column) && (length < CONVERT_COLUMN_MAX); column += 1)
+                {
+                    if (',' != *column)
+                    {
+                        options->column[length] = *column;
+                        length += 1;
+                    }
+                }
+                options->column[length] = '\0';
+            }
+            return SDL_TRUE;
+        case TRACE_FORMAT_CANDUMP:
+        default:
+            break;
+    }
+
+    return SDL_FALSE;
+}
+
+static SDL_bool parse_frame(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel)
+{
+    switch (options->format)
+    {
+        case TRACE_FORMAT_CANDUMP:
+            return parse_candump(options, token, count, message, channel);
+        case TRACE_FORMAT_ASC:
+            return parse_asc(options, token, count, message, channel);
+        case TRACE_FORMAT_TRC:
+            return parse_trc(options, token, count, message, channel);
+        default:
+            return SDL_FALSE;
+    }
+}
+
+/* (1436509052.249713) can0 123#DEADBEEF
+ * (1436509052.249713) can0 12345678##1DEADBEEF, CAN FD with flags
+ */
+static SDL_bool parse_candump(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel)
+{
+    char*  separator;
+    char*  data;
+    size_t length;
+    size_t id_length;
+    size_t index;
+    Uint64 time_us;
+    Uint32 id;
+
+    if ((count < 3) || ('(' != token[0][0]))
+    {
+        return SDL_FALSE;
+    }
+
+    length = SDL_strlen(token[0]);
+    if (')' != token[0][length - 1])
+    {
+        return SDL_FALSE;
+    }
+    token[0][length - 1] = '\0';
+
+    separator = SDL_strchr(token[2], '#');
+    if ((SDL_FALSE == parse_fixed(&token[0][1], 6, &time_us)) || (NULL == separator))
+    {
+        return SDL_FALSE;
+    }
+
+    *separator = '\0';
+    id_length  = SDL_strlen(token[2]);
+    if (SDL_FALSE == parse_uint(token[2], 16, &id))
+    {
+        return SDL_FALSE;
+    }
+
+    data = &separator[1];
+    if ('#' == data[0])
+    {
+        int fd_flags = get_hex_digit(data[1]);
+
+        if (fd_flags < 0)
+        {
+            return SDL_FALSE;
+        }
+
+        message->flags = CAN_FLAG_FD;
+        if (0 != (fd_flags & 0x01))
+        {
+            message->flags |= CAN_FLAG_BRS;
+        }
+        if (0 != (fd_flags & 0x02))
+        {
+            message->flags |= CAN_FLAG_ESI;
+        }
+        data = &data[2];
+    }
+    else if (('R' == data[0]) || ('r' == data[0]))
+    {
+        // Remote frames are not recorded.
+        return SDL_FALSE;
+    }
+
+    if (8 == id_length)
+    {
+        if (0 != (id & CANDUMP_ERROR_FLAG))
+        {
+            message->id     = id & CAN_ID_MASK;
+            message->flags |= CAN_FLAG_ERROR;
+        }
+        else
+        {
+            message->id = (id & CAN_ID_MASK) | CAN_ID_EXTENDED;
+        }
+    }
+    else
+    {
+        message->id = id & 0x7ff;
+    }
+
+    // A classic frame may be followed by its DLC, e.g. 123#11_9.
+    for (index = 0; ('\0' != data[index * 2]) && ('_' != data[index * 2]); index += 1)
+    {
+        int high = get_hex_digit(data[index * 2]);
+        int low  = get_hex_digit(data[(index * 2) + 1]);
+
+        if ((high < 0) || (low < 0) || (index >= CANFD_MAX_DATA_LENGTH))
+        {
+            return SDL_FALSE;
+        }
+        message->data[index] = (Uint8)((high << 4) | low);
+    }
+
+    message->length       = (Uint8)index;
+    message->timestamp_us = (time_us > options->first_us) ? (time_us - options->first_us) : 0;
+    *channel              = parse_channel(token[1]);
+
+    return SDL_TRUE;
+}
+
+/*    0.012345 1  123x            Rx   d 8 01 02 03 04 05 06 07 08
+ *    0.012345 CANFD   1 Rx        123  name  1 0 d 12 01 02 ...
+ *    0.012345 1  ErrorFrame
+ */
+static SDL_bool parse_asc(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel)
+{
+    Uint64   time_us;
+    Uint32   bus;
+    Uint32   id;
+    Uint32   dlc;
+    Uint32   length;
+    char*    id_token;
+    size_t   id_length;
+    int      index;
+    SDL_bool is_fd;
+
+    if ((count < 3) || (SDL_FALSE == parse_fixed(token[0], 6, &time_us)))
+    {
+        return SDL_FALSE;
+    }
+
+    if (SDL_TRUE == options->is_relative)
+    {
+        options->time_us += time_us;
+        time_us           = options->time_us;
+    }
+
+    is_fd = (0 == SDL_strcmp(token[1], "CANFD")) ? SDL_TRUE : SDL_FALSE;
+    index = (SDL_TRUE == is_fd) ? 2 : 1;
+
+    if ((SDL_FALSE == parse_uint(token[index], 10, &bus)) || (0 == bus))
+    {
+        // Not a frame, e.g. Start of measurement.
+        return SDL_FALSE;
+    }
+    *channel = (Uint8)SDL_min(bus - 1, 0xff);
+
+    // The direction precedes the CAN-ID of CAN FD frames.
+    index += (SDL_TRUE == is_fd) ? 2 : 1;
+    if (index >= count)
+    {
+        return SDL_FALSE;
+    }
+
+    message->timestamp_us = time_us;
+
+    if (0 == SDL_strcmp(token[index], "ErrorFrame"))
+    {
+        message->flags = CAN_FLAG_ERROR;
+        return SDL_TRUE;
+    }
+
+    id_token  = token[index];
+    id_length = SDL_strlen(id_token);
+    if (('x' == id_token[id_length - 1]) || ('X' == id_token[id_length - 1]))
+    {
+        id_token[id_length - 1] = '\0';
+        message->id = CAN_ID_EXTENDED;
+    }
+
+    if (SDL_FALSE == parse_uint(id_token, options->base, &id))
+    {
+        return SDL_FALSE;
+    }
+    message->id |= (0 != message->id) ? (id & CAN_ID_MASK) : (id & 0x7ff);
+    index       += 1;
+
+    if (SDL_TRUE == is_fd)
+    {
+        // The symbolic name is optional.
+        if ((index < count) && (0 != SDL_strcmp(token[index], "0")) && (0 != SDL_strcmp(token[index], "1")))
+        {
+            index += 1;
+        }
+
+        if (((index + 4) > count) ||
+            (SDL_FALSE == parse_uint(token[index + 2], 16, &dlc)) ||
+            (SDL_FALSE == parse_uint(token[index + 3], 10, &length)) ||
+            (length > CANFD_MAX_DATA_LENGTH))
+        {
+            return SDL_FALSE;
+        }
+
+        message->flags = CAN_FLAG_FD;
+        if (0 == SDL_strcmp(token[index], "1"))
+        {
+            message->flags |= CAN_FLAG_BRS;
+        }
+        if (0 == SDL_strcmp(token[index + 1], "1"))
+        {
+            message->flags |= CAN_FLAG_ESI;
+        }
+        index += 4;
+    }
+    else
+    {
+        // Remote frames are marked r instead of d and are not recorded.
+        if (((index + 3) > count) ||
+            (0 != SDL_strcmp(token[index + 1], "d")) ||
+            (SDL_FALSE == parse_uint(token[index + 2], 16, &dlc)))
+        {
+            return SDL_FALSE;
+        }
+
+        length = SDL_min(dlc, 8);
+        index += 3;
+    }
+
+    message->length = (Uint8)length;
+    if ((index + (int)length) > count)
+    {
+        return SDL_FALSE;
+    }
+
+    return parse_data(&token[index], (int)length, options->base, message);
+}
+
+/* The columns of a PCAN trace are given by its version or, since 2.1,
+ * by its header.  The offset is in milliseconds.
+ */
+static SDL_bool parse_trc(import_options_t* options, char** token, int count, can_message_t* message, Uint8* channel)
+{
+    const char* column     = get_trc_columns(options);
+    Uint64      offset_us  = 0;
+    Uint32      value;
+    Uint32      dlc        = 0;
+    int         length     = -1;
+    int         index;
+    SDL_bool    has_offset = SDL_FALSE;
+
+    *channel = 0;
+
+    for (index = 0; ('\0' != column[index]) && (index < count); index += 1)
+    {
+        char* field = token[index];
+
+        switch (column[index])
+        {
+            case 'O':
+                has_offset = parse_fixed(field, 3, &offset_us);
+                break;
+            case 'T':
+                if ((0 == SDL_strcmp(field, "DT")) || (0 == SDL_strcmp(field, "Rx")) || (0 == SDL_strcmp(field, "Tx")))
+                {
+                    message->flags = 0;
+                }
+                else if (0 == SDL_strcmp(field, "FD"))
+                {
+                    message->flags = CAN_FLAG_FD;
+                }
+                else if (0 == SDL_strcmp(field, "FB"))
+                {
+                    message->flags = CAN_FLAG_FD | CAN_FLAG_BRS;
+                }
+                else if (0 == SDL_strcmp(field, "FE"))
+                {
+                    message->flags = CAN_FLAG_FD | CAN_FLAG_ESI;
+                }
+                else if (0 == SDL_strcmp(field, "BI"))
+                {
+                    message->flags = CAN_FLAG_FD | CAN_FLAG_BRS | CAN_FLAG_ESI;
+                }
+                else if ((0 == SDL_strcmp(field, "ER")) || (0 == SDL_strcmp(field, "Error")))
+                {
+                    message->flags = CAN_FLAG_ERROR;
+                }
+                else
+                {
+                    // Remote frames, status and other events.
+                    return SDL_FALSE;
+                }
+                break;
+            case 'B':
+                if ((SDL_TRUE == parse_uint(field, 10, &value)) && (value > 0))
+                {
+                    *channel = (Uint8)SDL_min(value - 1, 0xff);
+                }
+                break;
+            case 'I':
+                if (SDL_TRUE == parse_uint(field, 16, &value))
+                {
+                    message->id = (SDL_strlen(field) > 4) ? ((value & CAN_ID_MASK) | CAN_ID_EXTENDED) : (value & 0x7ff);
+                }
+                else if (0 == (message->flags & CAN_FLAG_ERROR))
+                {
+                    return SDL_FALSE;
+                }
+                break;
+            case 'L':
+                if (SDL_FALSE == parse_uint(field, 10, &dlc))
+                {
+                    return SDL_FALSE;
+                }
+                break;
+            case 'l':
+                if ((SDL_FALSE == parse_uint(field, 10, &value)) || (value > CANFD_MAX_DATA_LENGTH))
+                {
+                    return SDL_FALSE;
+                }
+                length = (int)value;
+                break;
+            case 'D':
+                if (0 == SDL_strcmp(field, "RTR"))
+                {
+                    return SDL_FALSE;
+                }
+
+                if (length < 0)
+                {
+                    length = (0 != (message->flags & CAN_FLAG_FD)) ? dlc_to_length[SDL_min(dlc, 15)] : (int)SDL_min(dlc, 8);
+                }
+
+                message->length = (Uint8)length;
+                if ((index + length) > count)
+                {
+                    return SDL_FALSE;
+                }
+
+                if (SDL_FALSE == parse_data(&token[index], length, 16, message))
+                {
+                    return SDL_FALSE;
+                }
+                break;
+            default:
+                // Number, direction and reserved columns.
+                break;
+        }
+    }
+
+    if (SDL_FALSE == has_offset)
+    {
+        return SDL_FALSE;
+    }
+    message->timestamp_us = offset_us;
+
+    return SDL_TRUE;
+}
+
+// date Wed Jun 12 10:11:12.123 am 2024, the time of day may be 24-hour.
+static SDL_bool parse_asc_date(char** token, int count, Uint64* time_us)
+{
+    const char* month_name[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    struct tm   local_time;
+    char*       clock;
+    time_t      time_s;
+    Uint32      value;
+    Uint64      second_us;
+    int         month;
+
+    if (count < 6)
+    {
+        return SDL_FALSE;
+    }
+
+    SDL_zero(local_time);
+    local_time.tm_isdst = -1;
+
+    for (month = 0; month < 12; month += 1)
+    {
+        if (0 == SDL_strncasecmp(token[2], month_name[month], 3))
+        {
+            local_time.tm_mon = month;
+            break;
+        }
+    }
+
+    if ((month >= 12) || (SDL_FALSE == parse_uint(token[3], 10, &value)))
+    {
+        return SDL_FALSE;
+    }
+    local_time.tm_mday = (int)value;
+
+    // hh:mm:ss.sss
+    clock = token[4];
+    local_time.tm_hour = SDL_atoi(clock);
+    clock = SDL_strchr(clock, ':');
+    if (NULL == clock)
+    {
+        return SDL_FALSE;
+    }
+    local_time.tm_min = SDL_atoi(&clock[1]);
+    clock = SDL_strchr(&clock[1], ':');
+    if ((NULL == clock) || (SDL_FALSE == parse_fixed(&clock[1], 6, &second_us)))
+    {
+        return SDL_FALSE;
+    }
+    local_time.tm_sec = (int)(second_us / 1000000);
+
+    if ((0 == SDL_strcasecmp(token[5], "pm")) && (local_time.tm_hour < 12))
+    {
+        local_time.tm_hour += 12;
+    }
+    else if ((0 == SDL_strcasecmp(token[5], "am")) && (12 == local_time.tm_hour))
+    {
+        local_time.tm_hour = 0;
+    }
+
+    if (SDL_FALSE == parse_uint(token[count - 1], 10, &value))
+    {
+        return SDL_FALSE;
+    }
+    local_time.tm_year = (int)value - 1900;
+
+    time_s = mktime(&local_time);
+    if (time_s < 0)
+    {
+        return SDL_FALSE;
+    }
+
+    *time_us = ((Uint64)time_s * 1000000) + (second_us % 1000000);
+
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_data(char** token, int count, int base, can_message_t* message)
+{
+    Uint32 value;
+    int    index;
+
+    for (index = 0; index < count; index += 1)
+    {
+        if ((SDL_FALSE == parse_uint(token[index], base, &value)) || (value > 0xff))
+        {
+            return SDL_FALSE;
+        }
+        message->data[index] = (Uint8)value;
+    }
+
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_uint(const char* token, int base, Uint32* value)
+{
+    char* end;
+
+    if ((NULL == token) || ('\0' == token[0]) || ('-' == token[0]))
+    {
+        return SDL_FALSE;
+    }
+
+    *value = (Uint32)SDL_strtoul(token, &end, base);
+
+    return ('\0' == *end) ? SDL_TRUE : SDL_FALSE;
+}
+
+/* Parses a decimal number with a fraction into an integer scaled by
+ * 10^decimals.  Further digits of the fraction are cut off, so that no
+ * precision is lost to floating point.
+ */
+static SDL_bool parse_fixed(const char* token, int decimals, Uint64* value)
+{
+    int digits = -1;
+
+    *value = 0;
+
+    if (('\0' == *token) || ('.' == *token))
+    {
+        return SDL_FALSE;
+    }
+
+    for (; '\0' != *token; token += 1)
+    {
+        if (('.' == *token) && (digits < 0))
+        {
+            digits = 0;
+        }
+        else if ((*token < '0') || (*token > '9'))
+        {
+            return SDL_FALSE;
+        }
+        else if (digits < decimals)
+        {
+            *value = (*value * 10) + (Uint64)(*token - '0');
+            if (digits >= 0)
+            {
+                digits += 1;
+            }
+        }
+    }
+
+    for (digits = SDL_max(digits, 0); digits < decimals; digits += 1)
+    {
+        *value *= 10;
+    }
+
+    return SDL_TRUE;
+}
+
+// The number at the end of the interface name, e.g. 1 for can1.
+static Uint8 parse_channel(const char* token)
+{
+    size_t length = SDL_strlen(token);
+
+    while ((length > 0) && (token[length - 1] >= '0') && (token[length - 1] <= '9'))
+    {
+        length -= 1;
+    }
+
+    return (Uint8)SDL_min(SDL_atoi(&token[length]), 0xff);
+}
+
+static int get_hex_digit(char digit)
+{
+    if ((digit >= '0') && (digit <= '9'))
+    {
+        return digit - '0';
+    }
+    else if ((digit >= 'a') && (digit <= 'f'))
+    {
+        return digit - 'a' + 10;
+    }
+    else if ((digit >= 'A') && (digit <= 'F'))
+    {
+        return digit - 'A' + 10;
+    }
+
+    return -1;
+}
+
+static Uint8 get_dlc(Uint8 length)
+{
+    Uint8 dlc;
+
+    for (dlc = 0; dlc < 15; dlc += 1)
+    {
+        if (dlc_to_length[dlc] >= length)
+        {
+            break;
+        }
+    }
+
+    return dlc;
+}
+
+static const char* get_trc_columns(const import_options_t* options)
+{
+    if ('\0' != options->column[0])
+    {
+        return options->column;
+    }
+
+    switch (options->version)
+    {
+        case 0:
+        case 10:
+            return "NOILD";
+        case 11:
+            return "NOTILD";
+        case 12:
+            return "NOBTILD";
+        case 13:
+            return "NOBTI-LD";
+        case 20:
+            return "NOTIdLD";
+        case 21:
+        default:
+            return "NOTBIdRLD";
+    }
+}
+
+static void write_candump(text_writer_t* writer, Uint64 time_us, Uint8 channel, const can_message_t* message)
+{
+    char data[(CANFD_MAX_DATA_LENGTH * 3) + 1];
+    char id[16];
+
+    format_data(data, message, SDL_FALSE);
+
+    if (0 != (message->flags & CAN_FLAG_ERROR))
+    {
+        SDL_snprintf(id, sizeof(id), "%08X#", (message->id & CAN_ID_MASK) | CANDUMP_ERROR_FLAG);
+    }
+    else if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        SDL_snprintf(id, sizeof(id), (0 != (message->id & CAN_ID_EXTENDED)) ? "%08X##%X" : "%03X##%X",
+                     (0 != (message->id & CAN_ID_EXTENDED)) ? (message->id & CAN_ID_MASK) : (message->id & 0x7ff),
+                     ((0 != (message->flags & CAN_FLAG_BRS)) ? 0x01 : 0) | ((0 != (message->flags & CAN_FLAG_ESI)) ? 0x02 : 0));
+    }
+    else if (0 != (message->id & CAN_ID_EXTENDED))
+    {
+        SDL_snprintf(id, sizeof(id), "%08X#", message->id & CAN_ID_MASK);
+    }
+    else
+    {
+        SDL_snprintf(id, sizeof(id), "%03X#", message->id & 0x7ff);
+    }
+
+    write_text(writer, "(%llu.%06llu) can%u %s%s\n",
+               (unsigned long long)(time_us / 1000000),
+               (unsigned long long)(time_us % 1000000),
+               channel,
+               id,
+               data);
+}
+
+static void write_asc(text_writer_t* writer, Uint64 time_us, Uint8 channel, const can_message_t* message)
+{
+    char     data[(CANFD_MAX_DATA_LENGTH * 3) + 1];
+    char     id[16];
+    unsigned bus = (unsigned)channel + 1;
+
+    format_data(data, message, SDL_TRUE);
+
+    if (0 != (message->id & CAN_ID_EXTENDED))
+    {
+        SDL_snprintf(id, sizeof(id), "%Xx", message->id & CAN_ID_MASK);
+    }
+    else
+    {
+        SDL_snprintf(id, sizeof(id), "%X", message->id & 0x7ff);
+    }
+
+    write_text(writer, "%4llu.%06llu ", (unsigned long long)(time_us / 1000000), (unsigned long long)(time_us % 1000000));
+
+    if (0 != (message->flags & CAN_FLAG_ERROR))
+    {
+        write_text(writer, "%-2u ErrorFrame\n", bus);
+    }
+    else if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        unsigned flags = ASC_FLAG_EDL;
+
+        flags |= (0 != (message->flags & CAN_FLAG_BRS)) ? ASC_FLAG_BRS : 0;
+        flags |= (0 != (message->flags & CAN_FLAG_ESI)) ? ASC_FLAG_ESI : 0;
+
+        write_text(writer, "CANFD %3u Rx %8s %u %u %x %2u%s        0    0 %8X        0        0        0        0        0\n",
+                   bus,
+                   id,
+                   (0 != (message->flags & CAN_FLAG_BRS)) ? 1 : 0,
+                   (0 != (message->flags & CAN_FLAG_ESI)) ? 1 : 0,
+                   get_dlc(message->length),
+                   message->length,
+                   data,
+                   flags);
+    }
+    else
+    {
+        write_text(writer, "%-2u %-15s Rx   d %u%s\n", bus, id, message->length, data);
+    }
+}
+
+// Error frames have no equivalent in the PCAN format and are skipped.
+static SDL_bool write_trc(text_writer_t* writer, Uint64 frames, Uint64 time_us, Uint8 channel, const can_message_t* message)
+{
+    char        data[(CANFD_MAX_DATA_LENGTH * 3) + 1];
+    char        id[16];
+    const char* type = "DT";
+
+    if (0 != (message->flags & CAN_FLAG_ERROR))
+    {
+        return SDL_FALSE;
+    }
+    else if (0 != (message->flags & CAN_FLAG_FD))
+    {
+        switch (message->flags & (CAN_FLAG_BRS | CAN_FLAG_ESI))
+        {
+            case CAN_FLAG_BRS:
+                type = "FB";
+                break;
+            case CAN_FLAG_ESI:
+                type = "FE";
+                break;
+            case (CAN_FLAG_BRS | CAN_FLAG_ESI):
+                type = "BI";
+                break;
+            default:
+                type = "FD";
+                break;
+        }
+    }
+
+    format_data(data, message, SDL_TRUE);
+
+    if (0 != (message->id & CAN_ID_EXTENDED))
+    {
+        SDL_snprintf(id, sizeof(id), "%08X", message->id & CAN_ID_MASK);
+    }
+    else
+    {
+        SDL_snprintf(id, sizeof(id), "%04X", message->id & 0x7ff);
+    }
+
+    write_text(writer, "%7llu %9llu.%03llu %s %u %8s Rx - %2u%s\n",
+               (unsigned long long)frames,
+               (unsigned long long)(time_us / 1000),
+               (unsigned long long)(time_us % 1000),
+               type,
+               (unsigned)channel + 1,
+               id,
+               get_dlc(message->length),
+               data);
+
+    return SDL_TRUE;
+}
+
+static void format_data(char* buffer, const can_message_t* message, SDL_bool is_spaced)
+{
+    const char* digits = "0123456789ABCDEF";
+    int         index;
+
+    for (index = 0; index < message->length; index += 1)
+    {
+        if (SDL_TRUE == is_spaced)
+        {
+            *buffer = ' ';
+            buffer += 1;
+        }
+        buffer[0] = digits[message->data[index] >> 4];
+        buffer[1] = digits[message->data[index] & 0x0f];
+        buffer   += 2;
+    }
+    *buffer = '\0';
+}
+
+static int split_line(char* line, char** token, int max_count)
+{
+    int count = 0;
+
+    while (count < max_count)
+    {
+        while ((' ' == *line) || ('\t' == *line))
+        {
+            line += 1;
+        }
+
+        if ('\0' == *line)
+        {
+            break;
+        }
+
+        token[count] = line;
+        count       += 1;
+
+        while (('\0' != *line) && (' ' != *line) && ('\t' != *line))
+        {
+            line += 1;
+        }
+
+        if ('\0' != *line)
+        {
+            *line = '\0';
+            line += 1;
+        }
+    }
+
+    return count;
+}
+
+// Reads the lines between begin and end, or up to the end of the file if end is negative.
+static SDL_bool line_reader_open(line_reader_t* reader, const char* file_name, Sint64 begin, Sint64 end)
+{
+    SDL_zerop(reader);
+
+    reader->file = SDL_RWFromFile(file_name, "rb");
+    if (NULL == reader->file)
+    {
+        return SDL_FALSE;
+    }
+
+    if (end < 0)
+    {
+        end = SDL_RWsize(reader->file);
+    }
+
+    reader->buffer = (char*)SDL_malloc(CONVERT_BUFFER_SIZE + 1);
+    if ((NULL == reader->buffer) || (end < begin) || (SDL_RWseek(reader->file, begin, RW_SEEK_SET) < 0))
+    {
+        line_reader_close(reader);
+        return SDL_FALSE;
+    }
+
+    reader->remaining = end - begin;
+
+    return SDL_TRUE;
+}
+
+/* Returns the next line without its line break, NULL at the end.  Lines
+ * longer than the buffer are split.
+ */
+static char* read_line(line_reader_t* reader)
+{
+    size_t index = reader->start;
+
+    while (SDL_TRUE)
+    {
+        size_t read;
+
+        for (; index < reader->end; index += 1)
+        {
+            if ('\n' == reader->buffer[index])
+            {
+                return terminate_line(reader, index, index + 1);
+            }
+        }
+
+        if ((SDL_TRUE == reader->is_eof) || ((0 == reader->start) && (CONVERT_BUFFER_SIZE == reader->end)))
+        {
+            if (reader->start == reader->end)
+            {
+                return NULL;
+            }
+            return terminate_line(reader, reader->end, reader->end);
+        }
+
+        // Move the incomplete line to the front and fill up the buffer.
+        SDL_memmove(reader->buffer, &reader->buffer[reader->start], reader->end - reader->start);
+        reader->end  -= reader->start;
+        index        -= reader->start;
+        reader->start = 0;
+
+        read = SDL_RWread(reader->file, &reader->buffer[reader->end], 1, (size_t)SDL_min((Sint64)(CONVERT_BUFFER_SIZE - reader->end), reader->remaining));
+
+        reader->end       += read;
+        reader->remaining -= (Sint64)read;
+        if ((0 == read) || (0 == reader->remaining))
+        {
+            reader->is_eof = SDL_TRUE;
+        }
+    }
+}
+
+static char* terminate_line(line_reader_t* reader, size_t line_end, size_t next)
+{
+    char* line = &reader->buffer[reader->start];
+
+    reader->buffer[line_end] = '\0';
+    if ((line_end > reader->start) && ('\r' == reader->buffer[line_end - 1]))
+    {
+        reader->buffer[line_end - 1] = '\0';
+    }
+
+    reader->start = next;
+
+    return line;
+}
+
+static void line_reader_close(line_reader_t* reader)
+{
+    if (NULL != reader->file)
+    {
+        SDL_RWclose(reader->file);
+        reader->file = NULL;
+    }
+
+    SDL_free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+static SDL_bool text_writer_open(text_writer_t* writer, const char* file_name)
+{
+    SDL_zerop(writer);
+
+    writer->buffer = (char*)SDL_malloc(CONVERT_BUFFER_SIZE);
+    if (NULL == writer->buffer)
+    {
+        return SDL_FALSE;
+    }
+
+    writer->file = SDL_RWFromFile(file_name, "wb");
+    if (NULL == writer->file)
+    {
+        SDL_free(writer->buffer);
+        writer->buffer = NULL;
+        return SDL_FALSE;
+    }
+
+    return SDL_TRUE;
+}
+
+static void write_text(text_writer_t* writer, const char* format, ...)
+{
+    va_list args;
+    int     length;
+
+    if ((writer->used + CONVERT_LINE_MAX) > CONVERT_BUFFER_SIZE)
+    {
+        if (1 != SDL_RWwrite(writer->file, writer->buffer, writer->used, 1))
+        {
+            writer->is_failed = SDL_TRUE;
+        }
+        writer->used = 0;
+    }
+
+    va_start(args, format);
+    length = SDL_vsnprintf(&writer->buffer[writer->used], CONVERT_LINE_MAX, format, args);
+    va_end(args);
+
+    if (length > 0)
+    {
+        writer->used += (size_t)SDL_min(length, CONVERT_LINE_MAX - 1);
+    }
+}
+
+static SDL_bool text_writer_close(text_writer_t* writer)
+{
+    SDL_bool is_ok;
+
+    if ((writer->used > 0) && (1 != SDL_RWwrite(writer->file, writer->buffer, writer->used, 1)))
+    {
+        writer->is_failed = SDL_TRUE;
+    }
+
+    if (0 != SDL_RWclose(writer->file))
+    {
+        writer->is_failed = SDL_TRUE;
+    }
+
+    is_ok = (SDL_TRUE == writer->is_failed) ? SDL_FALSE : SDL_TRUE;
+
+    SDL_free(writer->buffer);
+    SDL_zerop(writer);
+
+    return is_ok;
+}
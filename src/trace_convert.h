@@ -0,0 +1,31 @@
+/** @file trace_convert.h
+ *
+ *  A versatile software tool to analyse and configure CANopen devices.
+ *
+ *  Copyright (c) 2022, Michael Fitzmayer. All rights reserved.
+ *  SPDX-License-Identifier: MIT
+ *
+ **/
+
+#ifndef TRACE_CONVERT_H
+#define TRACE_CONVERT_H
+
+#include "SDL.h"
+#include "lua.h"
+#include "core.h"
+
+/* The format of a file is given by its extension:
+ *   .trace  native trace, see trace.h
+ *   .log    candump log (candump -l)
+ *   .asc    Vector ASCII log
+ *   .trc    PEAK PCAN trace, versions 1.0 to 2.1
+ *   .pcapng Wireshark capture, see pcapng.h, only written
+ *
+ * Traces are converted from any of the other formats to the native one
+ * and back.
+ */
+SDL_bool trace_convert(const char* input_name, const char* output_name);
+int      lua_trace_convert(lua_State* L);
+void     lua_register_trace_convert_commands(core_t* core);
+
+#endif /* TRACE_CONVERT_H */